@@ -5,7 +5,15 @@
 #include "proxysql.h"
 #include "cpp.h"
 
+#include <thread>
 
+#include "wqueue.h"
+
+
+// Account records are immutable once added, and refcounted: the
+// credentials group, its snapshots and the sessions that authenticated with
+// an account all hold a reference. Only sha1_pass (set once, see set_SHA1() )
+// and num_connections_used are updated in place, atomically
 typedef struct _account_details_t {
 	char *username;
 	char *password;
@@ -21,6 +29,10 @@ typedef struct _account_details_t {
 	bool __frontend;	// this is used only during the dump
 	bool __backend;	// this is used only during the dump
 	bool __active;
+	int refcnt;
+	bool auth_digests; // auth_stage1 and auth_stage2 are valid, see proxy_verify_account_reply()
+	unsigned char auth_stage1[SHA_DIGEST_LENGTH]; // SHA1(password) , clear text passwords only
+	unsigned char auth_stage2[SHA_DIGEST_LENGTH]; // SHA1(SHA1(password))
 } account_details_t;
 
 #ifdef DEBUG
@@ -40,12 +52,44 @@ typedef struct _account_details_t {
 typedef std::unordered_map<uint64_t, account_details_t *> umap_auth;
 
 class PtrArray;
+class MySQL_Session;
+
+// how long a session waits for an auth thread before verifying the password
+// by itself
+#define AUTH_JOB_TIMEOUT_US 1000000
+
+// a password verification offloaded to the auth threads, shared between the
+// session and the auth thread: the last one to release it frees it
+typedef struct _auth_job_t {
+	pthread_mutex_t mutex;
+	account_details_t *ad; // referenced
+	MySQL_Session *sess; // NULL once the session doesn't wait for the result
+	int wake_fd; // pipe of the MySQL thread of the session
+	char scramble[SCRAMBLE_LENGTH];
+	unsigned char reply[SHA_DIGEST_LENGTH];
+	char sha1_pass[SHA_DIGEST_LENGTH]; // SHA1(password) , for hashed passwords
+	bool done;
+	bool ret;
+	int refcnt;
+} auth_job_t;
+
+// A read only copy of bt_map, published every time the credentials change.
+// Each thread keeps a reference to the last snapshot it has seen, so that
+// lookups take no lock until the version changes
+typedef struct _creds_snapshot_t {
+	umap_auth bt_map;
+	unsigned int version;
+	int refcnt;
+} creds_snapshot_t;
 
 typedef struct _creds_group_t {
 	rwlock_t lock;
 	//BtMap_auth bt_map;
 	umap_auth bt_map;
 	PtrArray *cred_array;
+	creds_snapshot_t *snapshot; // protected by lock
+	unsigned int version;
+	bool publish_deferred; // set_all_inactive() was called, publish in remove_inactives()
 } creds_group_t;
 
 class MySQL_Authentication {
@@ -53,22 +97,36 @@ class MySQL_Authentication {
 	creds_group_t creds_backends;
 	creds_group_t creds_frontends;
 	bool _reset(enum cred_username_type usertype);
+	void publish(creds_group_t &cg);
+	creds_snapshot_t * thread_snapshot(enum cred_username_type usertype);
+	wqueue<auth_job_t *> auth_queue;
+	std::thread **auth_threads;
+	unsigned int num_auth_threads;
+	void auth_thread_run();
+	void auth_job_release(auth_job_t *job);
 //	SQLite3DB *authdb;
 //  rwlock_t rwlock;
 	public:
+	unsigned long long auth_offloaded; // verifications run by the auth threads
 	MySQL_Authentication();
 	~MySQL_Authentication();
+	void init();
 	bool add(char *username, char *password, enum cred_username_type usertype, bool use_ssl, int default_hostgroup, char *default_schema, bool schema_locked, bool transaction_persistent, bool fast_forward, int max_connections);
 	bool del(char *username, enum cred_username_type usertype, bool set_lock=true);
 	bool reset();
 	void print_version();
 	char * lookup(char *username, enum cred_username_type usertype, bool *use_ssl, int *default_hostgroup, char **default_schema, bool *schema_locked, bool *transaction_persistent, bool *fast_forward, int *max_connections, void **sha1_pass);
+	account_details_t * lookup_account(char *username, enum cred_username_type usertype);
+	void release_account(account_details_t *ad);
+	void end_thread();
 	int dump_all_users(account_details_t ***);
 	int increase_frontend_user_connections(char *username, int *mc=NULL);
 	void decrease_frontend_user_connections(char *username);
 	void set_all_inactive(enum cred_username_type usertype);
 	void remove_inactives(enum cred_username_type usertype);
 	bool set_SHA1(char *username, enum cred_username_type usertype, void *sha_pass);
+	auth_job_t * submit_verification(account_details_t *ad, const char *scramble, const unsigned char *reply, MySQL_Session *sess);
+	int verification_result(auth_job_t *job, account_details_t *ad, const unsigned char *reply, char *sha1_pass);
 //	void rdlock();
 //	void rdunlock();
 //	void wrlock();
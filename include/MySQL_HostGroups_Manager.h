@@ -4,6 +4,8 @@
 #include "cpp.h"
 
 #include <thread>
+#include <deque>
+#include <vector>
 
 #include "thread.h"
 #include "wqueue.h"
@@ -16,8 +18,7 @@
 
 #define MHM_PTHREAD_MUTEX
 
-#define MYHGM_MYSQL_SERVERS "CREATE TABLE mysql_servers ( hostgroup_id INT NOT NULL DEFAULT 0 , hostname VARCHAR NOT NULL , port INT NOT NULL DEFAULT 3306 , weight INT CHECK (weight >= 0) NOT NULL DEFAULT 1 , status INT CHECK (status IN (0, 1, 2, 3, 4)) NOT NULL DEFAULT 0 , compression INT CHECK (compression >=0 AND compression <= 102400) NOT NULL DEFAULT 0 , max_connections INT CHECK (max_connections >=0) NOT NULL DEFAULT 1000 , max_replication_lag INT CHECK (max_replication_lag >= 0 AND max_replication_lag <= 126144000) NOT NULL DEFAULT 0 , use_ssl INT CHECK (use_ssl IN(0,1)) NOT NULL DEFAULT 0 , max_latency_ms INT UNSIGNED CHECK (max_latency_ms>=0) NOT NULL DEFAULT 0 , comment VARCHAR NOT NULL DEFAULT '' , mem_pointer INT NOT NULL DEFAULT 0 , PRIMARY KEY (hostgroup_id, hostname, port) )"
-#define MYHGM_MYSQL_SERVERS_INCOMING "CREATE TABLE mysql_servers_incoming ( hostgroup_id INT NOT NULL DEFAULT 0 , hostname VARCHAR NOT NULL , port INT NOT NULL DEFAULT 3306 , weight INT CHECK (weight >= 0) NOT NULL DEFAULT 1 , status INT CHECK (status IN (0, 1, 2, 3, 4)) NOT NULL DEFAULT 0 , compression INT CHECK (compression >=0 AND compression <= 102400) NOT NULL DEFAULT 0 , max_connections INT CHECK (max_connections >=0) NOT NULL DEFAULT 1000 , max_replication_lag INT CHECK (max_replication_lag >= 0 AND max_replication_lag <= 126144000) NOT NULL DEFAULT 0 , use_ssl INT CHECK (use_ssl IN(0,1)) NOT NULL DEFAULT 0 , max_latency_ms INT UNSIGNED CHECK (max_latency_ms>=0) NOT NULL DEFAULT 0 , comment VARCHAR NOT NULL DEFAULT '' , PRIMARY KEY (hostgroup_id, hostname, port))"
+#define MYHGM_MYSQL_SERVERS "CREATE TABLE mysql_servers ( hostgroup_id INT NOT NULL DEFAULT 0 , hostname VARCHAR NOT NULL , port INT NOT NULL DEFAULT 3306 , weight INT CHECK (weight >= 0) NOT NULL DEFAULT 1 , status INT CHECK (status IN (0, 1, 2, 3, 4)) NOT NULL DEFAULT 0 , compression INT CHECK (compression >=0 AND compression <= 102400) NOT NULL DEFAULT 0 , max_connections INT CHECK (max_connections >=0) NOT NULL DEFAULT 1000 , max_replication_lag INT CHECK (max_replication_lag >= 0 AND max_replication_lag <= 126144000) NOT NULL DEFAULT 0 , use_ssl INT CHECK (use_ssl IN(0,1)) NOT NULL DEFAULT 0 , max_latency_ms INT UNSIGNED CHECK (max_latency_ms>=0) NOT NULL DEFAULT 0 , min_idle_connections INT CHECK (min_idle_connections >=0) NOT NULL DEFAULT 0 , comment VARCHAR NOT NULL DEFAULT '' , mem_pointer INT NOT NULL DEFAULT 0 , PRIMARY KEY (hostgroup_id, hostname, port) )"
 #define MYHGM_MYSQL_REPLICATION_HOSTGROUPS "CREATE TABLE mysql_replication_hostgroups (writer_hostgroup INT CHECK (writer_hostgroup>=0) NOT NULL PRIMARY KEY , reader_hostgroup INT NOT NULL CHECK (reader_hostgroup<>writer_hostgroup AND reader_hostgroup>0) , comment VARCHAR , UNIQUE (reader_hostgroup))"
 
 class MySrvConnList;
@@ -25,6 +26,88 @@ class MySrvC;
 class MySrvList;
 class MyHGC;
 
+// priority classes of the sessions waiting for a connection, see mysql_query_rules.priority
+#define MYCONN_WAITER_PRIORITIES 3
+#define MYCONN_WAITER_PRIORITY_DEFAULT 1
+
+// A session waiting for a connection of a hostgroup that has none available.
+// It is queued in MyHGC::waiters by get_MyConn_from_pool() , and
+// push_MyConn_to_pool() hands a returned connection directly to the waiter
+// returned by MyHGC::next_waiter() . All the fields but `waiting` are
+// protected by the MyHGM lock
+class MyConn_waiter {
+	public:
+	MySQL_Session *sess;
+	MySQL_Connection *conn; // connection handed off to the session
+	unsigned long long since; // when the session was queued
+	unsigned long long deadline; // the session doesn't need to be woken up after this
+	unsigned int hid;
+	unsigned int priority; // set by the session before queuing, 0 is the highest
+	bool waiting; // owned by the session: true while queued or holding a handed off connection
+	MyConn_waiter(MySQL_Session *_sess) {
+		sess=_sess;
+		conn=NULL;
+		since=0;
+		deadline=0;
+		hid=0;
+		priority=MYCONN_WAITER_PRIORITY_DEFAULT;
+		waiting=false;
+	}
+};
+
+// A thread resetting the connections that can't go back to the pool as they
+// are, see HGCU_thread_run() . Connections are queued to it by
+// destroy_MyConn_from_pool() , that writes to pipefd[1] to wake it up
+typedef struct _hgcu_thread_t {
+	std::thread *thr;
+	wqueue<MySQL_Connection *> queue;
+	int pipefd[2];
+	unsigned int pending; // connections queued or being reset
+} hgcu_thread_t;
+
+// A KILL QUERY requested by a session, see MySQL_HostGroups_Manager::kill_query()
+class MySQL_Kill_Job {
+	public:
+	char *username;
+	char *password;
+	char *hostname;
+	unsigned int port;
+	unsigned long id;
+	unsigned long long queued_at;
+	bool retried; // already retried once, after losing an idle connection
+	std::string key; // hostname:port:id , used to coalesce duplicated requests
+	MySQL_Kill_Job(char *u, char *p, char *h, unsigned int P, unsigned long i);
+	~MySQL_Kill_Job();
+};
+
+// The thread executing KILL QUERY , see KILL_thread_run() . Jobs are queued to
+// it by kill_query() , that writes to pipefd[1] to wake it up . pending_keys
+// holds the keys of the jobs queued or in progress, and is protected by mutex
+typedef struct _kill_thread_t {
+	std::thread *thr;
+	wqueue<MySQL_Kill_Job *> queue;
+	int pipefd[2];
+	pthread_mutex_t mutex;
+	std::unordered_map<std::string, bool> pending_keys;
+} kill_thread_t;
+
+// a server loaded by server_add() , applied to the running servers by commit()
+typedef struct _MySrvC_incoming_t {
+	char *address;
+	char *comment;
+	unsigned int hid;
+	uint16_t port;
+	unsigned int weight;
+	int status;
+	unsigned int compression;
+	unsigned int max_connections;
+	unsigned int max_replication_lag;
+	unsigned int use_ssl;
+	unsigned int max_latency_ms;
+	unsigned int min_idle_connections;
+	MySrvC *mysrvc; // the running server it applies to, set by commit()
+} MySrvC_incoming_t;
+
 enum MySerStatus {
 	MYSQL_SERVER_STATUS_ONLINE,
 	MYSQL_SERVER_STATUS_SHUNNED,
@@ -33,6 +116,35 @@ enum MySerStatus {
 	MYSQL_SERVER_STATUS_SHUNNED_REPLICATION_LAG
 };
 
+// state of the circuit breaker of a server, see MySrvC::breaker_report()
+enum MySrvC_breaker_state {
+	MYSRVC_BREAKER_CLOSED, // the server gets traffic
+	MYSRVC_BREAKER_OPEN, // the server gets no traffic until mysql-circuit_breaker_open_ms elapsed
+	MYSRVC_BREAKER_HALF_OPEN // up to mysql-circuit_breaker_half_open_probes queries are let through
+};
+
+#define MYSRVC_BREAKER_BUCKETS 10 // the sliding window is made of this many buckets
+#define MYSRVC_BREAKER_LOG_MAX 1000 // transitions kept for stats_mysql_circuit_breaker_log
+
+// requests and failures in a slice of the sliding window, updated without locks
+typedef struct _mysrvc_breaker_bucket_t {
+	unsigned long long epoch; // monotonic time / bucket length
+	unsigned int requests;
+	unsigned int failures;
+} mysrvc_breaker_bucket_t;
+
+// a transition of the circuit breaker of a server
+typedef struct _mysrvc_breaker_event_t {
+	unsigned long long time_us; // realtime
+	unsigned int hid;
+	std::string address;
+	uint16_t port;
+	enum MySrvC_breaker_state from;
+	enum MySrvC_breaker_state to;
+	unsigned int requests; // in the sliding window when the transition happened
+	unsigned int failures;
+} mysrvc_breaker_event_t;
+
 
 
 class MySrvConnList {
@@ -76,6 +188,10 @@ class MySrvC {	// MySQL Server Container
 	unsigned int compression;
 	unsigned int max_connections;
 	unsigned int max_replication_lag;
+	unsigned int min_idle_connections; // free connections kept open by the warm-up task
+	unsigned int warming; // connections being opened by the warm-up task
+	time_t connect_rate_time; // second in which connect_rate_count new connections were created
+	unsigned int connect_rate_count;
 	unsigned int connect_OK;
 	unsigned int connect_ERR;
 	// note that these variables are in microsecond, while user defines max lantency in millisecond
@@ -89,14 +205,27 @@ class MySrvC {	// MySQL Server Container
 	bool shunned_automatic;
 	bool shunned_and_kill_all_connections; // if a serious failure is detected, this will cause all connections to die even if the server is just shunned
 	bool use_ssl;
+	bool reset_connection_unsupported; // the backend rejected COM_RESET_CONNECTION , HGCU uses COM_CHANGE_USER . Accessed with __atomic builtins
+	// circuit breaker. breaker_buckets are updated without locks, the rest is
+	// changed only holding the MyHGM lock
+	enum MySrvC_breaker_state breaker_state;
+	unsigned long long breaker_since; // when breaker_state was entered
+	unsigned int breaker_probes; // probes handed out in HALF_OPEN
+	unsigned int breaker_probes_ok; // successful probes in HALF_OPEN
+	mysrvc_breaker_bucket_t breaker_buckets[MYSRVC_BREAKER_BUCKETS];
 	char *comment;
 	//uint8_t charset;
 	MySrvConnList *ConnectionsUsed;
 	MySrvConnList *ConnectionsFree;
-	MySrvC(char *, uint16_t, unsigned int, enum MySerStatus, unsigned int, unsigned int _max_connections, unsigned int _max_replication_lag, unsigned int _use_ssl, unsigned int _max_latency_ms, char *_comment);
+	MySrvC(char *, uint16_t, unsigned int, enum MySerStatus, unsigned int, unsigned int _max_connections, unsigned int _max_replication_lag, unsigned int _use_ssl, unsigned int _max_latency_ms, unsigned int _min_idle_connections, char *_comment);
 	~MySrvC();
 	void connect_error(int);
+	bool connect_rate_exceeded();
 	void shun_and_killall();
+	void breaker_report(bool error, unsigned long long latency_us);
+	bool breaker_available(unsigned long long now);
+	void breaker_set_state(enum MySrvC_breaker_state st, unsigned long long now);
+	void breaker_window(unsigned long long now, unsigned int *requests, unsigned int *failures);
 };
 
 class MySrvList {	// MySQL Server List
@@ -118,15 +247,21 @@ class MyHGC {	// MySQL Host Group Container
 	public:
 	unsigned int hid;
 	MySrvList *mysrvs;
+	std::deque<MyConn_waiter *> waiters[MYCONN_WAITER_PRIORITIES]; // one FIFO queue per priority class
+	unsigned int num_waiters;
 	MyHGC(int);
 	~MyHGC();
-	MySrvC *get_random_MySrvC();
+	MySrvC *get_random_MySrvC(MySrvC *exclude=NULL);
+	MyConn_waiter *next_waiter(unsigned long long now);
+	void pop_waiter(MyConn_waiter *);
 };
 
 class MySQL_HostGroups_Manager {
 	private:
 	SQLite3DB	*admindb;
 	SQLite3DB	*mydb;
+	pthread_mutex_t mydb_lock; // mydb is only a copy for admin and monitor, see commit()
+	std::vector<MySrvC_incoming_t *> servers_incoming;
 #ifdef MHM_PTHREAD_MUTEX
 	pthread_mutex_t lock;
 #else
@@ -139,11 +274,20 @@ class MySQL_HostGroups_Manager {
 
 	void add(MySrvC *, unsigned int);
 	void purge_mysql_servers_table();
-	void generate_mysql_servers_table();
-	void generate_mysql_replication_hostgroups_table();
+	std::vector<char **> * mysql_servers_table_rows();
+	void generate_mysql_servers_table(std::vector<char **> *);
+	void generate_mysql_replication_hostgroups_table(SQLite3_result *);
+	void MyConn_waiter_dequeue(MyHGC *, MyConn_waiter *);
+	void MyConn_waiter_handoff(MyConn_waiter *, MySQL_Connection *);
+	void MyConn_waiters_serve(MyHGC *, MyConn_waiter *);
 	SQLite3_result *incoming_replication_hostgroups;
+	unsigned int servers_min_idle; // servers with min_idle_connections > 0 , updated by commit()
 
-	std::thread *HGCU_thread;
+	hgcu_thread_t **HGCU_threads;
+	unsigned int num_HGCU_threads;
+	unsigned int HGCU_next; // round robin among HGCU threads
+	kill_thread_t *KILL_thread;
+	std::deque<mysrvc_breaker_event_t> breaker_log; // the most recent transitions of the circuit breakers
 
 	public:
 	struct {
@@ -159,6 +303,30 @@ class MySQL_HostGroups_Manager {
 		unsigned long myconnpoll_get_ping;
 		unsigned long myconnpoll_push;
 		unsigned long myconnpoll_destroy;
+		unsigned long myconnpoll_wait; // sessions queued waiting for a connection
+		unsigned long myconnpoll_handoff; // connections handed off to a waiting session
+		unsigned long myconnpoll_waiting; // sessions currently queued
+		unsigned long long myconnpoll_wait_us; // total time spent in queue
+		unsigned long long myconnpoll_wait_max_us;
+		unsigned long myconnpoll_wait_prio[MYCONN_WAITER_PRIORITIES]; // myconnpoll_wait by priority class
+		unsigned long long myconnpoll_wait_us_prio[MYCONN_WAITER_PRIORITIES]; // myconnpoll_wait_us by priority class
+		unsigned long myconnpoll_warm; // connections opened by the warm-up task
+		unsigned long myconnpoll_warm_err; // warm-up connections that failed
+		unsigned long myconnpoll_connect_throttled; // connection requests delayed by mysql-connect_rate_limit_per_server
+		unsigned long myconnpoll_reset; // connections reset by HGCU and returned to the pool
+		unsigned long myconnpoll_reset_com; // of which, using COM_RESET_CONNECTION
+		unsigned long myconnpoll_reset_err; // connections HGCU failed to reset
+		unsigned long myconnpoll_reset_dropped; // connections not reset because HGCU was too busy
+		unsigned long kill_queued; // KILL QUERY requested by sessions
+		unsigned long kill_coalesced; // of which, already queued for the same backend thread
+		unsigned long kill_dropped; // not executed because too many were pending
+		unsigned long kill_ok;
+		unsigned long kill_err; // failed or timed out
+		unsigned long kill_conn_created; // connections created to execute KILL QUERY
+		unsigned long long kill_latency_us; // total time from kill_query() to completion
+		unsigned long long kill_latency_max_us;
+		unsigned long breaker_open; // circuit breakers tripped to OPEN
+		unsigned long breaker_fast_fail; // queries failed because all the servers of the hostgroup were OPEN
 		unsigned long long autocommit_cnt;
 		unsigned long long commit_cnt;
 		unsigned long long rollback_cnt;
@@ -166,14 +334,17 @@ class MySQL_HostGroups_Manager {
 		unsigned long long commit_cnt_filtered;
 		unsigned long long rollback_cnt_filtered;
 	} status;
-	wqueue<MySQL_Connection *> queue;
 	MySQL_HostGroups_Manager();
 	~MySQL_HostGroups_Manager();
+	void init();
+	unsigned int HGCU_pending();
+	void kill_query(char *username, char *password, char *hostname, unsigned int port, unsigned long id);
+	unsigned int KILL_pending();
 //	void rdlock();
 //	void rdunlock();
 	void wrlock();
 	void wrunlock();
-	bool server_add(unsigned int hid, char *add, uint16_t p=3306, unsigned int _weight=1, enum MySerStatus status=MYSQL_SERVER_STATUS_ONLINE, unsigned int _comp=0, unsigned int _max_connections=100, unsigned int _max_replication_lag=0, unsigned int _use_ssl=0, unsigned int _max_latency_ms=0, char *comment=NULL);
+	bool server_add(unsigned int hid, char *add, uint16_t p=3306, unsigned int _weight=1, enum MySerStatus status=MYSQL_SERVER_STATUS_ONLINE, unsigned int _comp=0, unsigned int _max_connections=100, unsigned int _max_replication_lag=0, unsigned int _use_ssl=0, unsigned int _max_latency_ms=0, unsigned int _min_idle_connections=0, char *comment=NULL);
 	bool commit();
 
 	void set_incoming_replication_hostgroups(SQLite3_result *);
@@ -184,11 +355,17 @@ class MySQL_HostGroups_Manager {
 	
 	void MyConn_add_to_pool(MySQL_Connection *);
 
-	MySQL_Connection * get_MyConn_from_pool(unsigned int);
+	MySQL_Connection * get_MyConn_from_pool(unsigned int, MyConn_waiter *w=NULL, MySrvC *exclude=NULL);
+	void cancel_MyConn_wait(MyConn_waiter *w);
 
 	void drop_all_idle_connections();
 	int get_multiple_idle_connections(int, unsigned long long, MySQL_Connection **, int);
-	SQLite3_result * SQL3_Connection_Pool();
+	int get_connections_to_warm(MySQL_Connection **, int);
+	void warm_connection_done(MySQL_Connection *, bool);
+	SQLite3_result * SQL3_Connection_Pool(bool purge=true); // purge=false doesn't drop idle connections
+	SQLite3_result * SQL3_Circuit_Breaker_Log();
+	void breaker_log_add(MySrvC *, enum MySrvC_breaker_state from, enum MySrvC_breaker_state to, unsigned int requests, unsigned int failures);
+	bool breaker_all_open(unsigned int hid);
 
 	void push_MyConn_to_pool(MySQL_Connection *, bool _lock=true);
 	void push_MyConn_to_pool_array(MySQL_Connection **);
@@ -24,12 +24,15 @@ class MySQL_Event {
 	unsigned char buf[10];
 	enum log_event_type et;
 	uint64_t hid;
+	unsigned long long *phases;
+	int num_phases;
 	public:
 	MySQL_Event(uint32_t _thread_id, char * _username, char * _schemaname , uint64_t _start_time , uint64_t _end_time , uint64_t _query_digest, char *_client, size_t _client_len);
 	uint64_t write(std::fstream *f);
 	uint64_t write_query(std::fstream *f);
 	void set_query(const char *ptr, int len);
 	void set_server(int _hid, const char *ptr, int len);
+	void set_phases(unsigned long long *_phases, int _num_phases);
 };
 
 class MySQL_Logger {
@@ -125,7 +125,7 @@ class MySQL_Protocol {
 	// - size of the packet 
 	bool process_pkt_OK(unsigned char *pkt, unsigned int len);
 	bool process_pkt_EOF(unsigned char *pkt, unsigned int len);
-	bool process_pkt_handshake_response(unsigned char *pkt, unsigned int len);
+	bool process_pkt_handshake_response(unsigned char *pkt, unsigned int len, bool *auth_pending=NULL);
 	bool process_pkt_COM_QUERY(unsigned char *pkt, unsigned int len);
 	bool process_pkt_COM_CHANGE_USER(unsigned char *pkt, unsigned int len);
 	void * Query_String_to_packet(uint8_t sid, std::string *s, unsigned int *l);
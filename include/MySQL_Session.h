@@ -23,6 +23,16 @@ class Query_Info {
 	unsigned long long start_time;
 	unsigned long long end_time;
 
+	// time spent in each query_phase , in microseconds
+	unsigned long long phase_time[QUERY_PHASE__END];
+	unsigned long long phase_ts; // start of the current phase, 0 if no query is running
+	unsigned long long client_write_start; // !=0 while the response is flushed to the client
+	uint64_t phases_digest; // digest_total the phases are aggregated into
+	// phases of the previous query, aggregated by the next update_query_digest()
+	// so that the digest lock is taken once per query
+	unsigned long long pending_phase_time[QUERY_PHASE__END];
+	uint64_t pending_phases_digest; // 0 if none
+
 	MYSQL_STMT *mysql_stmt;
 	stmt_execute_metadata_t *stmt_meta;
 	uint32_t stmt_global_id;
@@ -40,6 +50,9 @@ class Query_Info {
 	unsigned long long query_parser_update_counters();
 	void begin(unsigned char *_p, int len, bool mysql_header=false);
 	void end();
+	void phases_update(unsigned long long now);
+	void phases_client_write(unsigned long long now);
+	void phases_flush();
 	char *get_digest_text();
 	bool is_select_NOT_for_update();
 };
@@ -75,8 +88,13 @@ class MySQL_Session
 	void RequestEnd(MySQL_Data_Stream *);
 
 	void handler___status_WAITING_CLIENT_DATA___STATE_SLEEP___MYSQL_COM_QUERY___create_mirror_session();
+	void handler___status_PROCESSING_QUERY___create_hedge_session();
+	void handler___status_PROCESSING_QUERY___deliver_hedge_result();
+	bool handler___status_PROCESSING_QUERY___hedge_too_large(MySQL_Connection *);
+	void hedge_cancel();
 	int handler_again___status_PINGING_SERVER();
-	void handler_again___new_thread_to_kill_connection();
+	int handler_again___status_WARMING_SERVER();
+	void handler_again___kill_backend_query();
 
 	bool handler_again___verify_backend_charset();
 	bool handler_again___verify_init_connect();
@@ -108,6 +126,7 @@ class MySQL_Session
 	// uint64_t
 	unsigned long long start_time;
 	unsigned long long pause_until;
+	int wakeup; // set by other threads with __atomic_store_n() : the session is resumed at the next loop
 
 	unsigned long long idle_since;
 
@@ -119,9 +138,37 @@ class MySQL_Session
 	PtrArray *mybes;
 	MySQL_Data_Stream *client_myds;
 	MySQL_Data_Stream *server_myds;
-	char * default_schema;
+	char * default_schema; // if it belongs to account , it is not freed
+	struct _account_details_t *account; // the frontend account, referenced and not copied
+	struct _auth_job_t *auth_job; // password verification running in an auth thread
+	PtrSize_t auth_pkt; // the handshake response waiting for auth_job
 
 	uint32_t thread_session_id;
+	int procslot;	// index in thread->procslots , -1 if none
+	// what was last written in the processlist slot, to rewrite it only when needed
+	struct {
+		unsigned long long start_time;
+		unsigned long long query_start;
+		void *myconn;
+		void *query;
+		void *schemaname;
+		unsigned int query_length;
+		uint32_t session_id;
+		int status;
+		int hostgroup;
+		bool paused;
+	} procslot_cache;
+	MyConn_waiter *pool_waiter; // used to wait in queue for a connection from the pool
+	// hedged reads: the query is also sent to a second server if the first
+	// packet of the response doesn't arrive within a delay
+	MySQL_Session *hedge_sess; // in the original session, the session running the hedged query
+	MySQL_Session *hedge_parent; // in the hedge session, the original session
+	PtrSizeArray *hedge_result; // in the original session, the response of the hedge session
+	QP_rule_hedge *hedge_rule;
+	MySrvC *hedge_exclude; // in the hedge session, the server of the original session
+	unsigned long long hedge_at; // when to start the hedge session, 0 if not eligible
+	unsigned long long hedge_sent_at; // when the query was sent to the first server
+	unsigned long long backend_query_sent_at; // when the query was sent to the backend, for its circuit breaker
 	unsigned int last_insert_id;
 	enum session_status status;
 	int healthy;
@@ -188,6 +235,7 @@ class MySQL_Session
 	unsigned long long IdleTime();
 
 	void reset_all_backends();
+	void set_account(struct _account_details_t *ad);
 	void writeout();
 	void Memory_Stats();
 };
@@ -26,6 +26,63 @@ typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) _conn_exchange_t {
 	PtrArray *resume_mysql_sessions;
 } conn_exchange_t;
 
+#define PROCESSLIST_SLOTS_PER_CHUNK 256
+#define PROCESSLIST_MAX_CHUNKS 4096
+#define PROCESSLIST_USER_LEN 80
+#define PROCESSLIST_HOST_LEN 64
+#define PROCESSLIST_INFO_LEN 1024	// longer queries are truncated in stats_mysql_processlist
+
+// status of a session as reported by stats_mysql_processlist.
+// Empty strings and negative ports are reported as NULL
+class Processlist_Slot {
+	public:
+	volatile unsigned int seq;	// odd while the owner thread is writing the slot
+	bool in_use;
+	bool mirror;
+	int hostgroup;
+	uint32_t session_id;
+	int cli_port;
+	int l_srv_port;
+	int srv_port;
+	unsigned long long start_time;	// when the session entered its current state: time_ms is computed from this when read
+	char user[PROCESSLIST_USER_LEN];
+	char db[PROCESSLIST_USER_LEN];
+	char cli_host[PROCESSLIST_HOST_LEN];
+	char l_srv_host[PROCESSLIST_HOST_LEN];
+	char srv_host[PROCESSLIST_HOST_LEN];
+	char command[16];
+	char info[PROCESSLIST_INFO_LEN];
+};
+
+// Per thread array of Processlist_Slot, one per registered session.
+// Slots are written only by the owning thread, inside write_begin()/write_end() ,
+// and read by any thread with read() , that retries if a write was in progress
+// (seqlock). Chunks are never freed while the thread is alive, so readers
+// never need to lock the thread.
+class Processlist_Slots {
+	private:
+	std::vector<unsigned int> free_slots;	// used only by the owner thread
+	public:
+	Processlist_Slot *chunks[PROCESSLIST_MAX_CHUNKS];
+	volatile unsigned int nchunks;
+	Processlist_Slots();
+	~Processlist_Slots();
+	int acquire();
+	void release(int idx);
+	Processlist_Slot * slot(unsigned int idx) {
+		return &chunks[idx/PROCESSLIST_SLOTS_PER_CHUNK][idx%PROCESSLIST_SLOTS_PER_CHUNK];
+	}
+	void write_begin(Processlist_Slot *s) {
+		s->seq++;
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+	void write_end(Processlist_Slot *s) {
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		s->seq++;
+	}
+	bool read(unsigned int idx, Processlist_Slot *out);
+};
+
 class ProxySQL_Poll {
 
   private:
@@ -146,6 +203,7 @@ class MySQL_Thread
 
 	private:
   unsigned long long last_processing_idles;
+	unsigned long long last_connection_warming;
 	MySQL_Connection **my_idle_conns;
   bool processing_idles;
 	bool maintenance_loop;
@@ -170,6 +228,7 @@ class MySQL_Thread
 	PtrArray *mysql_sessions;
 	PtrArray *idle_mysql_sessions;
 	PtrArray *resume_mysql_sessions;
+	Processlist_Slots procslots;
 
 	conn_exchange_t myexchange;
 
@@ -203,6 +262,9 @@ class MySQL_Thread
 
 
   rwlock_t thread_mutex;
+	// snapshot of the global variables in use by this thread, see refresh_variables()
+	struct _mysql_threads_variables_snapshot_t * volatile variables_snapshot;
+	bool variables_reader;
   MySQL_Thread();
   ~MySQL_Thread();
   MySQL_Session * create_new_session_and_client_data_stream(int _fd);
@@ -212,6 +274,7 @@ class MySQL_Thread
   void poll_listener_del(int sock);
   void register_session(MySQL_Session*, bool up_start=true);
   void unregister_session(int);
+  void update_processlist_slot(MySQL_Session *);
   struct pollfd * get_pollfd(unsigned int i);
   bool process_data_on_data_stream(MySQL_Data_Stream *myds, unsigned int n);
   void process_all_sessions();
@@ -282,8 +345,12 @@ class MySQL_Threads_Handler
 	rwlock_t rwlock;
 	PtrArray *bind_fds;
 	MySQL_Listeners_Manager *MLM;
+	PtrArray *variables_readers; // MySQL_Thread objects that may reference a snapshot
+	std::vector<struct _mysql_threads_variables_snapshot_t *> retired_variables;
+	pthread_mutex_t variables_snapshot_mutex;
+	void free_retired_variables();
 	public:
-	struct {
+	struct variables_t {
 		int monitor_history;
 		int monitor_connect_interval;
 		int monitor_connect_timeout;
@@ -303,6 +370,18 @@ class MySQL_Threads_Handler
 		char *monitor_password;
 		int ping_interval_server_msec;
 		int ping_timeout_server;
+		int connection_warming_interval_msec;
+		int connect_rate_limit_per_server;
+		int connpool_priority_aging_ms;
+		int hedge_delay_percentile;
+		int circuit_breaker_error_pct;
+		int circuit_breaker_min_requests;
+		int circuit_breaker_window_ms;
+		int circuit_breaker_slow_query_ms;
+		int circuit_breaker_open_ms;
+		int circuit_breaker_half_open_probes;
+		int auth_threads;
+		bool threads_affinity;
 		int shun_on_failures;
 		int shun_recovery_time_sec;
 		int query_retries_on_failure;
@@ -323,6 +402,7 @@ class MySQL_Threads_Handler
 		bool commands_stats;
 		bool query_digests;
 		bool query_digests_lowercase;
+		bool query_digests_phases;
 		bool default_reconnect;
 		bool have_compress;
 		bool client_found_rows;
@@ -352,6 +432,7 @@ class MySQL_Threads_Handler
 		int poll_timeout_on_failure;
 		char *eventslog_filename;
 		int eventslog_filesize;
+		bool eventslog_phases;
 		// SSL related, proxy to server
 		char * ssl_p2s_ca;
 		char * ssl_p2s_cert;
@@ -394,7 +475,7 @@ class MySQL_Threads_Handler
 	void start_listeners();
 	void stop_listeners();
 	void signal_all_threads(unsigned char _c=0);
-	SQLite3_result * SQL3_Processlist();
+	SQLite3_result * SQL3_Processlist(SQLite3_vtab_filter *filter=NULL);
 	SQLite3_result * SQL3_GlobalStatus();
 	bool kill_session(uint32_t _thread_session_id);
 	unsigned long long get_total_stmt_prepare();
@@ -418,7 +499,20 @@ class MySQL_Threads_Handler
 		return MLM->find_iface_from_fd(fd);
 	}
 	void Get_Memory_Stats();
+	cpu_set_t process_cpuset; // CPUs available when proxysql started
+	bool get_thread_cpuset(int tn, cpu_set_t *cpuset);
+	void set_auxiliary_thread_affinity();
+	// published by commit() , read lock-free by MySQL_Thread::refresh_variables()
+	struct _mysql_threads_variables_snapshot_t * volatile published_variables;
+	void register_variables_reader(MySQL_Thread *);
+	void unregister_variables_reader(MySQL_Thread *);
 };
 
+// immutable copy of MySQL_Threads_Handler::variables , strings are owned by the snapshot
+typedef struct _mysql_threads_variables_snapshot_t {
+	MySQL_Threads_Handler::variables_t v;
+	unsigned int version;
+} mysql_threads_variables_snapshot_t;
+
 
 #endif /* __CLASS_MYSQL_THREAD_H */
@@ -0,0 +1,38 @@
+#ifndef __CLASS_PROXYSQL_EXPORTER_H
+#define __CLASS_PROXYSQL_EXPORTER_H
+#include "proxysql.h"
+#include "cpp.h"
+
+#define MAX_EXPORTER_LISTENERS 8
+
+// Minimal HTTP listener serving metrics in Prometheus text format (or
+// OpenMetrics, if the scraper asks for it) on GET /metrics .
+// Metrics are read directly from the modules' counters: no SQLite table is
+// involved, so a scrape never triggers GenericRefreshStatistics() .
+// It runs in its own thread and listens on admin-metrics_ifaces ; an empty
+// list disables it.
+class ProxySQL_Exporter {
+	private:
+	pthread_t thr;
+	bool thread_started;
+	int pipefd[2]; // used to wake up the thread on shutdown or on ifaces change
+	pthread_mutex_t mutex;
+	char *ifaces; // protected by mutex
+	int version; // incremented at every ifaces change
+	volatile int shutdown;
+	int nfds;
+	struct pollfd fds[MAX_EXPORTER_LISTENERS+1];
+	void close_listeners();
+	void open_listeners();
+	void serve_client(int fd);
+	void generate_metrics(std::string &out, bool openmetrics);
+	public:
+	unsigned long long scrapes; // number of /metrics requests served
+	ProxySQL_Exporter();
+	~ProxySQL_Exporter();
+	void start();
+	void stop();
+	void update_ifaces(const char *list);
+	void run();
+};
+#endif /* __CLASS_PROXYSQL_EXPORTER_H */
@@ -19,6 +19,7 @@
 #include "MySQL_HostGroups_Manager.h"
 #include "MySQL_Logger.hpp"
 #include "MySQL_PreparedStatement.h"
+#include "ProxySQL_Exporter.hpp"
 #undef swap
 #undef min
 #undef max
@@ -4,8 +4,26 @@
 #include "cpp.h"
 #include <vector>
 
+class ProxySQL_Exporter;
+
 typedef struct { uint32_t hash; uint32_t key; } t_symstruct;
 
+#define SNAPSHOT_MAGIC "PSQLSNAP"
+#define SNAPSHOT_FORMAT_VERSION 1
+#define SNAPSHOT_NULL_FIELD 0xFFFFFFFF
+
+// header of the runtime snapshot file, see ProxySQL_Admin::save_runtime_snapshot()
+typedef struct _proxysql_snapshot_header_t {
+	char magic[8];
+	uint32_t format_version;
+	uint32_t tables;
+	char proxysql_version[32];
+	uint64_t schema_hash;
+	uint64_t created_at;
+	uint64_t body_length;
+	uint64_t body_hash;
+} proxysql_snapshot_header_t;
+
 
 
 
@@ -51,6 +69,7 @@ class ProxySQL_Admin {
 	std::vector<table_def_t *> *tables_defs_admin;
 	std::vector<table_def_t *> *tables_defs_stats;
 	std::vector<table_def_t *> *tables_defs_config;
+	std::vector<SQLite3_vtab_table *> *vtabs_stats;
 
 
 	pthread_t admin_thr;
@@ -70,6 +89,7 @@ class ProxySQL_Admin {
 		char *mysql_ifaces;
 		char *telnet_admin_ifaces;
 		char *telnet_stats_ifaces;
+		char *metrics_ifaces;
 		bool admin_read_only;
 		bool hash_passwords;
 		char * admin_version;
@@ -80,6 +100,7 @@ class ProxySQL_Admin {
 
 
 	ProxySQL_External_Scheduler *scheduler;
+	ProxySQL_Exporter *exporter;
 
 	void dump_mysql_collations();
 	void insert_into_tables_defs(std::vector<table_def_t *> *, const char *table_name, const char *table_def);
@@ -151,6 +172,8 @@ class ProxySQL_Admin {
 	void init_mysql_query_rules();
 	void save_mysql_users_runtime_to_database(bool _runtime);
 	void save_mysql_servers_runtime_to_database(bool);
+	bool save_runtime_snapshot(char **err);
+	bool load_runtime_snapshot();
 	void admin_shutdown();
 	bool is_command(std::string);
 //	void SQLite3_to_MySQL(SQLite3_result *result, char *error, int affected_rows, MySQL_Protocol *myprot);
@@ -185,12 +208,12 @@ class ProxySQL_Admin {
 
 
 	void stats___mysql_query_rules();
-	void stats___mysql_query_digests();
+	void stats___mysql_query_rules_qos();
+	void stats___mysql_query_rules_hedge();
+	void stats___mysql_circuit_breaker_log();
 	void stats___mysql_query_digests_reset();
 	void stats___mysql_commands_counters();
-	void stats___mysql_processlist();
-	void stats___mysql_connection_pool();
-	void stats___mysql_global();
+	SQLite3_result * generate_stats_mysql_global();
 
 	int Read_Global_Variables_from_configfile(const char *prefix);
 	int Read_MySQL_Users_from_configfile();
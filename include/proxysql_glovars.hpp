@@ -25,10 +25,12 @@ class ProxySQL_GlobalVariables {
 	int __cmd_proxysql_gdbg;
 	bool __cmd_proxysql_initial;
 	bool __cmd_proxysql_reload;
+	bool __cmd_proxysql_snapshot;
 	char *__cmd_proxysql_admin_socket;
 	char *config_file;
 	char *datadir;
 	char *admindb;
+	char *snapshot;
 	char *errorlog;
 	char *pid;
 	struct  {
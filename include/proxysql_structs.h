@@ -13,7 +13,19 @@
 #define PROXYSQL_ENUMS
 
 enum log_event_type {
-	PROXYSQL_QUERY
+	PROXYSQL_QUERY,
+	PROXYSQL_QUERY_PHASES // PROXYSQL_QUERY followed by the query_phase times
+};
+
+// phases a query goes through, see Query_Info::phases_update()
+enum query_phase {
+	QUERY_PHASE_RULES,
+	QUERY_PHASE_POOL_WAIT,
+	QUERY_PHASE_CONNECT,
+	QUERY_PHASE_RESET,
+	QUERY_PHASE_BACKEND,
+	QUERY_PHASE_CLIENT_WRITE,
+	QUERY_PHASE__END
 };
 
 enum cred_username_type { USERNAME_BACKEND, USERNAME_FRONTEND };
@@ -133,6 +145,7 @@ enum session_status {
 	FAST_FORWARD,
 	PROCESSING_STMT_PREPARE,
 	PROCESSING_STMT_EXECUTE,
+	WARMING_SERVER,
 	NONE
 };
 
@@ -349,6 +362,8 @@ class ProxySQL_ConfigFile;
 class Query_Info;
 //class MySQL_Server;
 class SQLite3_result;
+class SQLite3_vtab_filter;
+class SQLite3_vtab_table;
 class stmt_execute_metadata_t;
 class MySQL_STMTs_meta;
 //class MySQL_Servers;
@@ -356,6 +371,9 @@ class MySQL_STMTs_meta;
 //class MySQL_Hostgroup;
 //class MySQL_HostGroups_Handler;
 class MySQL_HostGroups_Manager;
+class MyConn_waiter;
+class MySrvC;
+class QP_rule_hedge;
 #endif /* PROXYSQL_CLASSES */
 //#endif /* __cplusplus */
 
@@ -796,6 +814,16 @@ __thread int mysql_thread___long_query_time;
 __thread int mysql_thread___free_connections_pct;
 __thread int mysql_thread___ping_interval_server_msec;
 __thread int mysql_thread___ping_timeout_server;
+__thread int mysql_thread___connection_warming_interval_msec;
+__thread int mysql_thread___connect_rate_limit_per_server;
+__thread int mysql_thread___hedge_delay_percentile;
+__thread int mysql_thread___connpool_priority_aging_ms;
+__thread int mysql_thread___circuit_breaker_error_pct;
+__thread int mysql_thread___circuit_breaker_min_requests;
+__thread int mysql_thread___circuit_breaker_window_ms;
+__thread int mysql_thread___circuit_breaker_slow_query_ms;
+__thread int mysql_thread___circuit_breaker_open_ms;
+__thread int mysql_thread___circuit_breaker_half_open_probes;
 __thread int mysql_thread___shun_on_failures;
 __thread int mysql_thread___shun_recovery_time_sec;
 __thread int mysql_thread___query_retries_on_failure;
@@ -819,6 +847,7 @@ __thread bool mysql_thread___servers_stats;
 __thread bool mysql_thread___commands_stats;
 __thread bool mysql_thread___query_digests;
 __thread bool mysql_thread___query_digests_lowercase;
+__thread bool mysql_thread___query_digests_phases;
 __thread bool mysql_thread___default_reconnect;
 __thread bool mysql_thread___session_idle_show_processlist;
 __thread bool mysql_thread___sessions_sort;
@@ -836,6 +865,7 @@ __thread char * mysql_thread___ssl_p2s_cipher;
 /* variables used by events log */
 __thread char * mysql_thread___eventslog_filename;
 __thread int mysql_thread___eventslog_filesize;
+__thread bool mysql_thread___eventslog_phases;
 
 /* variables used by the monitoring module */
 __thread int mysql_thread___monitor_enabled;
@@ -886,6 +916,16 @@ extern __thread int mysql_thread___long_query_time;
 extern __thread int mysql_thread___free_connections_pct;
 extern __thread int mysql_thread___ping_interval_server_msec;
 extern __thread int mysql_thread___ping_timeout_server;
+extern __thread int mysql_thread___connection_warming_interval_msec;
+extern __thread int mysql_thread___connect_rate_limit_per_server;
+extern __thread int mysql_thread___hedge_delay_percentile;
+extern __thread int mysql_thread___connpool_priority_aging_ms;
+extern __thread int mysql_thread___circuit_breaker_error_pct;
+extern __thread int mysql_thread___circuit_breaker_min_requests;
+extern __thread int mysql_thread___circuit_breaker_window_ms;
+extern __thread int mysql_thread___circuit_breaker_slow_query_ms;
+extern __thread int mysql_thread___circuit_breaker_open_ms;
+extern __thread int mysql_thread___circuit_breaker_half_open_probes;
 extern __thread int mysql_thread___shun_on_failures;
 extern __thread int mysql_thread___shun_recovery_time_sec;
 extern __thread int mysql_thread___query_retries_on_failure;
@@ -909,6 +949,7 @@ extern __thread bool mysql_thread___servers_stats;
 extern __thread bool mysql_thread___commands_stats;
 extern __thread bool mysql_thread___query_digests;
 extern __thread bool mysql_thread___query_digests_lowercase;
+extern __thread bool mysql_thread___query_digests_phases;
 extern __thread bool mysql_thread___default_reconnect;
 extern __thread bool mysql_thread___session_idle_show_processlist;
 extern __thread bool mysql_thread___sessions_sort;
@@ -926,6 +967,7 @@ extern __thread char * mysql_thread___ssl_p2s_cipher;
 /* variables used by events log */
 extern __thread char * mysql_thread___eventslog_filename;
 extern __thread int mysql_thread___eventslog_filesize;
+extern __thread bool mysql_thread___eventslog_phases;
 
 /* variables used by the monitoring module */
 extern __thread int mysql_thread___monitor_enabled;
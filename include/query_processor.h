@@ -2,6 +2,7 @@
 #define __CLASS_QUERY_PROCESSOR_H
 #include "proxysql.h"
 #include "cpp.h"
+#include <deque>
 
 
 //typedef btree::btree_map<uint64_t, void *> BtMap_query_digest;
@@ -66,6 +67,63 @@ enum MYSQL_COM_QUERY_command {
 
 */
 
+// Rate and concurrency limits of a query rule, see Query_Processor::qos_admit() .
+// Kept by rule_id across LOAD MYSQL QUERY RULES TO RUNTIME , and never freed
+// while the Query Processor runs: sessions can always reference them.
+// The global bucket is refilled at max_qps tokens per second up to burst, and
+// threads take tokens from it in batches (see _thr_SQP_qos_tokens) .
+// Queries held back by a limit are queued FIFO on the rule, and the session
+// of the first one is woken up when a concurrency slot is released or when
+// the query ahead of it leaves the queue
+class Query_Processor_Output;
+class QP_rule_qos {
+	public:
+	int rule_id;
+	unsigned int idx; // slot in the per thread token caches
+	unsigned int max_qps;
+	unsigned int burst;
+	unsigned int max_concurrency;
+	unsigned int max_wait_ms;
+	rwlock_t rwlock; // protects tokens, last_refill and waiters
+	unsigned long long tokens; // in millionths of a token
+	unsigned long long last_refill;
+	int running; // queries holding a concurrency slot
+	std::deque<Query_Processor_Output *> waiters; // queries waiting for the limits of the rule
+	unsigned int num_waiters; // read without the lock to skip the wake up
+	unsigned long long admitted;
+	unsigned long long queued; // queries that had to wait
+	unsigned long long rejected;
+	unsigned long long wait_us; // total time spent waiting
+	QP_rule_qos(int _rule_id, unsigned int _idx);
+	unsigned int take(unsigned int n, unsigned long long now);
+	unsigned long long refill_at(unsigned long long now);
+	bool is_next(Query_Processor_Output *o);
+	void enqueue(Query_Processor_Output *o);
+	void dequeue(Query_Processor_Output *o);
+	void wake_next(Query_Processor_Output *self=NULL);
+};
+
+#define QP_HEDGE_BUCKETS 32
+#define QP_HEDGE_MIN_SAMPLES 100 // below this, the percentile is not computed
+#define QP_HEDGE_DECAY_SAMPLES 10000 // the histogram is halved every this many samples
+
+// Hedged reads of a query rule, see MySQL_Session::handler___status_PROCESSING_QUERY___create_hedge_session() .
+// Kept by rule_id across LOAD MYSQL QUERY RULES TO RUNTIME , like QP_rule_qos .
+// The latency of the first packet of the queries matching the rule is kept
+// in a log2 histogram, used to compute the delay before hedging
+class QP_rule_hedge {
+	public:
+	int rule_id;
+	unsigned int min_delay_ms;
+	unsigned int buckets[QP_HEDGE_BUCKETS]; // bucket i counts latencies in [2^i, 2^(i+1)) microseconds
+	unsigned int samples;
+	unsigned long long hedged; // queries sent to a second server
+	unsigned long long won; // of which, answered first by the second server
+	QP_rule_hedge(int _rule_id);
+	void add_sample(unsigned long long us);
+	unsigned long long delay_us(int percentile);
+};
+
 struct _Query_Processor_rule_t {
 	int rule_id;
 	bool active;
@@ -96,6 +154,14 @@ struct _Query_Processor_rule_t {
 	int log;
 	bool apply;
   char *comment; // #643
+	int qos_max_qps;
+	int qos_burst;
+	int qos_max_concurrency;
+	int qos_max_wait_ms;
+	QP_rule_qos *qos; // only in the rules of a QP_rules_set
+	int priority; // priority class while waiting for a pool connection
+	int hedge_delay_ms;
+	QP_rule_hedge *hedge; // only in the rules of a QP_rules_set
 	void *regex_engine1;
 	void *regex_engine2;
 	int hits;
@@ -117,6 +183,24 @@ struct _Query_Processor_rule_t {
 typedef struct _Query_Processor_rule_t QP_rule_t;
 //typedef struct _Query_Processor_output_t QP_out_t;
 
+// The active query rules with their regex already compiled, built once by
+// Query_Processor::commit() and shared by all the MySQL threads.
+// A set is never modified after it is published: threads hold a reference
+// while using it, and keep their hits in a per-thread array (see
+// _thr_SQP_hits) that is periodically flushed into the parent rules
+class QP_rules_set {
+	public:
+	std::vector<QP_rule_t *> rules;
+	unsigned int version;
+	int refcnt;
+	bool orphan; // the parent rules were deleted by reset_all() , hits can't be flushed
+	QP_rules_set(unsigned int v);
+	~QP_rules_set();
+	void release();
+};
+
+#define QP_QOS_MAX_LIMITS 4 // limits of different rules applied to the same query
+
 class Query_Processor_Output {
 	public:
 	void *ptr;
@@ -135,6 +219,15 @@ class Query_Processor_Output {
 	int log;
   char *comment; // #643
 	std::string *new_query;
+	QP_rule_qos *qos[QP_QOS_MAX_LIMITS]; // limits of the matching rules
+	bool qos_slot[QP_QOS_MAX_LIMITS]; // a concurrency slot is held
+	unsigned int qos_len;
+	bool qos_admitted;
+	unsigned long long qos_since; // when admission started, 0 if not yet
+	QP_rule_qos *qos_queued; // rule the query is queued on, if waiting
+	MySQL_Session *qos_sess; // session to wake up when the query can be admitted
+	int priority;
+	QP_rule_hedge *hedge; // hedged reads of the last matching rule that set hedge_delay_ms
 	void * operator new(size_t size) {
 		return l_alloc(size);
 	}
@@ -164,8 +257,33 @@ class Query_Processor_Output {
 		new_query=NULL;
 		error_msg=NULL;
 		comment=NULL; // #643
+		qos_len=0;
+		qos_admitted=false;
+		qos_since=0;
+		qos_queued=NULL;
+		qos_sess=NULL;
+		priority=-1;
+		hedge=NULL;
+	}
+	// releases the concurrency slots held by the query, or its place in queue
+	void qos_release() {
+		if (qos_queued) {
+			qos_queued->dequeue(this);
+			qos_queued=NULL;
+		}
+		for (unsigned int i=0; i<qos_len; i++) {
+			if (qos_slot[i]) {
+				__sync_fetch_and_sub(&qos[i]->running,1);
+				qos_slot[i]=false;
+				qos[i]->wake_next();
+			}
+		}
+		qos_len=0;
+		qos_admitted=false;
+		qos_since=0;
 	}
 	void destroy() {
+		qos_release();
 		if (error_msg) {
 			free(error_msg);
 			error_msg=NULL;
@@ -181,46 +299,85 @@ class Query_Processor_Output {
 
 static char *commands_counters_desc[MYSQL_COM_QUERY___NONE];
 
+// Latency histogram of the commands counters.
+// Buckets are log-linear in base 10: every decade is split in 9 linear
+// buckets (1-2us, 2-3us, ... 9-10us, 10-20us, 20-30us, ...) up to 10^10us ,
+// plus an overflow bucket. The upper bound of each bucket is inclusive.
+// All the legacy boundaries of stats_mysql_commands_counters (100us, 500us,
+// 1ms, ... 10s) are bucket boundaries, so those columns are exact sums.
+#define COMMAND_COUNTER_DECADES 10
+#define COMMAND_COUNTER_BUCKETS (2+9*COMMAND_COUNTER_DECADES)
+
 class Command_Counter {
 	private:
 	int cmd_idx;
-	int _add_idx(unsigned long long t) {
-		if (t<=100) return 0;
-		if (t<=500) return 1;
-		if (t<=1000) return 2;
-		if (t<=5000) return 3;
-		if (t<=10000) return 4;
-		if (t<=50000) return 5;
-		if (t<=100000) return 6;
-		if (t<=500000) return 7;
-		if (t<=1000000) return 8;
-		if (t<=5000000) return 9;
-		if (t<=10000000) return 10;
-		return 11;
-	}
 	public:
 	unsigned long long total_time;
-	unsigned long long counters[13];
+	unsigned long long total_cnt;
+	unsigned long long buckets[COMMAND_COUNTER_BUCKETS];
+	static int bucket_idx(unsigned long long t) {
+		if (t<=1) return 0;
+		unsigned long long x=t-1;
+		unsigned long long p=1;
+		for (int k=0; k<COMMAND_COUNTER_DECADES; k++) {
+			if (x < p*10) {
+				return 1+9*k+(int)(x/p)-1;
+			}
+			p*=10;
+		}
+		return COMMAND_COUNTER_BUCKETS-1;
+	}
+	// upper bound of a bucket, in microseconds. 0 for the overflow bucket
+	static unsigned long long bucket_bound(int idx) {
+		if (idx==0) return 1;
+		if (idx>=COMMAND_COUNTER_BUCKETS-1) return 0;
+		unsigned long long p=1;
+		for (int k=0; k<(idx-1)/9; k++) p*=10;
+		return (unsigned long long)((idx-1)%9+2)*p;
+	}
 	Command_Counter(int a) {
-		total_time=0;
 		cmd_idx=a;
+		reset();
+	}
+	void reset() {
 		total_time=0;
-		for (int i=0; i<13; i++) {
-			counters[i]=0;
+		total_cnt=0;
+		for (int i=0; i<COMMAND_COUNTER_BUCKETS; i++) {
+			buckets[i]=0;
 		}
 	}
+	// called only by the thread owning the counter
 	unsigned long long add_time(unsigned long long t) {
 		total_time+=t;
-		counters[0]++;
-		int i=_add_idx(t);
-		counters[i+1]++;
+		total_cnt++;
+		buckets[bucket_idx(t)]++;
 		return total_time;
 	}
+	// aggregates another counter (possibly being updated by its owner) into this one
+	void add(Command_Counter *c) {
+		total_time+=c->total_time;
+		total_cnt+=c->total_cnt;
+		for (int i=0; i<COMMAND_COUNTER_BUCKETS; i++) {
+			buckets[i]+=c->buckets[i];
+		}
+	}
 	char **get_row() {
+		// legacy upper bounds of cnt_100us ... cnt_10s
+		static const unsigned long long bounds[11] = { 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000 };
+		unsigned long long counters[12];
+		int b=0;
+		for (int i=0; i<12; i++) counters[i]=0;
+		for (int i=0; i<COMMAND_COUNTER_BUCKETS-1; i++) {
+			unsigned long long ub=bucket_bound(i);
+			while (b<11 && ub>bounds[b]) b++;
+			counters[b]+=buckets[i];
+		}
+		counters[11]+=buckets[COMMAND_COUNTER_BUCKETS-1];
 		char **pta=(char **)malloc(sizeof(char *)*15);
 		pta[0]=commands_counters_desc[cmd_idx];
 		itostr(pta[1],total_time);
-		for (int i=0;i<13;i++) itostr(pta[i+2], counters[i]);
+		itostr(pta[2],total_cnt);
+		for (int i=0;i<12;i++) itostr(pta[i+3], counters[i]);
 		return pta;
 	}
 	void free_row(char **pta) {
@@ -229,20 +386,57 @@ class Command_Counter {
 	}
 };
 
+// All the commands counters of a worker thread, in a single cache line
+// aligned block. Only the owning thread writes it, so the data path never
+// shares cache lines with other threads: blocks are aggregated when stats
+// are read.
+class Command_Counters_Block {
+	public:
+	Command_Counter *counters[MYSQL_COM_QUERY___NONE];
+	void *mem;
+	Command_Counters_Block() {
+		size_t cs=(sizeof(Command_Counter)+63) & ~((size_t)63);
+		if (posix_memalign(&mem, 64, cs*MYSQL_COM_QUERY___NONE)) {
+			assert(0);
+		}
+		for (int i=0; i<MYSQL_COM_QUERY___NONE; i++) {
+			counters[i]=new ((char *)mem+cs*i) Command_Counter(i);
+		}
+	}
+	~Command_Counters_Block() {
+		for (int i=0; i<MYSQL_COM_QUERY___NONE; i++) {
+			counters[i]->~Command_Counter();
+		}
+		free(mem);
+	}
+};
+
 
 
 class Query_Processor {
 
 
 	private:
-	umap_query_digest digest_umap;
+	umap_query_digest *digest_umap;
 	rwlock_t digest_rwlock;
 	int64_t padding;	// to get rwlock cache aligned
+	pthread_mutex_t digest_snapshot_mutex; // serializes readers of digest_umap, never taken by the data path
+	umap_query_digest * digest_umap_detach();
+	void digest_umap_reattach(umap_query_digest *snapshot);
 	enum MYSQL_COM_QUERY_command __query_parser_command_type(SQP_par_t *qp);
 	protected:
 	rwlock_t rwlock;
 	std::vector<QP_rule_t *> rules;
-	Command_Counter * commands_counters[MYSQL_COM_QUERY___NONE];
+	QP_rules_set *rules_set; // compiled active rules, protected by rwlock
+	QP_rules_set * get_rules_set();
+	Command_Counter * commands_counters[MYSQL_COM_QUERY___NONE]; // counters of the threads that already exited
+	std::vector<Command_Counters_Block *> thr_commands_counters; // counters of the running threads
+	pthread_mutex_t thr_commands_counters_mutex;
+	void aggregate_commands_counters(Command_Counter **out);
+	std::unordered_map<int, QP_rule_qos *> qos_map; // by rule_id , protected by rwlock
+	unsigned int qos_next_idx;
+	bool qos_take_token(QP_rule_qos *q, unsigned long long now);
+	std::unordered_map<int, QP_rule_hedge *> hedge_map; // by rule_id , protected by rwlock
 	volatile unsigned int version;
 	public:
 	Query_Processor();
@@ -254,7 +448,7 @@ class Query_Processor {
 	void wrunlock();	// explicit write unlock
 	bool insert(QP_rule_t *qr, bool lock=true);		// insert a new rule. Uses a generic void pointer to a structure that may vary depending from the Query Processor
 //	virtual bool insert_locked(QP_rule_t *qr) {return false;};		// call this instead of insert() in case lock was already acquired via wrlock()
-	QP_rule_t * new_query_rule(int rule_id, bool active, char *username, char *schemaname, int flagIN, char *client_addr, char *proxy_addr, int proxy_port, char *digest, char *match_digest, char *match_pattern, bool negate_match_pattern, char *re_modifiers, int flagOUT, char *replace_pattern, int destination_hostgroup, int cache_ttl, int reconnect, int timeout, int retries, int delay, int mirror_hostgroup, int mirror_flagOUT, char *error_msg, int sticky_conn, int multiplex, int log, bool apply, char *comment);	// to use a generic query rule struct, this is generated by this function and returned as generic void pointer
+	QP_rule_t * new_query_rule(int rule_id, bool active, char *username, char *schemaname, int flagIN, char *client_addr, char *proxy_addr, int proxy_port, char *digest, char *match_digest, char *match_pattern, bool negate_match_pattern, char *re_modifiers, int flagOUT, char *replace_pattern, int destination_hostgroup, int cache_ttl, int reconnect, int timeout, int retries, int delay, int mirror_hostgroup, int mirror_flagOUT, char *error_msg, int sticky_conn, int multiplex, int log, bool apply, char *comment, int qos_max_qps=-1, int qos_burst=-1, int qos_max_concurrency=-1, int qos_max_wait_ms=-1, int priority=-1, int hedge_delay_ms=-1);	// to use a generic query rule struct, this is generated by this function and returned as generic void pointer
 	void delete_query_rule(QP_rule_t *qr);	// destructor
 	//virtual bool remove(int rule_id, bool lock=true) {return false;}; // FIXME: not implemented yet, should be implemented at all ?
 //	virtual bool remove_locked(int rule_id) {return false;};		// call this instead of remove() in case lock was already acquired via wrlock()
@@ -268,6 +462,9 @@ class Query_Processor {
 	void commit();	// this applies all the changes in memory
 	SQLite3_result * get_current_query_rules();
 	SQLite3_result * get_stats_query_rules();	
+	SQLite3_result * get_stats_query_rules_qos();
+	SQLite3_result * get_stats_query_rules_hedge();
+	int qos_admit(Query_Processor_Output *qpo, MySQL_Session *sess, unsigned long long now, int *rule_id, unsigned long long *wait_until);
 
 	void update_query_processor_stats();
 
@@ -278,13 +475,16 @@ class Query_Processor {
 	char * get_digest_text(SQP_par_t *qp);
 	uint64_t get_digest(SQP_par_t *qp);
 
-	void update_query_digest(SQP_par_t *qp, int hid, MySQL_Connection_userinfo *ui, unsigned long long t, unsigned long long n, MySQL_STMT_Global_info *_stmt_info);
+	void update_query_digest(SQP_par_t *qp, int hid, MySQL_Connection_userinfo *ui, unsigned long long t, unsigned long long n, MySQL_STMT_Global_info *_stmt_info, uint64_t phases_digest=0, unsigned long long *phases=NULL);
+	void update_query_digest_phases(uint64_t digest_total, unsigned long long *t);
 
 	unsigned long long query_parser_update_counters(MySQL_Session *sess, enum MYSQL_COM_QUERY_command c, SQP_par_t *qp, unsigned long long t);
 
 	SQLite3_result * get_stats_commands_counters();
-	SQLite3_result * get_query_digests();
+	SQLite3_result * get_stats_commands_histogram();
+	SQLite3_result * get_query_digests(SQLite3_vtab_filter *filter=NULL);
 	SQLite3_result * get_query_digests_reset();
+	SQLite3_result * get_query_digests_phases(SQLite3_vtab_filter *filter=NULL);
 };
 
 
@@ -142,11 +142,63 @@ class SQLite3_result {
 	};
 };
 
+// Equality and lower bound constraints pushed down by SQLite into a virtual
+// table scan. Only columns with numeric affinity are pushed down: SQLite
+// compares text with a collation (of the column, or of the query) that the
+// module can't see. Row generators may use it to skip rows before formatting
+// them; SQLite always double-checks the constraints, so a generator is free
+// to ignore it.
+class SQLite3_vtab_filter {
+	public:
+	int columns;
+	char **values; // one per column, NULL if the column is not constrained
+	char **min_values; // lower bounds from > and >= constraints, NULL if none
+	SQLite3_vtab_filter(int c) {
+		columns=c;
+		values=(char **)malloc(sizeof(char *)*c);
+		memset(values,0,sizeof(char *)*c);
+		min_values=(char **)malloc(sizeof(char *)*c);
+		memset(min_values,0,sizeof(char *)*c);
+	};
+	~SQLite3_vtab_filter() {
+		for (int i=0;i<columns;i++) {
+			if (values[i]) free(values[i]);
+			if (min_values[i]) free(min_values[i]);
+		}
+		free(values);
+		free(min_values);
+	};
+	bool constrained(int col) {
+		return (col < columns && (values[col] || min_values[col]));
+	};
+	bool match(int col, const char *field);
+	bool match(SQLite3_row *row);
+};
+
+typedef SQLite3_result * (*SQLite3_vtab_rows_cb)(void *arg, SQLite3_vtab_filter *filter);
+
+// A read-only table whose rows are generated by a callback on every scan,
+// registered in SQLite as a virtual table module named after the table.
+class SQLite3_vtab_table {
+	public:
+	char *table_name;
+	char *table_def; // CREATE TABLE statement passed to sqlite3_declare_vtab()
+	int columns;
+	bool *numeric; // numeric affinity of each column, derived from table_def
+	SQLite3_vtab_rows_cb rows_cb;
+	void *rows_arg;
+	pthread_mutex_t *rows_mutex; // if not NULL, held while rows_cb runs
+	SQLite3_vtab_table(const char *name, const char *def, SQLite3_vtab_rows_cb cb, void *arg, pthread_mutex_t *m=NULL);
+	~SQLite3_vtab_table();
+};
+
 class SQLite3DB {
 	private:
 	char *url;
 	sqlite3 *db;
 	rwlock_t rwlock;
+	std::vector<sqlite3_stmt *> stmt_cache; // idle prepared statements, looked up by SQL text
+	pthread_mutex_t stmt_cache_mutex;
 	public:
 	char *get_url() const { return url; }
 	sqlite3 *get_db() const { return db; }
@@ -166,6 +218,42 @@ class SQLite3DB {
 	int check_table_structure(char *table_name, char *table_def);
 	bool build_table(char *table_name, char *table_def, bool dropit);
 	bool check_and_build_table(char *table_name, char *table_def);
+	bool create_vtab_module(SQLite3_vtab_table *vt);
+	sqlite3_stmt *prepare_cached(const char *str);
+	void release_cached(sqlite3_stmt *statement);
+};
+
+// Batched writer for runtime->table flushes.
+// Rows are bound as parameters (no escaping, no sprintf) and buffered until
+// rows_per_stmt of them can be written by a single multi-row statement;
+// the remainder is written one row at a time by flush().
+// Both statements are checked out of the SQLite3DB statement cache, so they
+// are prepared once and reused across flushes.
+// If begin() is called while no transaction is in progress, the writer owns
+// the transaction and flush() commits it.
+class SQLite3_batch_insert {
+	private:
+	SQLite3DB *db;
+	char *prefix; // "INSERT INTO t VALUES " , "REPLACE INTO t(a,b) VALUES " , ...
+	char *row; // "(?,?,?)" , or any row expression with params placeholders
+	int params;
+	int rows_per_stmt;
+	int pending;
+	char **values; // rows_per_stmt * params values, NULL is bound as NULL
+	bool *copied; // values[i] is a copy, freed once written
+	bool in_transaction;
+	sqlite3_stmt *stmt1;
+	sqlite3_stmt *stmtN;
+	char *build_query(int rows);
+	bool bind_and_step(sqlite3_stmt *stmt, char **vals, int rows);
+	void release_values(int n);
+	public:
+	unsigned long long rows_written;
+	SQLite3_batch_insert(SQLite3DB *_db, const char *_prefix, int _params, const char *_row=NULL, int _rows_per_stmt=32);
+	~SQLite3_batch_insert();
+	void begin();
+	bool add_row(char **fields, bool copy=true); // without copy, the fields must stay valid until flush()
+	bool flush();
 };
 
 #endif /* __CLASS_SQLITE3DB_H */
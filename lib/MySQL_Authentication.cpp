@@ -34,6 +34,41 @@ typedef struct _creds_group_t {
 } creds_group_t;
 */
 
+extern MySQL_Threads_Handler *GloMTH;
+
+void proxy_compute_two_stage_sha1_hash(const char *password, size_t pass_len, uint8 *hash_stage1, uint8 *hash_stage2);
+void unhex_pass(uint8_t *out, const char *in);
+bool proxy_verify_account_reply(account_details_t *ad, const char *scramble, const unsigned char *reply, char *sha1_pass);
+
+// per thread variables: the last snapshot of each credentials group seen by
+// the thread, indexed by cred_username_type
+__thread creds_snapshot_t * _thr_creds_snapshots[2];
+
+static void account_release(account_details_t *ad) {
+	if (__sync_sub_and_fetch(&ad->refcnt,1)==0) {
+		free(ad->username);
+		free(ad->password);
+		if (ad->sha1_pass) { free(ad->sha1_pass); ad->sha1_pass=NULL; }
+		free(ad->default_schema);
+		free(ad);
+	}
+}
+
+static void snapshot_release(creds_snapshot_t *cs) {
+	if (__sync_sub_and_fetch(&cs->refcnt,1)==0) {
+		for (umap_auth::iterator it=cs->bt_map.begin(); it!=cs->bt_map.end(); ++it) {
+			account_release(it->second);
+		}
+		delete cs;
+	}
+}
+
+static creds_snapshot_t * new_snapshot() {
+	creds_snapshot_t *cs=new creds_snapshot_t();
+	cs->version=0;
+	cs->refcnt=1; // the reference of creds_group_t
+	return cs;
+}
 
 MySQL_Authentication::MySQL_Authentication() {
 #ifdef DEBUG
@@ -48,6 +83,15 @@ MySQL_Authentication::MySQL_Authentication() {
 	spinlock_rwlock_init(&creds_frontends.lock);
 	creds_backends.cred_array = new PtrArray();
 	creds_frontends.cred_array = new PtrArray();
+	creds_backends.snapshot = new_snapshot();
+	creds_frontends.snapshot = new_snapshot();
+	creds_backends.version = 0;
+	creds_frontends.version = 0;
+	creds_backends.publish_deferred = false;
+	creds_frontends.publish_deferred = false;
+	auth_threads=NULL;
+	num_auth_threads=0;
+	auth_offloaded=0;
 
 //	spinlock_rwlock_init(&rwlock);
 //	authdb=new SQLite3DB();
@@ -58,12 +102,123 @@ MySQL_Authentication::MySQL_Authentication() {
 };
 
 MySQL_Authentication::~MySQL_Authentication() {
+	unsigned int i;
+	for (i=0; i<num_auth_threads; i++) {
+		auth_queue.add(NULL);
+	}
+	for (i=0; i<num_auth_threads; i++) {
+		auth_threads[i]->join();
+		delete auth_threads[i];
+	}
+	if (auth_threads) {
+		free(auth_threads);
+	}
 	reset();
+	end_thread();
+	snapshot_release(creds_backends.snapshot);
+	snapshot_release(creds_frontends.snapshot);
 	delete creds_backends.cred_array;
 	delete creds_frontends.cred_array;
 //	delete authdb;
 };
 
+// starts mysql-auth_threads auth threads. With none, passwords are verified
+// by the MySQL threads
+void MySQL_Authentication::init() {
+	unsigned int i;
+	if (GloMTH) {
+		num_auth_threads=GloMTH->get_variable_int((char *)"auth_threads");
+	}
+	if (num_auth_threads==0) {
+		return;
+	}
+	auth_threads=(std::thread **)malloc(sizeof(std::thread *)*num_auth_threads);
+	for (i=0; i<num_auth_threads; i++) {
+		auth_threads[i]=new std::thread(&MySQL_Authentication::auth_thread_run,this);
+	}
+}
+
+void MySQL_Authentication::auth_thread_run() {
+	auth_job_t *job;
+	while ((job=auth_queue.remove())) {
+		char sha1_pass[SHA_DIGEST_LENGTH];
+		bool ret=false;
+		pthread_mutex_lock(&job->mutex);
+		bool wanted=(job->sess!=NULL);
+		pthread_mutex_unlock(&job->mutex);
+		if (wanted) {
+			ret=proxy_verify_account_reply(job->ad, job->scramble, job->reply, sha1_pass);
+		}
+		pthread_mutex_lock(&job->mutex);
+		job->ret=ret;
+		if (ret) {
+			memcpy(job->sha1_pass,sha1_pass,SHA_DIGEST_LENGTH);
+		}
+		job->done=true;
+		if (job->sess) {
+			// same as a pool handoff: the session belongs to a MySQL thread, that
+			// resets its pause_until when it sees the wakeup flag
+			__atomic_store_n(&job->sess->wakeup,1,__ATOMIC_RELEASE);
+			unsigned char c=0;
+			if (write(job->wake_fd,&c,1)==-1) {
+				// the pipe is full, the thread will wake up anyway
+			}
+		}
+		pthread_mutex_unlock(&job->mutex);
+		auth_job_release(job);
+	}
+}
+
+void MySQL_Authentication::auth_job_release(auth_job_t *job) {
+	if (__sync_sub_and_fetch(&job->refcnt,1)==0) {
+		account_release(job->ad);
+		pthread_mutex_destroy(&job->mutex);
+		free(job);
+	}
+}
+
+// queues the verification of reply for an auth thread, that wakes up the
+// session when done. Returns NULL if there are no auth threads
+auth_job_t * MySQL_Authentication::submit_verification(account_details_t *ad, const char *scramble, const unsigned char *reply, MySQL_Session *sess) {
+	if (num_auth_threads==0 || ad->auth_digests==false || sess->thread==NULL) {
+		return NULL;
+	}
+	auth_job_t *job=(auth_job_t *)malloc(sizeof(auth_job_t));
+	pthread_mutex_init(&job->mutex, NULL);
+	__sync_fetch_and_add(&ad->refcnt,1);
+	job->ad=ad;
+	job->sess=sess;
+	job->wake_fd=sess->thread->pipefd[1];
+	memcpy(job->scramble,scramble,SCRAMBLE_LENGTH);
+	memcpy(job->reply,reply,SHA_DIGEST_LENGTH);
+	job->done=false;
+	job->ret=false;
+	job->refcnt=2; // the session and the auth thread
+	// the session sleeps until the auth thread is done, but not forever
+	sess->pause_until=sess->thread->curtime+AUTH_JOB_TIMEOUT_US;
+	__sync_fetch_and_add(&auth_offloaded,1);
+	auth_queue.add(job);
+	return job;
+}
+
+// releases the reference of the session to job. Returns the result of the
+// verification (1 if correct, 0 if wrong) , or -1 if it is not available or
+// it doesn't apply to the account and reply: the caller verifies by itself
+int MySQL_Authentication::verification_result(auth_job_t *job, account_details_t *ad, const unsigned char *reply, char *sha1_pass) {
+	int ret=-1;
+	pthread_mutex_lock(&job->mutex);
+	job->sess=NULL;
+	if (job->done && job->ad==ad && memcmp(job->reply,reply,SHA_DIGEST_LENGTH)==0) {
+		ret=(job->ret ? 1 : 0);
+		if (job->ret) {
+			memcpy(sha1_pass,job->sha1_pass,SHA_DIGEST_LENGTH);
+		}
+	}
+	pthread_mutex_unlock(&job->mutex);
+	auth_job_release(job);
+	return ret;
+}
+
 void MySQL_Authentication::print_version() {
 		fprintf(stderr,"Standard MySQL Authentication rev. %s -- %s -- %s\n", MYSQL_AUTHENTICATION_VERSION, __FILE__, __TIMESTAMP__);
 	};
@@ -97,9 +252,59 @@ void MySQL_Authentication::print_version() {
 //  return ret;
 //}
 
+// publishes a new snapshot of bt_map . Must be called holding cg.lock
+void MySQL_Authentication::publish(creds_group_t &cg) {
+	if (cg.publish_deferred) {
+		return;
+	}
+	creds_snapshot_t *cs=new_snapshot();
+	cs->bt_map=cg.bt_map;
+	for (umap_auth::iterator it=cs->bt_map.begin(); it!=cs->bt_map.end(); ++it) {
+		__sync_fetch_and_add(&it->second->refcnt,1);
+	}
+	creds_snapshot_t *old=cg.snapshot;
+	cs->version=__sync_add_and_fetch(&cg.version,1);
+	cg.snapshot=cs;
+	snapshot_release(old);
+}
+
+// returns the snapshot of the calling thread, refreshing it if a new one was
+// published. The lock is taken only when the version changed
+creds_snapshot_t * MySQL_Authentication::thread_snapshot(enum cred_username_type usertype) {
+	creds_group_t &cg=(usertype==USERNAME_BACKEND ? creds_backends : creds_frontends);
+	creds_snapshot_t *cs=_thr_creds_snapshots[usertype];
+	if (cs==NULL || cs->version!=__sync_add_and_fetch(&cg.version,0)) {
+		spin_rdlock(&cg.lock);
+		creds_snapshot_t *ncs=cg.snapshot;
+		__sync_fetch_and_add(&ncs->refcnt,1);
+		spin_rdunlock(&cg.lock);
+		if (cs) {
+			snapshot_release(cs);
+		}
+		cs=ncs;
+		_thr_creds_snapshots[usertype]=cs;
+	}
+	return cs;
+}
+
+// releases the snapshots referenced by the calling thread
+void MySQL_Authentication::end_thread() {
+	int i;
+	for (i=0; i<2; i++) {
+		if (_thr_creds_snapshots[i]) {
+			snapshot_release(_thr_creds_snapshots[i]);
+			_thr_creds_snapshots[i]=NULL;
+		}
+	}
+}
+
+// __active is used only by the writer: no new snapshot is published until
+// remove_inactives() is called, so the accounts added in the meantime are
+// published all at once
 void MySQL_Authentication::set_all_inactive(enum cred_username_type usertype) {
 	creds_group_t &cg=(usertype==USERNAME_BACKEND ? creds_backends : creds_frontends);
 	spin_wrlock(&cg.lock);
+	cg.publish_deferred=true;
 	unsigned int i;
 	for (i=0; i<cg.cred_array->len; i++) {
 		account_details_t *ado=(account_details_t *)cg.cred_array->index(i);
@@ -120,6 +325,8 @@ __loop_remove_inactives:
 			goto __loop_remove_inactives; // we aren't sure how the underlying structure changes, so we jump back to 0
 		}
 	}
+	cg.publish_deferred=false;
+	publish(cg);
 	spin_wrunlock(&cg.lock);
 }
 
@@ -132,7 +339,26 @@ bool MySQL_Authentication::add(char * username, char * password, enum cred_usern
 	delete myhash;
 
 	creds_group_t &cg=(usertype==USERNAME_BACKEND ? creds_backends : creds_frontends);
-	
+
+	// the digests used to verify the clients are computed once here, and not
+	// at every login, see proxy_verify_account_reply()
+	bool auth_digests=false;
+	uint8 auth_stage1[SHA_DIGEST_LENGTH];
+	uint8 auth_stage2[SHA_DIGEST_LENGTH];
+	memset(auth_stage1,0,SHA_DIGEST_LENGTH);
+	memset(auth_stage2,0,SHA_DIGEST_LENGTH);
+	if (usertype==USERNAME_FRONTEND && strlen(password)) {
+		if (password[0]=='*') {
+			if (strlen(password)==SHA_DIGEST_LENGTH*2+1) {
+				unhex_pass(auth_stage2,password+1);
+				auth_digests=true;
+			}
+		} else {
+			proxy_compute_two_stage_sha1_hash(password, strlen(password), auth_stage1, auth_stage2);
+			auth_digests=true;
+		}
+	}
+
 	void *sha1_pass=NULL;
 	char *oldpass=NULL;
 	spin_wrlock(&cg.lock);
@@ -140,22 +366,17 @@ bool MySQL_Authentication::add(char * username, char * password, enum cred_usern
 	std::unordered_map<uint64_t, account_details_t *>::iterator lookup;
 	lookup = cg.bt_map.find(hash1);
 	if (lookup != cg.bt_map.end()) {
+		// the old record can still be referenced by snapshots and sessions
 		account_details_t *ad=lookup->second;
 		cg.cred_array->remove_fast(ad);
      cg.bt_map.erase(lookup);
-		free(ad->username);
-		if (ad->sha1_pass) {
+		void *old_sha1_pass=ad->sha1_pass;
+		if (old_sha1_pass) {
 			oldpass=strdup(ad->password);
 			sha1_pass=malloc(SHA_DIGEST_LENGTH);
-			memcpy(sha1_pass,ad->sha1_pass,SHA_DIGEST_LENGTH);
-		}
-		free(ad->password);
-		if (ad->sha1_pass) {
-			free(ad->sha1_pass);
-			ad->sha1_pass=NULL;
+			memcpy(sha1_pass,old_sha1_pass,SHA_DIGEST_LENGTH);
 		}
-		free(ad->default_schema);
-		free(ad);
+		account_release(ad);
    }
 	account_details_t *ad=(account_details_t *)malloc(sizeof(account_details_t));
 	ad->username=strdup(username);
@@ -180,8 +401,13 @@ bool MySQL_Authentication::add(char * username, char * password, enum cred_usern
 	ad->max_connections=max_connections;
 	ad->num_connections_used=0;
 	ad->__active=true;
+	ad->refcnt=1; // the reference of bt_map
+	ad->auth_digests=auth_digests;
+	memcpy(ad->auth_stage1,auth_stage1,SHA_DIGEST_LENGTH);
+	memcpy(ad->auth_stage2,auth_stage2,SHA_DIGEST_LENGTH);
 	cg.bt_map.insert(std::make_pair(hash1,ad));
 	cg.cred_array->add(ad);
+	publish(cg);
 	spin_wrunlock(&cg.lock);
 
 	if (oldpass) {
@@ -255,52 +481,56 @@ __exit_dump_all_users:
 }
 
 
+// num_connections_used is updated atomically on the record of the thread
+// snapshot, that is the same record referenced by bt_map
 int MySQL_Authentication::increase_frontend_user_connections(char *username, int *mc) {
 	uint64_t hash1, hash2;
-	SpookyHash *myhash=new SpookyHash();
-	myhash->Init(1,2);
-	myhash->Update(username,strlen(username));
-	myhash->Final(&hash1,&hash2);
-	delete myhash;
-	creds_group_t &cg=creds_frontends;
+	SpookyHash myhash;
+	myhash.Init(1,2);
+	myhash.Update(username,strlen(username));
+	myhash.Final(&hash1,&hash2);
+	creds_snapshot_t *cs=thread_snapshot(USERNAME_FRONTEND);
 	int ret=0;
-	spin_wrlock(&cg.lock);
 	//btree::btree_map<uint64_t, account_details_t *>::iterator it;
 	std::unordered_map<uint64_t, account_details_t *>::iterator it;
-	it = cg.bt_map.find(hash1);
-	if (it != cg.bt_map.end()) {
+	it = cs->bt_map.find(hash1);
+	if (it != cs->bt_map.end()) {
 		account_details_t *ad=it->second;
-		if (ad->max_connections > ad->num_connections_used) {
-			ret=ad->max_connections-ad->num_connections_used;
-			ad->num_connections_used++;
+		int used=__sync_add_and_fetch(&ad->num_connections_used,0);
+		while (ad->max_connections > used) {
+			if (__sync_bool_compare_and_swap(&ad->num_connections_used,used,used+1)) {
+				ret=ad->max_connections-used;
+				break;
+			}
+			used=__sync_add_and_fetch(&ad->num_connections_used,0);
 		}
 		if (mc) {
 			*mc=ad->max_connections;
 		}
 	}
-	spin_wrunlock(&cg.lock);
 	return ret;
 }
 
 void MySQL_Authentication::decrease_frontend_user_connections(char *username) {
 	uint64_t hash1, hash2;
-	SpookyHash *myhash=new SpookyHash();
-	myhash->Init(1,2);
-	myhash->Update(username,strlen(username));
-	myhash->Final(&hash1,&hash2);
-	delete myhash;
-	creds_group_t &cg=creds_frontends;
-	spin_wrlock(&cg.lock);
+	SpookyHash myhash;
+	myhash.Init(1,2);
+	myhash.Update(username,strlen(username));
+	myhash.Final(&hash1,&hash2);
+	creds_snapshot_t *cs=thread_snapshot(USERNAME_FRONTEND);
 	//btree::btree_map<uint64_t, account_details_t *>::iterator it;
 	std::unordered_map<uint64_t, account_details_t *>::iterator it;
-	it = cg.bt_map.find(hash1);
-	if (it != cg.bt_map.end()) {
+	it = cs->bt_map.find(hash1);
+	if (it != cs->bt_map.end()) {
 		account_details_t *ad=it->second;
-		if (ad->num_connections_used > 0) {
-			ad->num_connections_used--;
+		int used=__sync_add_and_fetch(&ad->num_connections_used,0);
+		while (used > 0) {
+			if (__sync_bool_compare_and_swap(&ad->num_connections_used,used,used-1)) {
+				break;
+			}
+			used=__sync_add_and_fetch(&ad->num_connections_used,0);
 		}
 	}
-	spin_wrunlock(&cg.lock);
 }
 
 bool MySQL_Authentication::del(char * username, enum cred_username_type usertype, bool set_lock) {
@@ -323,66 +553,78 @@ bool MySQL_Authentication::del(char * username, enum cred_username_type usertype
 		account_details_t *ad=lookup->second;
 		cg.cred_array->remove_fast(ad);
 		cg.bt_map.erase(lookup);
-		free(ad->username);
-		free(ad->password);
-		if (ad->sha1_pass) { free(ad->sha1_pass); ad->sha1_pass=NULL; }
-		free(ad->default_schema);
-		free(ad);
+		account_release(ad);
 		ret=true;
 	}
-	if (set_lock)
+	if (set_lock) {
+		// otherwise the caller publishes the snapshot
+		publish(cg);
 		spin_wrunlock(&cg.lock);
+	}
 
 	return ret;
 };
 
+// sha1_pass is derived from the password, so it is set only once: if two
+// threads race to set it they write the same value, and the loser frees its copy
 bool MySQL_Authentication::set_SHA1(char * username, enum cred_username_type usertype, void *sha_pass) {
 	bool ret=false;
 	uint64_t hash1, hash2;
-	SpookyHash *myhash=new SpookyHash();
-	myhash->Init(1,2);
-	myhash->Update(username,strlen(username));
-	myhash->Final(&hash1,&hash2);
-	delete myhash;
-
-	creds_group_t &cg=(usertype==USERNAME_BACKEND ? creds_backends : creds_frontends);
+	SpookyHash myhash;
+	myhash.Init(1,2);
+	myhash.Update(username,strlen(username));
+	myhash.Final(&hash1,&hash2);
 
-	spin_wrlock(&cg.lock);
+	creds_snapshot_t *cs=thread_snapshot(usertype);
 	//btree::btree_map<uint64_t, account_details_t *>::iterator lookup;
 	std::unordered_map<uint64_t, account_details_t *>::iterator lookup;
-	lookup = cg.bt_map.find(hash1);
-	if (lookup != cg.bt_map.end()) {
+	lookup = cs->bt_map.find(hash1);
+	if (lookup != cs->bt_map.end()) {
 		account_details_t *ad=lookup->second;
-		if (ad->sha1_pass) { free(ad->sha1_pass); ad->sha1_pass=NULL; }
-		if (sha_pass) {
-			ad->sha1_pass=malloc(SHA_DIGEST_LENGTH);
-			memcpy(ad->sha1_pass,sha_pass,SHA_DIGEST_LENGTH);
+		if (sha_pass && ad->sha1_pass==NULL) {
+			void *p=malloc(SHA_DIGEST_LENGTH);
+			memcpy(p,sha_pass,SHA_DIGEST_LENGTH);
+			if (__sync_bool_compare_and_swap(&ad->sha1_pass,NULL,p)==false) {
+				free(p);
+			}
 		}
 		ret=true;
 	}
-   spin_wrunlock(&cg.lock);
 
 	return ret;
 };
 
-
-
-char * MySQL_Authentication::lookup(char * username, enum cred_username_type usertype, bool *use_ssl, int *default_hostgroup, char **default_schema, bool *schema_locked, bool *transaction_persistent, bool *fast_forward, int *max_connections, void **sha1_pass) {
-	char *ret=NULL;
+// returns the account with a reference, that must be released with
+// release_account() . Nothing is copied, and no lock is taken unless new
+// credentials were loaded since the last lookup of the calling thread
+account_details_t * MySQL_Authentication::lookup_account(char * username, enum cred_username_type usertype) {
+	account_details_t *ad=NULL;
 	uint64_t hash1, hash2;
 	SpookyHash myhash;
 	myhash.Init(1,2);
 	myhash.Update(username,strlen(username));
 	myhash.Final(&hash1,&hash2);
 
-	creds_group_t &cg=(usertype==USERNAME_BACKEND ? creds_backends : creds_frontends);
-
-	spin_rdlock(&cg.lock);
+	creds_snapshot_t *cs=thread_snapshot(usertype);
 	//btree::btree_map<uint64_t, account_details_t *>::iterator lookup;
 	std::unordered_map<uint64_t, account_details_t *>::iterator lookup;
-	lookup = cg.bt_map.find(hash1);
-	if (lookup != cg.bt_map.end()) {
-		account_details_t *ad=lookup->second;
+	lookup = cs->bt_map.find(hash1);
+	if (lookup != cs->bt_map.end()) {
+		ad=lookup->second;
+		__sync_fetch_and_add(&ad->refcnt,1);
+	}
+	return ad;
+}
+
+void MySQL_Authentication::release_account(account_details_t *ad) {
+	account_release(ad);
+}
+
+// legacy interface: returns copies of the account details
+char * MySQL_Authentication::lookup(char * username, enum cred_username_type usertype, bool *use_ssl, int *default_hostgroup, char **default_schema, bool *schema_locked, bool *transaction_persistent, bool *fast_forward, int *max_connections, void **sha1_pass) {
+	char *ret=NULL;
+	account_details_t *ad=lookup_account(username, usertype);
+	if (ad) {
 		ret=l_strdup(ad->password);
 		if (use_ssl) *use_ssl=ad->use_ssl;
 		if (default_hostgroup) *default_hostgroup=ad->default_hostgroup;
@@ -392,13 +634,14 @@ char * MySQL_Authentication::lookup(char * username, enum cred_username_type use
 		if (fast_forward) *fast_forward=ad->fast_forward;
 		if (max_connections) *max_connections=ad->max_connections;
 		if (sha1_pass) {
-			if (ad->sha1_pass) {
+			void *p=ad->sha1_pass;
+			if (p) {
 				*sha1_pass=malloc(SHA_DIGEST_LENGTH);
-				memcpy(*sha1_pass,ad->sha1_pass,SHA_DIGEST_LENGTH);
+				memcpy(*sha1_pass,p,SHA_DIGEST_LENGTH);
 			}
 		}
+		account_release(ad);
 	}
-	spin_rdunlock(&cg.lock);
 	return ret;
 
 }
@@ -416,12 +659,10 @@ bool MySQL_Authentication::_reset(enum cred_username_type usertype) {
 			account_details_t *ad=lookup->second;
 			cg.cred_array->remove_fast(ad);
      	cg.bt_map.erase(lookup);
-			free(ad->username);
-			free(ad->password);
-			if (ad->sha1_pass) { free(ad->sha1_pass); ad->sha1_pass=NULL; }
-			free(ad);
+			account_release(ad);
 		}
 	}
+	publish(cg);
 	spin_wrunlock(&cg.lock);
 
 	return true;
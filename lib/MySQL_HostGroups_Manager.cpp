@@ -16,6 +16,8 @@ extern ProxySQL_Admin *GloAdmin;
 
 extern MySQL_Threads_Handler *GloMTH;
 
+extern const CHARSET_INFO * proxysql_find_charset_nr(unsigned int nr);
+
 
 class MySrvConnList;
 class MySrvC;
@@ -24,77 +26,576 @@ class MyHGC;
 
 
 
-static void * HGCU_thread_run() {
+#ifdef epoll_create1
+	#define EPOLL_CREATE epoll_create1(0)
+#else
+	#define EPOLL_CREATE epoll_create(1)
+#endif
+
+#define HGCU_MAX_PENDING 1000 // per HGCU thread
+#define HGCU_TIMEOUT_US 1000000
+#define HGCU_MAXEVENTS 128
+
+// a connection being reset by an HGCU thread
+typedef struct _hgcu_conn_t {
+	MySQL_Connection *myconn;
+	unsigned long long deadline;
+	int fd;
+	int async_status; // COM_CHANGE_USER: status from mysql_change_user_start/cont
+	my_bool ret;
+	bool reset_com; // COM_RESET_CONNECTION in progress
+	unsigned int buf_len;
+	unsigned char buf[512]; // COM_RESET_CONNECTION response
+} hgcu_conn_t;
+
+// COM_RESET_CONNECTION is supported by MySQL 5.7.3 and MariaDB 10.2.4 .
+// The connector doesn't implement it: the command is written and its response
+// read directly on the socket, so neither SSL nor compression can be used
+static bool HGCU_use_reset_connection(MySQL_Connection *myconn) {
+	MySrvC *mysrvc=(MySrvC *)myconn->parent;
+	// reset_connection_unsupported is written by the HGCU threads
+	if (__atomic_load_n(&mysrvc->reset_connection_unsupported,__ATOMIC_RELAXED) || mysrvc->use_ssl || myconn->mysql->net.compress) {
+		return false;
+	}
+	unsigned long v=mysql_get_server_version(myconn->mysql);
+	return ((v >= 50703 && v < 100000) || v >= 100204);
+}
+
+static uint32_t HGCU_events(int async_status) {
+	uint32_t ev=0;
+	if (async_status & MYSQL_WAIT_READ) ev|=EPOLLIN;
+	if (async_status & MYSQL_WAIT_WRITE) ev|=EPOLLOUT;
+	if (async_status & MYSQL_WAIT_EXCEPT) ev|=EPOLLPRI;
+	return ev;
+}
+
+static void HGCU_change_user_start(hgcu_conn_t *hc) {
+	MySQL_Connection *myconn=hc->myconn;
+	hc->reset_com=false;
+	hc->async_status=mysql_change_user_start(&hc->ret, myconn->mysql, myconn->userinfo->username, myconn->userinfo->password, myconn->userinfo->schemaname);
+}
+
+// sends COM_RESET_CONNECTION . Returns false if the packet couldn't be written
+static bool HGCU_reset_connection_start(hgcu_conn_t *hc) {
+	unsigned char pkt[5] = { 1, 0, 0, 0, _MYSQL_COM_RESET_CONNECTION };
+	hc->reset_com=true;
+	hc->buf_len=0;
+	return (write(hc->fd, pkt, sizeof(pkt))==sizeof(pkt));
+}
+
+// reads the response to COM_RESET_CONNECTION .
+// Returns 1 on OK, 0 if incomplete, -1 on ERR, -2 on failure
+static int HGCU_reset_connection_cont(hgcu_conn_t *hc) {
+	int r=read(hc->fd, hc->buf+hc->buf_len, sizeof(hc->buf)-hc->buf_len);
+	if (r<=0) {
+		if (r==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)) return 0;
+		return -2;
+	}
+	hc->buf_len+=r;
+	if (hc->buf_len < 5) return 0;
+	unsigned int pkt_len=hc->buf[0] + (hc->buf[1]<<8) + (hc->buf[2]<<16);
+	if (pkt_len+4 > sizeof(hc->buf)) return -2;
+	if (hc->buf_len < pkt_len+4) return 0;
+	if (hc->buf_len > pkt_len+4) return -2; // nothing else is expected
+	if (hc->buf[4]==0xFF) return -1;
+	// OK packet: 0x00 , affected rows, last insert id , status flags
+	if (hc->buf[4]!=0x00 || pkt_len < 5 || hc->buf[5] >= 0xFB || hc->buf[6] >= 0xFB) return -2;
+	MYSQL *mysql=hc->myconn->mysql;
+	mysql->server_status=hc->buf[7] + (hc->buf[8]<<8);
+	// session variables are back to their global values, including the charset
+	const CHARSET_INFO *c=proxysql_find_charset_nr(mysql->server_language);
+	if (c) {
+		mysql->charset=c;
+	}
+	return 1;
+}
+
+// Connection reset: the connections returned by sessions that can't be put
+// back in the pool as they are get reset here . Every HGCU thread keeps all
+// its pending connections in one epoll set, and sends them
+// COM_RESET_CONNECTION or COM_CHANGE_USER . Connections not reset within
+// HGCU_TIMEOUT_US are destroyed
+static void * HGCU_thread_run(hgcu_thread_t *t) {
 	PtrArray *conn_array=new PtrArray();
-	while(1) {
-		MySQL_Connection *myconn=(MySQL_Connection *)MyHGM->queue.remove();
-		if (myconn==NULL) {
-			// intentionally exit immediately
-			return NULL;
+	// push_MyConn_to_pool() serves the sessions waiting for a connection and
+	// reads the mysql_thread___ variables: like the Monitor, this thread keeps
+	// its own copy (note: this is not a real MySQL thread, just the structures associated with it)
+	MySQL_Thread *mysql_thr=new MySQL_Thread();
+	unsigned int variables_version=0;
+	struct epoll_event events[HGCU_MAXEVENTS];
+	int efd=EPOLL_CREATE;
+	struct epoll_event ev;
+	ev.events=EPOLLIN;
+	ev.data.ptr=NULL;
+	epoll_ctl(efd, EPOLL_CTL_ADD, t->pipefd[0], &ev);
+	bool shutdown=false;
+	while (shutdown==false || conn_array->len) {
+		MySQL_Connection *myconn=NULL;
+		int i;
+		if (conn_array->len==0) {
+			// nothing in progress, block on the queue
+			myconn=t->queue.remove();
+			if (myconn==NULL) {
+				// intentionally exit immediately
+				break;
+			}
 		}
-		conn_array->add(myconn);
-		while (MyHGM->queue.size()) {
-			myconn=(MySQL_Connection *)MyHGM->queue.remove();
-			if (myconn==NULL) return NULL;
-			conn_array->add(myconn);
+		while (myconn || (shutdown==false && t->queue.size())) {
+			if (myconn==NULL) {
+				myconn=t->queue.remove(); // this thread is the only consumer
+				if (myconn==NULL) {
+					shutdown=true;
+					break;
+				}
+			}
+			hgcu_conn_t *hc=(hgcu_conn_t *)malloc(sizeof(hgcu_conn_t));
+			hc->myconn=myconn;
+			hc->deadline=monotonic_time()+HGCU_TIMEOUT_US;
+			hc->fd=myconn->mysql->net.vio ? mysql_get_socket(myconn->mysql) : -1;
+			hc->ret=0;
+			hc->async_status=0;
+			hc->reset_com=false;
+			hc->buf_len=0;
+			myconn=NULL;
+			if (hc->fd < 0) {
+				hc->ret=1;
+			} else {
+				if (HGCU_use_reset_connection(hc->myconn)) {
+					if (HGCU_reset_connection_start(hc)==false) {
+						hc->ret=1;
+					}
+				} else {
+					HGCU_change_user_start(hc);
+				}
+			}
+			if (hc->ret || (hc->reset_com==false && hc->async_status==0)) {
+				conn_array->add(hc);
+				continue; // completed, handled below
+			}
+			ev.events=(hc->reset_com ? EPOLLIN : HGCU_events(hc->async_status));
+			ev.data.ptr=hc;
+			epoll_ctl(efd, EPOLL_CTL_ADD, hc->fd, &ev);
+			conn_array->add(hc);
 		}
-		unsigned int l=conn_array->len;
-		int *errs=(int *)malloc(sizeof(int)*l);
-		int *statuses=(int *)malloc(sizeof(int)*l);
-		my_bool *ret=(my_bool *)malloc(sizeof(my_bool)*l);
-		int i;
-		for (i=0;i<(int)l;i++) {
-			myconn=(MySQL_Connection *)conn_array->index(i);
-			if (myconn->mysql->net.vio) {
-				statuses[i]=mysql_change_user_start(&ret[i], myconn->mysql, myconn->userinfo->password, myconn->userinfo->password, myconn->userinfo->schemaname);
+		unsigned long long now=monotonic_time();
+		int timeout=-1;
+		for (i=0; i<(int)conn_array->len; i++) {
+			hgcu_conn_t *hc=(hgcu_conn_t *)conn_array->index(i);
+			if (hc->ret || (hc->reset_com==false && hc->async_status==0)) {
+				timeout=0;
+				break;
+			}
+			int ms=(hc->deadline > now ? (hc->deadline-now)/1000 + 1 : 0);
+			if (timeout==-1 || ms < timeout) timeout=ms;
+		}
+		int n=epoll_wait(efd, events, HGCU_MAXEVENTS, timeout);
+		for (i=0; i<n; i++) {
+			hgcu_conn_t *hc=(hgcu_conn_t *)events[i].data.ptr;
+			if (hc==NULL) {
+				char buf[64];
+				if (read(t->pipefd[0], buf, sizeof(buf))==-1) {
+					// nothing to read, the wake up was already consumed
+				}
+				continue;
+			}
+			if (hc->reset_com) {
+				int rc=HGCU_reset_connection_cont(hc);
+				if (rc==1) {
+					hc->async_status=0;
+					hc->reset_com=false;
+					__sync_fetch_and_add(&MyHGM->status.myconnpoll_reset_com,1);
+				} else if (rc==-1) {
+					MySrvC *mysrvc=(MySrvC *)hc->myconn->parent;
+					if (__atomic_exchange_n(&mysrvc->reset_connection_unsupported,true,__ATOMIC_RELAXED)==false) {
+						proxy_info("Server %s:%d doesn't support COM_RESET_CONNECTION , using COM_CHANGE_USER to reset connections\n", mysrvc->address, mysrvc->port);
+					}
+					HGCU_change_user_start(hc);
+					if (hc->async_status) {
+						ev.events=HGCU_events(hc->async_status);
+						ev.data.ptr=hc;
+						epoll_ctl(efd, EPOLL_CTL_MOD, hc->fd, &ev);
+					}
+				} else if (rc==-2) {
+					hc->ret=1;
+				}
 			} else {
-				statuses[i]=0;
-				ret[i]=1;
+				int st=0;
+				if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) st|=MYSQL_WAIT_READ;
+				if (events[i].events & EPOLLOUT) st|=MYSQL_WAIT_WRITE;
+				if (events[i].events & EPOLLPRI) st|=MYSQL_WAIT_EXCEPT;
+				hc->async_status=mysql_change_user_cont(&hc->ret, hc->myconn->mysql, st);
+				if (hc->async_status) {
+					ev.events=HGCU_events(hc->async_status);
+					ev.data.ptr=hc;
+					epoll_ctl(efd, EPOLL_CTL_MOD, hc->fd, &ev);
+				}
 			}
 		}
-		for (i=0;i<(int)conn_array->len;i++) {
-			if (statuses[i]==0) {
-				myconn=(MySQL_Connection *)conn_array->remove_index_fast(i);
-				if (!ret[i]) {
-					myconn->reset();
-					MyHGM->push_MyConn_to_pool(myconn);
+		now=monotonic_time();
+		if (GloMTH && GloMTH->get_global_version()!=variables_version) {
+			variables_version=GloMTH->get_global_version();
+			mysql_thr->refresh_variables();
+		}
+		for (i=0; i<(int)conn_array->len; i++) {
+			hgcu_conn_t *hc=(hgcu_conn_t *)conn_array->index(i);
+			bool done=(hc->reset_com==false && hc->async_status==0);
+			if (done==false && hc->ret==0 && hc->deadline > now) {
+				continue;
+			}
+			conn_array->remove_index_fast(i);
+			i--;
+			if (hc->fd >= 0) {
+				epoll_ctl(efd, EPOLL_CTL_DEL, hc->fd, &ev);
+			}
+			myconn=hc->myconn;
+			if (done && hc->ret==0) {
+				myconn->reset();
+				__sync_fetch_and_add(&MyHGM->status.myconnpoll_reset,1);
+				MyHGM->push_MyConn_to_pool(myconn);
+			} else {
+				// failed, or timed out
+				__sync_fetch_and_add(&MyHGM->status.myconnpoll_reset_err,1);
+				myconn->send_quit=false;
+				MyHGM->destroy_MyConn_from_pool(myconn);
+			}
+			__sync_fetch_and_sub(&t->pending,1);
+			free(hc);
+		}
+	}
+	close(efd);
+	delete conn_array;
+	delete mysql_thr;
+	return NULL;
+}
+
+
+#define KILL_MAX_PENDING 1000 // KILL QUERY queued or in progress
+#define KILL_MAX_CONNS_PER_BACKEND 4 // per backend and user
+#define KILL_TIMEOUT_US 5000000
+#define KILL_IDLE_TIMEOUT_US 60000000
+#define KILL_MAXEVENTS 128
+
+MySQL_Kill_Job::MySQL_Kill_Job(char *u, char *p, char *h, unsigned int P, unsigned long i) {
+	username=strdup(u);
+	password=strdup(p ? p : "");
+	hostname=strdup(h);
+	port=P;
+	id=i;
+	queued_at=monotonic_time();
+	retried=false;
+	char buf[32];
+	sprintf(buf,":%u:%lu",port,id);
+	key=std::string(hostname)+buf;
+}
+
+MySQL_Kill_Job::~MySQL_Kill_Job() {
+	free(username);
+	free(password);
+	free(hostname);
+}
+
+class kill_backend_t;
+
+// a connection used to execute KILL QUERY . It is kept open and reused for
+// the following requests to the same backend with the same user
+typedef struct _kill_conn_t {
+	MYSQL *mysql;
+	MYSQL *ret_mysql;
+	kill_backend_t *kb;
+	MySQL_Kill_Job *job;
+	unsigned long long deadline;
+	unsigned long long last_used;
+	int fd;
+	int async_status;
+	int interr;
+	bool connected;
+	bool reused; // the job was given to an idle connection
+	bool registered; // fd is in the epoll set
+	char query[32];
+} kill_conn_t;
+
+// the connections to one backend for one user, and the requests waiting
+// for one of them
+class kill_backend_t {
+	public:
+	std::vector<kill_conn_t *> idle;
+	std::deque<MySQL_Kill_Job *> waiting;
+	unsigned int conns;
+	kill_backend_t() {
+		conns=0;
+	}
+};
+
+static void KILL_query_start(kill_conn_t *kc) {
+	sprintf(kc->query,"KILL QUERY %lu", kc->job->id);
+	kc->async_status=mysql_real_query_start(&kc->interr, kc->mysql, kc->query, strlen(kc->query));
+}
+
+static void KILL_connect_start(kill_conn_t *kc) {
+	MySQL_Kill_Job *ka=kc->job;
+	kc->mysql=mysql_init(NULL);
+	mysql_options(kc->mysql, MYSQL_OPT_NONBLOCK, 0);
+	mysql_options4(kc->mysql, MYSQL_OPT_CONNECT_ATTR_ADD, "program_name", "proxysql_killer");
+	__sync_fetch_and_add(&MyHGM->status.kill_conn_created,1);
+	if (ka->port) {
+		kc->async_status=mysql_real_connect_start(&kc->ret_mysql, kc->mysql, ka->hostname, ka->username, ka->password, NULL, ka->port, NULL, 0);
+	} else {
+		kc->async_status=mysql_real_connect_start(&kc->ret_mysql, kc->mysql, "localhost", ka->username, ka->password, NULL, 0, ka->hostname, 0);
+	}
+	kc->fd=mysql_get_socket(kc->mysql);
+}
+
+// Closes a connection and frees kc . mysql_close() would block until
+// COM_QUIT is written, stalling all the KILL QUERY of the thread if the
+// backend hangs: COM_QUIT is only attempted without blocking on healthy
+// connections (quit==true), and never on failed or timed out ones
+static void KILL_close(kill_conn_t *kc, bool quit) {
+	MYSQL *mysql=kc->mysql;
+	if (quit && kc->connected && mysql->net.vio) {
+		char buff[5];
+		mysql_hdr myhdr;
+		myhdr.pkt_id=0;
+		myhdr.pkt_length=1;
+		memcpy(buff, &myhdr, sizeof(mysql_hdr));
+		buff[4]=_MYSQL_COM_QUIT;
+		if (send(mysql->net.fd, buff, 5, MSG_NOSIGNAL|MSG_DONTWAIT)==-1) {
+			// the backend will notice the closed socket
+		}
+	}
+	mysql_close_no_command(mysql);
+	free(kc);
+}
+
+// KILL QUERY execution: a single thread executes all the KILL QUERY
+// requested by sessions, without blocking. Duplicated requests are coalesced
+// by kill_query() , and every backend gets at most KILL_MAX_CONNS_PER_BACKEND
+// connections per user, kept open for KILL_IDLE_TIMEOUT_US and reused
+static void * KILL_thread_run(kill_thread_t *t) {
+	std::unordered_map<std::string, kill_backend_t *> backends;
+	PtrArray *conn_array=new PtrArray(); // connections in progress
+	struct epoll_event events[KILL_MAXEVENTS];
+	int efd=EPOLL_CREATE;
+	struct epoll_event ev;
+	ev.events=EPOLLIN;
+	ev.data.ptr=NULL;
+	epoll_ctl(efd, EPOLL_CTL_ADD, t->pipefd[0], &ev);
+	bool shutdown=false;
+	int i;
+	while (shutdown==false) {
+		while (t->queue.size()) {
+			MySQL_Kill_Job *ka=t->queue.remove(); // this thread is the only consumer
+			if (ka==NULL) {
+				shutdown=true;
+				break;
+			}
+			proxy_warning("KILL QUERY %lu on %s:%d\n", ka->id, ka->hostname, ka->port);
+			std::string bkey=std::string(ka->username)+"@"+ka->key.substr(0,ka->key.rfind(':'));
+			kill_backend_t *kb=NULL;
+			std::unordered_map<std::string, kill_backend_t *>::iterator it=backends.find(bkey);
+			if (it==backends.end()) {
+				kb=new kill_backend_t();
+				backends[bkey]=kb;
+			} else {
+				kb=it->second;
+			}
+			kb->waiting.push_back(ka);
+		}
+		if (shutdown) {
+			break;
+		}
+		unsigned long long now=monotonic_time();
+		// assign the waiting requests to idle or new connections
+		for (std::unordered_map<std::string, kill_backend_t *>::iterator it=backends.begin(); it!=backends.end(); ++it) {
+			kill_backend_t *kb=it->second;
+			while (kb->waiting.size() && (kb->idle.size() || kb->conns < KILL_MAX_CONNS_PER_BACKEND)) {
+				kill_conn_t *kc=NULL;
+				if (kb->idle.size()) {
+					kc=kb->idle.back();
+					kb->idle.pop_back();
+				} else {
+					kc=(kill_conn_t *)malloc(sizeof(kill_conn_t));
+					memset(kc,0,sizeof(kill_conn_t));
+					kc->kb=kb;
+					kc->fd=-1;
+					kb->conns++;
+				}
+				kc->job=kb->waiting.front();
+				kb->waiting.pop_front();
+				kc->deadline=now+KILL_TIMEOUT_US;
+				kc->reused=kc->connected;
+				if (kc->connected) {
+					KILL_query_start(kc);
 				} else {
-					myconn->send_quit=false;
-					MyHGM->destroy_MyConn_from_pool(myconn);
+					KILL_connect_start(kc);
 				}
-				i--;
+				conn_array->add(kc);
 			}
 		}
-		unsigned long long now=monotonic_time();
-		while (conn_array->len && ((monotonic_time() - now) < 1000000)) {
-			usleep(50);
-			for (i=0;i<(int)conn_array->len;i++) {
-				myconn=(MySQL_Connection *)conn_array->index(i);
-				statuses[i]=mysql_change_user_cont(&ret[i], myconn->mysql, statuses[i]);
-			}
-			for (i=0;i<(int)conn_array->len;i++) {
-				if (statuses[i]==0) {
-					myconn=(MySQL_Connection *)conn_array->remove_index_fast(i);
-					if (!ret[i]) {
-						myconn->reset();
-						MyHGM->push_MyConn_to_pool(myconn);
-					} else {
-						myconn->send_quit=false;
-						MyHGM->destroy_MyConn_from_pool(myconn);
+		int timeout=-1;
+		for (i=0; i<(int)conn_array->len; i++) {
+			kill_conn_t *kc=(kill_conn_t *)conn_array->index(i);
+			if (kc->async_status==0) {
+				timeout=0;
+				continue;
+			}
+			if (kc->fd >= 0) {
+				ev.events=HGCU_events(kc->async_status);
+				ev.data.ptr=kc;
+				epoll_ctl(efd, (kc->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD), kc->fd, &ev);
+				kc->registered=true;
+			}
+			if (timeout==0) {
+				continue;
+			}
+			int ms=(kc->deadline > now ? (kc->deadline-now)/1000 + 1 : 0);
+			if (timeout==-1 || ms < timeout) timeout=ms;
+		}
+		if (timeout==-1) {
+			// wake up to close the idle connections
+			for (std::unordered_map<std::string, kill_backend_t *>::iterator it=backends.begin(); it!=backends.end(); ++it) {
+				if (it->second->idle.size()) {
+					timeout=KILL_IDLE_TIMEOUT_US/1000;
+					break;
+				}
+			}
+		}
+		int n=epoll_wait(efd, events, KILL_MAXEVENTS, timeout);
+		for (i=0; i<n; i++) {
+			kill_conn_t *kc=(kill_conn_t *)events[i].data.ptr;
+			if (kc==NULL) {
+				char buf[64];
+				if (read(t->pipefd[0], buf, sizeof(buf))==-1) {
+					// nothing to read, the wake up was already consumed
+				}
+				continue;
+			}
+			int st=0;
+			if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) st|=MYSQL_WAIT_READ;
+			if (events[i].events & EPOLLOUT) st|=MYSQL_WAIT_WRITE;
+			if (events[i].events & EPOLLPRI) st|=MYSQL_WAIT_EXCEPT;
+			if (kc->connected) {
+				kc->async_status=mysql_real_query_cont(&kc->interr, kc->mysql, st);
+			} else {
+				kc->async_status=mysql_real_connect_cont(&kc->ret_mysql, kc->mysql, st);
+			}
+		}
+		now=monotonic_time();
+		for (i=0; i<(int)conn_array->len; i++) {
+			kill_conn_t *kc=(kill_conn_t *)conn_array->index(i);
+			if (kc->async_status && kc->deadline > now) {
+				continue;
+			}
+			bool ok=false;
+			if (kc->async_status==0) {
+				if (kc->connected==false) {
+					if (kc->ret_mysql) {
+						// connected, now send KILL QUERY
+						kc->connected=true;
+						kc->fd=mysql_get_socket(kc->mysql);
+						KILL_query_start(kc);
+						if (kc->async_status) {
+							continue;
+						}
+					}
+				}
+				if (kc->connected) {
+					// ER_NO_SUCH_THREAD : the query already completed
+					ok=(kc->interr==0 || mysql_errno(kc->mysql)==1094);
+				}
+			}
+			conn_array->remove_index_fast(i);
+			i--;
+			MySQL_Kill_Job *ka=kc->job;
+			kc->job=NULL;
+			if (kc->registered) {
+				epoll_ctl(efd, EPOLL_CTL_DEL, kc->fd, &ev);
+				kc->registered=false;
+			}
+			if (ok==false && kc->reused && kc->async_status==0 && ka->retried==false) {
+				int myerr=mysql_errno(kc->mysql);
+				if (myerr==2006 || myerr==2013) { // CR_SERVER_GONE_ERROR , CR_SERVER_LOST
+					// the idle connection was closed by the backend (wait_timeout) :
+					// the job is executed again, on a new connection. The other idle
+					// connections were used less recently (idle is LIFO) and are dropped too
+					kill_backend_t *kb=kc->kb;
+					ka->retried=true;
+					kb->waiting.push_front(ka);
+					kb->conns--;
+					KILL_close(kc,false);
+					while (kb->idle.size()) {
+						KILL_close(kb->idle.back(),true);
+						kb->idle.pop_back();
+						kb->conns--;
 					}
-					i--;
+					continue;
 				}
 			}
+			unsigned long long t_us=now-ka->queued_at;
+			__sync_fetch_and_add(&MyHGM->status.kill_latency_us,t_us);
+			if (t_us > MyHGM->status.kill_latency_max_us) {
+				MyHGM->status.kill_latency_max_us=t_us;
+			}
+			if (ok) {
+				__sync_fetch_and_add(&MyHGM->status.kill_ok,1);
+			} else {
+				__sync_fetch_and_add(&MyHGM->status.kill_err,1);
+				proxy_error("KILL QUERY %lu on %s:%d failed: %s\n", ka->id, ka->hostname, ka->port, (kc->async_status ? "timeout" : mysql_error(kc->mysql)));
+			}
+			pthread_mutex_lock(&t->mutex);
+			t->pending_keys.erase(ka->key);
+			pthread_mutex_unlock(&t->mutex);
+			delete ka;
+			if (ok) {
+				kc->last_used=now;
+				kc->kb->idle.push_back(kc);
+			} else {
+				// the connection is in an unknown state, or not connected at all
+				kc->kb->conns--;
+				KILL_close(kc,false);
+			}
 		}
-		while (conn_array->len) {
-			// we reached here, and there are still connections
-			myconn=(MySQL_Connection *)conn_array->remove_index_fast(0);
-			myconn->send_quit=false;
-			MyHGM->destroy_MyConn_from_pool(myconn);
+		// close the connections idle for too long
+		for (std::unordered_map<std::string, kill_backend_t *>::iterator it=backends.begin(); it!=backends.end(); ) {
+			kill_backend_t *kb=it->second;
+			std::vector<kill_conn_t *>::iterator ci=kb->idle.begin();
+			while (ci!=kb->idle.end()) {
+				kill_conn_t *kc=*ci;
+				if (now - kc->last_used > KILL_IDLE_TIMEOUT_US) {
+					ci=kb->idle.erase(ci);
+					kb->conns--;
+					KILL_close(kc,true);
+				} else {
+					++ci;
+				}
+			}
+			if (kb->conns==0 && kb->waiting.size()==0) {
+				delete kb;
+				it=backends.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+	// shutdown: requests in progress or waiting are abandoned
+	while (conn_array->len) {
+		kill_conn_t *kc=(kill_conn_t *)conn_array->remove_index_fast(0);
+		delete kc->job;
+		KILL_close(kc,false);
+	}
+	for (std::unordered_map<std::string, kill_backend_t *>::iterator it=backends.begin(); it!=backends.end(); ++it) {
+		kill_backend_t *kb=it->second;
+		for (std::vector<kill_conn_t *>::iterator ci=kb->idle.begin(); ci!=kb->idle.end(); ++ci) {
+			KILL_close(*ci,true);
+		}
+		while (kb->waiting.size()) {
+			delete kb->waiting.front();
+			kb->waiting.pop_front();
 		}
-		free(statuses);
-		free(errs);
+		delete kb;
 	}
+	close(efd);
+	delete conn_array;
+	return NULL;
 }
 
 
@@ -198,7 +699,7 @@ void MySrvConnList::drop_all_connections() {
 }
 
 
-MySrvC::MySrvC(char *add, uint16_t p, unsigned int _weight, enum MySerStatus _status, unsigned int _compression /*, uint8_t _charset */, unsigned int _max_connections, unsigned int _max_replication_lag, unsigned int _use_ssl, unsigned int _max_latency_ms, char *_comment) {
+MySrvC::MySrvC(char *add, uint16_t p, unsigned int _weight, enum MySerStatus _status, unsigned int _compression /*, uint8_t _charset */, unsigned int _max_connections, unsigned int _max_replication_lag, unsigned int _use_ssl, unsigned int _max_latency_ms, unsigned int _min_idle_connections, char *_comment) {
 	address=strdup(add);
 	port=p;
 	weight=_weight;
@@ -207,7 +708,12 @@ MySrvC::MySrvC(char *add, uint16_t p, unsigned int _weight, enum MySerStatus _st
 	max_connections=_max_connections;
 	max_replication_lag=_max_replication_lag;
 	use_ssl=_use_ssl;
+	reset_connection_unsupported=false;
 	max_latency_us=_max_latency_ms*1000;
+	min_idle_connections=_min_idle_connections;
+	warming=0;
+	connect_rate_time=0;
+	connect_rate_count=0;
 	current_latency_us=0;
 	connect_OK=0;
 	connect_ERR=0;
@@ -218,6 +724,11 @@ MySrvC::MySrvC(char *add, uint16_t p, unsigned int _weight, enum MySerStatus _st
 	connect_ERR_at_time_last_detected_error=0;
 	shunned_automatic=false;
 	shunned_and_kill_all_connections=false;	// false to default
+	breaker_state=MYSRVC_BREAKER_CLOSED;
+	breaker_since=0;
+	breaker_probes=0;
+	breaker_probes_ok=0;
+	memset(breaker_buckets,0,sizeof(breaker_buckets));
 	//charset=_charset;
 	myhgc=NULL;
 	comment=strdup(_comment);
@@ -225,6 +736,20 @@ MySrvC::MySrvC(char *add, uint16_t p, unsigned int _weight, enum MySerStatus _st
 	ConnectionsFree=new MySrvConnList(this);
 }
 
+// true if the server already created mysql-connect_rate_limit_per_server
+// connections in the current second . The caller holds the lock
+bool MySrvC::connect_rate_exceeded() {
+	if (mysql_thread___connect_rate_limit_per_server==0) {
+		return false;
+	}
+	time_t t=time(NULL);
+	if (t!=connect_rate_time) {
+		connect_rate_time=t;
+		connect_rate_count=0;
+	}
+	return (connect_rate_count >= (unsigned int)mysql_thread___connect_rate_limit_per_server);
+}
+
 void MySrvC::connect_error(int err_num) {
 	// NOTE: this function operates without any mutex
 	// although, it is not extremely important if any counter is lost
@@ -263,6 +788,144 @@ void MySrvC::connect_error(int err_num) {
 			}
 		}
 	}
+	breaker_report(true, 0);
+}
+
+// length of a bucket of the sliding window of the circuit breaker
+static unsigned long long breaker_bucket_us() {
+	unsigned long long us=(unsigned long long)mysql_thread___circuit_breaker_window_ms*1000/MYSRVC_BREAKER_BUCKETS;
+	return (us ? us : 1);
+}
+
+// requests and failures in the last mysql-circuit_breaker_window_ms
+void MySrvC::breaker_window(unsigned long long now, unsigned int *requests, unsigned int *failures) {
+	unsigned long long e=now/breaker_bucket_us();
+	*requests=0;
+	*failures=0;
+	for (unsigned int i=0; i<MYSRVC_BREAKER_BUCKETS; i++) {
+		mysrvc_breaker_bucket_t *b=&breaker_buckets[i];
+		if (b->epoch + MYSRVC_BREAKER_BUCKETS > e) {
+			*requests+=b->requests;
+			*failures+=b->failures;
+		}
+	}
+}
+
+// Result of a query, or of a connection attempt, for the circuit breaker.
+// Queries slower than mysql-circuit_breaker_slow_query_ms count as failures.
+// The breaker trips to OPEN when the failures in the last
+// mysql-circuit_breaker_window_ms reach mysql-circuit_breaker_error_pct percent
+// of at least mysql-circuit_breaker_min_requests requests. In HALF_OPEN, a
+// failure trips it again, mysql-circuit_breaker_half_open_probes successes close it.
+// NOTE: like connect_error() , the window is updated without any mutex: a
+// few lost counts don't change the error rate significantly
+void MySrvC::breaker_report(bool error, unsigned long long latency_us) {
+	int pct=mysql_thread___circuit_breaker_error_pct;
+	if (pct==0) {
+		return;
+	}
+	int slow_ms=mysql_thread___circuit_breaker_slow_query_ms;
+	bool failed=( error || (slow_ms && latency_us > (unsigned long long)slow_ms*1000) );
+	unsigned long long now=monotonic_time();
+	// breaker_state is written with the MyHGM lock held: it is read here
+	// without the lock, and checked again under the lock before any change
+	enum MySrvC_breaker_state st=__atomic_load_n(&breaker_state,__ATOMIC_RELAXED);
+	if (st==MYSRVC_BREAKER_OPEN) {
+		// a query sent before the breaker tripped
+		return;
+	}
+	if (st==MYSRVC_BREAKER_HALF_OPEN) {
+		MyHGM->wrlock();
+		if (breaker_state==MYSRVC_BREAKER_HALF_OPEN) {
+			if (breaker_probes) {
+				breaker_probes--;
+			}
+			if (failed) {
+				breaker_set_state(MYSRVC_BREAKER_OPEN, now);
+			} else {
+				breaker_probes_ok++;
+				if (breaker_probes_ok >= (unsigned int)mysql_thread___circuit_breaker_half_open_probes) {
+					breaker_set_state(MYSRVC_BREAKER_CLOSED, now);
+				}
+			}
+		}
+		MyHGM->wrunlock();
+		return;
+	}
+	unsigned long long e=now/breaker_bucket_us();
+	mysrvc_breaker_bucket_t *b=&breaker_buckets[e%MYSRVC_BREAKER_BUCKETS];
+	unsigned long long be=b->epoch;
+	if (be!=e && __sync_bool_compare_and_swap(&b->epoch,be,e)) {
+		// the bucket is reused for a new slice of the window
+		b->requests=0;
+		b->failures=0;
+	}
+	__sync_fetch_and_add(&b->requests,1);
+	if (failed==false) {
+		return;
+	}
+	__sync_fetch_and_add(&b->failures,1);
+	unsigned int requests, failures;
+	breaker_window(now, &requests, &failures);
+	if (requests >= (unsigned int)mysql_thread___circuit_breaker_min_requests && (unsigned long long)failures*100 >= (unsigned long long)requests*pct) {
+		MyHGM->wrlock();
+		if (breaker_state==MYSRVC_BREAKER_CLOSED) {
+			breaker_set_state(MYSRVC_BREAKER_OPEN, now);
+		}
+		MyHGM->wrunlock();
+	}
+}
+
+// true if the circuit breaker lets a new query through, moving from OPEN to
+// HALF_OPEN after mysql-circuit_breaker_open_ms . The caller holds the MyHGM lock
+bool MySrvC::breaker_available(unsigned long long now) {
+	if (breaker_state==MYSRVC_BREAKER_CLOSED) {
+		return true;
+	}
+	if (mysql_thread___circuit_breaker_error_pct==0) {
+		// the circuit breaker was disabled
+		breaker_set_state(MYSRVC_BREAKER_CLOSED, now);
+		return true;
+	}
+	if (now - breaker_since < (unsigned long long)mysql_thread___circuit_breaker_open_ms*1000) {
+		return (breaker_state==MYSRVC_BREAKER_HALF_OPEN && breaker_probes < (unsigned int)mysql_thread___circuit_breaker_half_open_probes);
+	}
+	if (breaker_state==MYSRVC_BREAKER_OPEN) {
+		breaker_set_state(MYSRVC_BREAKER_HALF_OPEN, now);
+	} else {
+		// HALF_OPEN for too long: probes got connections that were never used for a query
+		breaker_since=now;
+		breaker_probes=0;
+		breaker_probes_ok=0;
+	}
+	return true;
+}
+
+// The caller holds the MyHGM lock
+void MySrvC::breaker_set_state(enum MySrvC_breaker_state st, unsigned long long now) {
+	unsigned int requests, failures;
+	breaker_window(now, &requests, &failures);
+	MyHGM->breaker_log_add(this, breaker_state, st, requests, failures);
+	switch (st) {
+		case MYSRVC_BREAKER_OPEN:
+			MyHGM->status.breaker_open++;
+			proxy_error("Circuit breaker of server %s:%d in hostgroup %u is open: %u failures out of %u requests\n", address, port, myhgc->hid, failures, requests);
+			break;
+		case MYSRVC_BREAKER_CLOSED:
+			proxy_info("Circuit breaker of server %s:%d in hostgroup %u is closed\n", address, port, myhgc->hid);
+			// start from a clean window, or the old failures would trip it again
+			for (unsigned int i=0; i<MYSRVC_BREAKER_BUCKETS; i++) {
+				breaker_buckets[i].requests=0;
+				breaker_buckets[i].failures=0;
+			}
+			break;
+		default:
+			break;
+	}
+	__atomic_store_n(&breaker_state,st,__ATOMIC_RELAXED); // read without the lock by breaker_report()
+	breaker_since=now;
+	breaker_probes=0;
+	breaker_probes_ok=0;
 }
 
 void MySrvC::shun_and_killall() {
@@ -291,6 +954,7 @@ MySrvList::~MySrvList() {
 MyHGC::MyHGC(int _hid) {
 	hid=_hid;
 	mysrvs=new MySrvList(this);
+	num_waiters=0;
 }
 
 
@@ -353,6 +1017,33 @@ MySQL_HostGroups_Manager::MySQL_HostGroups_Manager() {
 	status.myconnpoll_get_ping=0;
 	status.myconnpoll_push=0;
 	status.myconnpoll_destroy=0;
+	status.myconnpoll_wait=0;
+	status.myconnpoll_handoff=0;
+	status.myconnpoll_waiting=0;
+	status.myconnpoll_wait_us=0;
+	status.myconnpoll_wait_max_us=0;
+	for (int i=0; i<MYCONN_WAITER_PRIORITIES; i++) {
+		status.myconnpoll_wait_prio[i]=0;
+		status.myconnpoll_wait_us_prio[i]=0;
+	}
+	status.myconnpoll_warm=0;
+	status.myconnpoll_warm_err=0;
+	status.myconnpoll_connect_throttled=0;
+	servers_min_idle=0;
+	status.myconnpoll_reset=0;
+	status.myconnpoll_reset_com=0;
+	status.myconnpoll_reset_err=0;
+	status.myconnpoll_reset_dropped=0;
+	status.kill_queued=0;
+	status.kill_coalesced=0;
+	status.kill_dropped=0;
+	status.kill_ok=0;
+	status.kill_err=0;
+	status.kill_conn_created=0;
+	status.kill_latency_us=0;
+	status.kill_latency_max_us=0;
+	status.breaker_open=0;
+	status.breaker_fast_fail=0;
 	status.autocommit_cnt=0;
 	status.commit_cnt=0;
 	status.rollback_cnt=0;
@@ -368,25 +1059,138 @@ MySQL_HostGroups_Manager::MySQL_HostGroups_Manager() {
 	mydb=new SQLite3DB();
 	mydb->open((char *)"file:mem_mydb?mode=memory&cache=shared", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX);
 	mydb->execute(MYHGM_MYSQL_SERVERS);
-	mydb->execute(MYHGM_MYSQL_SERVERS_INCOMING);
 	mydb->execute(MYHGM_MYSQL_REPLICATION_HOSTGROUPS);
+	pthread_mutex_init(&mydb_lock, NULL);
 	MyHostGroups=new PtrArray();
 	incoming_replication_hostgroups=NULL;
-	HGCU_thread = new std::thread(&HGCU_thread_run);
+	HGCU_threads=NULL;
+	num_HGCU_threads=0;
+	HGCU_next=0;
+	KILL_thread=NULL;
+}
+
+// starts the HGCU threads: one every 2 MySQL threads, up to 8
+void MySQL_HostGroups_Manager::init() {
+	unsigned int i;
+	num_HGCU_threads=1;
+	if (GloMTH && GloMTH->num_threads > 2) {
+		num_HGCU_threads=GloMTH->num_threads/2;
+	}
+	if (num_HGCU_threads > 8) {
+		num_HGCU_threads=8;
+	}
+	HGCU_threads=(hgcu_thread_t **)malloc(sizeof(hgcu_thread_t *)*num_HGCU_threads);
+	for (i=0; i<num_HGCU_threads; i++) {
+		hgcu_thread_t *t=new hgcu_thread_t();
+		int rc=pipe(t->pipefd);
+		assert(rc==0);
+		fcntl(t->pipefd[0], F_SETFL, fcntl(t->pipefd[0], F_GETFL) | O_NONBLOCK);
+		fcntl(t->pipefd[1], F_SETFL, fcntl(t->pipefd[1], F_GETFL) | O_NONBLOCK);
+		t->pending=0;
+		t->thr=new std::thread(&HGCU_thread_run,t);
+		HGCU_threads[i]=t;
+	}
+	KILL_thread=new kill_thread_t();
+	int rc=pipe(KILL_thread->pipefd);
+	assert(rc==0);
+	fcntl(KILL_thread->pipefd[0], F_SETFL, fcntl(KILL_thread->pipefd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(KILL_thread->pipefd[1], F_SETFL, fcntl(KILL_thread->pipefd[1], F_GETFL) | O_NONBLOCK);
+	pthread_mutex_init(&KILL_thread->mutex, NULL);
+	KILL_thread->thr=new std::thread(&KILL_thread_run,KILL_thread);
+}
+
+// queues a KILL QUERY for KILL_thread_run() . A request for the same backend
+// thread already queued or in progress is not duplicated
+void MySQL_HostGroups_Manager::kill_query(char *username, char *password, char *hostname, unsigned int port, unsigned long id) {
+	if (KILL_thread==NULL) {
+		return;
+	}
+	__sync_fetch_and_add(&status.kill_queued,1);
+	MySQL_Kill_Job *ka=new MySQL_Kill_Job(username, password, hostname, port, id);
+	pthread_mutex_lock(&KILL_thread->mutex);
+	if (KILL_thread->pending_keys.find(ka->key)!=KILL_thread->pending_keys.end()) {
+		pthread_mutex_unlock(&KILL_thread->mutex);
+		__sync_fetch_and_add(&status.kill_coalesced,1);
+		delete ka;
+		return;
+	}
+	if (KILL_thread->pending_keys.size() >= KILL_MAX_PENDING) {
+		pthread_mutex_unlock(&KILL_thread->mutex);
+		__sync_fetch_and_add(&status.kill_dropped,1);
+		proxy_error("Not executing KILL QUERY %lu on %s:%d : too many pending KILL QUERY\n", id, hostname, port);
+		delete ka;
+		return;
+	}
+	KILL_thread->pending_keys[ka->key]=true;
+	pthread_mutex_unlock(&KILL_thread->mutex);
+	KILL_thread->queue.add(ka);
+	if (write(KILL_thread->pipefd[1],"",1)==-1) {
+		// the pipe is full, the thread will wake up anyway
+	}
+}
+
+unsigned int MySQL_HostGroups_Manager::KILL_pending() {
+	unsigned int p=0;
+	if (KILL_thread) {
+		pthread_mutex_lock(&KILL_thread->mutex);
+		p=KILL_thread->pending_keys.size();
+		pthread_mutex_unlock(&KILL_thread->mutex);
+	}
+	return p;
+}
+
+unsigned int MySQL_HostGroups_Manager::HGCU_pending() {
+	unsigned int i;
+	unsigned int p=0;
+	for (i=0; i<num_HGCU_threads; i++) {
+		p+=HGCU_threads[i]->pending;
+	}
+	return p;
 }
 
 MySQL_HostGroups_Manager::~MySQL_HostGroups_Manager() {
+	unsigned int i;
+	for (i=0; i<num_HGCU_threads; i++) {
+		hgcu_thread_t *t=HGCU_threads[i];
+		t->queue.add(NULL);
+		if (write(t->pipefd[1],"",1)==-1) {
+			// the pipe is full, the thread will wake up anyway
+		}
+		t->thr->join();
+		delete t->thr;
+		close(t->pipefd[0]);
+		close(t->pipefd[1]);
+		delete t;
+	}
+	if (HGCU_threads) {
+		free(HGCU_threads);
+	}
+	if (KILL_thread) {
+		KILL_thread->queue.add(NULL);
+		if (write(KILL_thread->pipefd[1],"",1)==-1) {
+			// the pipe is full, the thread will wake up anyway
+		}
+		KILL_thread->thr->join();
+		delete KILL_thread->thr;
+		while (KILL_thread->queue.size()) {
+			MySQL_Kill_Job *ka=KILL_thread->queue.remove();
+			if (ka) delete ka;
+		}
+		close(KILL_thread->pipefd[0]);
+		close(KILL_thread->pipefd[1]);
+		pthread_mutex_destroy(&KILL_thread->mutex);
+		delete KILL_thread;
+	}
 	while (MyHostGroups->len) {
 		MyHGC *myhgc=(MyHGC *)MyHostGroups->remove_index_fast(0);
 		delete myhgc;
 	}
 	delete MyHostGroups;
 	delete mydb;
+	pthread_mutex_destroy(&mydb_lock);
 	if (admindb) {
 		delete admindb;
 	}
-	queue.add(NULL);
-	HGCU_thread->join();
 #ifdef MHM_PTHREAD_MUTEX
 	pthread_mutex_destroy(&lock);
 #endif
@@ -423,21 +1227,26 @@ unsigned int MySQL_HostGroups_Manager::get_servers_table_version() {
 	return __sync_fetch_and_add(&status.servers_table_version,0);
 }
 
-// add a new row in mysql_servers_incoming
+// add a new server to servers_incoming
 // we always assume that the calling thread has acquired a rdlock()
-bool MySQL_HostGroups_Manager::server_add(unsigned int hid, char *add, uint16_t p, unsigned int _weight, enum MySerStatus status, unsigned int _comp /*, uint8_t _charset */, unsigned int _max_connections, unsigned int _max_replication_lag, unsigned int _use_ssl, unsigned int _max_latency_ms , char *comment) {
-	bool ret;
-	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 7, "Adding in mysql_servers_incoming server %s:%d in hostgroup %u with weight %u , status %u, %s compression, max_connections %d, max_replication_lag %u, use_ssl=%u, max_latency_ms=%u\n", add,p,hid,_weight,status, (_comp ? "with" : "without") /*, _charset */ , _max_connections, _max_replication_lag, _use_ssl, _max_latency_ms);
-	char *q=(char *)"INSERT INTO mysql_servers_incoming VALUES (%u, \"%s\", %u, %u, %u, %u, %u, %u, %u, %u, '%s')";
-	char *o=escape_string_single_quotes(comment,false);
-	char *query=(char *)malloc(strlen(q)+strlen(add)+128+strlen(o));
-	sprintf(query,q,hid,add,p,_weight,status,_comp /*,_charset */, _max_connections, _max_replication_lag, _use_ssl, _max_latency_ms,o);
-	ret=mydb->execute(query);
-	free(query);
-	if (o!=comment) { // there was a copy
-		free(o);
-	}
-	return ret;
+bool MySQL_HostGroups_Manager::server_add(unsigned int hid, char *add, uint16_t p, unsigned int _weight, enum MySerStatus status, unsigned int _comp /*, uint8_t _charset */, unsigned int _max_connections, unsigned int _max_replication_lag, unsigned int _use_ssl, unsigned int _max_latency_ms, unsigned int _min_idle_connections, char *comment) {
+	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 7, "Adding in servers_incoming server %s:%d in hostgroup %u with weight %u , status %u, %s compression, max_connections %d, max_replication_lag %u, use_ssl=%u, max_latency_ms=%u, min_idle_connections=%u\n", add,p,hid,_weight,status, (_comp ? "with" : "without") /*, _charset */ , _max_connections, _max_replication_lag, _use_ssl, _max_latency_ms, _min_idle_connections);
+	MySrvC_incoming_t *si=(MySrvC_incoming_t *)malloc(sizeof(MySrvC_incoming_t));
+	si->address=strdup(add);
+	si->comment=strdup(comment ? comment : (char *)"");
+	si->hid=hid;
+	si->port=p;
+	si->weight=_weight;
+	si->status=status;
+	si->compression=_comp;
+	si->max_connections=_max_connections;
+	si->max_replication_lag=_max_replication_lag;
+	si->use_ssl=_use_ssl;
+	si->max_latency_ms=_max_latency_ms;
+	si->min_idle_connections=_min_idle_connections;
+	si->mysrvc=NULL;
+	servers_incoming.push_back(si);
+	return true;
 }
 
 
@@ -445,129 +1254,140 @@ SQLite3_result * MySQL_HostGroups_Manager::execute_query(char *query, char **err
 	int cols=0;
 	int affected_rows=0;
 	SQLite3_result *resultset=NULL;
-	wrlock();
+	pthread_mutex_lock(&mydb_lock);
   mydb->execute_statement(query, error , &cols , &affected_rows , &resultset);
-	wrunlock();
+	pthread_mutex_unlock(&mydb_lock);
 	return resultset;
 }
 
-bool MySQL_HostGroups_Manager::commit() {
-
-	// purge table
-	purge_mysql_servers_table();
-
-	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "DELETE FROM mysql_servers\n");
-	mydb->execute("DELETE FROM mysql_servers");
-	generate_mysql_servers_table();
+static std::string server_key(unsigned int hid, const char *address, unsigned int port) {
+	char buf[32];
+	sprintf(buf,"%u:%u:",hid,port);
+	std::string key(buf);
+	key.append(address);
+	return key;
+}
 
-	char *error=NULL;
-	int cols=0;
-	int affected_rows=0;
-	SQLite3_result *resultset=NULL;
-  char *query=NULL;
-	wrlock();
-	query=(char *)"SELECT mem_pointer, t1.hostgroup_id, t1.hostname, t1.port FROM mysql_servers t1 LEFT OUTER JOIN mysql_servers_incoming t2 ON (t1.hostgroup_id=t2.hostgroup_id AND t1.hostname=t2.hostname AND t1.port=t2.port) WHERE t2.hostgroup_id IS NULL";
-  mydb->execute_statement(query, &error , &cols , &affected_rows , &resultset);
-	if (error) {
-		proxy_error("Error on %s : %s\n", query, error);
-	} else {
-		for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
-			SQLite3_row *r=*it;
-			long long ptr=atoll(r->fields[0]);
-			proxy_warning("Removed server at address %lld, hostgroup %s, address %s port %s. Setting status OFFLINE HARD and immediately dropping all free connections. Used connections will be dropped when trying to use them\n", ptr, r->fields[1], r->fields[2], r->fields[3]);
-			MySrvC *mysrvc=(MySrvC *)ptr;
-			mysrvc->status=MYSQL_SERVER_STATUS_OFFLINE_HARD;
-			//__sync_fetch_and_sub(&status.server_connections_connected, mysrvc->ConnectionsFree->conns->len);
-			mysrvc->ConnectionsFree->drop_all_connections();
-		}
+// applies servers_incoming to the running servers. The diff is computed in
+// memory, so the lock needed by every connection fetch is held only to walk
+// the servers once. The tables in mydb, only read by admin and monitor, are
+// written after the lock is released
+bool MySQL_HostGroups_Manager::commit() {
+	// hostgroup_id, hostname and port are the primary key: the first wins
+	std::unordered_map<std::string, MySrvC_incoming_t *> incoming;
+	incoming.reserve(servers_incoming.size());
+	for (std::vector<MySrvC_incoming_t *>::iterator it=servers_incoming.begin(); it!=servers_incoming.end(); ++it) {
+		MySrvC_incoming_t *si=*it;
+		incoming.insert(std::make_pair(server_key(si->hid,si->address,si->port),si));
 	}
-	if (resultset) { delete resultset; resultset=NULL; }
-
-	mydb->execute("DELETE FROM mysql_servers");
-	generate_mysql_servers_table();
-
-// INSERT OR IGNORE INTO mysql_servers SELECT ... FROM mysql_servers_incoming
-//	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "INSERT OR IGNORE INTO mysql_servers(hostgroup_id, hostname, port, weight, status, compression, max_connections) SELECT hostgroup_id, hostname, port, weight, status, compression, max_connections FROM mysql_servers_incoming\n");
-	mydb->execute("INSERT OR IGNORE INTO mysql_servers(hostgroup_id, hostname, port, weight, status, compression, max_connections, max_replication_lag, use_ssl, max_latency_ms, comment) SELECT hostgroup_id, hostname, port, weight, status, compression, max_connections, max_replication_lag, use_ssl, max_latency_ms, comment FROM mysql_servers_incoming");
 
-
-	// SELECT FROM mysql_servers whatever is not identical in mysql_servers_incoming, or where mem_pointer=0 (where there is no pointer yet)
-	query=(char *)"SELECT t1.*, t2.weight, t2.status, t2.compression, t2.max_connections, t2.max_replication_lag, t2.use_ssl, t2.max_latency_ms, t2.comment FROM mysql_servers t1 JOIN mysql_servers_incoming t2 ON (t1.hostgroup_id=t2.hostgroup_id AND t1.hostname=t2.hostname AND t1.port=t2.port) WHERE mem_pointer=0 OR t1.weight<>t2.weight OR t1.status<>t2.status OR t1.compression<>t2.compression OR t1.max_connections<>t2.max_connections OR t1.max_replication_lag<>t2.max_replication_lag OR t1.use_ssl<>t2.use_ssl OR t1.max_latency_ms<>t2.max_latency_ms or t1.comment<>t2.comment";
-	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "%s\n", query);
-  mydb->execute_statement(query, &error , &cols , &affected_rows , &resultset);
-	if (error) {
-		proxy_error("Error on %s : %s\n", query, error);
-	} else {
-		for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
-			SQLite3_row *r=*it;
-			long long ptr=atoll(r->fields[11]); // increase this index every time a new column is added
-			proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Server %s:%d , weight=%d, status=%d, mem_pointer=%llu, hostgroup=%d, compression=%d\n", r->fields[1], atoi(r->fields[2]), atoi(r->fields[3]), (MySerStatus) atoi(r->fields[4]), ptr, atoi(r->fields[0]), atoi(r->fields[5]));
-			//fprintf(stderr,"%lld\n", ptr);
-			if (ptr==0) {
-				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Creating new server %s:%d , weight=%d, status=%d, compression=%d\n", r->fields[1], atoi(r->fields[2]), atoi(r->fields[3]), (MySerStatus) atoi(r->fields[4]), atoi(r->fields[5]) );
-				MySrvC *mysrvc=new MySrvC(r->fields[1], atoi(r->fields[2]), atoi(r->fields[3]), (MySerStatus) atoi(r->fields[4]), atoi(r->fields[5]), atoi(r->fields[6]), atoi(r->fields[7]), atoi(r->fields[8]), atoi(r->fields[9]), r->fields[10]); // add new fields here if adding more columns in mysql_servers
-				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Adding new server %s:%d , weight=%d, status=%d, mem_ptr=%p into hostgroup=%d\n", r->fields[1], atoi(r->fields[2]), atoi(r->fields[3]), (MySerStatus) atoi(r->fields[4]), mysrvc, atoi(r->fields[0]));
-				add(mysrvc,atoi(r->fields[0]));
-			} else {
-				MySrvC *mysrvc=(MySrvC *)ptr;
-				// carefully increase the 2nd index by 1 for every new column added
-				if (atoi(r->fields[3])!=atoi(r->fields[12])) {
-					proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing weight for server %s:%d (%s:%d) from %d (%d) to %d\n" , mysrvc->address, mysrvc->port, r->fields[1], atoi(r->fields[2]), r->fields[3] , mysrvc->weight , atoi(r->fields[12]));
-					mysrvc->weight=atoi(r->fields[12]);
-				}
-				if (atoi(r->fields[4])!=atoi(r->fields[13])) {
-					proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing status for server %s:%d (%s:%d) from %d (%d) to %d\n" , mysrvc->address, mysrvc->port, r->fields[1], atoi(r->fields[2]), r->fields[4] , mysrvc->status , atoi(r->fields[13]));
-					mysrvc->status=(MySerStatus)atoi(r->fields[13]);
-					if (mysrvc->status==MYSQL_SERVER_STATUS_SHUNNED) {
-						mysrvc->shunned_automatic=false;
-					}
-				}
-				if (atoi(r->fields[5])!=atoi(r->fields[14])) {
-					proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing compression for server %s:%d (%s:%d) from %d (%d) to %d\n" , mysrvc->address, mysrvc->port, r->fields[1], atoi(r->fields[2]), r->fields[5] , mysrvc->compression , atoi(r->fields[14]));
-					mysrvc->compression=atoi(r->fields[14]);
-				}
-				if (atoi(r->fields[6])!=atoi(r->fields[15])) {
-					proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing max_connections for server %s:%d (%s:%d) from %d (%d) to %d\n" , mysrvc->address, mysrvc->port, r->fields[1], atoi(r->fields[2]), r->fields[6] , mysrvc->max_connections , atoi(r->fields[15]));
-					mysrvc->max_connections=atoi(r->fields[15]);
-				}
-				if (atoi(r->fields[7])!=atoi(r->fields[16])) {
-					proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing max_replication_lag for server %s:%d (%s:%d) from %d (%d) to %d\n" , mysrvc->address, mysrvc->port, r->fields[1], atoi(r->fields[2]), r->fields[7] , mysrvc->max_replication_lag , atoi(r->fields[16]));
-					mysrvc->max_replication_lag=atoi(r->fields[16]);
-				}
-				if (atoi(r->fields[8])!=atoi(r->fields[17])) {
-					proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing use_ssl for server %s:%d (%s:%d) from %d (%d) to %d\n" , mysrvc->address, mysrvc->port, r->fields[1], atoi(r->fields[2]), r->fields[8] , mysrvc->use_ssl , atoi(r->fields[17]));
-					mysrvc->use_ssl=atoi(r->fields[17]);
-				}
-				if (atoi(r->fields[9])!=atoi(r->fields[18])) {
-					proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing max_latency_ms for server %s:%d (%s:%d) from %d (%d) to %d\n" , mysrvc->address, mysrvc->port, r->fields[1], atoi(r->fields[2]), r->fields[9] , mysrvc->max_latency_us , atoi(r->fields[18]));
-					mysrvc->max_latency_us=1000*atoi(r->fields[18]);
+	wrlock();
+	purge_mysql_servers_table();
+	for (unsigned int i=0; i<MyHostGroups->len; i++) {
+		MyHGC *myhgc=(MyHGC *)MyHostGroups->index(i);
+		for (unsigned int j=0; j<myhgc->mysrvs->servers->len; j++) {
+			MySrvC *mysrvc=myhgc->mysrvs->idx(j);
+			std::unordered_map<std::string, MySrvC_incoming_t *>::iterator it=incoming.find(server_key(myhgc->hid,mysrvc->address,mysrvc->port));
+			if (it==incoming.end()) {
+				if (mysrvc->status!=MYSQL_SERVER_STATUS_OFFLINE_HARD) {
+					proxy_warning("Removed server at address %p, hostgroup %u, address %s port %d. Setting status OFFLINE HARD and immediately dropping all free connections. Used connections will be dropped when trying to use them\n", mysrvc, myhgc->hid, mysrvc->address, mysrvc->port);
+					mysrvc->status=MYSQL_SERVER_STATUS_OFFLINE_HARD;
+					mysrvc->ConnectionsFree->drop_all_connections();
 				}
-				if (strcmp(r->fields[10],r->fields[19])) {
-					proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing comment for server %s:%d (%s:%d) from '%s' to '%s'\n" , mysrvc->address, mysrvc->port, r->fields[1], atoi(r->fields[2]), r->fields[10], r->fields[19]);
-					free(mysrvc->comment);
-					mysrvc->comment=strdup(r->fields[19]);
+				continue;
+			}
+			MySrvC_incoming_t *si=it->second;
+			if (si->mysrvc) {
+				continue; // a duplicate of a server already matched
+			}
+			si->mysrvc=mysrvc;
+			if (mysrvc->weight!=si->weight) {
+				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing weight for server %s:%d from %d to %d\n" , mysrvc->address, mysrvc->port, mysrvc->weight , si->weight);
+				mysrvc->weight=si->weight;
+			}
+			if ((int)mysrvc->status!=si->status) {
+				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing status for server %s:%d from %d to %d\n" , mysrvc->address, mysrvc->port, mysrvc->status , si->status);
+				mysrvc->status=(MySerStatus)si->status;
+				if (mysrvc->status==MYSQL_SERVER_STATUS_SHUNNED) {
+					mysrvc->shunned_automatic=false;
 				}
 			}
+			if (mysrvc->compression!=si->compression) {
+				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing compression for server %s:%d from %d to %d\n" , mysrvc->address, mysrvc->port, mysrvc->compression , si->compression);
+				mysrvc->compression=si->compression;
+			}
+			if (mysrvc->max_connections!=si->max_connections) {
+				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing max_connections for server %s:%d from %d to %d\n" , mysrvc->address, mysrvc->port, mysrvc->max_connections , si->max_connections);
+				mysrvc->max_connections=si->max_connections;
+			}
+			if (mysrvc->max_replication_lag!=si->max_replication_lag) {
+				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing max_replication_lag for server %s:%d from %d to %d\n" , mysrvc->address, mysrvc->port, mysrvc->max_replication_lag , si->max_replication_lag);
+				mysrvc->max_replication_lag=si->max_replication_lag;
+			}
+			if (mysrvc->use_ssl!=si->use_ssl) {
+				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing use_ssl for server %s:%d from %d to %d\n" , mysrvc->address, mysrvc->port, mysrvc->use_ssl , si->use_ssl);
+				mysrvc->use_ssl=si->use_ssl;
+			}
+			if (mysrvc->max_latency_us!=si->max_latency_ms*1000) {
+				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing max_latency_ms for server %s:%d from %d to %d\n" , mysrvc->address, mysrvc->port, mysrvc->max_latency_us/1000 , si->max_latency_ms);
+				mysrvc->max_latency_us=si->max_latency_ms*1000;
+			}
+			if (mysrvc->min_idle_connections!=si->min_idle_connections) {
+				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing min_idle_connections for server %s:%d from %d to %d\n" , mysrvc->address, mysrvc->port, mysrvc->min_idle_connections , si->min_idle_connections);
+				mysrvc->min_idle_connections=si->min_idle_connections;
+			}
+			if (strcmp(mysrvc->comment,si->comment)) {
+				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Changing comment for server %s:%d from '%s' to '%s'\n" , mysrvc->address, mysrvc->port, mysrvc->comment, si->comment);
+				free(mysrvc->comment);
+				mysrvc->comment=strdup(si->comment);
+			}
+		}
+	}
+	for (std::unordered_map<std::string, MySrvC_incoming_t *>::iterator it=incoming.begin(); it!=incoming.end(); ++it) {
+		MySrvC_incoming_t *si=it->second;
+		if (si->mysrvc==NULL) {
+			proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Creating new server %s:%d , weight=%d, status=%d, compression=%d\n", si->address, si->port, si->weight, si->status, si->compression);
+			MySrvC *mysrvc=new MySrvC(si->address, si->port, si->weight, (MySerStatus)si->status, si->compression, si->max_connections, si->max_replication_lag, si->use_ssl, si->max_latency_ms, si->min_idle_connections, si->comment); // add new fields here if adding more columns in mysql_servers
+			proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Adding new server %s:%d , weight=%d, status=%d, mem_ptr=%p into hostgroup=%d\n", si->address, si->port, si->weight, si->status, mysrvc, si->hid);
+			add(mysrvc,si->hid);
 		}
 	}
-	if (resultset) { delete resultset; resultset=NULL; }
-	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "DELETE FROM mysql_servers_incoming\n");
-	mydb->execute("DELETE FROM mysql_servers_incoming");	
-
-	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "DELETE FROM mysql_servers\n");
-	mydb->execute("DELETE FROM mysql_servers");
-
-	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "DELETE FROM mysql_replication_hostgroups\n");
-	mydb->execute("DELETE FROM mysql_replication_hostgroups");
 
-	generate_mysql_servers_table();
-	generate_mysql_replication_hostgroups_table();
+	servers_min_idle=0;
+	for (unsigned int i=0; i<MyHostGroups->len; i++) {
+		MyHGC *myhgc=(MyHGC *)MyHostGroups->index(i);
+		for (unsigned int j=0; j<myhgc->mysrvs->servers->len; j++) {
+			if (myhgc->mysrvs->idx(j)->min_idle_connections) {
+				servers_min_idle++;
+			}
+		}
+	}
 
+	std::vector<char **> *rows=mysql_servers_table_rows();
+	SQLite3_result *replication_hostgroups=incoming_replication_hostgroups;
+	incoming_replication_hostgroups=NULL;
 	__sync_fetch_and_add(&status.servers_table_version,1);
+	// mydb_lock is taken before releasing the lock, so that mydb is written in
+	// the same order the servers were changed
+	pthread_mutex_lock(&mydb_lock);
 	wrunlock();
 	if (GloMTH) {
 		GloMTH->signal_all_threads(1);
 	}
+
+	for (std::vector<MySrvC_incoming_t *>::iterator it=servers_incoming.begin(); it!=servers_incoming.end(); ++it) {
+		MySrvC_incoming_t *si=*it;
+		free(si->address);
+		free(si->comment);
+		free(si);
+	}
+	servers_incoming.clear();
+
+	generate_mysql_servers_table(rows);
+	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "DELETE FROM mysql_replication_hostgroups\n");
+	mydb->execute("DELETE FROM mysql_replication_hostgroups");
+	generate_mysql_replication_hostgroups_table(replication_hostgroups);
+	pthread_mutex_unlock(&mydb_lock);
 	return true;
 }
 
@@ -589,72 +1409,90 @@ void MySQL_HostGroups_Manager::purge_mysql_servers_table() {
 	}
 }
 
-void MySQL_HostGroups_Manager::generate_mysql_servers_table() {
+// copies the running servers as rows of mysql_servers . The caller holds the lock
+std::vector<char **> * MySQL_HostGroups_Manager::mysql_servers_table_rows() {
+	std::vector<char **> *rows=new std::vector<char **>();
+	char buf[11][24];
 	for (unsigned int i=0; i<MyHostGroups->len; i++) {
 		MyHGC *myhgc=(MyHGC *)MyHostGroups->index(i);
 		MySrvC *mysrvc=NULL;
 		for (unsigned int j=0; j<myhgc->mysrvs->servers->len; j++) {
 			mysrvc=myhgc->mysrvs->idx(j);
 			uintptr_t ptr=(uintptr_t)mysrvc;
-			char *q=(char *)"INSERT INTO mysql_servers VALUES(%d,\"%s\",%d,%d,%d,%u,%u,%u,%u,%u,'%s',%llu)";
-			char *o=escape_string_single_quotes(mysrvc->comment, false);
-			char *query=(char *)malloc(strlen(q)+8+strlen(mysrvc->address)+8+8+8+8+8+16+8+16+32+strlen(o));
-			sprintf(query, q, mysrvc->myhgc->hid, mysrvc->address, mysrvc->port, mysrvc->weight, mysrvc->status, mysrvc->compression, mysrvc->max_connections, mysrvc->max_replication_lag, mysrvc->use_ssl, mysrvc->max_latency_us/1000,  o, ptr);
-			if (o!=mysrvc->comment) { // there was a copy
-				free(o);
-			}
-			char *st;
-			switch (mysrvc->status) {
-				case 0:
-					st=(char *)"ONLINE";
-					break;
-				case 2:
-					st=(char *)"OFFLINE_SOFT";
-					break;
-				case 3:
-					st=(char *)"OFFLINE_HARD";
-					break;
-				default:
-				case 1:
-				case 4:
-					st=(char *)"SHUNNED";
-					break;
+			sprintf(buf[0],"%d",mysrvc->myhgc->hid);
+			sprintf(buf[1],"%d",mysrvc->port);
+			sprintf(buf[2],"%d",mysrvc->weight);
+			sprintf(buf[3],"%d",mysrvc->status);
+			sprintf(buf[4],"%u",mysrvc->compression);
+			sprintf(buf[5],"%u",mysrvc->max_connections);
+			sprintf(buf[6],"%u",mysrvc->max_replication_lag);
+			sprintf(buf[7],"%u",mysrvc->use_ssl);
+			sprintf(buf[8],"%u",mysrvc->max_latency_us/1000);
+			sprintf(buf[9],"%u",mysrvc->min_idle_connections);
+			sprintf(buf[10],"%llu",(unsigned long long)ptr);
+			char **fields=(char **)malloc(sizeof(char *)*13);
+			fields[0]=strdup(buf[0]);
+			fields[1]=strdup(mysrvc->address);
+			for (int k=1; k<10; k++) {
+				fields[k+1]=strdup(buf[k]);
 			}
-			fprintf(stderr,"HID: %d , address: %s , port: %d , weight: %d , status: %s , max_connections: %u , max_replication_lag: %u , use_ssl: %u , max_latency_ms: %u , comment: %s\n", mysrvc->myhgc->hid, mysrvc->address, mysrvc->port, mysrvc->weight, st, mysrvc->max_connections, mysrvc->max_replication_lag, mysrvc->use_ssl, mysrvc->max_latency_us*1000, mysrvc->comment);
-			proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "%s\n", query);
-			//fprintf(stderr,"%s\n",query);
-			mydb->execute(query);
-			free(query);
+			fields[11]=strdup(mysrvc->comment);
+			fields[12]=strdup(buf[10]);
+			rows->push_back(fields);
+		}
+	}
+	return rows;
+}
+
+// replaces mysql_servers in mydb with rows, and frees them. The caller holds
+// mydb_lock
+void MySQL_HostGroups_Manager::generate_mysql_servers_table(std::vector<char **> *rows) {
+	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "DELETE FROM mysql_servers\n");
+	mydb->execute("DELETE FROM mysql_servers");
+	SQLite3_batch_insert bi(mydb, "INSERT INTO mysql_servers VALUES ", 13);
+	bi.begin();
+	for (std::vector<char **>::iterator it=rows->begin(); it!=rows->end(); ++it) {
+		char **fields=*it;
+		char *st;
+		switch (atoi(fields[4])) {
+			case 0:
+				st=(char *)"ONLINE";
+				break;
+			case 2:
+				st=(char *)"OFFLINE_SOFT";
+				break;
+			case 3:
+				st=(char *)"OFFLINE_HARD";
+				break;
+			default:
+			case 1:
+			case 4:
+				st=(char *)"SHUNNED";
+				break;
+		}
+		fprintf(stderr,"HID: %s , address: %s , port: %s , weight: %s , status: %s , max_connections: %s , max_replication_lag: %s , use_ssl: %s , max_latency_ms: %s , min_idle_connections: %s , comment: %s\n", fields[0], fields[1], fields[2], fields[3], st, fields[6], fields[7], fields[8], fields[9], fields[10], fields[11]);
+		bi.add_row(fields);
+		for (int k=0; k<13; k++) {
+			free(fields[k]);
 		}
+		free(fields);
 	}
+	bi.flush();
+	delete rows;
 }
 
-void MySQL_HostGroups_Manager::generate_mysql_replication_hostgroups_table() {
+void MySQL_HostGroups_Manager::generate_mysql_replication_hostgroups_table(SQLite3_result *incoming_replication_hostgroups) {
 	if (incoming_replication_hostgroups==NULL)
 		return;
 	proxy_info("New mysql_replication_hostgroups table\n");
+	SQLite3_batch_insert bi(mydb, "INSERT INTO mysql_replication_hostgroups VALUES ", 3);
+	bi.begin();
 	for (std::vector<SQLite3_row *>::iterator it = incoming_replication_hostgroups->rows.begin() ; it != incoming_replication_hostgroups->rows.end(); ++it) {
 		SQLite3_row *r=*it;
-		char *o=NULL;
-		int comment_length=0;	// #issue #643
-		if (r->fields[2]) { // comment is not null
-			o=escape_string_single_quotes(r->fields[2],false);
-			comment_length=strlen(o);
-		}
-		char *query=(char *)malloc(256+comment_length);
-		if (r->fields[2]) { // comment is not null
-			sprintf(query,"INSERT INTO mysql_replication_hostgroups VALUES(%s,%s,'%s')",r->fields[0], r->fields[1], o);
-			if (o!=r->fields[2]) { // there was a copy
-				free(o);
-			}
-		} else {
-			sprintf(query,"INSERT INTO mysql_replication_hostgroups VALUES(%s,%s,NULL)",r->fields[0],r->fields[1]);
-		}
-		mydb->execute(query);
+		bi.add_row(r->fields); // a NULL comment is saved as NULL, #643
 		fprintf(stderr,"writer_hostgroup: %s , reader_hostgroup: %s, %s\n", r->fields[0],r->fields[1], r->fields[2]);
-		free(query);
 	}
-	incoming_replication_hostgroups=NULL;
+	bi.flush();
 }
 
 SQLite3_result * MySQL_HostGroups_Manager::dump_table_mysql_servers() {
@@ -663,23 +1501,24 @@ SQLite3_result * MySQL_HostGroups_Manager::dump_table_mysql_servers() {
 	// purge table
 	purge_mysql_servers_table();
 
-	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "DELETE FROM mysql_servers\n");
-	mydb->execute("DELETE FROM mysql_servers");
-	generate_mysql_servers_table();
+	std::vector<char **> *rows=mysql_servers_table_rows();
+	pthread_mutex_lock(&mydb_lock);
+	wrunlock();
+	generate_mysql_servers_table(rows);
 
 	char *error=NULL;
 	int cols=0;
 	int affected_rows=0;
 	SQLite3_result *resultset=NULL;
-	char *query=(char *)"SELECT hostgroup_id, hostname, port, weight, CASE status WHEN 0 THEN \"ONLINE\" WHEN 1 THEN \"SHUNNED\" WHEN 2 THEN \"OFFLINE_SOFT\" WHEN 3 THEN \"OFFLINE_HARD\" WHEN 4 THEN \"SHUNNED\" END, compression, max_connections, max_replication_lag, use_ssl, max_latency_ms, comment FROM mysql_servers";
+	char *query=(char *)"SELECT hostgroup_id, hostname, port, weight, CASE status WHEN 0 THEN \"ONLINE\" WHEN 1 THEN \"SHUNNED\" WHEN 2 THEN \"OFFLINE_SOFT\" WHEN 3 THEN \"OFFLINE_HARD\" WHEN 4 THEN \"SHUNNED\" END, compression, max_connections, max_replication_lag, use_ssl, max_latency_ms, min_idle_connections, comment FROM mysql_servers";
 	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "%s\n", query);
 	mydb->execute_statement(query, &error , &cols , &affected_rows , &resultset);
-	wrunlock();
+	pthread_mutex_unlock(&mydb_lock);
 	return resultset;
 }
 
 SQLite3_result * MySQL_HostGroups_Manager::dump_table_mysql_replication_hostgroups() {
-	wrlock();
+	pthread_mutex_lock(&mydb_lock);
 	char *error=NULL;
 	int cols=0;
 	int affected_rows=0;
@@ -687,7 +1526,7 @@ SQLite3_result * MySQL_HostGroups_Manager::dump_table_mysql_replication_hostgrou
 	char *query=(char *)"SELECT writer_hostgroup, reader_hostgroup, comment FROM mysql_replication_hostgroups";
 	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "%s\n", query);
 	mydb->execute_statement(query, &error , &cols , &affected_rows , &resultset);
-	wrunlock();
+	pthread_mutex_unlock(&mydb_lock);
 	return resultset;
 }
 
@@ -757,7 +1596,20 @@ void MySQL_HostGroups_Manager::push_MyConn_to_pool(MySQL_Connection *c, bool _lo
 				delete c;
 			} else {
 				c->optimize();
-				mysrvc->ConnectionsFree->add(c);
+				MyConn_waiter *w=NULL;
+				if (mysrvc->breaker_state==MYSRVC_BREAKER_CLOSED) { // else the server is chosen only by get_random_MySrvC()
+					w=mysrvc->myhgc->next_waiter(monotonic_time());
+				}
+				if (w) {
+					// the connection goes directly to the next session waiting for this hostgroup
+					mysrvc->myhgc->pop_waiter(w);
+					status.myconnpoll_waiting--;
+					mysrvc->ConnectionsUsed->add(c);
+					MyConn_waiter_handoff(w,c);
+				} else {
+					mysrvc->ConnectionsFree->add(c);
+				}
+				goto __exit_push_MyConn_to_pool;
 			}
 		} else {
 			proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 7, "Destroying MySQL_Connection %p, server %s:%d with status %d\n", c, mysrvc->address, mysrvc->port, mysrvc->status);
@@ -767,6 +1619,8 @@ void MySQL_HostGroups_Manager::push_MyConn_to_pool(MySQL_Connection *c, bool _lo
 		proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 7, "Destroying MySQL_Connection %p, server %s:%d with status %d\n", c, mysrvc->address, mysrvc->port, mysrvc->status);
 		delete c;
 	}
+	// the connection was destroyed: a waiting session may be able to create a new one
+	MyConn_waiters_serve(mysrvc->myhgc, NULL);
 __exit_push_MyConn_to_pool:
 	if (_lock)
 		wrunlock();
@@ -785,17 +1639,57 @@ void MySQL_HostGroups_Manager::push_MyConn_to_pool_array(MySQL_Connection **ca)
 	wrunlock();
 }
 
-MySrvC *MyHGC::get_random_MySrvC() {
+// Returns the session that should get the next connection of the hostgroup,
+// or NULL if none is waiting. Each priority class is served in FIFO order, so
+// only the oldest waiter of each class is a candidate. Sessions with a lower
+// priority are raised by one class every mysql-connpool_priority_aging_ms
+// spent in queue, so they are not starved by a steady flow of higher priority
+// sessions. Between candidates of the same (aged) class the oldest wins.
+// The caller holds the MyHGM lock
+MyConn_waiter *MyHGC::next_waiter(unsigned long long now) {
+	if (num_waiters==0) {
+		return NULL;
+	}
+	MyConn_waiter *ret=NULL;
+	unsigned int ret_class=0;
+	unsigned long long aging=(unsigned long long)mysql_thread___connpool_priority_aging_ms*1000;
+	for (unsigned int i=0; i<MYCONN_WAITER_PRIORITIES; i++) {
+		if (waiters[i].size()==0) {
+			continue;
+		}
+		MyConn_waiter *w=waiters[i].front();
+		unsigned int c=i;
+		if (aging && now > w->since) {
+			unsigned long long steps=(now - w->since)/aging;
+			c=(steps >= i ? 0 : i-steps);
+		}
+		if (ret==NULL || c < ret_class || (c==ret_class && w->since < ret->since)) {
+			ret=w;
+			ret_class=c;
+		}
+	}
+	return ret;
+}
+
+// removes the waiter returned by next_waiter() . The caller holds the MyHGM lock
+void MyHGC::pop_waiter(MyConn_waiter *w) {
+	waiters[w->priority].pop_front();
+	num_waiters--;
+}
+
+// exclude , if set, is a server not to be returned (see hedged reads)
+MySrvC *MyHGC::get_random_MySrvC(MySrvC *exclude) {
 	MySrvC *mysrvc=NULL;
 	unsigned int j;
 	unsigned int sum=0;
 	unsigned int TotalUsedConn=0;
 	unsigned int l=mysrvs->cnt();
+	unsigned long long now=monotonic_time();
 	if (l) {
 		//int j=0;
 		for (j=0; j<l; j++) {
 			mysrvc=mysrvs->idx(j);
-			if (mysrvc->status==MYSQL_SERVER_STATUS_ONLINE) { // consider this server only if ONLINE
+			if (mysrvc->status==MYSQL_SERVER_STATUS_ONLINE && mysrvc!=exclude && mysrvc->breaker_available(now)) { // consider this server only if ONLINE, and its circuit breaker lets queries through
 				if (mysrvc->ConnectionsUsed->conns_length() < mysrvc->max_connections) { // consider this server only if didn't reach max_connections
 					if ( mysrvc->current_latency_us < ( mysrvc->max_latency_us ? mysrvc->max_latency_us : mysql_thread___default_max_latency_ms*1000 ) ) { // consider the host only if not too far
 						sum+=mysrvc->weight;
@@ -839,6 +1733,10 @@ MySrvC *MyHGC::get_random_MySrvC() {
 				}
 			}
 		}
+		if (sum==0 && exclude) {
+			// no other server: shunned servers are not brought back for a hedged read
+			return NULL;
+		}
 		if (sum==0) {
 			// per issue #531 , we try a desperate attempt to bring back online any shunned server
 			// we do this lowering the maximum wait time to 10%
@@ -877,7 +1775,7 @@ MySrvC *MyHGC::get_random_MySrvC() {
 		// we will now scan again to ignore overloaded server
 		for (j=0; j<l; j++) {
 			mysrvc=mysrvs->idx(j);
-			if (mysrvc->status==MYSQL_SERVER_STATUS_ONLINE) { // consider this server only if ONLINE
+			if (mysrvc->status==MYSQL_SERVER_STATUS_ONLINE && mysrvc!=exclude && mysrvc->breaker_available(now)) { // consider this server only if ONLINE, and its circuit breaker lets queries through
 				unsigned int len=mysrvc->ConnectionsUsed->conns_length();
 				if (len < mysrvc->max_connections) { // consider this server only if didn't reach max_connections
 					if ( mysrvc->current_latency_us < ( mysrvc->max_latency_us ? mysrvc->max_latency_us : mysql_thread___default_max_latency_ms*1000 ) ) { // consider the host only if not too far
@@ -902,7 +1800,7 @@ MySrvC *MyHGC::get_random_MySrvC() {
 
 		for (j=0; j<l; j++) {
 			mysrvc=mysrvs->idx(j);
-			if (mysrvc->status==MYSQL_SERVER_STATUS_ONLINE) { // consider this server only if ONLINE
+			if (mysrvc->status==MYSQL_SERVER_STATUS_ONLINE && mysrvc!=exclude && mysrvc->breaker_available(now)) { // consider this server only if ONLINE, and its circuit breaker lets queries through
 				unsigned int len=mysrvc->ConnectionsUsed->conns_length();
 				if (len < mysrvc->max_connections) { // consider this server only if didn't reach max_connections
 					if ( mysrvc->current_latency_us < ( mysrvc->max_latency_us ? mysrvc->max_latency_us : mysql_thread___default_max_latency_ms*1000 ) ) { // consider the host only if not too far
@@ -910,6 +1808,9 @@ MySrvC *MyHGC::get_random_MySrvC() {
 							New_sum+=mysrvc->weight;
 							if (k<=New_sum) {
 								proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 7, "Returning MySrvC %p, server %s:%d\n", mysrvc, mysrvc->address, mysrvc->port);
+								if (mysrvc->breaker_state==MYSRVC_BREAKER_HALF_OPEN) {
+									mysrvc->breaker_probes++;
+								}
 								return mysrvc;
 							}
 						}
@@ -947,6 +1848,7 @@ MySQL_Connection * MySrvConnList::get_random_MyConn() {
 	} else {
 		conn = new MySQL_Connection();
 		conn->parent=mysrvc;
+		mysrvc->connect_rate_count++;
 		//conn->options.charset=mysrvc->charset;
 		// deprecating this . #363
 		//conn->options.server_capabilities=0;
@@ -961,40 +1863,206 @@ MySQL_Connection * MySrvConnList::get_random_MyConn() {
 	return NULL; // never reach here
 }
 
-MySQL_Connection * MySQL_HostGroups_Manager::get_MyConn_from_pool(unsigned int _hid) {
+// removes a waiter from the queue of its hostgroup . The caller holds the lock
+void MySQL_HostGroups_Manager::MyConn_waiter_dequeue(MyHGC *myhgc, MyConn_waiter *w) {
+	std::deque<MyConn_waiter *> &q=myhgc->waiters[w->priority];
+	for (std::deque<MyConn_waiter *>::iterator it=q.begin(); it!=q.end(); ++it) {
+		if (*it==w) {
+			q.erase(it);
+			myhgc->num_waiters--;
+			status.myconnpoll_waiting--;
+			return;
+		}
+	}
+}
+
+// gives a connection to a waiter already removed from the queue, and wakes up
+// the thread of its session . The caller holds the lock.
+// The session belongs to another thread: only its wakeup flag is written
+void MySQL_HostGroups_Manager::MyConn_waiter_handoff(MyConn_waiter *w, MySQL_Connection *c) {
+	unsigned long long t=monotonic_time()-w->since;
+	w->conn=c;
+	status.myconnpoll_handoff++;
+	status.myconnpoll_wait_us+=t;
+	status.myconnpoll_wait_us_prio[w->priority]+=t;
+	if (t > status.myconnpoll_wait_max_us) {
+		status.myconnpoll_wait_max_us=t;
+	}
+	MySQL_Session *sess=w->sess;
+	// the owning thread resumes the session at the next loop, see MySQL_Thread::process_all_sessions()
+	__atomic_store_n(&sess->wakeup,1,__ATOMIC_RELEASE);
+	if (sess->thread) {
+		unsigned char s=0;
+		if (write(sess->thread->pipefd[1],&s,1)==-1) {
+			// the pipe is full, the thread will wake up anyway
+		}
+	}
+}
+
+// hands new connections to the sessions to be served before `stop` , as long
+// as the hostgroup can provide them . The caller holds the lock
+void MySQL_HostGroups_Manager::MyConn_waiters_serve(MyHGC *myhgc, MyConn_waiter *stop) {
+	unsigned long long now=monotonic_time();
+	MyConn_waiter *w=NULL;
+	while ((w=myhgc->next_waiter(now)) && w!=stop) {
+		MySrvC *mysrvc=myhgc->get_random_MySrvC();
+		if (mysrvc==NULL) {
+			return;
+		}
+		if (mysrvc->ConnectionsFree->conns_length()==0 && mysrvc->connect_rate_exceeded()) {
+			status.myconnpoll_connect_throttled++;
+			return;
+		}
+		MySQL_Connection *c=mysrvc->ConnectionsFree->get_random_MyConn();
+		mysrvc->ConnectionsUsed->add(c);
+		myhgc->pop_waiter(w);
+		status.myconnpoll_waiting--;
+		MyConn_waiter_handoff(w,c);
+	}
+}
+
+// If w is not NULL and no connection is available, the session is queued:
+// it will get a connection from push_MyConn_to_pool() as soon as one is
+// returned, in the order of MyHGC::next_waiter() .
+// Callers without a waiter (mirror and hedge sessions) only use spare
+// capacity: they get nothing while sessions are queued for the hostgroup,
+// and they don't retry (see handler_again___status_CONNECTING_SERVER() )
+// If exclude is not NULL, the connection is to a different server
+MySQL_Connection * MySQL_HostGroups_Manager::get_MyConn_from_pool(unsigned int _hid, MyConn_waiter *w, MySrvC *exclude) {
 	MySQL_Connection * conn=NULL;
+	MyHGC *myhgc=NULL;
+	MySrvC *mysrvc=NULL;
+	MyConn_waiter *next=NULL;
 	wrlock();
 	status.myconnpoll_get++;
-	MyHGC *myhgc=MyHGC_lookup(_hid);
-	MySrvC *mysrvc=myhgc->get_random_MySrvC();
+	if (w && w->waiting) {
+		if (w->conn) {
+			// a connection was handed off to the session
+			conn=w->conn;
+			w->conn=NULL;
+			w->waiting=false;
+			if (w->hid==_hid) {
+				status.myconnpoll_get_ok++;
+				goto __exit_get_MyConn_from_pool;
+			}
+			// the session is now looking for a different hostgroup
+			push_MyConn_to_pool(conn,false);
+			conn=NULL;
+		} else {
+			if (w->hid!=_hid) {
+				MyConn_waiter_dequeue(MyHGC_lookup(w->hid),w);
+				w->waiting=false;
+			}
+		}
+	}
+	myhgc=MyHGC_lookup(_hid);
+	// sessions ahead of this one are served first
+	MyConn_waiters_serve(myhgc,w);
+	next=myhgc->next_waiter(monotonic_time());
+	if (next==NULL || next==w) {
+		mysrvc=myhgc->get_random_MySrvC(exclude);
+		if (mysrvc && mysrvc->ConnectionsFree->conns_length()==0 && mysrvc->connect_rate_exceeded()) {
+			// a new connection is required, but the server already got too many in this second
+			status.myconnpoll_connect_throttled++;
+			mysrvc=NULL;
+		}
+	}
 	if (mysrvc) { // a MySrvC exists. If not, we return NULL = no targets
 		//conn=mysrvc->ConnectionsUsed->get_random_MyConn();
 		//mysrvc->ConnectionsFree->add(conn);
 		conn=mysrvc->ConnectionsFree->get_random_MyConn();
 		mysrvc->ConnectionsUsed->add(conn);
 		status.myconnpoll_get_ok++;
+		if (w && w->waiting) {
+			// the session was the next to be served
+			unsigned long long t=monotonic_time()-w->since;
+			myhgc->pop_waiter(w);
+			status.myconnpoll_waiting--;
+			status.myconnpoll_wait_us+=t;
+			status.myconnpoll_wait_us_prio[w->priority]+=t;
+			if (t > status.myconnpoll_wait_max_us) {
+				status.myconnpoll_wait_max_us=t;
+			}
+			w->waiting=false;
+		}
+	} else {
+		if (w) {
+			unsigned long long now=monotonic_time();
+			if (w->waiting==false) {
+				w->waiting=true;
+				w->hid=_hid;
+				w->since=now;
+				if (w->priority >= MYCONN_WAITER_PRIORITIES) {
+					w->priority=MYCONN_WAITER_PRIORITY_DEFAULT;
+				}
+				myhgc->waiters[w->priority].push_back(w);
+				myhgc->num_waiters++;
+				status.myconnpoll_wait++;
+				status.myconnpoll_wait_prio[w->priority]++;
+				status.myconnpoll_waiting++;
+			}
+			// the session sleeps until a connection is handed off. It still retries
+			// once in a while, as servers can also become available without
+			// connections being returned (brought ONLINE, max_connections raised)
+			unsigned long long retry_at=now+mysql_thread___poll_timeout_on_failure*1000;
+			if (w->deadline && w->deadline < retry_at) {
+				retry_at=w->deadline;
+			}
+			w->sess->pause_until=retry_at;
+		}
 	}
 //	conn->parent=mysrvc;
+__exit_get_MyConn_from_pool:
 	wrunlock();
 	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 7, "Returning MySQL Connection %p, server %s:%d\n", conn, (conn ? conn->parent->address : "") , (conn ? conn->parent->port : 0 ));
 	return conn;
 }
 
+// the session doesn't need a connection anymore (timeout, killed, closed)
+void MySQL_HostGroups_Manager::cancel_MyConn_wait(MyConn_waiter *w) {
+	wrlock();
+	if (w->conn) {
+		MySQL_Connection *c=w->conn;
+		w->conn=NULL;
+		push_MyConn_to_pool(c,false);
+	} else {
+		MyConn_waiter_dequeue(MyHGC_lookup(w->hid),w);
+	}
+	w->waiting=false;
+	wrunlock();
+}
+
 void MySQL_HostGroups_Manager::destroy_MyConn_from_pool(MySQL_Connection *c) {
 	bool to_del=true; // the default, legacy behavior
 	MySrvC *mysrvc=(MySrvC *)c->parent;
-	if (mysrvc->status==MYSQL_SERVER_STATUS_ONLINE && c->send_quit && queue.size() < 100) {
+	hgcu_thread_t *t=NULL;
+	if (mysrvc->status==MYSQL_SERVER_STATUS_ONLINE && c->send_quit && num_HGCU_threads) {
+		t=HGCU_threads[__sync_fetch_and_add(&HGCU_next,1)%num_HGCU_threads];
+		if (__sync_add_and_fetch(&t->pending,1) > HGCU_MAX_PENDING) {
+			__sync_fetch_and_sub(&t->pending,1);
+			__sync_fetch_and_add(&status.myconnpoll_reset_dropped,1);
+			t=NULL;
+		}
+	}
+	if (t) {
 		// overall, the backend seems healthy and so it is the connection. Try to reset it
 		proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 7, "Trying to reset MySQL_Connection %p, server %s:%d\n", c, mysrvc->address, mysrvc->port);
 		to_del=false;
-		c->userinfo->set(mysql_thread___monitor_username,mysql_thread___monitor_password,mysql_thread___default_schema,NULL);
-		queue.add(c);
+		if (HGCU_use_reset_connection(c)==false) {
+			// COM_RESET_CONNECTION keeps the current user, COM_CHANGE_USER switches to the monitor user
+			c->userinfo->set(mysql_thread___monitor_username,mysql_thread___monitor_password,mysql_thread___default_schema,NULL);
+		}
+		t->queue.add(c);
+		if (write(t->pipefd[1],"",1)==-1) {
+			// the pipe is full, the thread will wake up anyway
+		}
 	} else {
 		// we lock only this part of the code because we need to remove the connection from ConnectionsUsed
 		wrlock();
 		proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 7, "Destroying MySQL_Connection %p, server %s:%d\n", c, mysrvc->address, mysrvc->port);
 		mysrvc->ConnectionsUsed->remove(c);
 		status.myconnpoll_destroy++;
+		MyConn_waiters_serve(mysrvc->myhgc, NULL);
 		wrunlock();
 	}
 	if (to_del) {
@@ -1066,7 +2134,11 @@ void MySQL_HostGroups_Manager::drop_all_idle_connections() {
 
 			//PtrArray *pa=mysrvc->ConnectionsFree->conns;
 			MySrvConnList *mscl=mysrvc->ConnectionsFree;
-			while (mscl->conns_length() > mysql_thread___free_connections_pct*mysrvc->max_connections/100) {
+			unsigned int max_free=mysql_thread___free_connections_pct*mysrvc->max_connections/100;
+			if (max_free < mysrvc->min_idle_connections) {
+				max_free=mysrvc->min_idle_connections;
+			}
+			while (mscl->conns_length() > max_free) {
 				MySQL_Connection *mc=mscl->remove(0);
 				delete mc;
 				//__sync_fetch_and_sub(&status.server_connections_connected, 1);
@@ -1138,11 +2210,164 @@ __exit_get_multiple_idle_connections:
 	return num_conn_current;
 }
 
+// Creates new connections for the ONLINE servers that have fewer than
+// min_idle_connections free connections, honoring max_connections and
+// mysql-connect_rate_limit_per_server . The connections are not connected yet:
+// the calling thread connects them asynchronously and returns them to the pool
+int MySQL_HostGroups_Manager::get_connections_to_warm(MySQL_Connection **conn_list, int num_conn) {
+	if (servers_min_idle==0) {
+		return 0;
+	}
+	int num_conn_current=0;
+	wrlock();
+	for (unsigned int i=0; i<MyHostGroups->len; i++) {
+		MyHGC *myhgc=(MyHGC *)MyHostGroups->index(i);
+		for (unsigned int j=0; j<myhgc->mysrvs->cnt(); j++) {
+			MySrvC *mysrvc=myhgc->mysrvs->idx(j);
+			if (mysrvc->min_idle_connections==0 || mysrvc->status!=MYSQL_SERVER_STATUS_ONLINE) {
+				continue;
+			}
+			while (
+				num_conn_current < num_conn
+				&& mysrvc->ConnectionsFree->conns_length() + mysrvc->warming < mysrvc->min_idle_connections
+				&& mysrvc->ConnectionsFree->conns_length() + mysrvc->ConnectionsUsed->conns_length() < mysrvc->max_connections
+				&& mysrvc->connect_rate_exceeded()==false
+			) {
+				MySQL_Connection *mc=new MySQL_Connection();
+				mc->parent=mysrvc;
+				mysrvc->connect_rate_count++;
+				__sync_fetch_and_add(&status.server_connections_created, 1);
+				mysrvc->ConnectionsUsed->add(mc);
+				__sync_fetch_and_add(&mysrvc->warming,1); // decreased without lock by warm_connection_done()
+				conn_list[num_conn_current]=mc;
+				num_conn_current++;
+			}
+			if (num_conn_current>=num_conn) goto __exit_get_connections_to_warm;
+		}
+	}
+__exit_get_connections_to_warm:
+	wrunlock();
+	proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 7, "Returning %d connections to warm\n", num_conn_current);
+	return num_conn_current;
+}
+
+// called when the warm-up of a connection completes, before the connection
+// is returned to the pool or destroyed
+void MySQL_HostGroups_Manager::warm_connection_done(MySQL_Connection *c, bool ok) {
+	__sync_fetch_and_sub(&c->parent->warming,1);
+	if (ok) {
+		__sync_fetch_and_add(&status.myconnpoll_warm,1);
+	} else {
+		__sync_fetch_and_add(&status.myconnpoll_warm_err,1);
+	}
+}
+
 void MySQL_HostGroups_Manager::set_incoming_replication_hostgroups(SQLite3_result *s) {
 	incoming_replication_hostgroups=s;
 }
 
-SQLite3_result * MySQL_HostGroups_Manager::SQL3_Connection_Pool() {
+// The caller holds the lock
+void MySQL_HostGroups_Manager::breaker_log_add(MySrvC *mysrvc, enum MySrvC_breaker_state from, enum MySrvC_breaker_state to, unsigned int requests, unsigned int failures) {
+	mysrvc_breaker_event_t ev;
+	ev.time_us=realtime_time();
+	ev.hid=mysrvc->myhgc->hid;
+	ev.address=mysrvc->address;
+	ev.port=mysrvc->port;
+	ev.from=from;
+	ev.to=to;
+	ev.requests=requests;
+	ev.failures=failures;
+	breaker_log.push_back(ev);
+	if (breaker_log.size() > MYSRVC_BREAKER_LOG_MAX) {
+		breaker_log.pop_front();
+	}
+}
+
+// true if no server of the hostgroup can take queries only because its
+// circuit breaker is open: the session fails the query immediately instead of
+// waiting up to mysql-connect_timeout_server_max
+bool MySQL_HostGroups_Manager::breaker_all_open(unsigned int hid) {
+	unsigned int open=0;
+	unsigned int available=0;
+	unsigned long long now=monotonic_time();
+	unsigned long long open_us=(unsigned long long)mysql_thread___circuit_breaker_open_ms*1000;
+	wrlock();
+	MyHGC *myhgc=MyHGC_find(hid);
+	if (myhgc) {
+		for (unsigned int j=0; j<myhgc->mysrvs->cnt(); j++) {
+			MySrvC *mysrvc=myhgc->mysrvs->idx(j);
+			if (mysrvc->status!=MYSQL_SERVER_STATUS_ONLINE) {
+				continue;
+			}
+			if (mysrvc->breaker_state==MYSRVC_BREAKER_OPEN && now - mysrvc->breaker_since < open_us) {
+				open++;
+			} else {
+				available++;
+			}
+		}
+	}
+	if (open && available==0) {
+		status.breaker_fast_fail++;
+	}
+	wrunlock();
+	return (open && available==0);
+}
+
+static const char *breaker_state_str(enum MySrvC_breaker_state st) {
+	switch (st) {
+		case MYSRVC_BREAKER_CLOSED:
+			return "CLOSED";
+		case MYSRVC_BREAKER_OPEN:
+			return "OPEN";
+		case MYSRVC_BREAKER_HALF_OPEN:
+			return "HALF_OPEN";
+		default:
+			assert(0);
+			break;
+	}
+	return NULL;
+}
+
+SQLite3_result * MySQL_HostGroups_Manager::SQL3_Circuit_Breaker_Log() {
+	const int colnum=8;
+	proxy_debug(PROXY_DEBUG_MYSQL_CONNECTION, 4, "Dumping Circuit Breaker Log\n");
+	SQLite3_result *result=new SQLite3_result(colnum);
+	result->add_column_definition(SQLITE_TEXT,"time_us");
+	result->add_column_definition(SQLITE_TEXT,"hostgroup");
+	result->add_column_definition(SQLITE_TEXT,"srv_host");
+	result->add_column_definition(SQLITE_TEXT,"srv_port");
+	result->add_column_definition(SQLITE_TEXT,"from_state");
+	result->add_column_definition(SQLITE_TEXT,"to_state");
+	result->add_column_definition(SQLITE_TEXT,"requests");
+	result->add_column_definition(SQLITE_TEXT,"failures");
+	wrlock();
+	for (std::deque<mysrvc_breaker_event_t>::iterator it=breaker_log.begin(); it!=breaker_log.end(); ++it) {
+		char buf[32];
+		char **pta=(char **)malloc(sizeof(char *)*colnum);
+		sprintf(buf,"%llu", it->time_us);
+		pta[0]=strdup(buf);
+		sprintf(buf,"%u", it->hid);
+		pta[1]=strdup(buf);
+		pta[2]=strdup(it->address.c_str());
+		sprintf(buf,"%d", it->port);
+		pta[3]=strdup(buf);
+		pta[4]=strdup(breaker_state_str(it->from));
+		pta[5]=strdup(breaker_state_str(it->to));
+		sprintf(buf,"%u", it->requests);
+		pta[6]=strdup(buf);
+		sprintf(buf,"%u", it->failures);
+		pta[7]=strdup(buf);
+		result->add_row(pta);
+		for (int k=0; k<colnum; k++) {
+			free(pta[k]);
+		}
+		free(pta);
+	}
+	wrunlock();
+	return result;
+}
+
+SQLite3_result * MySQL_HostGroups_Manager::SQL3_Connection_Pool(bool purge) {
   const int colnum=12;
   proxy_debug(PROXY_DEBUG_MYSQL_CONNECTION, 4, "Dumping Connection Pool\n");
   SQLite3_result *result=new SQLite3_result(colnum);
@@ -1164,13 +2389,13 @@ SQLite3_result * MySQL_HostGroups_Manager::SQL3_Connection_Pool() {
 		MyHGC *myhgc=(MyHGC *)MyHostGroups->index(i);
 		for (j=0; j<(int)myhgc->mysrvs->cnt(); j++) {
 			MySrvC *mysrvc=(MySrvC *)myhgc->mysrvs->servers->index(j);
-			if (mysrvc->status!=MYSQL_SERVER_STATUS_ONLINE) {
+			if (purge && mysrvc->status!=MYSQL_SERVER_STATUS_ONLINE) {
 				proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 5, "Server %s:%d is not online\n", mysrvc->address, mysrvc->port);
 				//__sync_fetch_and_sub(&status.server_connections_connected, mysrvc->ConnectionsFree->conns->len);
 				mysrvc->ConnectionsFree->drop_all_connections();
 			}
 			// drop idle connections if beyond max_connection
-			while (mysrvc->ConnectionsFree->conns_length() && mysrvc->ConnectionsUsed->conns_length()+mysrvc->ConnectionsFree->conns_length() > mysrvc->max_connections) {
+			while (purge && mysrvc->ConnectionsFree->conns_length() && mysrvc->ConnectionsUsed->conns_length()+mysrvc->ConnectionsFree->conns_length() > mysrvc->max_connections) {
 				//MySQL_Connection *conn=(MySQL_Connection *)mysrvc->ConnectionsFree->conns->remove_index_fast(0);
 				MySQL_Connection *conn=mysrvc->ConnectionsFree->remove(0);
 				delete conn;
@@ -1238,7 +2463,7 @@ void MySQL_HostGroups_Manager::read_only_action(char *hostname, int port, int re
 	//const char *Q1B=(char *)"SELECT hostgroup_id,status FROM mysql_replication_hostgroups LEFT JOIN mysql_servers ON hostgroup_id=writer_hostgroup AND hostname='%s' AND port=%d";
 	const char *Q1B=(char *)"SELECT hostgroup_id,status FROM ( SELECT DISTINCT writer_hostgroup FROM mysql_replication_hostgroups JOIN mysql_servers WHERE (hostgroup_id=writer_hostgroup OR reader_hostgroup=hostgroup_id) AND hostname='%s' AND port=%d ) LEFT JOIN mysql_servers ON hostgroup_id=writer_hostgroup AND hostname='%s' AND port=%d";
 	const char *Q2=(char *)"UPDATE OR IGNORE mysql_servers SET hostgroup_id=(SELECT writer_hostgroup FROM mysql_replication_hostgroups WHERE reader_hostgroup=mysql_servers.hostgroup_id) WHERE hostname='%s' AND port=%d AND hostgroup_id IN (SELECT reader_hostgroup FROM mysql_replication_hostgroups WHERE reader_hostgroup=mysql_servers.hostgroup_id)";
-	const char *Q3A=(char *)"INSERT OR IGNORE INTO mysql_servers(hostgroup_id, hostname, port, status, weight, max_connections, max_replication_lag, use_ssl, max_latency_ms, comment) SELECT reader_hostgroup, hostname, port, status, weight, max_connections, max_replication_lag, use_ssl, max_latency_ms, mysql_servers.comment FROM mysql_servers JOIN mysql_replication_hostgroups ON mysql_servers.hostgroup_id=mysql_replication_hostgroups.writer_hostgroup WHERE hostname='%s' AND port=%d";
+	const char *Q3A=(char *)"INSERT OR IGNORE INTO mysql_servers(hostgroup_id, hostname, port, status, weight, max_connections, max_replication_lag, use_ssl, max_latency_ms, min_idle_connections, comment) SELECT reader_hostgroup, hostname, port, status, weight, max_connections, max_replication_lag, use_ssl, max_latency_ms, min_idle_connections, mysql_servers.comment FROM mysql_servers JOIN mysql_replication_hostgroups ON mysql_servers.hostgroup_id=mysql_replication_hostgroups.writer_hostgroup WHERE hostname='%s' AND port=%d";
 	const char *Q3B=(char *)"DELETE FROM mysql_servers WHERE hostname='%s' AND port=%d AND hostgroup_id IN (SELECT reader_hostgroup FROM mysql_replication_hostgroups WHERE reader_hostgroup=mysql_servers.hostgroup_id)";
 	const char *Q4=(char *)"UPDATE OR IGNORE mysql_servers SET hostgroup_id=(SELECT reader_hostgroup FROM mysql_replication_hostgroups WHERE writer_hostgroup=mysql_servers.hostgroup_id) WHERE hostname='%s' AND port=%d AND hostgroup_id IN (SELECT writer_hostgroup FROM mysql_replication_hostgroups WHERE writer_hostgroup=mysql_servers.hostgroup_id)";
 	const char *Q5=(char *)"DELETE FROM mysql_servers WHERE hostname='%s' AND port=%d AND hostgroup_id IN (SELECT writer_hostgroup FROM mysql_replication_hostgroups WHERE writer_hostgroup=mysql_servers.hostgroup_id)";
@@ -1254,9 +2479,9 @@ void MySQL_HostGroups_Manager::read_only_action(char *hostname, int port, int re
 	char *error=NULL;
 	int affected_rows=0;
 	SQLite3_result *resultset=NULL;
-	wrlock();
+	pthread_mutex_lock(&mydb_lock);
 	mydb->execute_statement(query, &error , &cols , &affected_rows , &resultset);
-	wrunlock();
+	pthread_mutex_unlock(&mydb_lock);
 	int num_rows=0;
 	if (resultset==NULL) {
 		goto __exit_read_only_action;
@@ -1293,9 +2518,9 @@ void MySQL_HostGroups_Manager::read_only_action(char *hostname, int port, int re
 				// there is a server in writer hostgroup, let check the status of present and not present hosts
 				// this is the same query as Q1, but with a LEFT JOIN
 				sprintf(query,Q1B,hostname,port,hostname,port);
-				wrlock();
+				pthread_mutex_lock(&mydb_lock);
 				mydb->execute_statement(query, &error , &cols , &affected_rows , &resultset);
-				wrunlock();
+				pthread_mutex_unlock(&mydb_lock);
 				bool act=false;
 				for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 					SQLite3_row *r=*it;
@@ -35,6 +35,8 @@ MySQL_Event::MySQL_Event (uint32_t _thread_id, char * _username, char * _scheman
 	et=PROXYSQL_QUERY;
 	hid=UINT64_MAX;
 	server=NULL;
+	phases=NULL;
+	num_phases=0;
 }
 
 void MySQL_Event::set_query(const char *ptr, int len) {
@@ -48,10 +50,19 @@ void MySQL_Event::set_server(int _hid, const char *ptr, int len) {
 	hid=_hid;
 }
 
+// the event becomes PROXYSQL_QUERY_PHASES : the first _num_phases query_phase
+// times are appended after the query
+void MySQL_Event::set_phases(unsigned long long *_phases, int _num_phases) {
+	phases=_phases;
+	num_phases=_num_phases;
+	et=PROXYSQL_QUERY_PHASES;
+}
+
 uint64_t MySQL_Event::write(std::fstream *f) {
 	uint64_t total_bytes=0;
 	switch (et) {
 		case PROXYSQL_QUERY:
+		case PROXYSQL_QUERY_PHASES:
 			total_bytes=write_query(f);
 			break;
 		default:
@@ -82,6 +93,14 @@ uint64_t MySQL_Event::write_query(std::fstream *f) {
 
 	total_bytes+=mysql_encode_length(query_len,NULL)+query_len;
 
+	int i;
+	if (et==PROXYSQL_QUERY_PHASES) {
+		total_bytes+=mysql_encode_length(num_phases,NULL);
+		for (i=0; i<num_phases; i++) {
+			total_bytes+=mysql_encode_length(phases[i],NULL);
+		}
+	}
+
 	// write total length , fixed size
 	f->write((const char *)&total_bytes,sizeof(uint64_t));
 	//char prefix;
@@ -138,6 +157,17 @@ uint64_t MySQL_Event::write_query(std::fstream *f) {
 		f->write(query_ptr,query_len);
 	}
 
+	if (et==PROXYSQL_QUERY_PHASES) {
+		len=mysql_encode_length(num_phases,buf);
+		write_encoded_length(buf,num_phases,len,buf[0]);
+		f->write((char *)buf,len);
+		for (i=0; i<num_phases; i++) {
+			len=mysql_encode_length(phases[i],buf);
+			write_encoded_length(buf,phases[i],len,buf[0]);
+			f->write((char *)buf,len);
+		}
+	}
+
 	return total_bytes;
 }
 
@@ -283,6 +313,10 @@ void MySQL_Logger::log_request(MySQL_Session *sess, MySQL_Data_Stream *myds) {
 	} else {
 		me.set_query("",0);
 	}
+	if (mysql_thread___eventslog_phases) {
+		// the client write phase is still running: it is only tracked per digest
+		me.set_phases(sess->CurrentQuery.phase_time, QUERY_PHASE_CLIENT_WRITE);
+	}
 
 	int sl=0;
 	char *sa=(char *)""; // default
@@ -1460,6 +1460,7 @@ __sleep_monitor_replication_lag:
 
 
 void * MySQL_Monitor::run() {
+	GloMTH->set_auxiliary_thread_affinity(); // inherited by all Monitor threads
 	// initialize the MySQL Thread (note: this is not a real thread, just the structures associated with it)
 	unsigned int MySQL_Monitor__thread_MySQL_Thread_Variables_version;
 	MySQL_Thread * mysql_thr = new MySQL_Thread();
@@ -193,6 +193,35 @@ bool proxy_scramble_sha1(char *pass_reply,  const char *message, const char *sha
 	return ret;
 }
 
+// same as proxy_scramble() and proxy_scramble_sha1() , but with the digests
+// cached in the account (ad->auth_digests must be true) : it computes a
+// single SHA1, or two for hashed passwords whose SHA1(password) is still not
+// known. If the password is correct sha1_pass is set to SHA1(password) ,
+// that is only meaningful for hashed passwords
+bool proxy_verify_account_reply(account_details_t *ad, const char *scramble, const unsigned char *reply, char *sha1_pass) {
+	uint8 to[SHA_DIGEST_LENGTH];
+	uint8 hash_stage1[SHA_DIGEST_LENGTH];
+	proxy_compute_sha1_hash_multi(to, scramble, SCRAMBLE_LENGTH, (const char *)ad->auth_stage2, SHA_DIGEST_LENGTH);
+	proxy_my_crypt((char *)hash_stage1, reply, to, SCRAMBLE_LENGTH);
+	if (ad->password[0]!='*') { // clear text password
+		return (memcmp(hash_stage1,ad->auth_stage1,SHA_DIGEST_LENGTH)==0);
+	}
+	void *known_sha1_pass=ad->sha1_pass;
+	if (known_sha1_pass) {
+		if (memcmp(hash_stage1,known_sha1_pass,SHA_DIGEST_LENGTH)) {
+			return false;
+		}
+	} else {
+		uint8 hash_stage2[SHA_DIGEST_LENGTH];
+		proxy_compute_sha1_hash(hash_stage2, (const char *)hash_stage1, SHA_DIGEST_LENGTH);
+		if (memcmp(hash_stage2,ad->auth_stage2,SHA_DIGEST_LENGTH)) {
+			return false;
+		}
+	}
+	memcpy(sha1_pass,hash_stage1,SHA_DIGEST_LENGTH);
+	return true;
+}
+
 
 
 
@@ -1166,9 +1195,6 @@ bool MySQL_Protocol::process_pkt_auth_swich_response(unsigned char *pkt, unsigne
 	}
 	mysql_hdr hdr;
 	memcpy(&hdr,pkt,sizeof(mysql_hdr));
-	int default_hostgroup=-1;
-	bool transaction_persistent;
-	bool _ret_use_ssl=false;
 	unsigned char pass[128];
 	memset(pass,0,128);
 	pkt+=sizeof(mysql_hdr);
@@ -1176,7 +1202,11 @@ bool MySQL_Protocol::process_pkt_auth_swich_response(unsigned char *pkt, unsigne
 	char reply[SHA_DIGEST_LENGTH+1];
 	reply[SHA_DIGEST_LENGTH]='\0';
 	void *sha1_pass=NULL;
-	password=GloMyAuth->lookup((char *)userinfo->username, USERNAME_FRONTEND, &_ret_use_ssl, &default_hostgroup, NULL, NULL, &transaction_persistent, NULL, NULL, &sha1_pass);
+	account_details_t *ad=GloMyAuth->lookup_account((char *)userinfo->username, USERNAME_FRONTEND);
+	if (ad) {
+		password=ad->password;
+		sha1_pass=ad->sha1_pass;
+	}
 	// FIXME: add support for default schema and fast forward , issues #255 and #256
 	if (password==NULL) {
 		ret=false;
@@ -1184,30 +1214,31 @@ bool MySQL_Protocol::process_pkt_auth_swich_response(unsigned char *pkt, unsigne
 //		if (pass_len==0 && strlen(password)==0) {
 //			ret=true;
 //		} else {
-			if (password[0]!='*') { // clear text password
+			if (ad->auth_digests) {
+				ret=proxy_verify_account_reply(ad, (*myds)->myconn->scramble_buff, pass, reply);
+			} else if (password[0]!='*') { // clear text password
 				proxy_scramble(reply, (*myds)->myconn->scramble_buff, password);
 				if (memcmp(reply, pass, SHA_DIGEST_LENGTH)==0) {
 					ret=true;
 				}
 			} else {
 				ret=proxy_scramble_sha1((char *)pass,(*myds)->myconn->scramble_buff,password+1, reply);
-				if (ret) {
-					if (sha1_pass==NULL) {
-						// currently proxysql doesn't know any sha1_pass for that specific user, let's set it!
-						GloMyAuth->set_SHA1((char *)userinfo->username, USERNAME_FRONTEND,reply);
-					}
-					if (userinfo->sha1_pass) free(userinfo->sha1_pass);
-					userinfo->sha1_pass=sha1_pass_hex(reply);
+			}
+			if (ret && password[0]=='*') {
+				if (sha1_pass==NULL) {
+					// currently proxysql doesn't know any sha1_pass for that specific user, let's set it!
+					GloMyAuth->set_SHA1((char *)userinfo->username, USERNAME_FRONTEND,reply);
 				}
+				if (userinfo->sha1_pass) free(userinfo->sha1_pass);
+				userinfo->sha1_pass=sha1_pass_hex(reply);
 			}
 //		}
 //		if (_ret_use_ssl==true) {
 //			ret=false;
 //		}
 	}
-	if (sha1_pass) {
-		free(sha1_pass);
-		sha1_pass=NULL;
+	if (ad) {
+		GloMyAuth->release_account(ad);
 	}
 	return ret;
 }
@@ -1240,7 +1271,14 @@ bool MySQL_Protocol::process_pkt_COM_CHANGE_USER(unsigned char *pkt, unsigned in
 	cur+=pass_len;
 	db=(char *)pkt+cur;
 	void *sha1_pass=NULL;
-	password=GloMyAuth->lookup((char *)user, USERNAME_FRONTEND, &_ret_use_ssl, &default_hostgroup, NULL, NULL, &transaction_persistent, NULL, NULL, &sha1_pass);
+	account_details_t *ad=GloMyAuth->lookup_account((char *)user, USERNAME_FRONTEND);
+	if (ad) {
+		password=ad->password;
+		sha1_pass=ad->sha1_pass;
+		_ret_use_ssl=ad->use_ssl;
+		default_hostgroup=ad->default_hostgroup;
+		transaction_persistent=ad->transaction_persistent;
+	}
 	// FIXME: add support for default schema and fast forward, see issue #255 and #256
 	(*myds)->sess->default_hostgroup=default_hostgroup;
 	(*myds)->sess->transaction_persistent=transaction_persistent;
@@ -1250,7 +1288,17 @@ bool MySQL_Protocol::process_pkt_COM_CHANGE_USER(unsigned char *pkt, unsigned in
 		if (pass_len==0 && strlen(password)==0) {
 			ret=true;
 		} else {
-			if (password[0]!='*') { // clear text password
+			if (ad->auth_digests) {
+				ret=proxy_verify_account_reply(ad, (*myds)->myconn->scramble_buff, pass, reply);
+				if (ret && password[0]=='*') {
+					if (sha1_pass==NULL) {
+						// currently proxysql doesn't know any sha1_pass for that specific user, let's set it!
+						GloMyAuth->set_SHA1((char *)user, USERNAME_FRONTEND,reply);
+					}
+					if (userinfo->sha1_pass) free(userinfo->sha1_pass);
+					userinfo->sha1_pass=sha1_pass_hex(reply);
+				}
+			} else if (password[0]!='*') { // clear text password
 				proxy_scramble(reply, (*myds)->myconn->scramble_buff, password);
 				if (memcmp(reply, pass, SHA_DIGEST_LENGTH)==0) {
 					ret=true;
@@ -1287,21 +1335,19 @@ bool MySQL_Protocol::process_pkt_COM_CHANGE_USER(unsigned char *pkt, unsigned in
 		userinfo->username=strdup((const char *)user);
 		/*if (pass_len) */ userinfo->password=strdup((const char *)"");
 	}
-	//if (password) free(password);
-	if (password) {
-		free(password);
-		password=NULL;
-	}
-	if (sha1_pass) {
-		free(sha1_pass);
-		sha1_pass=NULL;
+	// password and sha1_pass belong to the account
+	if (ad) {
+		GloMyAuth->release_account(ad);
 	}
 
 	return ret;
 }
 
 //bool MySQL_Protocol::process_pkt_handshake_response(MySQL_Data_Stream *myds, unsigned char *pkt, unsigned int len) {
-bool MySQL_Protocol::process_pkt_handshake_response(unsigned char *pkt, unsigned int len) {
+// if auth_pending is not NULL the password can be verified by an auth thread:
+// in that case it returns false with *auth_pending set, and the packet has
+// to be processed again once the session is woken up
+bool MySQL_Protocol::process_pkt_handshake_response(unsigned char *pkt, unsigned int len, bool *auth_pending) {
 	bool ret=false;
 	uint8_t charset;
 	uint32_t  capabilities;
@@ -1345,20 +1391,24 @@ bool MySQL_Protocol::process_pkt_handshake_response(unsigned char *pkt, unsigned
 
 	char reply[SHA_DIGEST_LENGTH+1];
 	reply[SHA_DIGEST_LENGTH]='\0';
-	int default_hostgroup=-1;
-	char *default_schema=NULL;
-	bool schema_locked;
-	bool transaction_persistent;
-	bool fast_forward;
-	int max_connections;
-	password=GloMyAuth->lookup((char *)user, USERNAME_FRONTEND, &_ret_use_ssl, &default_hostgroup, &default_schema, &schema_locked, &transaction_persistent, &fast_forward, &max_connections, &sha1_pass);
-	//assert(default_hostgroup>=0);
-	(*myds)->sess->default_hostgroup=default_hostgroup;
-	(*myds)->sess->default_schema=default_schema; // just the pointer is passed
-	(*myds)->sess->schema_locked=schema_locked;
-	(*myds)->sess->transaction_persistent=transaction_persistent;
-	(*myds)->sess->session_fast_forward=fast_forward;
-	(*myds)->sess->user_max_connections=max_connections;
+	// the account is the template of the session: its fields are not copied,
+	// the session keeps a reference to it
+	account_details_t *ad=GloMyAuth->lookup_account((char *)user, USERNAME_FRONTEND);
+	MySQL_Session *_sess=(*myds)->sess;
+	_sess->set_account(ad);
+	if (ad) {
+		password=ad->password;
+		sha1_pass=ad->sha1_pass;
+		_ret_use_ssl=ad->use_ssl;
+		_sess->default_hostgroup=ad->default_hostgroup;
+		_sess->default_schema=ad->default_schema; // owned by the account
+		_sess->schema_locked=ad->schema_locked;
+		_sess->transaction_persistent=ad->transaction_persistent;
+		_sess->session_fast_forward=ad->fast_forward;
+		_sess->user_max_connections=ad->max_connections;
+	} else {
+		_sess->default_hostgroup=-1;
+	}
 	if (password==NULL) {
 		// this is a workaround for bug #603
 		if ((*myds)->sess->admin==true) {
@@ -1371,7 +1421,7 @@ bool MySQL_Protocol::process_pkt_handshake_response(unsigned char *pkt, unsigned
 					(*myds)->sess->transaction_persistent=false;
 					(*myds)->sess->session_fast_forward=false;
 					(*myds)->sess->user_max_connections=0;
-					password=l_strdup(mysql_thread___monitor_password);
+					password=mysql_thread___monitor_password;
 				ret=true;
 				}
 			} else {
@@ -1384,24 +1434,42 @@ bool MySQL_Protocol::process_pkt_handshake_response(unsigned char *pkt, unsigned
 		if (pass_len==0 && strlen(password)==0) {
 			ret=true;
 		} else {
-			if (password[0]!='*') { // clear text password
+			int r=-1;
+			if (_sess->auth_job) {
+				// the session was woken up by the auth thread: use its result
+				r=GloMyAuth->verification_result(_sess->auth_job, ad, pass, reply);
+				_sess->auth_job=NULL;
+			} else {
+				if (auth_pending) {
+					_sess->auth_job=GloMyAuth->submit_verification(ad, (*myds)->myconn->scramble_buff, pass, _sess);
+					if (_sess->auth_job) {
+						*auth_pending=true;
+						return false;
+					}
+				}
+			}
+			if (r>=0) {
+				ret=(r==1);
+			} else if (ad->auth_digests) {
+				ret=proxy_verify_account_reply(ad, (*myds)->myconn->scramble_buff, pass, reply);
+			} else if (password[0]!='*') { // clear text password
 				proxy_scramble(reply, (*myds)->myconn->scramble_buff, password);
 				if (memcmp(reply, pass, SHA_DIGEST_LENGTH)==0) {
 					ret=true;
 				}
 			} else {
 				ret=proxy_scramble_sha1((char *)pass,(*myds)->myconn->scramble_buff,password+1, reply);
-				if (ret) {
-					if (sha1_pass==NULL) {
-						// currently proxysql doesn't know any sha1_pass for that specific user, let's set it!
-						GloMyAuth->set_SHA1((char *)user, USERNAME_FRONTEND,reply);
-					}
-					if (userinfo->sha1_pass) free(userinfo->sha1_pass);
-					userinfo->sha1_pass=sha1_pass_hex(reply);
-					}
+			}
+			if (ret && password[0]=='*') {
+				if (sha1_pass==NULL) {
+					// currently proxysql doesn't know any sha1_pass for that specific user, let's set it!
+					GloMyAuth->set_SHA1((char *)user, USERNAME_FRONTEND,reply);
 				}
+				if (userinfo->sha1_pass) free(userinfo->sha1_pass);
+				userinfo->sha1_pass=sha1_pass_hex(reply);
 			}
 		}
+	}
 		if (_ret_use_ssl==true) {
 			// if we reached here, use_ssl is false , but _ret_use_ssl is true
 			// it means that a client is required to use SSL , but it is not
@@ -1446,15 +1514,8 @@ bool MySQL_Protocol::process_pkt_handshake_response(unsigned char *pkt, unsigned
 	}
 
 __exit_process_pkt_handshake_response:
-	//if (password) free(password);
-	if (password) {
-		free(password);
-		password=NULL;
-	}
-	if (sha1_pass) {
-		free(sha1_pass);
-		sha1_pass=NULL;
-	}
+	// password and sha1_pass are not copies: they belong to the account
+	// referenced by the session, or to the thread variables
 
 	//l_free(len,pkt);
 	return ret;
@@ -17,57 +17,6 @@ extern ProxySQL_Admin *GloAdmin;
 extern MySQL_Logger *GloMyLogger;
 extern MySQL_STMT_Manager *GloMyStmt;
 
-class KillArgs {
-	public:
-	char *username;
-	char *password;
-	char *hostname;
-	unsigned int port;
-	unsigned long id;
-	KillArgs(char *u, char *p, char *h, unsigned int P, unsigned long i) {
-		username=strdup(u);
-		password=strdup(p);
-		hostname=strdup(h);
-		port=P;
-		id=i;
-	};
-	~KillArgs() {
-		free(username);
-		free(password);
-		free(hostname);
-	};
-};
-
-static void * kill_query_thread(void *arg) {
-	KillArgs *ka=(KillArgs *)arg;
-	MYSQL *mysql;
-	mysql=mysql_init(NULL);
-	mysql_options4(mysql, MYSQL_OPT_CONNECT_ATTR_ADD, "program_name", "proxysql_killer");
-	if (!mysql) {
-		goto __exit_kill_query_thread;
-	}
-	MYSQL *ret;
-	if (ka->port) {
-		proxy_warning("KILL QUERY %lu on %s:%d\n", ka->id, ka->hostname, ka->port);
-		ret=mysql_real_connect(mysql,ka->hostname,ka->username,ka->password,NULL,ka->port,NULL,0);
-	} else {
-		proxy_warning("KILL QUERY %lu on localhost\n", ka->id);
-		ret=mysql_real_connect(mysql,"localhost",ka->username,ka->password,NULL,0,ka->hostname,0);
-	}
-	if (!ret) {
-		goto __exit_kill_query_thread;
-	}
-	char buf[100];
-	sprintf(buf,"KILL QUERY %lu", ka->id);
-	// FIXME: these 2 calls are blocking, fortunately on their own thread
-	mysql_query(mysql,buf);
-	mysql_close(mysql);
-__exit_kill_query_thread:
-	delete ka;
-	return NULL;
-}
-
-
 extern Query_Processor *GloQPro;
 extern Query_Cache *GloQC;
 extern ProxySQL_Admin *GloAdmin;
@@ -80,9 +29,15 @@ Query_Info::Query_Info() {
 	QueryParserArgs.digest_text=NULL;
 	QueryParserArgs.first_comment=NULL;
 	stmt_info=NULL;
+	memset(phase_time,0,sizeof(phase_time));
+	phase_ts=0;
+	client_write_start=0;
+	phases_digest=0;
+	pending_phases_digest=0;
 }
 
 Query_Info::~Query_Info() {
+	phases_flush();
 	//if (QueryParserArgs) {
 	GloQPro->query_parser_free(&QueryParserArgs);
 	//}
@@ -105,6 +60,9 @@ void Query_Info::begin(unsigned char *_p, int len, bool mysql_header) {
 	QueryParserArgs.digest_text=NULL;
 	QueryParserArgs.first_comment=NULL;
 	start_time=sess->thread->curtime;
+	memset(phase_time,0,sizeof(phase_time));
+	phase_ts=start_time;
+	client_write_start=0;
 	init(_p, len, mysql_header);
 	if (mysql_thread___commands_stats || mysql_thread___query_digests) {
 		query_parser_init();
@@ -114,11 +72,23 @@ void Query_Info::begin(unsigned char *_p, int len, bool mysql_header) {
 }
 
 void Query_Info::end() {
+	phases_digest=0;
 	query_parser_update_counters();
 	query_parser_free();
 	if ((end_time-start_time) > (unsigned int)mysql_thread___long_query_time*1000) {
 		__sync_add_and_fetch(&sess->thread->status_variables.queries_slow,1);
 	}
+	if (phase_ts) {
+		phase_ts=0;
+		if (phases_digest && mysql_thread___query_digests_phases) {
+			// the phases are aggregated once the response is flushed to the client,
+			// see MySQL_Thread::process_all_sessions()
+			client_write_start=sess->thread->curtime;
+			if (sess->mirror) {
+				phases_client_write(client_write_start);
+			}
+		}
+	}
 	assert(mysql_stmt==NULL);
 	if (stmt_info) {
 		//__sync_fetch_and_sub(&stmt_info->ref_count,1); // decrease reference count
@@ -165,6 +135,9 @@ unsigned long long Query_Info::query_parser_update_counters() {
 //		if (stmt_info->MyComQueryCmd==MYSQL_COM_QUERY_UNKNOWN) return 0; // this means that it was never initialized
 //	}
 	unsigned long long ret=GloQPro->query_parser_update_counters(sess, MyComQueryCmd, &QueryParserArgs, end_time-start_time);
+	if (stmt_info ? stmt_info->digest_text : QueryParserArgs.digest_text) {
+		phases_digest=QueryParserArgs.digest_total;
+	}
 	MyComQueryCmd=MYSQL_COM_QUERY___NONE;
 	//l_free(QueryLength+1,QueryPointer);
 	QueryPointer=NULL;
@@ -172,6 +145,66 @@ unsigned long long Query_Info::query_parser_update_counters() {
 	return ret;
 }
 
+// Charges the time elapsed since the previous call to the phase matching the
+// status the session was left in. It is called when the session is
+// processed and when the request ends: thread->curtime is used, so no clock
+// is read and the resolution is one poll() loop
+void Query_Info::phases_update(unsigned long long now) {
+	if (phase_ts==0) return;
+	int p=-1;
+	switch (sess->status) {
+		case CONNECTING_SERVER:
+			// without a connection the session is waiting for one from the pool
+			if (sess->mybe && sess->mybe->server_myds && sess->mybe->server_myds->myconn) {
+				p=QUERY_PHASE_CONNECT;
+			} else {
+				p=QUERY_PHASE_POOL_WAIT;
+			}
+			break;
+		case CHANGING_USER_SERVER:
+		case CHANGING_AUTOCOMMIT:
+		case CHANGING_CHARSET:
+		case CHANGING_SCHEMA:
+		case SETTING_INIT_CONNECT:
+			p=QUERY_PHASE_RESET;
+			break;
+		case PROCESSING_QUERY:
+		case PROCESSING_STMT_PREPARE:
+		case PROCESSING_STMT_EXECUTE:
+			if (sess->mybe && sess->mybe->server_myds && sess->mybe->server_myds->myconn) {
+				p=QUERY_PHASE_BACKEND;
+			} else {
+				p=QUERY_PHASE_POOL_WAIT;
+			}
+			break;
+		default:
+			break;
+	}
+	if (p>=0 && now > phase_ts) {
+		phase_time[p]+=now-phase_ts;
+	}
+	phase_ts=now;
+}
+
+// the response of the last query has been flushed to the client. The phases
+// are aggregated with the digest of the next query, see
+// Query_Processor::update_query_digest()
+void Query_Info::phases_client_write(unsigned long long now) {
+	phase_time[QUERY_PHASE_CLIENT_WRITE]=now-client_write_start;
+	client_write_start=0;
+	phases_flush();
+	memcpy(pending_phase_time,phase_time,sizeof(phase_time));
+	pending_phases_digest=phases_digest;
+}
+
+// aggregates the pending phases on their own, if no query digest took them
+void Query_Info::phases_flush() {
+	if (pending_phases_digest) {
+		GloQPro->update_query_digest_phases(pending_phases_digest, pending_phase_time);
+		pending_phases_digest=0;
+	}
+}
+
 char * Query_Info::get_digest_text() {
 	return GloQPro->get_digest_text(&QueryParserArgs);
 }
@@ -209,7 +242,19 @@ void MySQL_Session::operator delete(void *ptr) {
 
 MySQL_Session::MySQL_Session() {
 	thread_session_id=0;
+	procslot=-1;
+	memset(&procslot_cache,0,sizeof(procslot_cache));
+	pool_waiter=new MyConn_waiter(this);
+	hedge_sess=NULL;
+	hedge_parent=NULL;
+	hedge_result=NULL;
+	hedge_rule=NULL;
+	hedge_exclude=NULL;
+	hedge_at=0;
+	hedge_sent_at=0;
+	backend_query_sent_at=0;
 	pause_until=0;
+	wakeup=0;
 	qpo=new Query_Processor_Output();
 //	Session_STMT_Manager=NULL;
 	start_time=0;
@@ -224,6 +269,10 @@ MySQL_Session::MySQL_Session() {
 	stats=false;
 	client_authenticated=false;
 	default_schema=NULL;
+	account=NULL;
+	auth_job=NULL;
+	auth_pkt.ptr=NULL;
+	auth_pkt.size=0;
 	schema_locked=false;
 	session_fast_forward=false;
 	started_sending_data_to_client=false;
@@ -253,6 +302,18 @@ MySQL_Session::MySQL_Session() {
 	SLDH=new StmtLongDataHandler();
 }
 
+// the session keeps a reference to the account it authenticated with,
+// the previous one (if any) is released
+void MySQL_Session::set_account(account_details_t *ad) {
+	if (account) {
+		if (default_schema==account->default_schema) {
+			default_schema=NULL;
+		}
+		GloMyAuth->release_account(account);
+	}
+	account=ad;
+}
+
 MySQL_Session::~MySQL_Session() {
 	if (sess_STMTs_meta) {
 		delete sess_STMTs_meta;
@@ -267,13 +328,34 @@ MySQL_Session::~MySQL_Session() {
 	//if (server_myds) {
 	//	delete server_myds;
 	//}
+	if (pool_waiter->waiting) {
+		MyHGM->cancel_MyConn_wait(pool_waiter);
+	}
+	delete pool_waiter;
+	hedge_cancel();
+	if (hedge_parent) {
+		// the original session keeps waiting for its own server
+		hedge_parent->hedge_sess=NULL;
+		hedge_parent=NULL;
+	}
+	if (auth_job) {
+		// the auth thread can still be running it: just drop the result
+		GloMyAuth->verification_result(auth_job, NULL, NULL, NULL);
+		auth_job=NULL;
+	}
+	if (auth_pkt.ptr) {
+		l_free(auth_pkt.size,auth_pkt.ptr);
+	}
 	reset_all_backends();
 	delete mybes;
 	if (default_schema) {
 //		int s=strlen(default_schema);
 //		l_free(s+1,default_schema);
-		free(default_schema);
+		if (account==NULL || default_schema!=account->default_schema) {
+			free(default_schema);
+		}
 	}
+	set_account(NULL);
 	proxy_debug(PROXY_DEBUG_NET,1,"Thread=%p, Session=%p -- Shutdown Session %p\n" , this->thread, this, this);
 	delete command_counters;
 	if (admin==false && connections_handler==false && mirror==false) {
@@ -682,6 +764,117 @@ void MySQL_Session::handler___status_WAITING_CLIENT_DATA___STATE_SLEEP___MYSQL_C
 	}
 }
 
+// Hedged reads: the query is sent also to another server of the same hostgroup.
+// The new session works like a mirror session, and hands the full response to
+// this session if the first packet from our server didn't arrive yet
+void MySQL_Session::handler___status_PROCESSING_QUERY___create_hedge_session() {
+	MySQL_Data_Stream *myds=mybe->server_myds;
+	unsigned int query_size=myds->mysql_real_query.QuerySize;
+	if (query_size >= 15*1024*1024) {
+		return;
+	}
+	MySQL_Session *newsess=new MySQL_Session();
+	newsess->client_myds = new MySQL_Data_Stream();
+	newsess->client_myds->DSS=STATE_SLEEP;
+	newsess->client_myds->sess=newsess;
+	newsess->client_myds->fd=0;
+	newsess->client_myds->myds_type=MYDS_FRONTEND;
+	newsess->client_myds->PSarrayOUT= new PtrSizeArray();
+	newsess->thread_session_id=__sync_fetch_and_add(&glovars.thread_id,1);
+	if (newsess->thread_session_id==0) {
+		newsess->thread_session_id=__sync_fetch_and_add(&glovars.thread_id,1);
+	}
+	thread->register_session(newsess);
+	newsess->status=WAITING_CLIENT_DATA;
+	MySQL_Connection *myconn=new MySQL_Connection;
+	myconn->userinfo->set(client_myds->myconn->userinfo);
+	// the response goes to our client: the backend connection of the hedge
+	// session is set up as ours (see the handler for PROCESSING_QUERY) . Only
+	// queries without any other session state are hedged
+	myconn->options.charset=client_myds->myconn->options.charset;
+	myconn->options.autocommit=client_myds->myconn->options.autocommit;
+	myconn->options.max_allowed_pkt=client_myds->myconn->options.max_allowed_pkt;
+	myconn->options.server_capabilities=client_myds->myconn->options.server_capabilities;
+	newsess->autocommit=autocommit;
+	newsess->client_myds->attach_connection(myconn);
+	newsess->client_myds->myprot.init(&newsess->client_myds, newsess->client_myds->myconn->userinfo, newsess);
+	newsess->to_process=1;
+	newsess->default_hostgroup=default_hostgroup;
+	newsess->mirror_hostgroup=current_hostgroup; // same hostgroup ...
+	newsess->hedge_exclude=myds->myconn->parent; // ... but another server
+	newsess->mirror_flagOUT=-1; // the query rules are not processed again
+	newsess->default_schema=strdup(default_schema);
+	newsess->mirror=true;
+	newsess->hedge_parent=this;
+	hedge_sess=newsess;
+	// the query sent to the backend, rewritten by the query rules if needed
+	newsess->mirrorPkt.size=sizeof(mysql_hdr)+1+query_size;
+	newsess->mirrorPkt.ptr=l_alloc(newsess->mirrorPkt.size);
+	mysql_hdr myhdr;
+	myhdr.pkt_id=0;
+	myhdr.pkt_length=1+query_size;
+	memcpy(newsess->mirrorPkt.ptr,&myhdr,sizeof(mysql_hdr));
+	((unsigned char *)newsess->mirrorPkt.ptr)[sizeof(mysql_hdr)]=_MYSQL_COM_QUERY;
+	memcpy((char *)newsess->mirrorPkt.ptr+sizeof(mysql_hdr)+1,myds->mysql_real_query.QueryPtr,query_size);
+	__sync_fetch_and_add(&hedge_rule->hedged,1);
+	newsess->handler(); // execute immediately
+	newsess->to_process=0;
+}
+
+// called in the hedge session when its query completed successfully
+void MySQL_Session::handler___status_PROCESSING_QUERY___deliver_hedge_result() {
+	MySQL_Session *sess=hedge_parent;
+	sess->hedge_result=client_myds->PSarrayOUT;
+	client_myds->PSarrayOUT=new PtrSizeArray();
+	sess->hedge_sess=NULL;
+	hedge_parent=NULL;
+	// the hedge session runs in the same thread of sess : a pause in the past
+	// has sess processed at the next loop
+	sess->pause_until=1;
+	unsigned char c=0;
+	if (write(thread->pipefd[1],&c,1)==-1) {
+		// the pipe is full, the thread will wake up anyway
+	}
+}
+
+// called in the hedge session while the response is buffered: a response
+// larger than mysql-threshold_resultset_size is not hedged, as it would be
+// kept in memory until the query completes. Returns true if cancelled
+bool MySQL_Session::handler___status_PROCESSING_QUERY___hedge_too_large(MySQL_Connection *myconn) {
+	unsigned long long size=0;
+	if (myconn->MyRS) {
+		size=myconn->MyRS->resultset_size;
+	}
+	for (unsigned int i=0; i<client_myds->PSarrayOUT->len && size <= (unsigned long long)mysql_thread___threshold_resultset_size; i++) {
+		size+=client_myds->PSarrayOUT->pdata[i].size;
+	}
+	if (size <= (unsigned long long)mysql_thread___threshold_resultset_size) {
+		return false;
+	}
+	// the original session keeps waiting for its own server, and kills this one
+	hedge_parent->hedge_cancel();
+	return true;
+}
+
+// stops hedging the current query: the hedge session, if any, is killed
+void MySQL_Session::hedge_cancel() {
+	hedge_at=0;
+	if (hedge_sess) {
+		hedge_sess->hedge_parent=NULL;
+		hedge_sess->killed=true;
+		hedge_sess=NULL;
+	}
+	if (hedge_result) {
+		PtrSize_t pkt;
+		while (hedge_result->len) {
+			hedge_result->remove_index_fast(0,&pkt);
+			l_free(pkt.size, pkt.ptr);
+		}
+		delete hedge_result;
+		hedge_result=NULL;
+	}
+}
+
 int MySQL_Session::handler_again___status_PINGING_SERVER() {
 	assert(mybe->server_myds->myconn);
 	MySQL_Data_Stream *myds=mybe->server_myds;
@@ -728,7 +921,7 @@ int MySQL_Session::handler_again___status_PINGING_SERVER() {
 	return 0;
 }
 
-void MySQL_Session::handler_again___new_thread_to_kill_connection() {
+void MySQL_Session::handler_again___kill_backend_query() {
 	MySQL_Data_Stream *myds=mybe->server_myds;
 	if (myds->myconn && myds->myconn->mysql) {
 		if (myds->killed_at==0) {
@@ -744,13 +937,7 @@ void MySQL_Session::handler_again___new_thread_to_kill_connection() {
 					auth_password=ui->password;
 				}
 			}
-			KillArgs *ka = new KillArgs(ui->username, auth_password, myds->myconn->parent->address, myds->myconn->parent->port, myds->myconn->mysql->thread_id);
-			pthread_attr_t attr;
-			pthread_attr_init(&attr);
-			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-			pthread_attr_setstacksize (&attr, 256*1024);
-			pthread_t pt;
-			pthread_create(&pt, &attr, &kill_query_thread, ka);
+			MyHGM->kill_query(ui->username, auth_password, myds->myconn->parent->address, myds->myconn->parent->port, myds->myconn->mysql->thread_id);
 		}
 	}
 }
@@ -1010,6 +1197,37 @@ bool MySQL_Session::handler_again___status_CHANGING_SCHEMA(int *_rc) {
 }
 
 
+// connection opened by the warm-up task: once connected it is returned to the pool
+int MySQL_Session::handler_again___status_WARMING_SERVER() {
+	assert(mybe->server_myds->myconn);
+	MySQL_Data_Stream *myds=mybe->server_myds;
+	MySQL_Connection *myconn=myds->myconn;
+	int rc=myconn->async_connect(myds->revents);
+	if (myds->mypolls==NULL) {
+		myds->assign_fd_from_mysql_conn();
+		thread->mypolls.add(POLLIN|POLLOUT, myds->fd, myds, thread->curtime);
+	}
+	if (rc==0) {
+		MyHGM->warm_connection_done(myconn,true);
+		myds->DSS=STATE_MARIADB_GENERIC;
+		myds->return_MySQL_Connection_To_Pool();
+		delete mybe->server_myds;
+		mybe->server_myds=NULL;
+		set_status(NONE);
+		return -1;
+	}
+	if (rc==-1 || rc==-2) {
+		MyHGM->warm_connection_done(myconn,false);
+		myds->destroy_MySQL_Connection_From_Pool(false);
+		myds->fd=0;
+		delete mybe->server_myds;
+		mybe->server_myds=NULL;
+		return -1;
+	}
+	// rc==1 , nothing to do for now
+	return 0;
+}
+
 bool MySQL_Session::handler_again___status_CONNECTING_SERVER(int *_rc) { 
 	//fprintf(stderr,"CONNECTING_SERVER\n");
 	if (mirror) {
@@ -1023,6 +1241,9 @@ bool MySQL_Session::handler_again___status_CONNECTING_SERVER(int *_rc) {
 				PROXY_TRACE();
 			}
 			char buf[256];
+			if (pool_waiter->waiting) {
+				MyHGM->cancel_MyConn_wait(pool_waiter);
+			}
 			sprintf(buf,"Max connect timeout reached while reaching hostgroup %d after %llums", current_hostgroup, (thread->curtime - CurrentQuery.start_time)/1000 );
 			client_myds->myprot.generate_pkt_ERR(true,NULL,NULL,1,9001,(char *)"HY000",buf);
 //					CurrentQuery.end();
@@ -1056,7 +1277,25 @@ bool MySQL_Session::handler_again___status_CONNECTING_SERVER(int *_rc) {
 		}		
 	}
 	if (mybe->server_myds->myconn==NULL) {
-		pause_until=thread->curtime+mysql_thread___connect_retries_delay*1000;
+		if (mysql_thread___circuit_breaker_error_pct && MyHGM->breaker_all_open(mybe->hostgroup_id)) {
+			// fail fast: the circuit breakers of all the servers of the hostgroup are open
+			char buf[256];
+			if (pool_waiter->waiting) {
+				MyHGM->cancel_MyConn_wait(pool_waiter);
+			}
+			sprintf(buf,"All the servers of hostgroup %d are unavailable: circuit breaker open", current_hostgroup);
+			client_myds->myprot.generate_pkt_ERR(true,NULL,NULL,1,9004,(char *)"HY000",buf);
+			RequestEnd(mybe->server_myds);
+			while (previous_status.size()) {
+				previous_status.pop();
+			}
+			mybe->server_myds->max_connect_time=0;
+			NEXT_IMMEDIATE_NEW(WAITING_CLIENT_DATA);
+		}
+		if (pool_waiter->waiting==false) {
+			// if queued, get_MyConn_from_pool() already set pause_until
+			pause_until=thread->curtime+mysql_thread___connect_retries_delay*1000;
+		}
 		//goto __exit_DSS__STATE_NOT_INITIALIZED;
 		*_rc=1;
 		return false;
@@ -1344,6 +1583,7 @@ int MySQL_Session::handler() {
 	unsigned char c;
 
 	active_transactions=NumActiveTransactions();
+	CurrentQuery.phases_update(thread->curtime);
 
 //	FIXME: Sessions without frontend are an ugly hack
 	if (session_fast_forward==false) {
@@ -1371,6 +1611,17 @@ int MySQL_Session::handler() {
 
 __get_pkts_from_client:
 
+	if (auth_pkt.ptr) {
+		// the auth thread verified the password, or it took too long: process
+		// the handshake response again
+		pause_until=0;
+		pkt.ptr=auth_pkt.ptr;
+		pkt.size=auth_pkt.size;
+		auth_pkt.ptr=NULL;
+		auth_pkt.size=0;
+		handler___status_CONNECTING_CLIENT___STATE_SERVER_HANDSHAKE(&pkt, &wrong_pass);
+	}
+
 	//for (j=0; j<client_myds->PSarrayIN->len;) {
 	// implement a more complex logic to run even in case of mirror
 	// if client_myds , this is a regular client
@@ -1482,6 +1733,9 @@ __get_pkts_from_client:
 										thread->status_variables.query_processor_time=thread->status_variables.query_processor_time +
 											(endt.tv_sec*1000000000+endt.tv_nsec) -
 											(begint.tv_sec*1000000000+begint.tv_nsec);
+										CurrentQuery.phase_time[QUERY_PHASE_RULES]+=(
+											(endt.tv_sec*1000000000+endt.tv_nsec) -
+											(begint.tv_sec*1000000000+begint.tv_nsec))/1000;
 									}
 									assert(qpo);	// GloQPro->process_mysql_query() should always return a qpo
 									rc_break=handler___status_WAITING_CLIENT_DATA___STATE_SLEEP___MYSQL_COM_QUERY_qpo(&pkt);
@@ -1848,6 +2102,14 @@ handler_again:
 			}
 			break;
 
+		case WARMING_SERVER:
+			{
+				int rc=handler_again___status_WARMING_SERVER();
+				if (rc==-1) // connected or failed, the session is no longer needed
+					return -1;
+			}
+			break;
+
 		case PROCESSING_STMT_PREPARE:
 		case PROCESSING_STMT_EXECUTE:
 		case PROCESSING_QUERY:
@@ -1855,19 +2117,67 @@ handler_again:
 			if (pause_until > thread->curtime) {
 				return 0;
 			}
+			if (qpo->qos_len && qpo->qos_admitted==false && mirror==false) {
+				// the query matched rules with rate limits: it is admitted before getting a connection
+				int qos_rule_id=0;
+				unsigned long long qos_wait_until=0;
+				int rc=GloQPro->qos_admit(qpo, this, thread->curtime, &qos_rule_id, &qos_wait_until);
+				if (rc==0) {
+					// queued on the rule: the session is woken up when it can be admitted
+					pause_until=qos_wait_until;
+					return 0;
+				}
+				if (rc==-1) {
+					char buf[128];
+					sprintf(buf,"Query rejected by the rate limits of query rule %d", qos_rule_id);
+					client_myds->myprot.generate_pkt_ERR(true,NULL,NULL,1,9003,(char *)"HY000",buf);
+					RequestEnd(mybe->server_myds);
+					while (previous_status.size()) {
+						previous_status.pop();
+					}
+					NEXT_IMMEDIATE(WAITING_CLIENT_DATA);
+				}
+			}
 			if (mysql_thread___connect_timeout_server_max) {
 				if (mybe->server_myds->max_connect_time==0)
 					mybe->server_myds->max_connect_time=thread->curtime+mysql_thread___connect_timeout_server_max*1000;
 			} else {
 				mybe->server_myds->max_connect_time=0;
 			}
+			if (hedge_result) {
+				// the hedge session got the whole response before we got the first packet
+				MySQL_Data_Stream *myds=mybe->server_myds;
+				handler_again___kill_backend_query();
+				hedge_rule->add_sample(thread->curtime-hedge_sent_at); // a lower bound
+				hedge_sent_at=0;
+				__sync_fetch_and_add(&hedge_rule->won,1);
+				if (client_myds->PSarrayOUT->len==0) {
+					// the buffer is handed over, not copied
+					PtrSizeArray *tmp=client_myds->PSarrayOUT;
+					client_myds->PSarrayOUT=hedge_result;
+					hedge_result=tmp; // empty, freed by hedge_cancel()
+				} else {
+					client_myds->PSarrayOUT->copy_add(hedge_result,0,hedge_result->len);
+					while (hedge_result->len) hedge_result->remove_index(hedge_result->len-1,NULL);
+				}
+				hedge_cancel();
+				// the connection is in the middle of a query: it can't be reused
+				myds->destroy_MySQL_Connection_From_Pool(false);
+				myds->fd=0;
+				myds->DSS=STATE_NOT_INITIALIZED;
+				RequestEnd(myds);
+				while (previous_status.size()) {
+					previous_status.pop();
+				}
+				NEXT_IMMEDIATE(WAITING_CLIENT_DATA);
+			}
 			if (
 				(mybe->server_myds->myconn && mybe->server_myds->myconn->async_state_machine!=ASYNC_IDLE && mybe->server_myds->wait_until && thread->curtime >= mybe->server_myds->wait_until)
 				// query timed out
 				||
 				(killed==true) // session was killed by admin
 			) {
-				handler_again___new_thread_to_kill_connection();
+				handler_again___kill_backend_query();
 			}
 			if (mybe->server_myds->DSS==STATE_NOT_INITIALIZED) {
 				// we don't have a backend yet
@@ -1900,7 +2210,7 @@ handler_again:
 					if (handler_again___verify_backend_user_schema()) {
 						goto handler_again;
 					}
-					if (mirror==false) { // do not care about autocommit and charset if mirror
+					if (mirror==false || hedge_parent) { // do not care about autocommit and charset if mirror, unless hedge
 						if (handler_again___verify_init_connect()) {
 							goto handler_again;
 						}
@@ -1950,6 +2260,20 @@ handler_again:
 							mybe->server_myds->wait_until+=def_query_timeout*1000;
 						}
 					}
+					backend_query_sent_at=thread->curtime;
+					hedge_at=0;
+					hedge_sent_at=0;
+					if (
+						mirror==false && status==PROCESSING_QUERY && qpo && qpo->hedge
+						&& CurrentQuery.MyComQueryCmd==MYSQL_COM_QUERY_SELECT
+						&& memchr(myds->mysql_real_query.QueryPtr,';',myds->mysql_real_query.QuerySize-1)==NULL // no multi statements
+						&& autocommit==true && myconn->IsActiveTransaction()==false && myconn->MultiplexDisabled()==false
+					) {
+						// only reads outside transactions can be hedged
+						hedge_rule=qpo->hedge;
+						hedge_sent_at=thread->curtime;
+						hedge_at=hedge_sent_at+hedge_rule->delay_us(mysql_thread___hedge_delay_percentile);
+					}
 				}
 				int rc;
 				timespec begint;
@@ -1999,10 +2323,24 @@ handler_again:
 				thread->status_variables.backend_query_time=thread->status_variables.backend_query_time +
 					(endt.tv_sec*1000000000+endt.tv_nsec) -
 					(begint.tv_sec*1000000000+begint.tv_nsec);
+				if (hedge_sent_at) {
+					if (rc!=1 || myconn->MyRS) {
+						// the first packet arrived
+						hedge_rule->add_sample(thread->curtime-hedge_sent_at);
+						hedge_sent_at=0;
+						hedge_cancel();
+					} else {
+						if (hedge_at && thread->curtime >= hedge_at) {
+							hedge_at=0;
+							handler___status_PROCESSING_QUERY___create_hedge_session();
+						}
+					}
+				}
 //				if (myconn->async_state_machine==ASYNC_QUERY_END) {
 				if (rc==0) {
 					// FIXME: deprecate old MySQL_Result_to_MySQL_wire , not completed yet
 					//MySQL_Result_to_MySQL_wire(myconn->mysql,myconn->mysql_result,&client_myds->myprot);
+					myconn->parent->breaker_report(false, thread->curtime-backend_query_sent_at);
 
 
 					// check if multiplexing needs to be disabled
@@ -2018,6 +2356,9 @@ handler_again:
 					switch (status) {
 						case PROCESSING_QUERY:
 							MySQL_Result_to_MySQL_wire(myconn->mysql, myconn->MyRS);
+							if (hedge_parent) {
+								handler___status_PROCESSING_QUERY___deliver_hedge_result();
+							}
 							break;
 						case PROCESSING_STMT_PREPARE:
 							{
@@ -2126,6 +2467,16 @@ handler_again:
 				} else {
 					if (rc==-1) {
 						CurrentQuery.mysql_stmt=NULL; // immediately reset mysql_stmt
+						{
+							// only the errors caused by the server, not by the query, count for its circuit breaker
+							int e=mysql_errno(myconn->mysql);
+							bool srv_err=(
+								e > 2000 // broken connection
+								|| e==1047 || e==1053 || e==1290 // not ready, shutting down, read-only
+								|| (e==1317 && myds->killed_at && killed==false) // query timeout
+							);
+							myconn->parent->breaker_report(srv_err, thread->curtime-backend_query_sent_at);
+						}
 						// the query failed
 						/* placeholder. This may be releant for #740
 						switch(status) {
@@ -2324,6 +2675,9 @@ handler_again:
 							// rc==1 , query is still running
 							// start sending to frontend if mysql_thread___threshold_resultset_size is reached
 							case 1:
+								if (hedge_parent && handler___status_PROCESSING_QUERY___hedge_too_large(myconn)) {
+									break;
+								}
 								if (myconn->MyRS && myconn->MyRS->result && myconn->MyRS->resultset_size > (unsigned int) mysql_thread___threshold_resultset_size) {
 									myconn->MyRS->get_resultset(client_myds->PSarrayOUT);
 								}
@@ -2331,6 +2685,9 @@ handler_again:
 							// rc==2 : a multi-resultset (or multi statement) was detected, and the current statement is completed
 							case 2:
 								MySQL_Result_to_MySQL_wire(myconn->mysql, myconn->MyRS);
+								if (hedge_parent) {
+									handler___status_PROCESSING_QUERY___hedge_too_large(myconn);
+								}
 								  if (myconn->MyRS) { // we also need to clear MyRS, so that the next staement will recreate it if needed
 										delete myconn->MyRS;
 										myconn->MyRS=NULL;
@@ -2340,6 +2697,9 @@ handler_again:
 							// rc==3 , a multi statement query is still running
 							// start sending to frontend if mysql_thread___threshold_resultset_size is reached
 							case 3:
+								if (hedge_parent && handler___status_PROCESSING_QUERY___hedge_too_large(myconn)) {
+									break;
+								}
 								if (myconn->MyRS && myconn->MyRS->result && myconn->MyRS->resultset_size > (unsigned int) mysql_thread___threshold_resultset_size) {
 									myconn->MyRS->get_resultset(client_myds->PSarrayOUT);
 								}
@@ -2548,8 +2908,16 @@ void MySQL_Session::handler___status_CHANGING_USER_CLIENT___STATE_CLIENT_HANDSHA
 }
 
 void MySQL_Session::handler___status_CONNECTING_CLIENT___STATE_SERVER_HANDSHAKE(PtrSize_t *pkt, bool *wrong_pass) {
+	bool auth_pending=false;
+	bool auth_ok=client_myds->myprot.process_pkt_handshake_response((unsigned char *)pkt->ptr,pkt->size,(admin==false ? &auth_pending : NULL));
+	if (auth_pending) {
+		// the password is verified by an auth thread, that wakes up the session
+		auth_pkt.ptr=pkt->ptr;
+		auth_pkt.size=pkt->size;
+		return;
+	}
 	if ( 
-		(client_myds->myprot.process_pkt_handshake_response((unsigned char *)pkt->ptr,pkt->size)==true) 
+		(auth_ok==true) 
 		&&
 		( (default_hostgroup<0 && admin==true) || (default_hostgroup>=0 && admin==false) || strncmp(client_myds->myconn->userinfo->username,mysql_thread___monitor_username,strlen(mysql_thread___monitor_username))==0 ) // Do not delete this line. See bug #492
 	)	{
@@ -2797,6 +3165,7 @@ bool MySQL_Session::handler___status_WAITING_CLIENT_DATA___STATE_SLEEP___MYSQL_C
 		unsigned char *c=(unsigned char *)pkt->ptr+sizeof(mysql_hdr);
 		*c=(unsigned char)_MYSQL_COM_QUERY; // set command type
 		memcpy((unsigned char *)pkt->ptr+sizeof(mysql_hdr)+1,qpo->new_query->data(),qpo->new_query->length()); // copy query
+		unsigned long long rules_time=CurrentQuery.phase_time[QUERY_PHASE_RULES];
 		CurrentQuery.query_parser_free();
 		CurrentQuery.begin((unsigned char *)pkt->ptr,pkt->size,true);
 		delete qpo->new_query;
@@ -2805,6 +3174,9 @@ bool MySQL_Session::handler___status_WAITING_CLIENT_DATA___STATE_SLEEP___MYSQL_C
 		thread->status_variables.query_processor_time=thread->status_variables.query_processor_time +
 			(endt.tv_sec*1000000000+endt.tv_nsec) -
 			(begint.tv_sec*1000000000+begint.tv_nsec);
+		CurrentQuery.phase_time[QUERY_PHASE_RULES]=rules_time + (
+			(endt.tv_sec*1000000000+endt.tv_nsec) -
+			(begint.tv_sec*1000000000+begint.tv_nsec))/1000;
 	}
 
 	if (pkt->size > (unsigned int) mysql_thread___max_allowed_packet) {
@@ -2972,9 +3344,23 @@ void MySQL_Session::handler___client_DSS_QUERY_SENT___server_DSS_NOT_INITIALIZED
 		i--;
 		}
 #else
-		mc=thread->get_MyConn_local(mybe->hostgroup_id); // experimental , #644
+		if (pool_waiter->waiting==false && hedge_exclude==NULL) {
+			mc=thread->get_MyConn_local(mybe->hostgroup_id); // experimental , #644
+		}
 		if (mc==NULL) {
-			mc=MyHGM->get_MyConn_from_pool(mybe->hostgroup_id);
+			if (mirror==false) {
+				// without free connections the session waits in queue
+				pool_waiter->deadline=mybe->server_myds->max_connect_time;
+				if (pool_waiter->waiting==false) {
+					// the priority class can't change while queued
+					pool_waiter->priority=( (qpo->priority >= 0 && qpo->priority < MYCONN_WAITER_PRIORITIES) ? qpo->priority : MYCONN_WAITER_PRIORITY_DEFAULT );
+				}
+				mc=MyHGM->get_MyConn_from_pool(mybe->hostgroup_id, pool_waiter);
+			} else {
+				// mirror and hedge sessions don't queue: they only use spare capacity.
+				// A hedge session doesn't use the server of the original session
+				mc=MyHGM->get_MyConn_from_pool(mybe->hostgroup_id, NULL, hedge_exclude);
+			}
 		} else {
 			thread->status_variables.ConnPool_get_conn_immediate++;
 		}
@@ -3207,6 +3593,7 @@ void MySQL_Session::RequestEnd(MySQL_Data_Stream *myds) {
 	// we need to access statistics before calling CurrentQuery.end()
 	// so we track the time here
 	CurrentQuery.end_time=thread->curtime;
+	CurrentQuery.phases_update(thread->curtime);
 
 	if (qpo) {
 		if (qpo->log==1) {
@@ -3220,6 +3607,8 @@ void MySQL_Session::RequestEnd(MySQL_Data_Stream *myds) {
 	//	qpo=NULL;
 	//}
 	GloQPro->delete_QP_out(qpo);
+	hedge_sent_at=0;
+	hedge_cancel();
 	// if there is an associated myds, clean its status
 	if (myds) {
 		// if there is a mysql connection, clean its status
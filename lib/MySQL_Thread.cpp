@@ -216,6 +216,7 @@ static char * mysql_thread_variables_names[]= {
 	(char *)"connect_timeout_server_max",
 	(char *)"eventslog_filename",
 	(char *)"eventslog_filesize",
+	(char *)"eventslog_phases",
 	(char *)"default_charset",
 	(char *)"free_connections_pct",
 	(char *)"session_idle_ms",
@@ -259,6 +260,18 @@ static char * mysql_thread_variables_names[]= {
 	(char *)"query_cache_size_MB",
 	(char *)"ping_interval_server_msec",
 	(char *)"ping_timeout_server",
+	(char *)"connection_warming_interval_msec",
+	(char *)"connect_rate_limit_per_server",
+	(char *)"connpool_priority_aging_ms",
+	(char *)"hedge_delay_percentile",
+	(char *)"circuit_breaker_error_pct",
+	(char *)"circuit_breaker_min_requests",
+	(char *)"circuit_breaker_window_ms",
+	(char *)"circuit_breaker_slow_query_ms",
+	(char *)"circuit_breaker_open_ms",
+	(char *)"circuit_breaker_half_open_probes",
+	(char *)"auth_threads",
+	(char *)"threads_affinity",
 	(char *)"default_schema",
 	(char *)"poll_timeout",
 	(char *)"poll_timeout_on_failure",
@@ -269,6 +282,7 @@ static char * mysql_thread_variables_names[]= {
 	(char *)"commands_stats",
 	(char *)"query_digests",
 	(char *)"query_digests_lowercase",
+	(char *)"query_digests_phases",
 	(char *)"servers_stats",
 	(char *)"default_reconnect",
 	(char *)"session_debug",
@@ -299,6 +313,8 @@ MySQL_Threads_Handler::MySQL_Threads_Handler() {
 	stacksize=0;
 	shutdown_=0;
 	spinlock_rwlock_init(&rwlock);
+	CPU_ZERO(&process_cpuset);
+	sched_getaffinity(0, sizeof(process_cpuset), &process_cpuset);
 	//spinlock_rwlock_init(&rwlock_idles);
 	//spinlock_rwlock_init(&rwlock_resumes);
 	//idle_mysql_sessions = new PtrArray();
@@ -349,12 +365,25 @@ MySQL_Threads_Handler::MySQL_Threads_Handler() {
 	variables.init_connect=NULL;
 	variables.ping_interval_server_msec=10000;
 	variables.ping_timeout_server=200;
+	variables.connection_warming_interval_msec=1000;
+	variables.connect_rate_limit_per_server=0;
+	variables.connpool_priority_aging_ms=1000;
+	variables.hedge_delay_percentile=95;
+	variables.circuit_breaker_error_pct=0;
+	variables.circuit_breaker_min_requests=20;
+	variables.circuit_breaker_window_ms=10000;
+	variables.circuit_breaker_slow_query_ms=0;
+	variables.circuit_breaker_open_ms=5000;
+	variables.circuit_breaker_half_open_probes=3;
+	variables.auth_threads=0;
+	variables.threads_affinity=false;
 	variables.default_schema=strdup((char *)"information_schema");
 	variables.default_charset=33;
 	variables.interfaces=strdup((char *)"");
 	variables.server_version=strdup((char *)"5.5.30");
 	variables.eventslog_filename=strdup((char *)""); // proxysql-mysql-eventslog is recommended
 	variables.eventslog_filesize=100*1024*1024;
+	variables.eventslog_phases=false;
 //	variables.server_capabilities=CLIENT_FOUND_ROWS | CLIENT_PROTOCOL_41 | CLIENT_IGNORE_SIGPIPE | CLIENT_TRANSACTIONS | CLIENT_SECURE_CONNECTION | CLIENT_CONNECT_WITH_DB | CLIENT_SSL;
 	variables.server_capabilities=CLIENT_FOUND_ROWS | CLIENT_PROTOCOL_41 | CLIENT_IGNORE_SIGPIPE | CLIENT_TRANSACTIONS | CLIENT_SECURE_CONNECTION | CLIENT_CONNECT_WITH_DB;
 	variables.poll_timeout=2000;
@@ -367,6 +396,7 @@ MySQL_Threads_Handler::MySQL_Threads_Handler() {
 	variables.enforce_autocommit_on_reads=false;
 	variables.query_digests=true;
 	variables.query_digests_lowercase=false;
+	variables.query_digests_phases=false;
 	variables.sessions_sort=true;
 	variables.session_idle_show_processlist=false;
 	variables.servers_stats=true;
@@ -380,6 +410,10 @@ MySQL_Threads_Handler::MySQL_Threads_Handler() {
 #endif /*debug */
 	__global_MySQL_Thread_Variables_version=1;
 	MLM = new MySQL_Listeners_Manager();
+	variables_readers = new PtrArray();
+	pthread_mutex_init(&variables_snapshot_mutex,NULL);
+	published_variables=NULL;
+	commit();
 }
 
 
@@ -466,11 +500,97 @@ void MySQL_Threads_Handler::wrunlock() {
 	spin_wrunlock(&rwlock);
 }
 
+static char * variables_snapshot_string(char *s, bool empty_is_null) {
+	if (s==NULL || (empty_is_null && strlen(s)==0)) {
+		return NULL;
+	}
+	return strdup(s);
+}
+
+static void free_variables_snapshot(mysql_threads_variables_snapshot_t *s) {
+	if (s->v.monitor_username) free(s->v.monitor_username);
+	if (s->v.monitor_password) free(s->v.monitor_password);
+	if (s->v.default_schema) free(s->v.default_schema);
+	if (s->v.server_version) free(s->v.server_version);
+	if (s->v.init_connect) free(s->v.init_connect);
+	if (s->v.eventslog_filename) free(s->v.eventslog_filename);
+	if (s->v.ssl_p2s_ca) free(s->v.ssl_p2s_ca);
+	if (s->v.ssl_p2s_cert) free(s->v.ssl_p2s_cert);
+	if (s->v.ssl_p2s_key) free(s->v.ssl_p2s_key);
+	if (s->v.ssl_p2s_cipher) free(s->v.ssl_p2s_cipher);
+	free(s);
+}
+
+// Threads don't read MySQL_Threads_Handler::variables directly: commit() copies
+// them into an immutable snapshot and publishes its pointer, and
+// MySQL_Thread::refresh_variables() picks it up without locks or lookups by name.
+// Every MySQL_Thread announces the snapshot it is using in variables_snapshot
+// (a hazard pointer): a replaced snapshot is freed only once no thread uses it
 void MySQL_Threads_Handler::commit() {
+	mysql_threads_variables_snapshot_t *s=(mysql_threads_variables_snapshot_t *)malloc(sizeof(mysql_threads_variables_snapshot_t));
+	s->v=variables;
+	s->v.monitor_username=variables_snapshot_string(variables.monitor_username,false);
+	s->v.monitor_password=variables_snapshot_string(variables.monitor_password,false);
+	s->v.default_schema=variables_snapshot_string(variables.default_schema,false);
+	s->v.interfaces=NULL; // not used by threads
+	s->v.server_version=variables_snapshot_string(variables.server_version,false);
+	s->v.init_connect=variables_snapshot_string(variables.init_connect,true);
+	s->v.eventslog_filename=variables_snapshot_string(variables.eventslog_filename,false);
+	s->v.ssl_p2s_ca=variables_snapshot_string(variables.ssl_p2s_ca,true);
+	s->v.ssl_p2s_cert=variables_snapshot_string(variables.ssl_p2s_cert,true);
+	s->v.ssl_p2s_key=variables_snapshot_string(variables.ssl_p2s_key,true);
+	s->v.ssl_p2s_cipher=variables_snapshot_string(variables.ssl_p2s_cipher,true);
+	pthread_mutex_lock(&variables_snapshot_mutex);
+	s->version=__sync_add_and_fetch(&__global_MySQL_Thread_Variables_version,0)+1;
+	mysql_threads_variables_snapshot_t *old=published_variables;
+	__sync_synchronize();
+	published_variables=s;
+	// the new version is visible only after the snapshot is
 	__sync_add_and_fetch(&__global_MySQL_Thread_Variables_version,1);
+	if (old) {
+		retired_variables.push_back(old);
+	}
+	free_retired_variables();
+	pthread_mutex_unlock(&variables_snapshot_mutex);
 	proxy_debug(PROXY_DEBUG_MYSQL_SERVER, 1, "Increasing version number to %d - all threads will notice this and refresh their variables\n", __global_MySQL_Thread_Variables_version);
 }
 
+// must be called with variables_snapshot_mutex held
+void MySQL_Threads_Handler::free_retired_variables() {
+	__sync_synchronize();
+	std::vector<mysql_threads_variables_snapshot_t *>::iterator it=retired_variables.begin();
+	while (it!=retired_variables.end()) {
+		mysql_threads_variables_snapshot_t *s=*it;
+		bool in_use=false;
+		for (unsigned int i=0; i<variables_readers->len && in_use==false; i++) {
+			MySQL_Thread *thr=(MySQL_Thread *)variables_readers->index(i);
+			if (thr->variables_snapshot==s) {
+				in_use=true;
+			}
+		}
+		if (in_use) {
+			it++;
+		} else {
+			free_variables_snapshot(s);
+			it=retired_variables.erase(it);
+		}
+	}
+}
+
+void MySQL_Threads_Handler::register_variables_reader(MySQL_Thread *thr) {
+	pthread_mutex_lock(&variables_snapshot_mutex);
+	variables_readers->add(thr);
+	pthread_mutex_unlock(&variables_snapshot_mutex);
+}
+
+void MySQL_Threads_Handler::unregister_variables_reader(MySQL_Thread *thr) {
+	pthread_mutex_lock(&variables_snapshot_mutex);
+	variables_readers->remove(thr);
+	thr->variables_snapshot=NULL;
+	free_retired_variables();
+	pthread_mutex_unlock(&variables_snapshot_mutex);
+}
+
 char * MySQL_Threads_Handler::get_variable_string(char *name) {
 	if (!strncasecmp(name,"monitor_",8)) {
 		if (!strcasecmp(name,"monitor_username")) return strdup(variables.monitor_username);
@@ -563,6 +683,7 @@ int MySQL_Threads_Handler::get_variable_int(char *name) {
 	if (!strcasecmp(name,"connect_timeout_server_max")) return (int)variables.connect_timeout_server_max;
 	if (!strcasecmp(name,"connect_retries_delay")) return (int)variables.connect_retries_delay;
 	if (!strcasecmp(name,"eventslog_filesize")) return (int)variables.eventslog_filesize;
+	if (!strcasecmp(name,"eventslog_phases")) return (int)variables.eventslog_phases;
 	if (!strcasecmp(name,"max_allowed_packet")) return (int)variables.max_allowed_packet;
 	if (!strcasecmp(name,"max_transaction_time")) return (int)variables.max_transaction_time;
 	if (!strcasecmp(name,"threshold_query_length")) return (int)variables.threshold_query_length;
@@ -582,6 +703,18 @@ int MySQL_Threads_Handler::get_variable_int(char *name) {
 	if (!strcasecmp(name,"session_idle_ms")) return (int)variables.session_idle_ms;
 	if (!strcasecmp(name,"ping_interval_server_msec")) return (int)variables.ping_interval_server_msec;
 	if (!strcasecmp(name,"ping_timeout_server")) return (int)variables.ping_timeout_server;
+	if (!strcasecmp(name,"connection_warming_interval_msec")) return (int)variables.connection_warming_interval_msec;
+	if (!strcasecmp(name,"connect_rate_limit_per_server")) return (int)variables.connect_rate_limit_per_server;
+	if (!strcasecmp(name,"connpool_priority_aging_ms")) return (int)variables.connpool_priority_aging_ms;
+	if (!strcasecmp(name,"hedge_delay_percentile")) return (int)variables.hedge_delay_percentile;
+	if (!strcasecmp(name,"circuit_breaker_error_pct")) return (int)variables.circuit_breaker_error_pct;
+	if (!strcasecmp(name,"circuit_breaker_min_requests")) return (int)variables.circuit_breaker_min_requests;
+	if (!strcasecmp(name,"circuit_breaker_window_ms")) return (int)variables.circuit_breaker_window_ms;
+	if (!strcasecmp(name,"circuit_breaker_slow_query_ms")) return (int)variables.circuit_breaker_slow_query_ms;
+	if (!strcasecmp(name,"circuit_breaker_open_ms")) return (int)variables.circuit_breaker_open_ms;
+	if (!strcasecmp(name,"circuit_breaker_half_open_probes")) return (int)variables.circuit_breaker_half_open_probes;
+	if (!strcasecmp(name,"auth_threads")) return (int)variables.auth_threads;
+	if (!strcasecmp(name,"threads_affinity")) return (int)variables.threads_affinity;
 	if (!strcasecmp(name,"have_compress")) return (int)variables.have_compress;
 	if (!strcasecmp(name,"client_found_rows")) return (int)variables.client_found_rows;
 	if (!strcasecmp(name,"multiplexing")) return (int)variables.multiplexing;
@@ -590,6 +723,7 @@ int MySQL_Threads_Handler::get_variable_int(char *name) {
 	if (!strcasecmp(name,"commands_stats")) return (int)variables.commands_stats;
 	if (!strcasecmp(name,"query_digests")) return (int)variables.query_digests;
 	if (!strcasecmp(name,"query_digests_lowercase")) return (int)variables.query_digests_lowercase;
+	if (!strcasecmp(name,"query_digests_phases")) return (int)variables.query_digests_phases;
 	if (!strcasecmp(name,"sessions_sort")) return (int)variables.sessions_sort;
 	if (!strcasecmp(name,"session_idle_show_processlist")) return (int)variables.session_idle_show_processlist;
 	if (!strcasecmp(name,"servers_stats")) return (int)variables.servers_stats;
@@ -834,6 +968,50 @@ char * MySQL_Threads_Handler::get_variable(char *name) {	// this is the public f
 		sprintf(intbuf,"%d",variables.ping_timeout_server);
 		return strdup(intbuf);
 	}
+	if (!strcasecmp(name,"connection_warming_interval_msec")) {
+		sprintf(intbuf,"%d",variables.connection_warming_interval_msec);
+		return strdup(intbuf);
+	}
+	if (!strcasecmp(name,"connect_rate_limit_per_server")) {
+		sprintf(intbuf,"%d",variables.connect_rate_limit_per_server);
+		return strdup(intbuf);
+	}
+	if (!strcasecmp(name,"connpool_priority_aging_ms")) {
+		sprintf(intbuf,"%d",variables.connpool_priority_aging_ms);
+		return strdup(intbuf);
+	}
+	if (!strcasecmp(name,"hedge_delay_percentile")) {
+		sprintf(intbuf,"%d",variables.hedge_delay_percentile);
+		return strdup(intbuf);
+	}
+	if (!strcasecmp(name,"circuit_breaker_error_pct")) {
+		sprintf(intbuf,"%d",variables.circuit_breaker_error_pct);
+		return strdup(intbuf);
+	}
+	if (!strcasecmp(name,"circuit_breaker_min_requests")) {
+		sprintf(intbuf,"%d",variables.circuit_breaker_min_requests);
+		return strdup(intbuf);
+	}
+	if (!strcasecmp(name,"circuit_breaker_window_ms")) {
+		sprintf(intbuf,"%d",variables.circuit_breaker_window_ms);
+		return strdup(intbuf);
+	}
+	if (!strcasecmp(name,"circuit_breaker_slow_query_ms")) {
+		sprintf(intbuf,"%d",variables.circuit_breaker_slow_query_ms);
+		return strdup(intbuf);
+	}
+	if (!strcasecmp(name,"circuit_breaker_open_ms")) {
+		sprintf(intbuf,"%d",variables.circuit_breaker_open_ms);
+		return strdup(intbuf);
+	}
+	if (!strcasecmp(name,"circuit_breaker_half_open_probes")) {
+		sprintf(intbuf,"%d",variables.circuit_breaker_half_open_probes);
+		return strdup(intbuf);
+	}
+	if (!strcasecmp(name,"auth_threads")) {
+		sprintf(intbuf,"%d",variables.auth_threads);
+		return strdup(intbuf);
+	}
 	if (!strcasecmp(name,"poll_timeout")) {
 		sprintf(intbuf,"%d",variables.poll_timeout);
 		return strdup(intbuf);
@@ -855,6 +1033,9 @@ char * MySQL_Threads_Handler::get_variable(char *name) {	// this is the public f
 		return strdup((variables.session_debug ? "true" : "false"));
 	}
 #endif /* DEBUG */
+	if (!strcasecmp(name,"threads_affinity")) {
+		return strdup((variables.threads_affinity ? "true" : "false"));
+	}
 	if (!strcasecmp(name,"have_compress")) {
 		return strdup((variables.have_compress ? "true" : "false"));
 	}
@@ -879,6 +1060,12 @@ char * MySQL_Threads_Handler::get_variable(char *name) {	// this is the public f
 	if (!strcasecmp(name,"query_digests_lowercase")) {
 		return strdup((variables.query_digests_lowercase ? "true" : "false"));
 	}
+	if (!strcasecmp(name,"query_digests_phases")) {
+		return strdup((variables.query_digests_phases ? "true" : "false"));
+	}
+	if (!strcasecmp(name,"eventslog_phases")) {
+		return strdup((variables.eventslog_phases ? "true" : "false"));
+	}
 	if (!strcasecmp(name,"sessions_sort")) {
 		return strdup((variables.sessions_sort ? "true" : "false"));
 	}
@@ -1239,6 +1426,105 @@ bool MySQL_Threads_Handler::set_variable(char *name, char *value) {	// this is t
 			return false;
 		}
 	}
+	if (!strcasecmp(name,"connection_warming_interval_msec")) {
+		int intv=atoi(value);
+		if (intv >= 0 && intv <= 3600*1000) {
+			variables.connection_warming_interval_msec=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	if (!strcasecmp(name,"connect_rate_limit_per_server")) {
+		int intv=atoi(value);
+		if (intv >= 0 && intv <= 1000000) {
+			variables.connect_rate_limit_per_server=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	if (!strcasecmp(name,"connpool_priority_aging_ms")) { // read by MyHGC::next_waiter()
+		int intv=atoi(value);
+		if (intv >= 0 && intv <= 3600*1000) {
+			variables.connpool_priority_aging_ms=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	if (!strcasecmp(name,"hedge_delay_percentile")) {
+		int intv=atoi(value);
+		if (intv >= 0 && intv <= 100) {
+			variables.hedge_delay_percentile=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	if (!strcasecmp(name,"circuit_breaker_error_pct")) { // read by MySrvC::breaker_report() and MyHGC::get_random_MySrvC()
+		int intv=atoi(value);
+		if (intv >= 0 && intv <= 100) {
+			variables.circuit_breaker_error_pct=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	if (!strcasecmp(name,"circuit_breaker_min_requests")) {
+		int intv=atoi(value);
+		if (intv >= 1 && intv <= 1000000) {
+			variables.circuit_breaker_min_requests=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	if (!strcasecmp(name,"circuit_breaker_window_ms")) {
+		int intv=atoi(value);
+		if (intv >= 100 && intv <= 3600*1000) {
+			variables.circuit_breaker_window_ms=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	if (!strcasecmp(name,"circuit_breaker_slow_query_ms")) {
+		int intv=atoi(value);
+		if (intv >= 0 && intv <= 3600*1000) {
+			variables.circuit_breaker_slow_query_ms=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	if (!strcasecmp(name,"circuit_breaker_open_ms")) {
+		int intv=atoi(value);
+		if (intv >= 10 && intv <= 3600*1000) {
+			variables.circuit_breaker_open_ms=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	if (!strcasecmp(name,"circuit_breaker_half_open_probes")) {
+		int intv=atoi(value);
+		if (intv >= 1 && intv <= 1000) {
+			variables.circuit_breaker_half_open_probes=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	if (!strcasecmp(name,"auth_threads")) { // read only at startup, see MySQL_Authentication::init()
+		int intv=atoi(value);
+		if (intv >= 0 && intv <= 16) {
+			variables.auth_threads=intv;
+			return true;
+		} else {
+			return false;
+		}
+	}
 	if (!strcasecmp(name,"shun_on_failures")) {
 		int intv=atoi(value);
 		if (intv >= 0 && intv <= 10000000) {
@@ -1506,6 +1792,17 @@ bool MySQL_Threads_Handler::set_variable(char *name, char *value) {	// this is t
 		}
 		return false;
 	}
+	if (!strcasecmp(name,"threads_affinity")) { // read only at startup, see create_thread()
+		if (strcasecmp(value,"true")==0 || strcasecmp(value,"1")==0) {
+			variables.threads_affinity=true;
+			return true;
+		}
+		if (strcasecmp(value,"false")==0 || strcasecmp(value,"0")==0) {
+			variables.threads_affinity=false;
+			return true;
+		}
+		return false;
+	}
 	if (!strcasecmp(name,"multiplexing")) {
 		if (strcasecmp(value,"true")==0 || strcasecmp(value,"1")==0) {
 			variables.multiplexing=true;
@@ -1576,6 +1873,28 @@ bool MySQL_Threads_Handler::set_variable(char *name, char *value) {	// this is t
 		}
 		return false;
 	}
+	if (!strcasecmp(name,"query_digests_phases")) {
+		if (strcasecmp(value,"true")==0 || strcasecmp(value,"1")==0) {
+			variables.query_digests_phases=true;
+			return true;
+		}
+		if (strcasecmp(value,"false")==0 || strcasecmp(value,"0")==0) {
+			variables.query_digests_phases=false;
+			return true;
+		}
+		return false;
+	}
+	if (!strcasecmp(name,"eventslog_phases")) {
+		if (strcasecmp(value,"true")==0 || strcasecmp(value,"1")==0) {
+			variables.eventslog_phases=true;
+			return true;
+		}
+		if (strcasecmp(value,"false")==0 || strcasecmp(value,"0")==0) {
+			variables.eventslog_phases=false;
+			return true;
+		}
+		return false;
+	}
 	if (!strcasecmp(name,"session_idle_show_processlist")) {
 		if (strcasecmp(value,"true")==0 || strcasecmp(value,"1")==0) {
 			variables.session_idle_show_processlist=true;
@@ -1666,11 +1985,60 @@ void MySQL_Threads_Handler::init(unsigned int num, size_t stack) {
 	mysql_threads_idles=(proxysql_mysql_thread_t *)malloc(sizeof(proxysql_mysql_thread_t)*num_threads);
 }
 
+// With mysql-threads_affinity, MySQL thread tn (and its idle thread) is pinned to the
+// tn-th CPU available to the process, and the auxiliary threads (Admin, Monitor,
+// Query Cache purge) to the CPUs left, if any. With tn<0 returns the CPUs of the
+// auxiliary threads. Returns false if threads should not be pinned
+bool MySQL_Threads_Handler::get_thread_cpuset(int tn, cpu_set_t *cpuset) {
+	if (variables.threads_affinity==false) {
+		return false;
+	}
+	std::vector<int> cpus;
+	for (int i=0; i<CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &process_cpuset)) {
+			cpus.push_back(i);
+		}
+	}
+	if (cpus.size() < 2) {
+		return false;
+	}
+	CPU_ZERO(cpuset);
+	if (tn >= 0) {
+		CPU_SET(cpus[tn % cpus.size()], cpuset);
+		return true;
+	}
+	unsigned int nt=(num_threads ? num_threads : DEFAULT_NUM_THREADS);
+	if (nt >= cpus.size()) {
+		return false; // no CPU is left for the auxiliary threads
+	}
+	for (unsigned int i=nt; i<cpus.size(); i++) {
+		CPU_SET(cpus[i], cpuset);
+	}
+	return true;
+}
+
+// called by the auxiliary threads: the threads they create inherit the affinity
+void MySQL_Threads_Handler::set_auxiliary_thread_affinity() {
+	cpu_set_t cpuset;
+	if (get_thread_cpuset(-1, &cpuset)) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+	}
+}
+
 proxysql_mysql_thread_t * MySQL_Threads_Handler::create_thread(unsigned int tn, void *(*start_routine) (void *), bool idles) {
-	if (idles==false) {
-		pthread_create(&mysql_threads[tn].thread_id, &attr, start_routine , &mysql_threads[tn]);
+	proxysql_mysql_thread_t *thr=(idles==false ? &mysql_threads[tn] : &mysql_threads_idles[tn]);
+	cpu_set_t cpuset;
+	if (get_thread_cpuset(tn, &cpuset)) {
+		// the thread starts on its CPU, so the memory it first touches (MySQL_Thread, sessions,
+		// buffers, connection cache) is allocated on the local NUMA node
+		pthread_attr_t thr_attr;
+		pthread_attr_init(&thr_attr);
+		pthread_attr_setstacksize(&thr_attr, stacksize);
+		pthread_attr_setaffinity_np(&thr_attr, sizeof(cpuset), &cpuset);
+		pthread_create(&thr->thread_id, &thr_attr, start_routine , thr);
+		pthread_attr_destroy(&thr_attr);
 	} else {
-		pthread_create(&mysql_threads_idles[tn].thread_id, &attr, start_routine , &mysql_threads_idles[tn]);
+		pthread_create(&thr->thread_id, &attr, start_routine , thr);
 	}
 	return NULL;
 }
@@ -1739,6 +2107,18 @@ MySQL_Threads_Handler::~MySQL_Threads_Handler() {
 	mysql_threads_idles=NULL;
 	delete MLM;
 	MLM=NULL;
+	pthread_mutex_lock(&variables_snapshot_mutex);
+	for (std::vector<mysql_threads_variables_snapshot_t *>::iterator it=retired_variables.begin(); it!=retired_variables.end(); ++it) {
+		free_variables_snapshot(*it);
+	}
+	retired_variables.clear();
+	if (published_variables) {
+		free_variables_snapshot(published_variables);
+		published_variables=NULL;
+	}
+	delete variables_readers;
+	variables_readers=NULL;
+	pthread_mutex_unlock(&variables_snapshot_mutex);
 }
 
 MySQL_Thread::~MySQL_Thread() {
@@ -1805,15 +2185,22 @@ MySQL_Thread::~MySQL_Thread() {
 	//if (my_idle_myds)
 	//	free(my_idle_myds);
 	GloQPro->end_thread();
+	GloMyAuth->end_thread();
 
-	if (mysql_thread___default_schema) { free(mysql_thread___default_schema); mysql_thread___default_schema=NULL; }
-	if (mysql_thread___server_version) { free(mysql_thread___server_version); mysql_thread___server_version=NULL; }
-	if (mysql_thread___init_connect) { free(mysql_thread___init_connect); mysql_thread___init_connect=NULL; }
-	if (mysql_thread___eventslog_filename) { free(mysql_thread___eventslog_filename); mysql_thread___eventslog_filename=NULL; }
-	if (mysql_thread___ssl_p2s_ca) { free(mysql_thread___ssl_p2s_ca); mysql_thread___ssl_p2s_ca=NULL; }
-	if (mysql_thread___ssl_p2s_cert) { free(mysql_thread___ssl_p2s_cert); mysql_thread___ssl_p2s_cert=NULL; }
-	if (mysql_thread___ssl_p2s_key) { free(mysql_thread___ssl_p2s_key); mysql_thread___ssl_p2s_key=NULL; }
-	if (mysql_thread___ssl_p2s_cipher) { free(mysql_thread___ssl_p2s_cipher); mysql_thread___ssl_p2s_cipher=NULL; }
+	// string variables point into the snapshot, that can be freed once this thread is unregistered
+	if (variables_reader && GloMTH) {
+		GloMTH->unregister_variables_reader(this);
+	}
+	mysql_thread___monitor_username=NULL;
+	mysql_thread___monitor_password=NULL;
+	mysql_thread___default_schema=NULL;
+	mysql_thread___server_version=NULL;
+	mysql_thread___init_connect=NULL;
+	mysql_thread___eventslog_filename=NULL;
+	mysql_thread___ssl_p2s_ca=NULL;
+	mysql_thread___ssl_p2s_cert=NULL;
+	mysql_thread___ssl_p2s_key=NULL;
+	mysql_thread___ssl_p2s_cipher=NULL;
 }
 
 
@@ -1914,13 +2301,249 @@ void MySQL_Thread::register_session(MySQL_Session *_sess, bool up_start) {
 	_sess->thread=this;
 	if (up_start)
 		_sess->start_time=curtime;
+	_sess->procslot=procslots.acquire();
+	_sess->procslot_cache.status=-1; // forces a full write of the slot
+	_sess->procslot_cache.myconn=NULL;
+	update_processlist_slot(_sess);
 	proxy_debug(PROXY_DEBUG_NET,1,"Thread=%p, Session=%p -- Registered new session\n", _sess->thread, _sess);
 }
 
 void MySQL_Thread::unregister_session(int idx) {
 	if (mysql_sessions==NULL) return;
 	proxy_debug(PROXY_DEBUG_NET,1,"Thread=%p, Session=%p -- Unregistered session\n", this, mysql_sessions->index(idx));
-	mysql_sessions->remove_index_fast(idx);
+	MySQL_Session *sess=(MySQL_Session *)mysql_sessions->remove_index_fast(idx);
+	if (sess->procslot>=0) {
+		procslots.release(sess->procslot);
+		sess->procslot=-1;
+	}
+}
+
+Processlist_Slots::Processlist_Slots() {
+	nchunks=0;
+	memset(chunks,0,sizeof(chunks));
+}
+
+Processlist_Slots::~Processlist_Slots() {
+	for (unsigned int i=0; i<nchunks; i++) {
+		free(chunks[i]);
+	}
+}
+
+// returns the index of a free slot, or -1 if the thread has too many sessions
+int Processlist_Slots::acquire() {
+	if (free_slots.empty()) {
+		if (nchunks==PROCESSLIST_MAX_CHUNKS) {
+			return -1;
+		}
+		Processlist_Slot *c=(Processlist_Slot *)calloc(PROCESSLIST_SLOTS_PER_CHUNK,sizeof(Processlist_Slot));
+		chunks[nchunks]=c;
+		for (int i=PROCESSLIST_SLOTS_PER_CHUNK-1; i>=0; i--) {
+			free_slots.push_back(nchunks*PROCESSLIST_SLOTS_PER_CHUNK+i);
+		}
+		// the chunk must be visible before readers see the new nchunks
+		__atomic_store_n(&nchunks, nchunks+1, __ATOMIC_RELEASE);
+	}
+	unsigned int idx=free_slots.back();
+	free_slots.pop_back();
+	return idx;
+}
+
+void Processlist_Slots::release(int idx) {
+	Processlist_Slot *s=slot(idx);
+	write_begin(s);
+	s->in_use=false;
+	write_end(s);
+	free_slots.push_back(idx);
+}
+
+// copies the slot into out , and returns false if the slot is not in use
+bool Processlist_Slots::read(unsigned int idx, Processlist_Slot *out) {
+	Processlist_Slot *s=slot(idx);
+	for (int retries=0; retries<1000; retries++) {
+		if (s->in_use==false) return false;
+		unsigned int seq1=__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq1 & 1) continue;
+		memcpy(out, (const void *)s, sizeof(Processlist_Slot));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq1 == __atomic_load_n(&s->seq, __ATOMIC_RELAXED)) {
+			return out->in_use;
+		}
+	}
+	return false;
+}
+
+static void processlist_sockaddr(struct sockaddr *addr, char *host, int *port) {
+	switch (addr->sa_family) {
+		case AF_INET: {
+			struct sockaddr_in *ipv4 = (struct sockaddr_in *)addr;
+			inet_ntop(addr->sa_family, &ipv4->sin_addr, host, INET_ADDRSTRLEN);
+			*port=ntohs(ipv4->sin_port);
+			break;
+			}
+		case AF_INET6: {
+			struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)addr;
+			inet_ntop(addr->sa_family, &ipv6->sin6_addr, host, INET6_ADDRSTRLEN);
+			*port=ntohs(ipv6->sin6_port);
+			break;
+			}
+		default:
+			strcpy(host,"localhost");
+			*port=-1;
+			break;
+	}
+}
+
+// Writes the status of the session into its processlist slot.
+// It is called after every run of the session handler, thus it rewrites the
+// slot only if something relevant changed since the last call.
+// The slot stores when the session entered its current state, not the time
+// spent in it: sessions that are idle or parked in epoll don't run the
+// handler, and SQL3_Processlist() computes time_ms when it reads the slot
+void MySQL_Thread::update_processlist_slot(MySQL_Session *sess) {
+	if (sess->procslot<0) return;
+	Processlist_Slot *s=procslots.slot(sess->procslot);
+	unsigned long long start_time=sess->procslot_cache.start_time;
+	if (sess->mirror) {
+		// for mirror session we only consider the start time
+		start_time=sess->start_time;
+	} else if (epoll_thread) {
+		start_time=sess->idle_since;
+	} else if (sess->status!=WAITING_CLIENT_DATA && sess->CurrentQuery.start_time) {
+		// a command is running: since when it was received
+		start_time=sess->CurrentQuery.start_time;
+	} else if (sess->procslot_cache.status!=(int)sess->status) {
+		// idle, or not running a command: since the change of status
+		start_time=curtime;
+	}
+	MySQL_Connection *mc=NULL;
+	if (sess->mybe && sess->mybe->server_myds) {
+		mc=sess->mybe->server_myds->myconn;
+	}
+	void *query=NULL;
+	unsigned int query_length=0;
+	if (mc) {
+		if (sess->CurrentQuery.stmt_info==NULL) { // text protocol
+			query=mc->query.ptr;
+			query_length=mc->query.length;
+		} else { // prepared statement
+			query=sess->CurrentQuery.stmt_info->query;
+			query_length=sess->CurrentQuery.stmt_info->query_length;
+		}
+	}
+	MySQL_Connection_userinfo *ui=NULL;
+	if (sess->client_myds && sess->client_myds->myconn) {
+		ui=sess->client_myds->myconn->userinfo;
+	}
+	void *schemaname=(ui ? ui->schemaname : NULL);
+	bool paused=(sess->pause_until > curtime);
+	if (
+		sess->procslot_cache.status==(int)sess->status &&
+		sess->procslot_cache.hostgroup==sess->current_hostgroup &&
+		sess->procslot_cache.session_id==sess->thread_session_id &&
+		sess->procslot_cache.myconn==mc &&
+		sess->procslot_cache.query==query &&
+		sess->procslot_cache.query_length==query_length &&
+		sess->procslot_cache.query_start==sess->CurrentQuery.start_time &&
+		sess->procslot_cache.schemaname==schemaname &&
+		sess->procslot_cache.paused==paused
+	) {
+		// only the start time can have changed
+		if (start_time!=sess->procslot_cache.start_time) {
+			procslots.write_begin(s);
+			s->start_time=start_time;
+			procslots.write_end(s);
+			sess->procslot_cache.start_time=start_time;
+		}
+		return;
+	}
+	bool new_slot=(sess->procslot_cache.status==-1);
+	bool new_query=(new_slot || sess->procslot_cache.query!=query || sess->procslot_cache.query_length!=query_length || sess->procslot_cache.query_start!=sess->CurrentQuery.start_time);
+	bool new_conn=(new_slot || sess->procslot_cache.myconn!=mc);
+	procslots.write_begin(s);
+	s->session_id=sess->thread_session_id;
+	s->mirror=sess->mirror;
+	s->hostgroup=sess->current_hostgroup;
+	s->start_time=start_time;
+	s->user[0]=0;
+	s->db[0]=0;
+	if (ui) {
+		strncpy(s->user, (ui->username ? ui->username : "unauthenticated user"), PROCESSLIST_USER_LEN-1);
+		s->user[PROCESSLIST_USER_LEN-1]=0;
+		if (ui->schemaname) {
+			strncpy(s->db, ui->schemaname, PROCESSLIST_USER_LEN-1);
+			s->db[PROCESSLIST_USER_LEN-1]=0;
+		}
+	}
+	if (new_slot) {
+		s->cli_host[0]=0;
+		s->cli_port=-1;
+		if (sess->client_myds && sess->mirror==false && sess->client_myds->client_addr) {
+			processlist_sockaddr(sess->client_myds->client_addr, s->cli_host, &s->cli_port);
+		}
+	}
+	if (new_conn) {
+		s->l_srv_host[0]=0;
+		s->l_srv_port=-1;
+		s->srv_host[0]=0;
+		s->srv_port=-1;
+		if (mc) {
+			struct sockaddr addr;
+			socklen_t addr_len=sizeof(struct sockaddr);
+			memset(&addr,0,addr_len);
+			if (getsockname(mc->fd, &addr, &addr_len)==0) {
+				processlist_sockaddr(&addr, s->l_srv_host, &s->l_srv_port);
+			}
+			strncpy(s->srv_host, mc->parent->address, PROCESSLIST_HOST_LEN-1);
+			s->srv_host[PROCESSLIST_HOST_LEN-1]=0;
+			s->srv_port=mc->parent->port;
+		}
+	}
+	if (new_query) {
+		unsigned int l=(query_length < PROCESSLIST_INFO_LEN-1 ? query_length : PROCESSLIST_INFO_LEN-1);
+		if (query && l) {
+			memcpy(s->info, query, l);
+		}
+		s->info[(query ? l : 0)]=0;
+	}
+	switch (sess->status) {
+		case CONNECTING_SERVER:
+			strcpy(s->command,"Connect");
+			break;
+		case PROCESSING_QUERY:
+			strcpy(s->command,(paused ? "Delay" : "Query"));
+			break;
+		case WAITING_CLIENT_DATA:
+			strcpy(s->command,"Sleep");
+			break;
+		case CHANGING_USER_SERVER:
+			strcpy(s->command,"Change user");
+			break;
+		case CHANGING_SCHEMA:
+			strcpy(s->command,"InitDB");
+			break;
+		case PROCESSING_STMT_EXECUTE:
+			strcpy(s->command,"Execute");
+			break;
+		case PROCESSING_STMT_PREPARE:
+			strcpy(s->command,"Prepare");
+			break;
+		default:
+			sprintf(s->command,"%d", sess->status);
+			break;
+	}
+	// sessions without a client data stream are not reported
+	s->in_use=(sess->client_myds!=NULL);
+	procslots.write_end(s);
+	sess->procslot_cache.status=(s->in_use ? (int)sess->status : -1);
+	sess->procslot_cache.hostgroup=sess->current_hostgroup;
+	sess->procslot_cache.session_id=sess->thread_session_id;
+	sess->procslot_cache.myconn=mc;
+	sess->procslot_cache.query=query;
+	sess->procslot_cache.query_length=query_length;
+	sess->procslot_cache.query_start=sess->CurrentQuery.start_time;
+	sess->procslot_cache.schemaname=schemaname;
+	sess->procslot_cache.paused=paused;
+	sess->procslot_cache.start_time=start_time;
 }
 
 
@@ -2003,6 +2626,37 @@ void MySQL_Thread::run() {
 		last_processing_idles=curtime;
 	}
 
+	if (mysql_thread___connection_warming_interval_msec && (last_connection_warming < curtime-mysql_thread___connection_warming_interval_msec*1000) ) {
+		// open new connections for servers below min_idle_connections
+		int i;
+		int num_warm=MyHGM->get_connections_to_warm(my_idle_conns, SESSIONS_FOR_CONNECTIONS_HANDLER);
+		for (i=0; i<num_warm; i++) {
+			MySQL_Data_Stream *myds;
+			MySQL_Connection *mc=my_idle_conns[i];
+			MySQL_Session *sess=new MySQL_Session();
+			sess->mybe=sess->find_or_create_backend(mc->parent->myhgc->hid);
+
+			myds=sess->mybe->server_myds;
+			myds->attach_connection(mc);
+			myds->myds_type=MYDS_BACKEND;
+			// a session taking the connection switches to its own user, as for any pooled connection
+			mc->userinfo->set(mysql_thread___monitor_username, mysql_thread___monitor_password, mysql_thread___default_schema, NULL);
+			mc->reusable=true;
+
+			sess->to_process=1;
+			sess->status=WARMING_SERVER;
+			myds->DSS=STATE_MARIADB_CONNECTING;
+			register_session_connection_handler(sess,true);
+			int rc=sess->handler();
+			if (rc==-1) {
+				unsigned int sess_idx=mysql_sessions->len-1;
+				unregister_session(sess_idx);
+				delete sess;
+			}
+		}
+		last_connection_warming=curtime;
+	}
+
 __run_skip_1:
 
 		if (idle_maintenance_thread) {
@@ -2091,6 +2745,12 @@ __run_skip_1:
 //					} else {
 //						mypolls.poll_timeout=1000;
 					}
+					if (myds->sess->hedge_at > curtime) {
+						// the query may need to be hedged
+						if (mypolls.poll_timeout==0 || (myds->sess->hedge_at - curtime < mypolls.poll_timeout) ) {
+							mypolls.poll_timeout= myds->sess->hedge_at - curtime;
+						}
+					}
 				}
 			}
 			if (myds) myds->revents=0;
@@ -2449,6 +3109,9 @@ __run_skip_1a:
 							// timeout
 							_myds->sess->to_process=1;
 						}
+						if (_myds->sess->hedge_at && curtime >= _myds->sess->hedge_at) {
+							_myds->sess->to_process=1;
+						}
 					}
 				}
 				}
@@ -2584,6 +3247,9 @@ bool MySQL_Thread::process_data_on_data_stream(MySQL_Data_Stream *myds, unsigned
 							// timeout
 							myds->sess->to_process=1;
 						}
+						if (myds->sess->hedge_at && curtime >= myds->sess->hedge_at) {
+							myds->sess->to_process=1;
+						}
 					}
 				}
 				if (myds->myds_type==MYDS_BACKEND && myds->sess->status!=FAST_FORWARD) {
@@ -2673,6 +3339,13 @@ void MySQL_Thread::process_all_sessions() {
 				continue;
 			}
 		}
+		if (__atomic_load_n(&sess->wakeup,__ATOMIC_ACQUIRE)) {
+			// woken up by another thread, ex: a connection was handed off from the pool.
+			// Only this thread writes pause_until
+			__atomic_store_n(&sess->wakeup,0,__ATOMIC_RELAXED);
+			sess->pause_until=0;
+			sess->to_process=1;
+		}
 		if (maintenance_loop) {
 			unsigned int numTrx=0;
 			unsigned long long sess_time = sess->IdleTime();
@@ -2708,6 +3381,13 @@ void MySQL_Thread::process_all_sessions() {
 						unregister_session(n);
 						n--;
 						delete sess;
+					} else {
+						update_processlist_slot(sess);
+						if (sess->CurrentQuery.client_write_start) {
+							if (sess->client_myds==NULL || sess->client_myds->available_data_out()==false) {
+								sess->CurrentQuery.phases_client_write(curtime);
+							}
+						}
 					}
 				}
 			} else {
@@ -2730,40 +3410,61 @@ void MySQL_Thread::refresh_variables() {
 	if (GloMTH==NULL) {
 		return;
 	}
-	GloMTH->wrlock();
-	__thread_MySQL_Thread_Variables_version=__global_MySQL_Thread_Variables_version;
-	mysql_thread___max_allowed_packet=GloMTH->get_variable_int((char *)"max_allowed_packet");
-	mysql_thread___max_transaction_time=GloMTH->get_variable_int((char *)"max_transaction_time");
-	mysql_thread___threshold_query_length=GloMTH->get_variable_int((char *)"threshold_query_length");
-	mysql_thread___threshold_resultset_size=GloMTH->get_variable_int((char *)"threshold_resultset_size");
-	mysql_thread___wait_timeout=GloMTH->get_variable_int((char *)"wait_timeout");
-	mysql_thread___max_connections=GloMTH->get_variable_int((char *)"max_connections");
-	mysql_thread___max_stmts_per_connection=GloMTH->get_variable_int((char *)"max_stmts_per_connection");
-	mysql_thread___max_stmts_cache=GloMTH->get_variable_int((char *)"max_stmts_cache");
-	mysql_thread___default_query_delay=GloMTH->get_variable_int((char *)"default_query_delay");
-	mysql_thread___default_query_timeout=GloMTH->get_variable_int((char *)"default_query_timeout");
-	mysql_thread___query_processor_iterations=GloMTH->get_variable_int((char *)"query_processor_iterations");
-	mysql_thread___query_processor_regex=GloMTH->get_variable_int((char *)"query_processor_regex");
-	mysql_thread___default_max_latency_ms=GloMTH->get_variable_int((char *)"default_max_latency_ms");
-	mysql_thread___long_query_time=GloMTH->get_variable_int((char *)"long_query_time");
-	mysql_thread___query_cache_size_MB=GloMTH->get_variable_int((char *)"query_cache_size_MB");
-	mysql_thread___ping_interval_server_msec=GloMTH->get_variable_int((char *)"ping_interval_server_msec");
-	mysql_thread___ping_timeout_server=GloMTH->get_variable_int((char *)"ping_timeout_server");
-	mysql_thread___shun_on_failures=GloMTH->get_variable_int((char *)"shun_on_failures");
-	mysql_thread___shun_recovery_time_sec=GloMTH->get_variable_int((char *)"shun_recovery_time_sec");
-	mysql_thread___query_retries_on_failure=GloMTH->get_variable_int((char *)"query_retries_on_failure");
-	mysql_thread___connect_retries_on_failure=GloMTH->get_variable_int((char *)"connect_retries_on_failure");
-	mysql_thread___connection_max_age_ms=GloMTH->get_variable_int((char *)"connection_max_age_ms");
-	mysql_thread___connect_timeout_server=GloMTH->get_variable_int((char *)"connect_timeout_server");
-	mysql_thread___connect_timeout_server_max=GloMTH->get_variable_int((char *)"connect_timeout_server_max");
-	mysql_thread___free_connections_pct=GloMTH->get_variable_int((char *)"free_connections_pct");
-	mysql_thread___session_idle_ms=GloMTH->get_variable_int((char *)"session_idle_ms");
-	mysql_thread___connect_retries_delay=GloMTH->get_variable_int((char *)"connect_retries_delay");
-
-	if (mysql_thread___monitor_username) free(mysql_thread___monitor_username);
-	mysql_thread___monitor_username=GloMTH->get_variable_string((char *)"monitor_username");
-	if (mysql_thread___monitor_password) free(mysql_thread___monitor_password);
-	mysql_thread___monitor_password=GloMTH->get_variable_string((char *)"monitor_password");
+	if (variables_reader==false) {
+		GloMTH->register_variables_reader(this);
+		variables_reader=true;
+	}
+	mysql_threads_variables_snapshot_t *s;
+	// announce the snapshot before using it, and retry if it was replaced meanwhile:
+	// commit() won't free a snapshot that is announced by any thread
+	do {
+		s=GloMTH->published_variables;
+		variables_snapshot=s;
+		__sync_synchronize();
+	} while (s!=GloMTH->published_variables);
+	MySQL_Threads_Handler::variables_t *v=&s->v;
+	__thread_MySQL_Thread_Variables_version=s->version;
+	mysql_thread___max_allowed_packet=v->max_allowed_packet;
+	mysql_thread___max_transaction_time=v->max_transaction_time;
+	mysql_thread___threshold_query_length=v->threshold_query_length;
+	mysql_thread___threshold_resultset_size=v->threshold_resultset_size;
+	mysql_thread___wait_timeout=v->wait_timeout;
+	mysql_thread___max_connections=v->max_connections;
+	mysql_thread___max_stmts_per_connection=v->max_stmts_per_connection;
+	mysql_thread___max_stmts_cache=v->max_stmts_cache;
+	mysql_thread___default_query_delay=v->default_query_delay;
+	mysql_thread___default_query_timeout=v->default_query_timeout;
+	mysql_thread___query_processor_iterations=v->query_processor_iterations;
+	mysql_thread___query_processor_regex=v->query_processor_regex;
+	mysql_thread___default_max_latency_ms=v->default_max_latency_ms;
+	mysql_thread___long_query_time=v->long_query_time;
+	mysql_thread___query_cache_size_MB=v->query_cache_size_MB;
+	mysql_thread___ping_interval_server_msec=v->ping_interval_server_msec;
+	mysql_thread___ping_timeout_server=v->ping_timeout_server;
+	mysql_thread___connection_warming_interval_msec=v->connection_warming_interval_msec;
+	mysql_thread___connect_rate_limit_per_server=v->connect_rate_limit_per_server;
+	mysql_thread___hedge_delay_percentile=v->hedge_delay_percentile;
+	mysql_thread___connpool_priority_aging_ms=v->connpool_priority_aging_ms;
+	mysql_thread___circuit_breaker_error_pct=v->circuit_breaker_error_pct;
+	mysql_thread___circuit_breaker_min_requests=v->circuit_breaker_min_requests;
+	mysql_thread___circuit_breaker_window_ms=v->circuit_breaker_window_ms;
+	mysql_thread___circuit_breaker_slow_query_ms=v->circuit_breaker_slow_query_ms;
+	mysql_thread___circuit_breaker_open_ms=v->circuit_breaker_open_ms;
+	mysql_thread___circuit_breaker_half_open_probes=v->circuit_breaker_half_open_probes;
+	mysql_thread___shun_on_failures=v->shun_on_failures;
+	mysql_thread___shun_recovery_time_sec=v->shun_recovery_time_sec;
+	mysql_thread___query_retries_on_failure=v->query_retries_on_failure;
+	mysql_thread___connect_retries_on_failure=v->connect_retries_on_failure;
+	mysql_thread___connection_max_age_ms=v->connection_max_age_ms;
+	mysql_thread___connect_timeout_server=v->connect_timeout_server;
+	mysql_thread___connect_timeout_server_max=v->connect_timeout_server_max;
+	mysql_thread___free_connections_pct=v->free_connections_pct;
+	mysql_thread___session_idle_ms=v->session_idle_ms;
+	mysql_thread___connect_retries_delay=v->connect_retries_delay;
+
+	// string variables are not copied: they point into the snapshot
+	mysql_thread___monitor_username=v->monitor_username;
+	mysql_thread___monitor_password=v->monitor_password;
 
 	// Removing this code due to bug #603
 //	if (mysql_thread___monitor_username && mysql_thread___monitor_password) {
@@ -2773,65 +3474,60 @@ void MySQL_Thread::refresh_variables() {
 //	}
 
 	// SSL proxy to server
-	if (mysql_thread___ssl_p2s_ca) free(mysql_thread___ssl_p2s_ca);
-	mysql_thread___ssl_p2s_ca=GloMTH->get_variable_string((char *)"ssl_p2s_ca");
-	if (mysql_thread___ssl_p2s_cert) free(mysql_thread___ssl_p2s_cert);
-	mysql_thread___ssl_p2s_cert=GloMTH->get_variable_string((char *)"ssl_p2s_cert");
-	if (mysql_thread___ssl_p2s_key) free(mysql_thread___ssl_p2s_key);
-	mysql_thread___ssl_p2s_key=GloMTH->get_variable_string((char *)"ssl_p2s_key");
-	if (mysql_thread___ssl_p2s_cipher) free(mysql_thread___ssl_p2s_cipher);
-	mysql_thread___ssl_p2s_cipher=GloMTH->get_variable_string((char *)"ssl_p2s_cipher");
-
-	mysql_thread___monitor_writer_is_also_reader=(bool)GloMTH->get_variable_int((char *)"monitor_writer_is_also_reader");
-	mysql_thread___monitor_enabled=(bool)GloMTH->get_variable_int((char *)"monitor_enabled");
-	mysql_thread___monitor_history=GloMTH->get_variable_int((char *)"monitor_history");
-	mysql_thread___monitor_connect_interval=GloMTH->get_variable_int((char *)"monitor_connect_interval");
-	mysql_thread___monitor_connect_timeout=GloMTH->get_variable_int((char *)"monitor_connect_timeout");
-	mysql_thread___monitor_ping_interval=GloMTH->get_variable_int((char *)"monitor_ping_interval");
-	mysql_thread___monitor_ping_max_failures=GloMTH->get_variable_int((char *)"monitor_ping_max_failures");
-	mysql_thread___monitor_ping_timeout=GloMTH->get_variable_int((char *)"monitor_ping_timeout");
-	mysql_thread___monitor_read_only_interval=GloMTH->get_variable_int((char *)"monitor_read_only_interval");
-	mysql_thread___monitor_read_only_timeout=GloMTH->get_variable_int((char *)"monitor_read_only_timeout");
-	mysql_thread___monitor_replication_lag_interval=GloMTH->get_variable_int((char *)"monitor_replication_lag_interval");
-	mysql_thread___monitor_replication_lag_timeout=GloMTH->get_variable_int((char *)"monitor_replication_lag_timeout");
-	mysql_thread___monitor_query_interval=GloMTH->get_variable_int((char *)"monitor_query_interval");
-	mysql_thread___monitor_query_timeout=GloMTH->get_variable_int((char *)"monitor_query_timeout");
-	mysql_thread___monitor_slave_lag_when_null=GloMTH->get_variable_int((char *)"monitor_slave_lag_when_null");
-
-	if (mysql_thread___init_connect) free(mysql_thread___init_connect);
-	mysql_thread___init_connect=GloMTH->get_variable_string((char *)"init_connect");
-	if (mysql_thread___server_version) free(mysql_thread___server_version);
-	mysql_thread___server_version=GloMTH->get_variable_string((char *)"server_version");
-	if (mysql_thread___eventslog_filename) free(mysql_thread___eventslog_filename);
-	mysql_thread___eventslog_filesize=GloMTH->get_variable_int((char *)"eventslog_filesize");
-	mysql_thread___eventslog_filename=GloMTH->get_variable_string((char *)"eventslog_filename");
+	mysql_thread___ssl_p2s_ca=v->ssl_p2s_ca;
+	mysql_thread___ssl_p2s_cert=v->ssl_p2s_cert;
+	mysql_thread___ssl_p2s_key=v->ssl_p2s_key;
+	mysql_thread___ssl_p2s_cipher=v->ssl_p2s_cipher;
+
+	mysql_thread___monitor_writer_is_also_reader=v->monitor_writer_is_also_reader;
+	mysql_thread___monitor_enabled=v->monitor_enabled;
+	mysql_thread___monitor_history=v->monitor_history;
+	mysql_thread___monitor_connect_interval=v->monitor_connect_interval;
+	mysql_thread___monitor_connect_timeout=v->monitor_connect_timeout;
+	mysql_thread___monitor_ping_interval=v->monitor_ping_interval;
+	mysql_thread___monitor_ping_max_failures=v->monitor_ping_max_failures;
+	mysql_thread___monitor_ping_timeout=v->monitor_ping_timeout;
+	mysql_thread___monitor_read_only_interval=v->monitor_read_only_interval;
+	mysql_thread___monitor_read_only_timeout=v->monitor_read_only_timeout;
+	mysql_thread___monitor_replication_lag_interval=v->monitor_replication_lag_interval;
+	mysql_thread___monitor_replication_lag_timeout=v->monitor_replication_lag_timeout;
+	mysql_thread___monitor_query_interval=v->monitor_query_interval;
+	mysql_thread___monitor_query_timeout=v->monitor_query_timeout;
+	mysql_thread___monitor_slave_lag_when_null=v->monitor_slave_lag_when_null;
+
+	mysql_thread___init_connect=v->init_connect;
+	mysql_thread___server_version=v->server_version;
+	mysql_thread___eventslog_filesize=v->eventslog_filesize;
+	mysql_thread___eventslog_filename=v->eventslog_filename;
+	mysql_thread___eventslog_phases=v->eventslog_phases;
 	GloMyLogger->set_base_filename(); // both filename and filesize are set here
-	if (mysql_thread___default_schema) free(mysql_thread___default_schema);
-	mysql_thread___default_schema=GloMTH->get_variable_string((char *)"default_schema");
-	mysql_thread___server_capabilities=GloMTH->get_variable_uint16((char *)"server_capabilities");
-	mysql_thread___default_charset=GloMTH->get_variable_uint8((char *)"default_charset");
-	mysql_thread___poll_timeout=GloMTH->get_variable_int((char *)"poll_timeout");
-	mysql_thread___poll_timeout_on_failure=GloMTH->get_variable_int((char *)"poll_timeout_on_failure");
-	mysql_thread___have_compress=(bool)GloMTH->get_variable_int((char *)"have_compress");
-	mysql_thread___client_found_rows=(bool)GloMTH->get_variable_int((char *)"client_found_rows");
-	mysql_thread___multiplexing=(bool)GloMTH->get_variable_int((char *)"multiplexing");
-//	mysql_thread___stmt_multiplexing=(bool)GloMTH->get_variable_int((char *)"stmt_multiplexing");
-	mysql_thread___enforce_autocommit_on_reads=(bool)GloMTH->get_variable_int((char *)"enforce_autocommit_on_reads");
-	mysql_thread___commands_stats=(bool)GloMTH->get_variable_int((char *)"commands_stats");
-	mysql_thread___query_digests=(bool)GloMTH->get_variable_int((char *)"query_digests");
-	mysql_thread___query_digests_lowercase=(bool)GloMTH->get_variable_int((char *)"query_digests_lowercase");
-	mysql_thread___sessions_sort=(bool)GloMTH->get_variable_int((char *)"sessions_sort");
-	mysql_thread___session_idle_show_processlist=(bool)GloMTH->get_variable_int((char *)"session_idle_show_processlist");
-	mysql_thread___servers_stats=(bool)GloMTH->get_variable_int((char *)"servers_stats");
-	mysql_thread___default_reconnect=(bool)GloMTH->get_variable_int((char *)"default_reconnect");
+	mysql_thread___default_schema=v->default_schema;
+	mysql_thread___server_capabilities=v->server_capabilities;
+	mysql_thread___default_charset=v->default_charset;
+	mysql_thread___poll_timeout=v->poll_timeout;
+	mysql_thread___poll_timeout_on_failure=v->poll_timeout_on_failure;
+	mysql_thread___have_compress=v->have_compress;
+	mysql_thread___client_found_rows=v->client_found_rows;
+	mysql_thread___multiplexing=v->multiplexing;
+//	mysql_thread___stmt_multiplexing=v->stmt_multiplexing;
+	mysql_thread___enforce_autocommit_on_reads=v->enforce_autocommit_on_reads;
+	mysql_thread___commands_stats=v->commands_stats;
+	mysql_thread___query_digests=v->query_digests;
+	mysql_thread___query_digests_lowercase=v->query_digests_lowercase;
+	mysql_thread___query_digests_phases=v->query_digests_phases;
+	mysql_thread___sessions_sort=v->sessions_sort;
+	mysql_thread___session_idle_show_processlist=v->session_idle_show_processlist;
+	mysql_thread___servers_stats=v->servers_stats;
+	mysql_thread___default_reconnect=v->default_reconnect;
 #ifdef DEBUG
-	mysql_thread___session_debug=(bool)GloMTH->get_variable_int((char *)"session_debug");
+	mysql_thread___session_debug=v->session_debug;
 #endif /* DEBUG */
-	GloMTH->wrunlock();
 }
 
 MySQL_Thread::MySQL_Thread() {
 	efd=-1;
+	variables_snapshot=NULL;
+	variables_reader=false;
 	epoll_thread=false;
 	spinlock_rwlock_init(&thread_mutex);
 	mysess_idx=0;
@@ -2849,6 +3545,7 @@ MySQL_Thread::MySQL_Thread() {
 	myexchange.resume_mysql_sessions=NULL;
 	processing_idles=false;
 	last_processing_idles=0;
+	last_connection_warming=0;
 	__thread_MySQL_Thread_Variables_version=0;
 	mysql_thread___server_version=NULL;
 	mysql_thread___init_connect=NULL;
@@ -3000,6 +3697,12 @@ SQLite3_result * MySQL_Threads_Handler::SQL3_GlobalStatus() {
 		pta[1]=buf;
 		result->add_row(pta);
 	}
+	if (GloMyAuth) {	// passwords verified by the auth threads
+		pta[0]=(char *)"Client_auth_offloaded";
+		sprintf(buf,"%llu",GloMyAuth->auth_offloaded);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
 	{
 		// Connections
 		pta[0]=(char *)"Server_Connections_aborted";
@@ -3173,6 +3876,161 @@ SQLite3_result * MySQL_Threads_Handler::SQL3_GlobalStatus() {
 		pta[1]=buf;
 		result->add_row(pta);
 	}
+	{	// sessions queued waiting for a connection
+		pta[0]=(char *)"ConnPool_wait_queued";
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_wait);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// sessions currently in queue
+		pta[0]=(char *)"ConnPool_wait_queue_length";
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_waiting);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// connections handed off to a waiting session
+		pta[0]=(char *)"ConnPool_wait_handoff";
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_handoff);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// total time spent in queue
+		pta[0]=(char *)"ConnPool_wait_time_us";
+		sprintf(buf,"%llu",MyHGM->status.myconnpoll_wait_us);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// longest time spent in queue
+		pta[0]=(char *)"ConnPool_wait_time_max_us";
+		sprintf(buf,"%llu",MyHGM->status.myconnpoll_wait_max_us);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	for (int i=0; i<MYCONN_WAITER_PRIORITIES; i++) {	// queued sessions and time spent in queue, by priority class
+		char name[64];
+		sprintf(name,"ConnPool_wait_queued_priority_%d",i);
+		pta[0]=name;
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_wait_prio[i]);
+		pta[1]=buf;
+		result->add_row(pta);
+		sprintf(name,"ConnPool_wait_time_us_priority_%d",i);
+		sprintf(buf,"%llu",MyHGM->status.myconnpoll_wait_us_prio[i]);
+		result->add_row(pta);
+	}
+	{	// connections opened because of min_idle_connections
+		pta[0]=(char *)"ConnPool_warm_connections";
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_warm);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{
+		pta[0]=(char *)"ConnPool_warm_errors";
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_warm_err);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// connections not created because of connect_rate_limit_per_server
+		pta[0]=(char *)"ConnPool_connect_throttled";
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_connect_throttled);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// connections reset by HGCU and returned to the pool
+		pta[0]=(char *)"ConnPool_reset_ok";
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_reset);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// of which, reset with COM_RESET_CONNECTION
+		pta[0]=(char *)"ConnPool_reset_com_reset_connection";
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_reset_com);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// connections that failed to reset, and were destroyed
+		pta[0]=(char *)"ConnPool_reset_failed";
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_reset_err);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// connections destroyed without trying to reset them, HGCU too busy
+		pta[0]=(char *)"ConnPool_reset_dropped";
+		sprintf(buf,"%lu",MyHGM->status.myconnpoll_reset_dropped);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// connections queued or being reset
+		pta[0]=(char *)"ConnPool_reset_pending";
+		sprintf(buf,"%u",MyHGM->HGCU_pending());
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// KILL QUERY requested by sessions
+		pta[0]=(char *)"Kill_query_queued";
+		sprintf(buf,"%lu",MyHGM->status.kill_queued);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// of which, already pending for the same backend thread
+		pta[0]=(char *)"Kill_query_coalesced";
+		sprintf(buf,"%lu",MyHGM->status.kill_coalesced);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// not executed, too many pending
+		pta[0]=(char *)"Kill_query_dropped";
+		sprintf(buf,"%lu",MyHGM->status.kill_dropped);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{
+		pta[0]=(char *)"Kill_query_ok";
+		sprintf(buf,"%lu",MyHGM->status.kill_ok);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// failed or timed out
+		pta[0]=(char *)"Kill_query_failed";
+		sprintf(buf,"%lu",MyHGM->status.kill_err);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// connections created to execute KILL QUERY
+		pta[0]=(char *)"Kill_query_connections_created";
+		sprintf(buf,"%lu",MyHGM->status.kill_conn_created);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// total time from request to completion
+		pta[0]=(char *)"Kill_query_latency_us";
+		sprintf(buf,"%llu",MyHGM->status.kill_latency_us);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{
+		pta[0]=(char *)"Kill_query_latency_max_us";
+		sprintf(buf,"%llu",MyHGM->status.kill_latency_max_us);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// circuit breakers tripped
+		pta[0]=(char *)"CircuitBreaker_open";
+		sprintf(buf,"%lu",MyHGM->status.breaker_open);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// queries failed immediately, all the servers of the hostgroup were OPEN
+		pta[0]=(char *)"CircuitBreaker_fast_fail";
+		sprintf(buf,"%lu",MyHGM->status.breaker_fast_fail);
+		pta[1]=buf;
+		result->add_row(pta);
+	}
+	{	// KILL QUERY queued or in progress
+		pta[0]=(char *)"Kill_query_pending";
+		sprintf(buf,"%u",MyHGM->KILL_pending());
+		pta[1]=buf;
+		result->add_row(pta);
+	}
 	free(pta);
 	return result;
 }
@@ -3208,11 +4066,13 @@ void MySQL_Threads_Handler::Get_Memory_Stats() {
 	}
 }
 
-SQLite3_result * MySQL_Threads_Handler::SQL3_Processlist() {
+// The processlist is built from the Processlist_Slot of each thread: threads
+// are never locked. If a filter is passed, it is evaluated on each row before
+// adding it to the resultset
+SQLite3_result * MySQL_Threads_Handler::SQL3_Processlist(SQLite3_vtab_filter *filter) {
 	const int colnum=14;
-        char port[NI_MAXSERV];
 	proxy_debug(PROXY_DEBUG_MYSQL_CONNECTION, 4, "Dumping MySQL Processlist\n");
-  SQLite3_result *result=new SQLite3_result(colnum);
+	SQLite3_result *result=new SQLite3_result(colnum);
 	result->add_column_definition(SQLITE_TEXT,"ThreadID");
 	result->add_column_definition(SQLITE_TEXT,"SessionID");
 	result->add_column_definition(SQLITE_TEXT,"user");
@@ -3227,209 +4087,61 @@ SQLite3_result * MySQL_Threads_Handler::SQL3_Processlist() {
 	result->add_column_definition(SQLITE_TEXT,"command");
 	result->add_column_definition(SQLITE_TEXT,"time_ms");
 	result->add_column_definition(SQLITE_TEXT,"info");
+	Processlist_Slot *sl=(Processlist_Slot *)malloc(sizeof(Processlist_Slot));
+	char thread_id[16];
+	char session_id[16];
+	char cli_port[16];
+	char hostgroup[16];
+	char l_srv_port[16];
+	char srv_port[16];
+	char time_ms[32];
+	char *pta[colnum];
+	unsigned long long now=monotonic_time();
 	unsigned int i;
-	signal_all_threads(1);
-	MySQL_Thread *thr=NULL;
-	for (i=0;i<num_threads*2;i++) {
-		if (i<num_threads) {
-			thr=(MySQL_Thread *)mysql_threads[i].worker;
-			spin_wrlock(&thr->thread_mutex);
-		} else {
-			if (mysql_thread___session_idle_show_processlist) {
-				thr=(MySQL_Thread *)mysql_threads_idles[i-num_threads].worker;
-				spin_wrlock(&thr->thread_mutex);
-			}
-		}
-	}
 	for (i=0;i < ( mysql_thread___session_idle_show_processlist ? num_threads*2 : num_threads); i++) {
+		MySQL_Thread *thr=NULL;
 		if (i<num_threads) {
 			thr=(MySQL_Thread *)mysql_threads[i].worker;
 		} else {
 			thr=(MySQL_Thread *)mysql_threads_idles[i-num_threads].worker;
 		}
-		unsigned int j;
-		for (j=0; j<thr->mysql_sessions->len; j++) {
-			MySQL_Session *sess=(MySQL_Session *)thr->mysql_sessions->pdata[j];
-			if (sess->client_myds) {
-				char buf[1024];
-				char **pta=(char **)malloc(sizeof(char *)*colnum);
-				sprintf(buf,"%d", i);
-				pta[0]=strdup(buf);
-				sprintf(buf,"%u", sess->thread_session_id);
-				pta[1]=strdup(buf);
-				MySQL_Connection_userinfo *ui=sess->client_myds->myconn->userinfo;
-				pta[2]=NULL;
-				pta[3]=NULL;
-				if (ui) {
-					if (ui->username) {
-						pta[2]=strdup(ui->username);
-					} else {
-						pta[2]=strdup("unauthenticated user");
-					}
-					if (ui->schemaname) {
-						pta[3]=strdup(ui->schemaname);
-					}
+		if (thr==NULL) continue;
+		sprintf(thread_id,"%d", i);
+		if (filter && filter->match(0,thread_id)==false) continue;
+		unsigned int nslots=__atomic_load_n(&thr->procslots.nchunks, __ATOMIC_ACQUIRE)*PROCESSLIST_SLOTS_PER_CHUNK;
+		for (unsigned int j=0; j<nslots; j++) {
+			if (thr->procslots.read(j, sl)==false) continue;
+			sprintf(session_id,"%u", sl->session_id);
+			sprintf(hostgroup,"%d", sl->hostgroup);
+			sprintf(time_ms,"%llu", (sl->start_time < now ? (now - sl->start_time)/1000 : 0));
+			sprintf(cli_port,"%d", sl->cli_port);
+			sprintf(l_srv_port,"%d", sl->l_srv_port);
+			sprintf(srv_port,"%d", sl->srv_port);
+			pta[0]=thread_id;
+			pta[1]=session_id;
+			pta[2]=(sl->user[0] ? sl->user : NULL);
+			pta[3]=(sl->db[0] ? sl->db : NULL);
+			pta[4]=(sl->cli_host[0] ? sl->cli_host : NULL);
+			pta[5]=(sl->cli_port >= 0 ? cli_port : NULL);
+			pta[6]=hostgroup;
+			pta[7]=(sl->l_srv_host[0] ? sl->l_srv_host : NULL);
+			pta[8]=(sl->l_srv_port >= 0 ? l_srv_port : NULL);
+			pta[9]=(sl->srv_host[0] ? sl->srv_host : NULL);
+			pta[10]=(sl->srv_port >= 0 ? srv_port : NULL);
+			pta[11]=sl->command;
+			pta[12]=time_ms;
+			pta[13]=(sl->info[0] ? sl->info : NULL);
+			if (filter) {
+				bool skip=false;
+				for (int k=1; k<colnum && skip==false; k++) {
+					if (filter->match(k,pta[k])==false) skip=true;
 				}
-
-                                if (sess->mirror==false) {
-                                        switch (sess->client_myds->client_addr->sa_family) {
-                                        case AF_INET: {
-                                                struct sockaddr_in *ipv4 = (struct sockaddr_in *)sess->client_myds->client_addr;
-                                                inet_ntop(sess->client_myds->client_addr->sa_family, &ipv4->sin_addr, buf, INET_ADDRSTRLEN);
-                                                pta[4] = strdup(buf);
-                                                sprintf(port, "%d", ntohs(ipv4->sin_port));
-                                                pta[5] = strdup(port);
-                                                break;
-                                                }
-                                        case AF_INET6: {
-                                                struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)sess->client_myds->client_addr;
-                                                inet_ntop(sess->client_myds->client_addr->sa_family, &ipv6->sin6_addr, buf, INET6_ADDRSTRLEN);
-                                                pta[4] = strdup(buf);
-                                                sprintf(port, "%d", ntohs(ipv6->sin6_port));
-                                                pta[5] = strdup(port);
-                                                break;
-                                                }
-                                        default:
-                                                pta[4] = strdup("localhost");
-                                                pta[5] = NULL;
-                                                break;
-                                        }
-                                }
-				sprintf(buf,"%d", sess->current_hostgroup);
-				pta[6]=strdup(buf);
-				if (sess->mybe && sess->mybe->server_myds && sess->mybe->server_myds->myconn) {
-					MySQL_Connection *mc=sess->mybe->server_myds->myconn;
-
-
-					struct sockaddr addr;
-					socklen_t addr_len=sizeof(struct sockaddr);
-					memset(&addr,0,addr_len);
-					int rc;
-					rc=getsockname(mc->fd, &addr, &addr_len);
-					if (rc==0) {
-                                        switch (addr.sa_family) { 
-                                                case AF_INET: {
-                                                        struct sockaddr_in *ipv4 = (struct sockaddr_in *)&addr;
-                                                        inet_ntop(addr.sa_family, &ipv4->sin_addr, buf, INET_ADDRSTRLEN);
-                                                        pta[7] = strdup(buf);
-                                                        sprintf(port, "%d", ntohs(ipv4->sin_port));
-                                                        pta[8] = strdup(port);
-                                                        break;
-                                                        }
-                                                case AF_INET6: {
-                                                        struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)&addr;
-                                                        inet_ntop(addr.sa_family, &ipv6->sin6_addr, buf, INET6_ADDRSTRLEN);
-                                                        pta[7] = strdup(buf);
-                                                        sprintf(port, "%d", ntohs(ipv6->sin6_port));
-                                                        pta[8] = strdup(port);
-                                                        break;
-                                                        }
-                                                default:
-                                                        pta[7] = strdup("localhost");
-                                                        pta[8] = NULL;
-                                                        break;
-                                                }
-					} else {
-						pta[7]=NULL;
-						pta[8]=NULL;
-					}
-
-					sprintf(buf,"%s", mc->parent->address);
-					pta[9]=strdup(buf);
-					sprintf(buf,"%d", mc->parent->port);
-					pta[10]=strdup(buf);
-					if (sess->CurrentQuery.stmt_info==NULL) { // text protocol
-						if (mc->query.length) {
-							pta[13]=(char *)malloc(mc->query.length+1);
-							strncpy(pta[13],mc->query.ptr,mc->query.length);
-							pta[13][mc->query.length]='\0';
-						} else {
-							pta[13]=NULL;
-						}
-					} else { // prepared statement
-						MySQL_STMT_Global_info *si=sess->CurrentQuery.stmt_info;
-						if (si->query_length) {
-							pta[13]=(char *)malloc(si->query_length+1);
-							strncpy(pta[13],si->query,si->query_length);
-							pta[13][si->query_length]='\0';
-						} else {
-							pta[13]=NULL;
-						}
-					}
-				} else {
-					pta[7]=NULL;
-					pta[8]=NULL;
-					pta[9]=NULL;
-					pta[10]=NULL;
-					pta[13]=NULL;
-				}
-				switch (sess->status) {
-					case CONNECTING_SERVER:
-						pta[11]=strdup("Connect");
-						break;
-					case PROCESSING_QUERY:
-						if (sess->pause_until > sess->thread->curtime) {
-							pta[11]=strdup("Delay");
-						} else {
-							pta[11]=strdup("Query");
-						}
-						break;
-					case WAITING_CLIENT_DATA:
-						pta[11]=strdup("Sleep");
-						break;
-					case CHANGING_USER_SERVER:
-						pta[11]=strdup("Change user");
-						break;
-					case CHANGING_SCHEMA:
-						pta[11]=strdup("InitDB");
-						break;
-					case PROCESSING_STMT_EXECUTE:
-						pta[11]=strdup("Execute");
-						break;
-					case PROCESSING_STMT_PREPARE:
-						pta[11]=strdup("Prepare");
-						break;
-					default:
-						sprintf(buf,"%d", sess->status);
-						pta[11]=strdup(buf);
-						break;
-				}
-				if (sess->mirror==false) {
-					int idx=sess->client_myds->poll_fds_idx;
-					unsigned long long last_sent=sess->thread->mypolls.last_sent[idx];
-					unsigned long long last_recv=sess->thread->mypolls.last_recv[idx];
-					unsigned long long last_time=(last_sent > last_recv ? last_sent : last_recv);
-					if (last_time>sess->thread->curtime) {
-						last_time=sess->thread->curtime;
-					}
-					sprintf(buf,"%llu", (sess->thread->curtime - last_time)/1000 );
-				} else {
-					// for mirror session we only consider the start time
-					sprintf(buf,"%llu", (sess->thread->curtime - sess->start_time)/1000 );
-				}
-				pta[12]=strdup(buf);
-
-				result->add_row(pta);
-				unsigned int k;
-				for (k=0; k<colnum; k++) {
-					if (pta[k])
-						free(pta[k]);
-				}
-				free(pta);
-			}
-		}
-	}
-	for (i=0;i<num_threads*2;i++) {
-		if (i<num_threads) {
-			thr=(MySQL_Thread *)mysql_threads[i].worker;
-			spin_wrunlock(&thr->thread_mutex);
-		} else {
-			if (mysql_thread___session_idle_show_processlist) {
-				thr=(MySQL_Thread *)mysql_threads_idles[i-num_threads].worker;
-				spin_wrunlock(&thr->thread_mutex);
+				if (skip) continue;
 			}
+			result->add_row(pta);
 		}
 	}
+	free(sl);
 	return result;
 }
 
@@ -3721,7 +4433,7 @@ MySQL_Connection * MySQL_Thread::get_MyConn_local(unsigned int _hid) {
 	MySQL_Connection *c=NULL;
 	for (i=0; i<cached_connections->len; i++) {
 		c=(MySQL_Connection *)cached_connections->index(i);
-		if (c->parent->myhgc->hid==_hid) {
+		if (c->parent->myhgc->hid==_hid && c->parent->breaker_state==MYSRVC_BREAKER_CLOSED) {
 			c=(MySQL_Connection *)cached_connections->remove_index_fast(i);
 			return c;
 		}
@@ -3732,7 +4444,7 @@ MySQL_Connection * MySQL_Thread::get_MyConn_local(unsigned int _hid) {
 void MySQL_Thread::push_MyConn_local(MySQL_Connection *c) {
 	MySrvC *mysrvc=NULL;
 	mysrvc=(MySrvC *)c->parent;
-	if (mysrvc->status==MYSQL_SERVER_STATUS_ONLINE) {
+	if (mysrvc->status==MYSQL_SERVER_STATUS_ONLINE && mysrvc->breaker_state==MYSRVC_BREAKER_CLOSED) {
 		if (c->async_state_machine==ASYNC_IDLE) {
 			cached_connections->add(c);
 			return; // all went well
@@ -18,6 +18,9 @@
 #include <resolv.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "SpookyV2.h"
 //#define MYSQL_THREAD_IMPLEMENTATION
 
@@ -96,7 +99,7 @@ pthread_mutex_t admin_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define LINESIZE	2048
 
-#define ADMIN_SQLITE_TABLE_MYSQL_SERVERS "CREATE TABLE mysql_servers (hostgroup_id INT NOT NULL DEFAULT 0 , hostname VARCHAR NOT NULL , port INT NOT NULL DEFAULT 3306 , status VARCHAR CHECK (UPPER(status) IN ('ONLINE','SHUNNED','OFFLINE_SOFT', 'OFFLINE_HARD')) NOT NULL DEFAULT 'ONLINE' , weight INT CHECK (weight >= 0) NOT NULL DEFAULT 1 , compression INT CHECK (compression >=0 AND compression <= 102400) NOT NULL DEFAULT 0 , max_connections INT CHECK (max_connections >=0) NOT NULL DEFAULT 1000 , max_replication_lag INT CHECK (max_replication_lag >= 0 AND max_replication_lag <= 126144000) NOT NULL DEFAULT 0 , use_ssl INT CHECK (use_ssl IN(0,1)) NOT NULL DEFAULT 0 , max_latency_ms INT UNSIGNED CHECK (max_latency_ms>=0) NOT NULL DEFAULT 0 , comment VARCHAR NOT NULL DEFAULT '' , PRIMARY KEY (hostgroup_id, hostname, port) )"
+#define ADMIN_SQLITE_TABLE_MYSQL_SERVERS "CREATE TABLE mysql_servers (hostgroup_id INT NOT NULL DEFAULT 0 , hostname VARCHAR NOT NULL , port INT NOT NULL DEFAULT 3306 , status VARCHAR CHECK (UPPER(status) IN ('ONLINE','SHUNNED','OFFLINE_SOFT', 'OFFLINE_HARD')) NOT NULL DEFAULT 'ONLINE' , weight INT CHECK (weight >= 0) NOT NULL DEFAULT 1 , compression INT CHECK (compression >=0 AND compression <= 102400) NOT NULL DEFAULT 0 , max_connections INT CHECK (max_connections >=0) NOT NULL DEFAULT 1000 , max_replication_lag INT CHECK (max_replication_lag >= 0 AND max_replication_lag <= 126144000) NOT NULL DEFAULT 0 , use_ssl INT CHECK (use_ssl IN(0,1)) NOT NULL DEFAULT 0 , max_latency_ms INT UNSIGNED CHECK (max_latency_ms>=0) NOT NULL DEFAULT 0 , min_idle_connections INT CHECK (min_idle_connections >=0) NOT NULL DEFAULT 0 , comment VARCHAR NOT NULL DEFAULT '' , PRIMARY KEY (hostgroup_id, hostname, port) )"
 
 // mysql_servers in v1.1.0
 #define ADMIN_SQLITE_TABLE_MYSQL_SERVERS_V1_1_0 "CREATE TABLE mysql_servers (hostgroup_id INT NOT NULL DEFAULT 0 , hostname VARCHAR NOT NULL , port INT NOT NULL DEFAULT 3306 , status VARCHAR CHECK (UPPER(status) IN ('ONLINE','SHUNNED','OFFLINE_SOFT', 'OFFLINE_HARD')) NOT NULL DEFAULT 'ONLINE' , weight INT CHECK (weight >= 0) NOT NULL DEFAULT 1 , compression INT CHECK (compression >=0 AND compression <= 102400) NOT NULL DEFAULT 0 , max_connections INT CHECK (max_connections >=0) NOT NULL DEFAULT 1000 , max_replication_lag INT CHECK (max_replication_lag >= 0 AND max_replication_lag <= 126144000) NOT NULL DEFAULT 0 , PRIMARY KEY (hostgroup_id, hostname, port) )"
@@ -128,7 +131,16 @@ pthread_mutex_t admin_mutex = PTHREAD_MUTEX_INITIALIZER;
 // mysql_query_rules in v1.3.1
 #define ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES_V1_3_1 "CREATE TABLE mysql_query_rules (rule_id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL , active INT CHECK (active IN (0,1)) NOT NULL DEFAULT 0 , username VARCHAR , schemaname VARCHAR , flagIN INT NOT NULL DEFAULT 0 , client_addr VARCHAR , proxy_addr VARCHAR , proxy_port INT , digest VARCHAR , match_digest VARCHAR , match_pattern VARCHAR , negate_match_pattern INT CHECK (negate_match_pattern IN (0,1)) NOT NULL DEFAULT 0 , re_modifiers VARCHAR DEFAULT 'CASELESS' , flagOUT INT , replace_pattern VARCHAR , destination_hostgroup INT DEFAULT NULL , cache_ttl INT CHECK(cache_ttl > 0) , reconnect INT CHECK (reconnect IN (0,1)) DEFAULT NULL , timeout INT UNSIGNED , retries INT CHECK (retries>=0 AND retries <=1000) , delay INT UNSIGNED , mirror_flagOUT INT UNSIGNED , mirror_hostgroup INT UNSIGNED , error_msg VARCHAR , sticky_conn INT CHECK (sticky_conn IN (0,1)) , multiplex INT CHECK (multiplex IN (0,1)) , log INT CHECK (log IN (0,1)) , apply INT CHECK(apply IN (0,1)) NOT NULL DEFAULT 0 , comment VARCHAR)"
 
-#define ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES_V1_3_1
+// mysql_query_rules in v1.4.0 , with rate limits
+#define ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES_V1_4_0 "CREATE TABLE mysql_query_rules (rule_id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL , active INT CHECK (active IN (0,1)) NOT NULL DEFAULT 0 , username VARCHAR , schemaname VARCHAR , flagIN INT NOT NULL DEFAULT 0 , client_addr VARCHAR , proxy_addr VARCHAR , proxy_port INT , digest VARCHAR , match_digest VARCHAR , match_pattern VARCHAR , negate_match_pattern INT CHECK (negate_match_pattern IN (0,1)) NOT NULL DEFAULT 0 , re_modifiers VARCHAR DEFAULT 'CASELESS' , flagOUT INT , replace_pattern VARCHAR , destination_hostgroup INT DEFAULT NULL , cache_ttl INT CHECK(cache_ttl > 0) , reconnect INT CHECK (reconnect IN (0,1)) DEFAULT NULL , timeout INT UNSIGNED , retries INT CHECK (retries>=0 AND retries <=1000) , delay INT UNSIGNED , mirror_flagOUT INT UNSIGNED , mirror_hostgroup INT UNSIGNED , error_msg VARCHAR , sticky_conn INT CHECK (sticky_conn IN (0,1)) , multiplex INT CHECK (multiplex IN (0,1)) , log INT CHECK (log IN (0,1)) , apply INT CHECK(apply IN (0,1)) NOT NULL DEFAULT 0 , comment VARCHAR , qos_max_qps INT CHECK (qos_max_qps>=0) , qos_burst INT CHECK (qos_burst>=0) , qos_max_concurrency INT CHECK (qos_max_concurrency>=0) , qos_max_wait_ms INT CHECK (qos_max_wait_ms>=0))"
+
+// mysql_query_rules in v1.4.1 , with priority classes
+#define ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES_V1_4_1 "CREATE TABLE mysql_query_rules (rule_id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL , active INT CHECK (active IN (0,1)) NOT NULL DEFAULT 0 , username VARCHAR , schemaname VARCHAR , flagIN INT NOT NULL DEFAULT 0 , client_addr VARCHAR , proxy_addr VARCHAR , proxy_port INT , digest VARCHAR , match_digest VARCHAR , match_pattern VARCHAR , negate_match_pattern INT CHECK (negate_match_pattern IN (0,1)) NOT NULL DEFAULT 0 , re_modifiers VARCHAR DEFAULT 'CASELESS' , flagOUT INT , replace_pattern VARCHAR , destination_hostgroup INT DEFAULT NULL , cache_ttl INT CHECK(cache_ttl > 0) , reconnect INT CHECK (reconnect IN (0,1)) DEFAULT NULL , timeout INT UNSIGNED , retries INT CHECK (retries>=0 AND retries <=1000) , delay INT UNSIGNED , mirror_flagOUT INT UNSIGNED , mirror_hostgroup INT UNSIGNED , error_msg VARCHAR , sticky_conn INT CHECK (sticky_conn IN (0,1)) , multiplex INT CHECK (multiplex IN (0,1)) , log INT CHECK (log IN (0,1)) , apply INT CHECK(apply IN (0,1)) NOT NULL DEFAULT 0 , comment VARCHAR , qos_max_qps INT CHECK (qos_max_qps>=0) , qos_burst INT CHECK (qos_burst>=0) , qos_max_concurrency INT CHECK (qos_max_concurrency>=0) , qos_max_wait_ms INT CHECK (qos_max_wait_ms>=0) , priority INT CHECK (priority IN (0,1,2)))"
+
+// mysql_query_rules in v1.4.2 , with hedged reads
+#define ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES_V1_4_2 "CREATE TABLE mysql_query_rules (rule_id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL , active INT CHECK (active IN (0,1)) NOT NULL DEFAULT 0 , username VARCHAR , schemaname VARCHAR , flagIN INT NOT NULL DEFAULT 0 , client_addr VARCHAR , proxy_addr VARCHAR , proxy_port INT , digest VARCHAR , match_digest VARCHAR , match_pattern VARCHAR , negate_match_pattern INT CHECK (negate_match_pattern IN (0,1)) NOT NULL DEFAULT 0 , re_modifiers VARCHAR DEFAULT 'CASELESS' , flagOUT INT , replace_pattern VARCHAR , destination_hostgroup INT DEFAULT NULL , cache_ttl INT CHECK(cache_ttl > 0) , reconnect INT CHECK (reconnect IN (0,1)) DEFAULT NULL , timeout INT UNSIGNED , retries INT CHECK (retries>=0 AND retries <=1000) , delay INT UNSIGNED , mirror_flagOUT INT UNSIGNED , mirror_hostgroup INT UNSIGNED , error_msg VARCHAR , sticky_conn INT CHECK (sticky_conn IN (0,1)) , multiplex INT CHECK (multiplex IN (0,1)) , log INT CHECK (log IN (0,1)) , apply INT CHECK(apply IN (0,1)) NOT NULL DEFAULT 0 , comment VARCHAR , qos_max_qps INT CHECK (qos_max_qps>=0) , qos_burst INT CHECK (qos_burst>=0) , qos_max_concurrency INT CHECK (qos_max_concurrency>=0) , qos_max_wait_ms INT CHECK (qos_max_wait_ms>=0) , priority INT CHECK (priority IN (0,1,2)) , hedge_delay_ms INT CHECK (hedge_delay_ms>=0))"
+
+#define ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES_V1_4_2
 
 #define ADMIN_SQLITE_TABLE_GLOBAL_VARIABLES "CREATE TABLE global_variables (variable_name VARCHAR NOT NULL PRIMARY KEY , variable_value VARCHAR NOT NULL)"
 
@@ -154,15 +166,18 @@ pthread_mutex_t admin_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define ADMIN_SQLITE_TABLE_SCHEDULER_V1_2_2c "CREATE TABLE scheduler (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL , active INT CHECK (active IN (0,1)) NOT NULL DEFAULT 1 , interval_ms INTEGER CHECK (interval_ms>=100 AND interval_ms<=100000000) NOT NULL , filename VARCHAR NOT NULL , arg1 VARCHAR , arg2 VARCHAR , arg3 VARCHAR , arg4 VARCHAR , arg5 VARCHAR , comment VARCHAR NOT NULL DEFAULT '')"
 
-#define ADMIN_SQLITE_TABLE_RUNTIME_MYSQL_SERVERS "CREATE TABLE runtime_mysql_servers (hostgroup_id INT NOT NULL DEFAULT 0 , hostname VARCHAR NOT NULL , port INT NOT NULL DEFAULT 3306 , status VARCHAR CHECK (UPPER(status) IN ('ONLINE','SHUNNED','OFFLINE_SOFT', 'OFFLINE_HARD')) NOT NULL DEFAULT 'ONLINE' , weight INT CHECK (weight >= 0) NOT NULL DEFAULT 1 , compression INT CHECK (compression >=0 AND compression <= 102400) NOT NULL DEFAULT 0 , max_connections INT CHECK (max_connections >=0) NOT NULL DEFAULT 1000 , max_replication_lag INT CHECK (max_replication_lag >= 0 AND max_replication_lag <= 126144000) NOT NULL DEFAULT 0 , use_ssl INT CHECK (use_ssl IN(0,1)) NOT NULL DEFAULT 0 , max_latency_ms INT UNSIGNED CHECK (max_latency_ms>=0) NOT NULL DEFAULT 0 , comment VARCHAR NOT NULL DEFAULT '' , PRIMARY KEY (hostgroup_id, hostname, port) )"
+#define ADMIN_SQLITE_TABLE_RUNTIME_MYSQL_SERVERS "CREATE TABLE runtime_mysql_servers (hostgroup_id INT NOT NULL DEFAULT 0 , hostname VARCHAR NOT NULL , port INT NOT NULL DEFAULT 3306 , status VARCHAR CHECK (UPPER(status) IN ('ONLINE','SHUNNED','OFFLINE_SOFT', 'OFFLINE_HARD')) NOT NULL DEFAULT 'ONLINE' , weight INT CHECK (weight >= 0) NOT NULL DEFAULT 1 , compression INT CHECK (compression >=0 AND compression <= 102400) NOT NULL DEFAULT 0 , max_connections INT CHECK (max_connections >=0) NOT NULL DEFAULT 1000 , max_replication_lag INT CHECK (max_replication_lag >= 0 AND max_replication_lag <= 126144000) NOT NULL DEFAULT 0 , use_ssl INT CHECK (use_ssl IN(0,1)) NOT NULL DEFAULT 0 , max_latency_ms INT UNSIGNED CHECK (max_latency_ms>=0) NOT NULL DEFAULT 0 , min_idle_connections INT CHECK (min_idle_connections >=0) NOT NULL DEFAULT 0 , comment VARCHAR NOT NULL DEFAULT '' , PRIMARY KEY (hostgroup_id, hostname, port) )"
 
 #define ADMIN_SQLITE_TABLE_RUNTIME_MYSQL_REPLICATION_HOSTGROUPS "CREATE TABLE runtime_mysql_replication_hostgroups (writer_hostgroup INT CHECK (writer_hostgroup>=0) NOT NULL PRIMARY KEY , reader_hostgroup INT NOT NULL CHECK (reader_hostgroup<>writer_hostgroup AND reader_hostgroup>0) , comment VARCHAR , UNIQUE (reader_hostgroup))"
 
-#define ADMIN_SQLITE_TABLE_RUNTIME_MYSQL_QUERY_RULES "CREATE TABLE runtime_mysql_query_rules (rule_id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL , active INT CHECK (active IN (0,1)) NOT NULL DEFAULT 0 , username VARCHAR , schemaname VARCHAR , flagIN INT NOT NULL DEFAULT 0 , client_addr VARCHAR , proxy_addr VARCHAR , proxy_port INT , digest VARCHAR , match_digest VARCHAR , match_pattern VARCHAR , negate_match_pattern INT CHECK (negate_match_pattern IN (0,1)) NOT NULL DEFAULT 0 , re_modifiers VARCHAR , flagOUT INT , replace_pattern VARCHAR , destination_hostgroup INT DEFAULT NULL , cache_ttl INT CHECK(cache_ttl > 0) , reconnect INT CHECK (reconnect IN (0,1)) DEFAULT NULL , timeout INT UNSIGNED , retries INT CHECK (retries>=0 AND retries <=1000) , delay INT UNSIGNED , mirror_flagOUT INT UNSIGNED , mirror_hostgroup INT UNSIGNED , error_msg VARCHAR , sticky_conn INT CHECK (sticky_conn IN (0,1)) , multiplex INT CHECK (multiplex IN (0,1)) , log INT CHECK (log IN (0,1)) , apply INT CHECK(apply IN (0,1)) NOT NULL DEFAULT 0 , comment VARCHAR)"
+#define ADMIN_SQLITE_TABLE_RUNTIME_MYSQL_QUERY_RULES "CREATE TABLE runtime_mysql_query_rules (rule_id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL , active INT CHECK (active IN (0,1)) NOT NULL DEFAULT 0 , username VARCHAR , schemaname VARCHAR , flagIN INT NOT NULL DEFAULT 0 , client_addr VARCHAR , proxy_addr VARCHAR , proxy_port INT , digest VARCHAR , match_digest VARCHAR , match_pattern VARCHAR , negate_match_pattern INT CHECK (negate_match_pattern IN (0,1)) NOT NULL DEFAULT 0 , re_modifiers VARCHAR , flagOUT INT , replace_pattern VARCHAR , destination_hostgroup INT DEFAULT NULL , cache_ttl INT CHECK(cache_ttl > 0) , reconnect INT CHECK (reconnect IN (0,1)) DEFAULT NULL , timeout INT UNSIGNED , retries INT CHECK (retries>=0 AND retries <=1000) , delay INT UNSIGNED , mirror_flagOUT INT UNSIGNED , mirror_hostgroup INT UNSIGNED , error_msg VARCHAR , sticky_conn INT CHECK (sticky_conn IN (0,1)) , multiplex INT CHECK (multiplex IN (0,1)) , log INT CHECK (log IN (0,1)) , apply INT CHECK(apply IN (0,1)) NOT NULL DEFAULT 0 , comment VARCHAR , qos_max_qps INT CHECK (qos_max_qps>=0) , qos_burst INT CHECK (qos_burst>=0) , qos_max_concurrency INT CHECK (qos_max_concurrency>=0) , qos_max_wait_ms INT CHECK (qos_max_wait_ms>=0) , priority INT CHECK (priority IN (0,1,2)) , hedge_delay_ms INT CHECK (hedge_delay_ms>=0))"
 
 #define ADMIN_SQLITE_TABLE_RUNTIME_SCHEDULER "CREATE TABLE runtime_scheduler (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL , active INT CHECK (active IN (0,1)) NOT NULL DEFAULT 1 , interval_ms INTEGER CHECK (interval_ms>=100 AND interval_ms<=100000000) NOT NULL , filename VARCHAR NOT NULL , arg1 VARCHAR , arg2 VARCHAR , arg3 VARCHAR , arg4 VARCHAR , arg5 VARCHAR , comment VARCHAR NOT NULL DEFAULT '')" 
 
 #define STATS_SQLITE_TABLE_MYSQL_QUERY_RULES "CREATE TABLE stats_mysql_query_rules (rule_id INTEGER PRIMARY KEY , hits INT NOT NULL)"
+#define STATS_SQLITE_TABLE_MYSQL_QUERY_RULES_HEDGE "CREATE TABLE stats_mysql_query_rules_hedge (rule_id INTEGER PRIMARY KEY , hedge_delay_ms INT NOT NULL , current_delay_us INT NOT NULL , hedged INT NOT NULL , won INT NOT NULL)"
+#define STATS_SQLITE_TABLE_MYSQL_CIRCUIT_BREAKER_LOG "CREATE TABLE stats_mysql_circuit_breaker_log (time_us INT NOT NULL , hostgroup INT NOT NULL , srv_host VARCHAR NOT NULL , srv_port INT NOT NULL , from_state VARCHAR NOT NULL , to_state VARCHAR NOT NULL , requests INT NOT NULL , failures INT NOT NULL)"
+#define STATS_SQLITE_TABLE_MYSQL_QUERY_RULES_QOS "CREATE TABLE stats_mysql_query_rules_qos (rule_id INTEGER PRIMARY KEY , max_qps INT NOT NULL , burst INT NOT NULL , max_concurrency INT NOT NULL , max_wait_ms INT NOT NULL , running INT NOT NULL , admitted INT NOT NULL , queued INT NOT NULL , rejected INT NOT NULL , wait_time_us INT NOT NULL)"
 #define STATS_SQLITE_TABLE_MYSQL_COMMANDS_COUNTERS "CREATE TABLE stats_mysql_commands_counters (Command VARCHAR NOT NULL PRIMARY KEY , Total_Time_us INT NOT NULL , Total_cnt INT NOT NULL , cnt_100us INT NOT NULL , cnt_500us INT NOT NULL , cnt_1ms INT NOT NULL , cnt_5ms INT NOT NULL , cnt_10ms INT NOT NULL , cnt_50ms INT NOT NULL , cnt_100ms INT NOT NULL , cnt_500ms INT NOT NULL , cnt_1s INT NOT NULL , cnt_5s INT NOT NULL , cnt_10s INT NOT NULL , cnt_INFs)"
 #define STATS_SQLITE_TABLE_MYSQL_PROCESSLIST "CREATE TABLE stats_mysql_processlist (ThreadID INT NOT NULL , SessionID INTEGER PRIMARY KEY , user VARCHAR , db VARCHAR , cli_host VARCHAR , cli_port VARCHAR , hostgroup VARCHAR , l_srv_host VARCHAR , l_srv_port VARCHAR , srv_host VARCHAR , srv_port VARCHAR , command VARCHAR , time_ms INT NOT NULL , info VARCHAR)"
 #define STATS_SQLITE_TABLE_MYSQL_CONNECTION_POOL "CREATE TABLE stats_mysql_connection_pool (hostgroup VARCHAR , srv_host VARCHAR , srv_port VARCHAR , status VARCHAR , ConnUsed INT , ConnFree INT , ConnOK INT , ConnERR INT , Queries INT , Bytes_data_sent INT , Bytes_data_recv INT , Latency_ms INT)"
@@ -173,6 +188,19 @@ pthread_mutex_t admin_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define STATS_SQLITE_TABLE_MYSQL_GLOBAL "CREATE TABLE stats_mysql_global (Variable_Name VARCHAR NOT NULL PRIMARY KEY , Variable_Value VARCHAR NOT NULL)"
 
+#define STATS_SQLITE_TABLE_MYSQL_COMMANDS_HISTOGRAM "CREATE TABLE stats_mysql_commands_histogram (Command VARCHAR NOT NULL , le_us INT , cnt INT NOT NULL)"
+
+#define STATS_SQLITE_TABLE_MYSQL_QUERY_DIGEST_PHASES "CREATE TABLE stats_mysql_query_digest_phases (hostgroup INT , schemaname VARCHAR NOT NULL , username VARCHAR NOT NULL , digest VARCHAR NOT NULL , phase VARCHAR NOT NULL , count_star INTEGER NOT NULL , sum_time INTEGER NOT NULL , max_time INTEGER NOT NULL , cnt_100us INT NOT NULL , cnt_500us INT NOT NULL , cnt_1ms INT NOT NULL , cnt_5ms INT NOT NULL , cnt_10ms INT NOT NULL , cnt_50ms INT NOT NULL , cnt_100ms INT NOT NULL , cnt_500ms INT NOT NULL , cnt_1s INT NOT NULL , cnt_5s INT NOT NULL , cnt_10s INT NOT NULL , cnt_INFs INT NOT NULL , PRIMARY KEY(hostgroup, schemaname, username, digest, phase))"
+
+// the following stats tables are virtual tables: their rows are generated
+// from the runtime structures on every scan, see SQLite3_vtab_table
+#define STATS_SQLITE_VTAB_MYSQL_PROCESSLIST "CREATE VIRTUAL TABLE stats_mysql_processlist USING stats_mysql_processlist"
+#define STATS_SQLITE_VTAB_MYSQL_CONNECTION_POOL "CREATE VIRTUAL TABLE stats_mysql_connection_pool USING stats_mysql_connection_pool"
+#define STATS_SQLITE_VTAB_MYSQL_QUERY_DIGEST "CREATE VIRTUAL TABLE stats_mysql_query_digest USING stats_mysql_query_digest"
+#define STATS_SQLITE_VTAB_MYSQL_GLOBAL "CREATE VIRTUAL TABLE stats_mysql_global USING stats_mysql_global"
+#define STATS_SQLITE_VTAB_MYSQL_COMMANDS_HISTOGRAM "CREATE VIRTUAL TABLE stats_mysql_commands_histogram USING stats_mysql_commands_histogram"
+#define STATS_SQLITE_VTAB_MYSQL_QUERY_DIGEST_PHASES "CREATE VIRTUAL TABLE stats_mysql_query_digest_phases USING stats_mysql_query_digest_phases"
+
 #ifdef DEBUG
 #define ADMIN_SQLITE_TABLE_DEBUG_LEVELS "CREATE TABLE debug_levels (module VARCHAR NOT NULL PRIMARY KEY , verbosity INT NOT NULL DEFAULT 0)"
 #endif /* DEBUG */
@@ -191,6 +219,7 @@ static char * admin_variables_names[]= {
   (char *)"mysql_ifaces",
   (char *)"telnet_admin_ifaces",
   (char *)"telnet_stats_ifaces",
+  (char *)"metrics_ifaces",
   (char *)"refresh_interval",
 	(char *)"read_only",
 	(char *)"hash_passwords",
@@ -517,6 +546,19 @@ bool admin_handler_command_proxysql(char *query_no_space, unsigned int query_no_
 		return false;
 	}
 
+	if (query_no_space_length==strlen("PROXYSQL SAVE SNAPSHOT") && !strncasecmp("PROXYSQL SAVE SNAPSHOT",query_no_space, query_no_space_length)) {
+		proxy_info("Received PROXYSQL SAVE SNAPSHOT command\n");
+		ProxySQL_Admin *SPA=(ProxySQL_Admin *)pa;
+		char *err=NULL;
+		if (SPA->save_runtime_snapshot(&err)) {
+			SPA->send_MySQL_OK(&sess->client_myds->myprot, NULL);
+		} else {
+			SPA->send_MySQL_ERR(&sess->client_myds->myprot, err);
+			free(err);
+		}
+		return false;
+	}
+
 	if (query_no_space_length==strlen("PROXYSQL KILL") && !strncasecmp("PROXYSQL KILL",query_no_space, query_no_space_length)) {
 		proxy_info("Received PROXYSQL KILL command\n");
 		exit(EXIT_SUCCESS);
@@ -1226,13 +1268,12 @@ bool admin_handler_command_load_or_save(char *query_no_space, unsigned int query
 
 void ProxySQL_Admin::GenericRefreshStatistics(const char *query_no_space, unsigned int query_no_space_length, bool admin) {
 	bool refresh=false;
-	bool stats_mysql_processlist=false;
-	bool stats_mysql_connection_pool=false;
-	bool stats_mysql_query_digest=false;
 	bool stats_mysql_query_digest_reset=false;
-	bool stats_mysql_global=false;
 	bool stats_mysql_commands_counters=false;
 	bool stats_mysql_query_rules=false;
+	bool stats_mysql_query_rules_qos=false;
+	bool stats_mysql_query_rules_hedge=false;
+	bool stats_mysql_circuit_breaker_log=false;
 	bool dump_global_variables=false;
 
 	bool runtime_scheduler=false;
@@ -1240,23 +1281,20 @@ void ProxySQL_Admin::GenericRefreshStatistics(const char *query_no_space, unsign
 	bool runtime_mysql_servers=false;
 	bool runtime_mysql_query_rules=false;
 
-	if (strcasestr(query_no_space,"processlist"))
-		// This will match the following usecases:
-		// SHOW PROCESSLIST
-		// SHOW FULL PROCESSLIST
-		// SELECT * FROM stats_mysql_processlist
-		{ stats_mysql_processlist=true; refresh=true; }
-	if (strstr(query_no_space,"stats_mysql_query_digest"))
-		{ stats_mysql_query_digest=true; refresh=true; }
+	// stats_mysql_processlist, stats_mysql_connection_pool, stats_mysql_query_digest,
+	// stats_mysql_global, stats_mysql_commands_histogram and stats_mysql_query_digest_phases
+	// are virtual tables and don't need any refresh
 	if (strstr(query_no_space,"stats_mysql_query_digest_reset"))
 		{ stats_mysql_query_digest_reset=true; refresh=true; }
-	if (strstr(query_no_space,"stats_mysql_global"))
-		{ stats_mysql_global=true; refresh=true; }
-	if (strstr(query_no_space,"stats_mysql_connection_pool"))
-		{ stats_mysql_connection_pool=true; refresh=true; }
 	if (strstr(query_no_space,"stats_mysql_commands_counters"))
 		{ stats_mysql_commands_counters=true; refresh=true; }
-	if (strstr(query_no_space,"stats_mysql_query_rules"))
+	if (strstr(query_no_space,"stats_mysql_circuit_breaker_log"))
+		{ stats_mysql_circuit_breaker_log=true; refresh=true; }
+	if (strstr(query_no_space,"stats_mysql_query_rules_qos"))
+		{ stats_mysql_query_rules_qos=true; refresh=true; }
+	else if (strstr(query_no_space,"stats_mysql_query_rules_hedge"))
+		{ stats_mysql_query_rules_hedge=true; refresh=true; }
+	else if (strstr(query_no_space,"stats_mysql_query_rules"))
 		{ stats_mysql_query_rules=true; refresh=true; }
 	if (admin) {
 		if (strstr(query_no_space,"global_variables"))
@@ -1284,18 +1322,16 @@ void ProxySQL_Admin::GenericRefreshStatistics(const char *query_no_space, unsign
 	if (refresh==true) {
 		pthread_mutex_lock(&admin_mutex);
 		//ProxySQL_Admin *SPA=(ProxySQL_Admin *)pa;
-		if (stats_mysql_processlist)
-			stats___mysql_processlist();
-		if (stats_mysql_query_digest)
-			stats___mysql_query_digests();
 		if (stats_mysql_query_digest_reset)
 			stats___mysql_query_digests_reset();
-		if (stats_mysql_connection_pool)
-			stats___mysql_connection_pool();
-		if (stats_mysql_global)
-			stats___mysql_global();
 		if (stats_mysql_query_rules)
 			stats___mysql_query_rules();
+		if (stats_mysql_query_rules_qos)
+			stats___mysql_query_rules_qos();
+		if (stats_mysql_query_rules_hedge)
+			stats___mysql_query_rules_hedge();
+		if (stats_mysql_circuit_breaker_log)
+			stats___mysql_circuit_breaker_log();
 		if (stats_mysql_commands_counters)
 			stats___mysql_commands_counters();
 		if (admin) {
@@ -2020,7 +2056,6 @@ void admin_session_handler(MySQL_Session *sess, ProxySQL_Admin *pa, PtrSize_t *p
 		l_free(query_length,query);
 		query=l_strdup("SELECT Variable_Name AS Variable_name, Variable_Value AS Value FROM stats_mysql_global ORDER BY variable_name");
 		query_length=strlen(query)+1;
-		GloAdmin->stats___mysql_global();
 		goto __run_query;
 	}
 
@@ -2137,16 +2172,6 @@ void *child_mysql(void *arg) {
 	int client = *(int *)arg;
 //	__thr_sfp=l_mem_init();
 
-	GloMTH->wrlock();
-	mysql_thread___server_version=GloMTH->get_variable((char *)"server_version");
-	mysql_thread___default_schema=GloMTH->get_variable((char *)"default_schema");
-	{
-		char *s=GloMTH->get_variable((char *)"server_capabilities");
-		mysql_thread___server_capabilities=atoi(s);
-		free(s);
-	}
-	GloMTH->wrunlock();
-
 	struct pollfd fds[1];
 	nfds_t nfds=1;
 	int rc;
@@ -2215,8 +2240,6 @@ void *child_mysql(void *arg) {
 
 __exit_child_mysql:
 	//delete sess;
-	if (mysql_thread___default_schema) { free(mysql_thread___default_schema); mysql_thread___default_schema=NULL; }
-	if (mysql_thread___server_version) { free(mysql_thread___server_version); mysql_thread___server_version=NULL; }
 	delete mysql_thr;
 //	l_mem_destroy(__thr_sfp);
 	return NULL;
@@ -2301,6 +2324,7 @@ static void * admin_main_loop(void *arg)
 	volatile int *shutdown=((struct _main_args *)arg)->shutdown;
 	char *socket_names[MAX_ADMIN_LISTENERS];
 	for (i=0;i<MAX_ADMIN_LISTENERS;i++) { socket_names[i]=NULL; }
+	GloMTH->set_auxiliary_thread_affinity(); // inherited by the admin sessions threads
 	pthread_attr_t attr;
   pthread_attr_init(&attr);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -2439,6 +2463,36 @@ __end_while_pool:
 #endif /* DEBUG */
 #define PROXYSQL_ADMIN_VERSION "0.2.0902" DEB
 
+static SQLite3_result * vtab_stats_mysql_processlist(void *arg, SQLite3_vtab_filter *filter) {
+	if (!GloMTH) return NULL;
+	return GloMTH->SQL3_Processlist(filter);
+}
+
+static SQLite3_result * vtab_stats_mysql_connection_pool(void *arg, SQLite3_vtab_filter *filter) {
+	if (!MyHGM) return NULL;
+	return MyHGM->SQL3_Connection_Pool();
+}
+
+static SQLite3_result * vtab_stats_mysql_query_digest(void *arg, SQLite3_vtab_filter *filter) {
+	if (!GloQPro) return NULL;
+	return GloQPro->get_query_digests(filter);
+}
+
+static SQLite3_result * vtab_stats_mysql_global(void *arg, SQLite3_vtab_filter *filter) {
+	ProxySQL_Admin *SPA=(ProxySQL_Admin *)arg;
+	return SPA->generate_stats_mysql_global();
+}
+
+static SQLite3_result * vtab_stats_mysql_commands_histogram(void *arg, SQLite3_vtab_filter *filter) {
+	if (!GloQPro) return NULL;
+	return GloQPro->get_stats_commands_histogram();
+}
+
+static SQLite3_result * vtab_stats_mysql_query_digest_phases(void *arg, SQLite3_vtab_filter *filter) {
+	if (!GloQPro) return NULL;
+	return GloQPro->get_query_digests_phases(filter);
+}
+
 ProxySQL_Admin::ProxySQL_Admin() {
 #ifdef DEBUG
 		if (glovars.has_debug==false) {
@@ -2463,6 +2517,7 @@ ProxySQL_Admin::ProxySQL_Admin() {
 	variables.telnet_stats_ifaces=NULL;
 	//variables.telnet_admin_ifaces=strdup("127.0.0.1:6030");
 	//variables.telnet_stats_ifaces=strdup("127.0.0.1:6031");
+	variables.metrics_ifaces=strdup("");	// the metrics exporter is disabled by default
 	variables.refresh_interval=2000;
 	variables.hash_passwords=true;	// issue #676
 	variables.admin_read_only=false;	// by default, the admin interface accepts writes
@@ -2472,6 +2527,7 @@ ProxySQL_Admin::ProxySQL_Admin() {
 #endif /* DEBUG */
 	// create the scheduler
 	scheduler=new ProxySQL_External_Scheduler();
+	exporter=new ProxySQL_Exporter();
 
 	match_regexes.opt=(re2::RE2::Options *)new re2::RE2::Options(RE2::Quiet);
 	re2::RE2::Options *opt2=(re2::RE2::Options *)match_regexes.opt;
@@ -2581,12 +2637,17 @@ bool ProxySQL_Admin::init() {
 
 
 	insert_into_tables_defs(tables_defs_stats,"stats_mysql_query_rules", STATS_SQLITE_TABLE_MYSQL_QUERY_RULES);
+	insert_into_tables_defs(tables_defs_stats,"stats_mysql_query_rules_qos", STATS_SQLITE_TABLE_MYSQL_QUERY_RULES_QOS);
+	insert_into_tables_defs(tables_defs_stats,"stats_mysql_query_rules_hedge", STATS_SQLITE_TABLE_MYSQL_QUERY_RULES_HEDGE);
 	insert_into_tables_defs(tables_defs_stats,"stats_mysql_commands_counters", STATS_SQLITE_TABLE_MYSQL_COMMANDS_COUNTERS);
-	insert_into_tables_defs(tables_defs_stats,"stats_mysql_processlist", STATS_SQLITE_TABLE_MYSQL_PROCESSLIST);
-	insert_into_tables_defs(tables_defs_stats,"stats_mysql_connection_pool", STATS_SQLITE_TABLE_MYSQL_CONNECTION_POOL);
-	insert_into_tables_defs(tables_defs_stats,"stats_mysql_query_digest", STATS_SQLITE_TABLE_MYSQL_QUERY_DIGEST);
+	insert_into_tables_defs(tables_defs_stats,"stats_mysql_circuit_breaker_log", STATS_SQLITE_TABLE_MYSQL_CIRCUIT_BREAKER_LOG);
+	insert_into_tables_defs(tables_defs_stats,"stats_mysql_processlist", STATS_SQLITE_VTAB_MYSQL_PROCESSLIST);
+	insert_into_tables_defs(tables_defs_stats,"stats_mysql_connection_pool", STATS_SQLITE_VTAB_MYSQL_CONNECTION_POOL);
+	insert_into_tables_defs(tables_defs_stats,"stats_mysql_query_digest", STATS_SQLITE_VTAB_MYSQL_QUERY_DIGEST);
 	insert_into_tables_defs(tables_defs_stats,"stats_mysql_query_digest_reset", STATS_SQLITE_TABLE_MYSQL_QUERY_DIGEST_RESET);
-	insert_into_tables_defs(tables_defs_stats,"stats_mysql_global", STATS_SQLITE_TABLE_MYSQL_GLOBAL);
+	insert_into_tables_defs(tables_defs_stats,"stats_mysql_global", STATS_SQLITE_VTAB_MYSQL_GLOBAL);
+	insert_into_tables_defs(tables_defs_stats,"stats_mysql_commands_histogram", STATS_SQLITE_VTAB_MYSQL_COMMANDS_HISTOGRAM);
+	insert_into_tables_defs(tables_defs_stats,"stats_mysql_query_digest_phases", STATS_SQLITE_VTAB_MYSQL_QUERY_DIGEST_PHASES);
 	insert_into_tables_defs(tables_defs_stats,"global_variables", ADMIN_SQLITE_TABLE_GLOBAL_VARIABLES); // workaround for issue #708
 
 	// upgrade mysql_servers if needed (upgrade from previous version)
@@ -2601,6 +2662,19 @@ bool ProxySQL_Admin::init() {
 	// upgrade scheduler if needed (upgrade from previous version)
 	disk_upgrade_scheduler();
 
+	vtabs_stats=new std::vector<SQLite3_vtab_table *>;
+	vtabs_stats->push_back(new SQLite3_vtab_table("stats_mysql_processlist", STATS_SQLITE_TABLE_MYSQL_PROCESSLIST, vtab_stats_mysql_processlist, this, &admin_mutex));
+	vtabs_stats->push_back(new SQLite3_vtab_table("stats_mysql_connection_pool", STATS_SQLITE_TABLE_MYSQL_CONNECTION_POOL, vtab_stats_mysql_connection_pool, this, &admin_mutex));
+	vtabs_stats->push_back(new SQLite3_vtab_table("stats_mysql_query_digest", STATS_SQLITE_TABLE_MYSQL_QUERY_DIGEST, vtab_stats_mysql_query_digest, this, &admin_mutex));
+	vtabs_stats->push_back(new SQLite3_vtab_table("stats_mysql_global", STATS_SQLITE_TABLE_MYSQL_GLOBAL, vtab_stats_mysql_global, this, &admin_mutex));
+	vtabs_stats->push_back(new SQLite3_vtab_table("stats_mysql_commands_histogram", STATS_SQLITE_TABLE_MYSQL_COMMANDS_HISTOGRAM, vtab_stats_mysql_commands_histogram, this, &admin_mutex));
+	vtabs_stats->push_back(new SQLite3_vtab_table("stats_mysql_query_digest_phases", STATS_SQLITE_TABLE_MYSQL_QUERY_DIGEST_PHASES, vtab_stats_mysql_query_digest_phases, this, &admin_mutex));
+	for (std::vector<SQLite3_vtab_table *>::iterator it=vtabs_stats->begin(); it!=vtabs_stats->end(); ++it) {
+		// admindb reads the stats tables through the attached "stats" schema
+		statsdb->create_vtab_module(*it);
+		admindb->create_vtab_module(*it);
+	}
+
 	check_and_build_standard_tables(admindb, tables_defs_admin);
 	check_and_build_standard_tables(configdb, tables_defs_config);
 	check_and_build_standard_tables(statsdb, tables_defs_stats);
@@ -2643,34 +2717,42 @@ bool ProxySQL_Admin::init() {
 
 	if (GloVars.__cmd_proxysql_reload || GloVars.__cmd_proxysql_initial || admindb_file_exists==false) { // see #617
 		if (GloVars.configfile_open) {
+			unsigned long long t1=monotonic_time();
+			int rows=0;
 			if (GloVars.confFile->cfg) {
- 				Read_MySQL_Servers_from_configfile();
-				Read_Global_Variables_from_configfile("admin");
-				Read_Global_Variables_from_configfile("mysql");
-				Read_MySQL_Users_from_configfile();
-				Read_MySQL_Query_Rules_from_configfile();
-				Read_Scheduler_from_configfile();
+ 				rows+=Read_MySQL_Servers_from_configfile();
+				rows+=Read_Global_Variables_from_configfile("admin");
+				rows+=Read_Global_Variables_from_configfile("mysql");
+				rows+=Read_MySQL_Users_from_configfile();
+				rows+=Read_MySQL_Query_Rules_from_configfile();
+				rows+=Read_Scheduler_from_configfile();
 				__insert_or_replace_disktable_select_maintable();
 			} else {
 				if (GloVars.confFile->OpenFile(GloVars.config_file)==true) {
- 					Read_MySQL_Servers_from_configfile();
-					Read_MySQL_Users_from_configfile();
-					Read_MySQL_Query_Rules_from_configfile();
-					Read_Global_Variables_from_configfile("admin");
-					Read_Global_Variables_from_configfile("mysql");
-					Read_Scheduler_from_configfile();
+ 					rows+=Read_MySQL_Servers_from_configfile();
+					rows+=Read_MySQL_Users_from_configfile();
+					rows+=Read_MySQL_Query_Rules_from_configfile();
+					rows+=Read_Global_Variables_from_configfile("admin");
+					rows+=Read_Global_Variables_from_configfile("mysql");
+					rows+=Read_Scheduler_from_configfile();
 					__insert_or_replace_disktable_select_maintable();
 				}
 			}
+			proxy_info("Loaded %d rows from config file in %llums\n", rows, (monotonic_time()-t1)/1000);
 		}
 	}
+	if (GloVars.__cmd_proxysql_snapshot) {
+		// the snapshot is the runtime state: it replaces what was loaded from disk or config file
+		load_runtime_snapshot();
+	}
 	flush_admin_variables___database_to_runtime(admindb,true);
 	flush_mysql_variables___database_to_runtime(admindb,true);
 
 	S_amll.update_ifaces(variables.mysql_ifaces, &S_amll.ifaces_mysql);
 	S_amll.update_ifaces(variables.telnet_admin_ifaces, &S_amll.ifaces_telnet_admin);
 	S_amll.update_ifaces(variables.telnet_stats_ifaces, &S_amll.ifaces_telnet_stats);
-
+	exporter->update_ifaces(variables.metrics_ifaces);
+	exporter->start();
 
 
 //	pthread_t admin_thr;
@@ -2696,11 +2778,20 @@ void ProxySQL_Admin::admin_shutdown() {
 	int i;
 //	do { usleep(50); } while (main_shutdown==0);
 	pthread_join(admin_thr, NULL);
+	if (exporter) {
+		exporter->stop();
+		delete exporter;
+		exporter=NULL;
+	}
 	delete admindb;
 	delete statsdb;
 	delete configdb;
 	delete monitordb;
 	sqlite3_shutdown();
+	for (std::vector<SQLite3_vtab_table *>::iterator it=vtabs_stats->begin(); it!=vtabs_stats->end(); ++it) {
+		delete *it;
+	}
+	delete vtabs_stats;
 	if (main_poll_fds) {
 		for (i=0;i<main_poll_nfds;i++) {
 			shutdown(main_poll_fds[i].fd,SHUT_RDWR);
@@ -2769,14 +2860,21 @@ bool ProxySQL_Admin::is_command(std::string s) {
 
 void ProxySQL_Admin::dump_mysql_collations() {
 	const CHARSET_INFO * c = compiled_charsets;
-	char buf[1024];
-	char *query=(char *)"INSERT INTO mysql_collations VALUES (%d, \"%s\", \"%s\", \"\")";
+	char buf[16];
+	char *fields[4];
+	SQLite3_batch_insert bi(admindb, "INSERT INTO mysql_collations VALUES ", 4);
+	bi.begin();
 	admindb->execute("DELETE FROM mysql_collations");
 	do {
-		sprintf(buf,query,c->nr, c->name, c->csname);
-		admindb->execute(buf);
+		sprintf(buf,"%d",c->nr);
+		fields[0]=buf;
+		fields[1]=(char *)c->name;
+		fields[2]=(char *)c->csname;
+		fields[3]=(char *)"";
+		bi.add_row(fields);
 		++c;
 	} while (c[0].nr != 0);
+	bi.flush();
 	admindb->execute("INSERT OR REPLACE INTO mysql_collations SELECT Id, Collation, Charset, 'Yes' FROM mysql_collations JOIN (SELECT MIN(Id) minid FROM mysql_collations GROUP BY Charset) t ON t.minid=mysql_collations.Id");
 	admindb->execute("DELETE FROM disk.mysql_collations");
 	admindb->execute("INSERT INTO disk.mysql_collations SELECT * FROM main.mysql_collations");
@@ -2934,32 +3032,33 @@ void ProxySQL_Admin::flush_mysql_variables___runtime_to_database(SQLite3DB *db,
 	if (runtime) {
 		db->execute("DELETE FROM runtime_global_variables WHERE variable_name LIKE 'mysql-%'");
 	}
-	char *a;
-	char *b=(char *)"INSERT INTO runtime_global_variables(variable_name, variable_value) VALUES(\"mysql-%s\",\"%s\")";
-  if (replace) {
-    a=(char *)"REPLACE INTO global_variables(variable_name, variable_value) VALUES(\"mysql-%s\",\"%s\")";
-  } else {
-    a=(char *)"INSERT OR IGNORE INTO global_variables(variable_name, variable_value) VALUES(\"mysql-%s\",\"%s\")";
-  }
-  int l=strlen(a)+200;
+	SQLite3_batch_insert bi(db, (replace ? "REPLACE INTO global_variables(variable_name, variable_value) VALUES " : "INSERT OR IGNORE INTO global_variables(variable_name, variable_value) VALUES "), 2);
+	SQLite3_batch_insert *bir=NULL;
+	if (runtime) {
+		bir=new SQLite3_batch_insert(db, "INSERT INTO runtime_global_variables(variable_name, variable_value) VALUES ", 2);
+	}
+	bi.begin();
 	GloMTH->wrlock();
 	char **varnames=GloMTH->get_variables_list();
 	for (int i=0; varnames[i]; i++) {
 		char *val=GloMTH->get_variable(varnames[i]);
-		l+=( varnames[i] ? strlen(varnames[i]) : 6);
-		l+=( val ? strlen(val) : 6);
-		char *query=(char *)malloc(l);
-		sprintf(query, a, varnames[i], val);
-		if (runtime) {
-			db->execute(query);
-			sprintf(query, b, varnames[i], val);
-		}
-		db->execute(query);
+		char *fields[2];
+		fields[0]=(char *)malloc(strlen(varnames[i])+7);
+		sprintf(fields[0],"mysql-%s",varnames[i]);
+		fields[1]=(val ? val : (char *)"");
+		bi.add_row(fields);
+		if (bir) {
+			bir->add_row(fields);
+		}
+		free(fields[0]);
 		if (val)
 			free(val);
-		free(query);
 	}
 	GloMTH->wrunlock();
+	if (bir) {
+		delete bir;
+	}
+	bi.flush();
 	for (int i=0; varnames[i]; i++) {
 		free(varnames[i]);
 	}
@@ -2998,6 +3097,7 @@ char * ProxySQL_Admin::get_variable(char *name) {
 	if (!strcasecmp(name,"mysql_ifaces")) return s_strdup(variables.mysql_ifaces);
 	if (!strcasecmp(name,"telnet_admin_ifaces")) return s_strdup(variables.telnet_admin_ifaces);
 	if (!strcasecmp(name,"telnet_stats_ifaces")) return s_strdup(variables.telnet_stats_ifaces);
+	if (!strcasecmp(name,"metrics_ifaces")) return s_strdup(variables.metrics_ifaces);
 	if (!strcasecmp(name,"refresh_interval")) {
 		sprintf(intbuf,"%d",variables.refresh_interval);
 		return strdup(intbuf);
@@ -3166,6 +3266,17 @@ bool ProxySQL_Admin::set_variable(char *name, char *value) {  // this is the pub
 			return false;
 		}
 	}
+	if (!strcasecmp(name,"metrics_ifaces")) {
+		// an empty list is valid: it disables the metrics exporter
+		if (strcmp(variables.metrics_ifaces,value)) {
+			free(variables.metrics_ifaces);
+			variables.metrics_ifaces=strdup(value);
+			if (exporter) {
+				exporter->update_ifaces(variables.metrics_ifaces);
+			}
+		}
+		return true;
+	}
 	if (!strcasecmp(name,"refresh_interval")) {
 		int intv=atoi(value);
 		if (intv > 100 && intv < 100000) {
@@ -3226,226 +3337,124 @@ bool ProxySQL_Admin::set_variable(char *name, char *value) {  // this is the pub
 
 
 
-void ProxySQL_Admin::stats___mysql_global() {
-	if (!GloMTH) return;
-	SQLite3_result * resultset=GloMTH->SQL3_GlobalStatus();
-	if (resultset==NULL) return;
-	statsdb->execute("BEGIN");
-	statsdb->execute("DELETE FROM stats_mysql_global");
-	char *a=(char *)"INSERT INTO stats_mysql_global VALUES (\"%s\",\"%s\")";
-	for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
-		SQLite3_row *r=*it;
-		int arg_len=0;
-		for (int i=0; i<2; i++) {
-			arg_len+=strlen(r->fields[i]);
-		}
-		char *query=(char *)malloc(strlen(a)+arg_len+32);
-		sprintf(query,a,r->fields[0],r->fields[1]);
-		statsdb->execute(query);
-		free(query);
-	}
-	delete resultset;
-	resultset=NULL;
+SQLite3_result * ProxySQL_Admin::generate_stats_mysql_global() {
+	if (!GloMTH) return NULL;
+	SQLite3_result * result=GloMTH->SQL3_GlobalStatus();
+	if (result==NULL) return NULL;
+	char *pta[2];
+	char bu[32];
 	int highwater;
 	int current;
 	sqlite3_status(SQLITE_STATUS_MEMORY_USED, &current, &highwater, 0);
-	char bu[32];
-	char *vn=NULL;
-	char *query=NULL;
-	vn=(char *)"SQLite3_memory_bytes";
+	pta[0]=(char *)"SQLite3_memory_bytes";
 	sprintf(bu,"%d",current);
-	query=(char *)malloc(strlen(a)+strlen(vn)+strlen(bu)+16);
-	sprintf(query,a,vn,bu);
-	statsdb->execute(query);
-	free(query);
+	pta[1]=bu;
+	result->add_row(pta);
 
 	unsigned long long connpool_mem=MyHGM->Get_Memory_Stats();
-	vn=(char *)"ConnPool_memory_bytes";
+	pta[0]=(char *)"ConnPool_memory_bytes";
 	sprintf(bu,"%llu",connpool_mem);
-	query=(char *)malloc(strlen(a)+strlen(vn)+strlen(bu)+16);
-	sprintf(query,a,vn,bu);
-	statsdb->execute(query);
-	free(query);
+	result->add_row(pta);
 
 	if (GloMyStmt) {
 		uint32_t stmt_active_unique=0;
 		uint32_t stmt_active_total=0;
 		GloMyStmt->active_prepared_statements(&stmt_active_unique,&stmt_active_total);
-		vn=(char *)"Stmt_Active_Total";
+		pta[0]=(char *)"Stmt_Active_Total";
 		sprintf(bu,"%u",stmt_active_total);
-		query=(char *)malloc(strlen(a)+strlen(vn)+strlen(bu)+16);
-		sprintf(query,a,vn,bu);
-		statsdb->execute(query);
-		free(query);
-		vn=(char *)"Stmt_Active_Unique";
+		result->add_row(pta);
+		pta[0]=(char *)"Stmt_Active_Unique";
 		sprintf(bu,"%u",stmt_active_unique);
-		query=(char *)malloc(strlen(a)+strlen(vn)+strlen(bu)+16);
-		sprintf(query,a,vn,bu);
-		statsdb->execute(query);
-		free(query);
-		vn=(char *)"Stmt_Max_Stmt_id";
+		result->add_row(pta);
+		pta[0]=(char *)"Stmt_Max_Stmt_id";
 		sprintf(bu,"%u",GloMyStmt->total_prepared_statements());
-		query=(char *)malloc(strlen(a)+strlen(vn)+strlen(bu)+16);
-		sprintf(query,a,vn,bu);
-		statsdb->execute(query);
-		free(query);
+		result->add_row(pta);
 	}
 
-	resultset=GloQC->SQL3_getStats();
+	SQLite3_result * resultset=GloQC->SQL3_getStats();
 	if (resultset) {
 		for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 			SQLite3_row *r=*it;
-			int arg_len=0;
-			for (int i=0; i<2; i++) {
-				arg_len+=strlen(r->fields[i]);
-			}
-			char *query=(char *)malloc(strlen(a)+arg_len+32);
-			sprintf(query,a,r->fields[0],r->fields[1]);
-			statsdb->execute(query);
-			free(query);
+			result->add_row(r->fields);
 		}
 		delete resultset;
 		resultset=NULL;
 	}
-
-	statsdb->execute("COMMIT");
+	return result;
 }
 
-void ProxySQL_Admin::stats___mysql_processlist() {
-	if (!GloMTH) return;
-	SQLite3_result * resultset=GloMTH->SQL3_Processlist();
+void ProxySQL_Admin::stats___mysql_commands_counters() {
+	if (!GloQPro) return;
+	SQLite3_result * resultset=GloQPro->get_stats_commands_counters();
 	if (resultset==NULL) return;
-	statsdb->execute("BEGIN");
-	statsdb->execute("DELETE FROM stats_mysql_processlist");
-	char *a=(char *)"INSERT INTO stats_mysql_processlist VALUES ('%s','%s','%s','%s','%s','%s','%s','%s','%s','%s','%s','%s','%s','%s')";
+	SQLite3_batch_insert bi(statsdb, "INSERT INTO stats_mysql_commands_counters VALUES ", 15);
+	bi.begin();
+	statsdb->execute("DELETE FROM stats_mysql_commands_counters");
 	for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 		SQLite3_row *r=*it;
-		int arg_len=0;
-		char *o_info=NULL;
-		for (int i=0; i<13; i++) { // info (field 13) is left out! See #746
-			if (r->fields[i])
-				arg_len+=strlen(r->fields[i]);
-		}
-		if (r->fields[13]) { // this is just for info column (field 13) . See #746
-			o_info=escape_string_single_quotes(r->fields[13],false);
-			int l=strlen(o_info)+4;
-			arg_len+=l;
-		}
-		char *query=(char *)malloc(strlen(a)+arg_len+32);
-		sprintf(query,a,
-			(r->fields[0] ? r->fields[0] : ""),
-			(r->fields[1] ? r->fields[1] : ""),
-			(r->fields[2] ? r->fields[2] : ""),
-			(r->fields[3] ? r->fields[3] : ""),
-			(r->fields[4] ? r->fields[4] : ""),
-			(r->fields[5] ? r->fields[5] : ""),
-			(r->fields[6] ? r->fields[6] : ""),
-			(r->fields[7] ? r->fields[7] : ""),
-			(r->fields[8] ? r->fields[8] : ""),
-			(r->fields[9] ? r->fields[9] : ""),
-			(r->fields[10] ? r->fields[10] : ""),
-			(r->fields[11] ? r->fields[11] : ""),
-			(r->fields[12] ? r->fields[12] : ""),
-			(r->fields[13] ? o_info : "")
-		);
-		statsdb->execute(query);
-		free(query);
-		if (o_info) {
-			if (o_info!=r->fields[13]) { // there was a copy
-				free(o_info);
-			}
-		}
+		bi.add_row(r->fields);
 	}
-	statsdb->execute("COMMIT");
+	bi.flush();
 	delete resultset;
 }
 
-void ProxySQL_Admin::stats___mysql_connection_pool() {
-
-	if (!MyHGM) return;
-	SQLite3_result * resultset=MyHGM->SQL3_Connection_Pool();
+void ProxySQL_Admin::stats___mysql_query_rules() {
+	if (!GloQPro) return;
+	SQLite3_result * resultset=GloQPro->get_stats_query_rules();
 	if (resultset==NULL) return;
-	statsdb->execute("BEGIN");
-	statsdb->execute("DELETE FROM stats_mysql_connection_pool");
-	char *a=(char *)"INSERT INTO stats_mysql_connection_pool VALUES (\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\")";
+	SQLite3_batch_insert bi(statsdb, "INSERT INTO stats_mysql_query_rules VALUES ", 2);
+	bi.begin();
+	statsdb->execute("DELETE FROM stats_mysql_query_rules");
 	for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 		SQLite3_row *r=*it;
-		int arg_len=0;
-		for (int i=0; i<12; i++) {
-			arg_len+=strlen(r->fields[i]);
-		}
-		char *query=(char *)malloc(strlen(a)+arg_len+32);
-		sprintf(query,a,r->fields[0],r->fields[1],r->fields[2],r->fields[3],r->fields[4],r->fields[5],r->fields[6],r->fields[7],r->fields[8],r->fields[9],r->fields[10],r->fields[11]);
-		statsdb->execute(query);
-		free(query);
+		bi.add_row(r->fields);
 	}
-	statsdb->execute("COMMIT");
+	bi.flush();
 	delete resultset;
 }
 
-void ProxySQL_Admin::stats___mysql_commands_counters() {
+void ProxySQL_Admin::stats___mysql_query_rules_qos() {
 	if (!GloQPro) return;
-	SQLite3_result * resultset=GloQPro->get_stats_commands_counters();
+	SQLite3_result * resultset=GloQPro->get_stats_query_rules_qos();
 	if (resultset==NULL) return;
-	statsdb->execute("BEGIN");
-	statsdb->execute("DELETE FROM stats_mysql_commands_counters");
-	char *a=(char *)"INSERT INTO stats_mysql_commands_counters VALUES (\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\")";
+	SQLite3_batch_insert bi(statsdb, "INSERT INTO stats_mysql_query_rules_qos VALUES ", 10);
+	bi.begin();
+	statsdb->execute("DELETE FROM stats_mysql_query_rules_qos");
 	for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 		SQLite3_row *r=*it;
-		int arg_len=0;
-		for (int i=0; i<15; i++) {
-			arg_len+=strlen(r->fields[i]);
-		}
-		char *query=(char *)malloc(strlen(a)+arg_len+32);
-		sprintf(query,a,r->fields[0],r->fields[1],r->fields[2],r->fields[3],r->fields[4],r->fields[5],r->fields[6],r->fields[7],r->fields[8],r->fields[9],r->fields[10],r->fields[11],r->fields[12],r->fields[13],r->fields[14]);
-		statsdb->execute(query);
-		free(query);
+		bi.add_row(r->fields);
 	}
-	statsdb->execute("COMMIT");
+	bi.flush();
 	delete resultset;
 }
 
-void ProxySQL_Admin::stats___mysql_query_rules() {
+void ProxySQL_Admin::stats___mysql_query_rules_hedge() {
 	if (!GloQPro) return;
-	SQLite3_result * resultset=GloQPro->get_stats_query_rules();
+	SQLite3_result * resultset=GloQPro->get_stats_query_rules_hedge();
 	if (resultset==NULL) return;
-	statsdb->execute("BEGIN");
-	statsdb->execute("DELETE FROM stats_mysql_query_rules");
-	char *a=(char *)"INSERT INTO stats_mysql_query_rules VALUES (\"%s\",\"%s\")";
+	SQLite3_batch_insert bi(statsdb, "INSERT INTO stats_mysql_query_rules_hedge VALUES ", 5);
+	bi.begin();
+	statsdb->execute("DELETE FROM stats_mysql_query_rules_hedge");
 	for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 		SQLite3_row *r=*it;
-		int arg_len=0;
-		for (int i=0; i<2; i++) {
-			arg_len+=strlen(r->fields[i]);
-		}
-		char *query=(char *)malloc(strlen(a)+arg_len+32);
-		sprintf(query,a,r->fields[0],r->fields[1]);
-		statsdb->execute(query);
-		free(query);
+		bi.add_row(r->fields);
 	}
-	statsdb->execute("COMMIT");
+	bi.flush();
 	delete resultset;
 }
 
-void ProxySQL_Admin::stats___mysql_query_digests() {
-	if (!GloQPro) return;
-	SQLite3_result * resultset=GloQPro->get_query_digests();
+void ProxySQL_Admin::stats___mysql_circuit_breaker_log() {
+	if (!MyHGM) return;
+	SQLite3_result * resultset=MyHGM->SQL3_Circuit_Breaker_Log();
 	if (resultset==NULL) return;
-	statsdb->execute("BEGIN");
-	statsdb->execute("DELETE FROM stats_mysql_query_digest");
-	char *a=(char *)"INSERT INTO stats_mysql_query_digest VALUES (%s,\"%s\",\"%s\",\"%s\",\"%s\",%s,%s,%s,%s,%s,%s)";
+	SQLite3_batch_insert bi(statsdb, "INSERT INTO stats_mysql_circuit_breaker_log VALUES ", 8);
+	bi.begin();
+	statsdb->execute("DELETE FROM stats_mysql_circuit_breaker_log");
 	for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 		SQLite3_row *r=*it;
-		int arg_len=0;
-		for (int i=0; i<11; i++) {
-			arg_len+=strlen(r->fields[i]);
-		}
-		char *query=(char *)malloc(strlen(a)+arg_len+32);
-		sprintf(query,a,r->fields[10],r->fields[0],r->fields[1],r->fields[2],r->fields[3],r->fields[4],r->fields[5],r->fields[6],r->fields[7],r->fields[8],r->fields[9]);
-		statsdb->execute(query);
-		free(query);
+		bi.add_row(r->fields);
 	}
-	statsdb->execute("COMMIT");
+	bi.flush();
 	delete resultset;
 }
 
@@ -3453,100 +3462,55 @@ void ProxySQL_Admin::stats___mysql_query_digests_reset() {
 	if (!GloQPro) return;
 	SQLite3_result * resultset=GloQPro->get_query_digests_reset();
 	if (resultset==NULL) return;
-	statsdb->execute("BEGIN");
+	SQLite3_batch_insert bi(statsdb, "INSERT INTO stats_mysql_query_digest_reset VALUES ", 11);
+	bi.begin();
 	statsdb->execute("DELETE FROM stats_mysql_query_digest_reset");
-	char *a=(char *)"INSERT INTO stats_mysql_query_digest_reset VALUES (%s,\"%s\",\"%s\",\"%s\",\"%s\",%s,%s,%s,%s,%s,%s)";
 	for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 		SQLite3_row *r=*it;
-		int arg_len=0;
-		for (int i=0; i<11; i++) {
-			arg_len+=strlen(r->fields[i]);
-		}
-		char *query=(char *)malloc(strlen(a)+arg_len+32);
-		sprintf(query,a,r->fields[10],r->fields[0],r->fields[1],r->fields[2],r->fields[3],r->fields[4],r->fields[5],r->fields[6],r->fields[7],r->fields[8],r->fields[9]);
-		statsdb->execute(query);
-		free(query);
+		bi.add_row(r->fields);
 	}
-	statsdb->execute("COMMIT");
+	bi.flush();
 	delete resultset;
 }
 
 void ProxySQL_Admin::save_mysql_query_rules_from_runtime(bool _runtime) {
+	SQLite3_result * resultset=GloQPro->get_current_query_rules();
+	if (resultset==NULL) {
+		if (_runtime) {
+			admindb->execute("DELETE FROM runtime_mysql_query_rules");
+		} else {
+			admindb->execute("DELETE FROM mysql_query_rules");
+		}
+		return;
+	}
+	char *a=NULL;
 	if (_runtime) {
-		admindb->execute("DELETE FROM runtime_mysql_query_rules");
+		a=(char *)"INSERT INTO runtime_mysql_query_rules (rule_id, active, username, schemaname, flagIN, client_addr, proxy_addr, proxy_port, digest, match_digest, match_pattern, negate_match_pattern, re_modifiers, flagOUT, replace_pattern, destination_hostgroup, cache_ttl, reconnect, timeout, retries, delay, mirror_flagOUT, mirror_hostgroup, error_msg, sticky_conn, multiplex, log, apply, comment, qos_max_qps, qos_burst, qos_max_concurrency, qos_max_wait_ms, priority, hedge_delay_ms) VALUES ";
 	} else {
-		admindb->execute("DELETE FROM mysql_query_rules");
+		a=(char *)"INSERT INTO mysql_query_rules (rule_id, active, username, schemaname, flagIN, client_addr, proxy_addr, proxy_port, digest, match_digest, match_pattern, negate_match_pattern, re_modifiers, flagOUT, replace_pattern, destination_hostgroup, cache_ttl, reconnect, timeout, retries, delay, mirror_flagOUT, mirror_hostgroup, error_msg, sticky_conn, multiplex, log, apply, comment, qos_max_qps, qos_burst, qos_max_concurrency, qos_max_wait_ms, priority, hedge_delay_ms) VALUES ";
 	}
-	SQLite3_result * resultset=GloQPro->get_current_query_rules();
-	if (resultset==NULL) return;
-	//char *a=(char *)"INSERT INTO mysql_query_rules VALUES (\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\")";
-	char *a=NULL;
+	SQLite3_batch_insert bi(admindb, a, 35);
+	bi.begin();
 	if (_runtime) {
-		a=(char *)"INSERT INTO runtime_mysql_query_rules (rule_id, active, username, schemaname, flagIN, client_addr, proxy_addr, proxy_port, digest, match_digest, match_pattern, negate_match_pattern, re_modifiers, flagOUT, replace_pattern, destination_hostgroup, cache_ttl, reconnect, timeout, retries, delay, mirror_flagOUT, mirror_hostgroup, error_msg, sticky_conn, multiplex, log, apply, comment) VALUES (%s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s)";
+		admindb->execute("DELETE FROM runtime_mysql_query_rules");
 	} else {
-		a=(char *)"INSERT INTO mysql_query_rules (rule_id, active, username, schemaname, flagIN, client_addr, proxy_addr, proxy_port, digest, match_digest, match_pattern, negate_match_pattern, re_modifiers, flagOUT, replace_pattern, destination_hostgroup, cache_ttl, reconnect, timeout, retries, delay, mirror_flagOUT, mirror_hostgroup, error_msg, sticky_conn, multiplex, log, apply, comment) VALUES (%s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s)";
+		admindb->execute("DELETE FROM mysql_query_rules");
 	}
+	// numeric fields set to -1 in runtime are NULL in the table
+	static const int nullable_numeric[] = { 4, 7, 13, 15, 16, 17, 18, 19, 20, 21, 22, 24, 25, 26, 27, 29, 30, 31, 32, 33, 34 };
+	char *fields[35];
 	for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 		SQLite3_row *r=*it;
-		int arg_len=0;
-		char *buffs[29];
-		for (int i=0; i<29; i++) {
-			if (r->fields[i]) {
-				char *o=escape_string_single_quotes(r->fields[i],false);
-				int l=strlen(o)+4;
-				arg_len+=l;
-				buffs[i]=(char *)malloc(l);
-				sprintf(buffs[i],"'%s'",o);
-				if (o!=r->fields[i]) { // there was a copy
-					free(o);
-				}
-			} else {
-				int l=9;
-				arg_len+=l;
-				buffs[i]=(char *)malloc(l);
-				sprintf(buffs[i],"NULL");
+		memcpy(fields, r->fields, sizeof(char *)*35);
+		for (unsigned int i=0; i<sizeof(nullable_numeric)/sizeof(int); i++) {
+			int j=nullable_numeric[i];
+			if (fields[j] && strcmp(fields[j],"-1")==0) {
+				fields[j]=NULL;
 			}
 		}
-		char *query=(char *)malloc(strlen(a)+arg_len+32);
-
-		sprintf(query,a,
-			buffs[0],
-			buffs[1],
-			buffs[2],
-			buffs[3],
-			( strcmp(r->fields[4],"-1")==0 ? "NULL" : r->fields[4] ), // flagIN
-			buffs[5],	// client_addr
-			buffs[6],	// proxy_addr
-			( strcmp(r->fields[7],"-1")==0 ? "NULL" : r->fields[7] ), // proxy_port
-			buffs[8],	// digest
-			buffs[9], // match_digest
-			buffs[10], // match_pattern
-			r->fields[11], // negate
-      buffs[12], // re_modifiers
-			( strcmp(r->fields[13],"-1")==0 ? "NULL" : r->fields[13] ), // flagOUT
-			buffs[14], // replace_pattern
-			( strcmp(r->fields[15],"-1")==0 ? "NULL" : r->fields[15] ), // destination_hostgroup
-			( strcmp(r->fields[16],"-1")==0 ? "NULL" : r->fields[16] ), // cache_ttl
-			( strcmp(r->fields[17],"-1")==0 ? "NULL" : r->fields[17] ), // reconnect
-			( strcmp(r->fields[18],"-1")==0 ? "NULL" : r->fields[18] ), // timeout
-			( strcmp(r->fields[19],"-1")==0 ? "NULL" : r->fields[19] ), // retries
-			( strcmp(r->fields[20],"-1")==0 ? "NULL" : r->fields[20] ), // delay
-			( strcmp(r->fields[21],"-1")==0 ? "NULL" : r->fields[21] ), // mirror_flagOUT
-			( strcmp(r->fields[22],"-1")==0 ? "NULL" : r->fields[22] ), // mirror_hostgroup
-			buffs[23], // error_msg
-			( strcmp(r->fields[24],"-1")==0 ? "NULL" : r->fields[24] ), // sticky_conn
-			( strcmp(r->fields[25],"-1")==0 ? "NULL" : r->fields[25] ), // multiplex
-			( strcmp(r->fields[26],"-1")==0 ? "NULL" : r->fields[26] ), // log
-			( strcmp(r->fields[27],"-1")==0 ? "NULL" : r->fields[27] ), // apply
-			buffs[28] // comment
-		);
-		//fprintf(stderr,"%s\n",query);
-		admindb->execute(query);
-		for (int i=0; i<29; i++) {
-			free(buffs[i]);
-		}
-		free(query);
+		bi.add_row(fields);
 	}
+	bi.flush();
 	delete resultset;
 }
 
@@ -3582,31 +3546,31 @@ void ProxySQL_Admin::flush_admin_variables___runtime_to_database(SQLite3DB *db,
 	if (runtime) {
 		db->execute("DELETE FROM runtime_global_variables WHERE variable_name LIKE 'admin-%'");
 	}
-	char *a;
-	char *b=(char *)"INSERT INTO runtime_global_variables(variable_name, variable_value) VALUES(\"admin-%s\",\"%s\")";
-  if (replace) {
-    a=(char *)"REPLACE INTO global_variables(variable_name, variable_value) VALUES(\"admin-%s\",\"%s\")";
-  } else {
-    a=(char *)"INSERT OR IGNORE INTO global_variables(variable_name, variable_value) VALUES(\"admin-%s\",\"%s\")";
-  }
-  int l=strlen(a)+200;
-
+	SQLite3_batch_insert bi(db, (replace ? "REPLACE INTO global_variables(variable_name, variable_value) VALUES " : "INSERT OR IGNORE INTO global_variables(variable_name, variable_value) VALUES "), 2);
+	SQLite3_batch_insert *bir=NULL;
+	if (runtime) {
+		bir=new SQLite3_batch_insert(db, "INSERT INTO runtime_global_variables(variable_name, variable_value) VALUES ", 2);
+	}
+	bi.begin();
 	char **varnames=get_variables_list();
 	for (int i=0; varnames[i]; i++) {
 		char *val=get_variable(varnames[i]);
-		l+=( varnames[i] ? strlen(varnames[i]) : 6);
-		l+=( val ? strlen(val) : 6);
-		char *query=(char *)malloc(l);
-		sprintf(query, a, varnames[i], val);
-		db->execute(query);
-		if (runtime) {
-			sprintf(query, b, varnames[i], val);
-			db->execute(query);
-		}
+		char *fields[2];
+		fields[0]=(char *)malloc(strlen(varnames[i])+7);
+		sprintf(fields[0],"admin-%s",varnames[i]);
+		fields[1]=(val ? val : (char *)"");
+		bi.add_row(fields);
+		if (bir) {
+			bir->add_row(fields);
+		}
+		free(fields[0]);
 		if (val)
 			free(val);
-		free(query);
 	}
+	if (bir) {
+		delete bir;
+	}
+	bi.flush();
 	for (int i=0; varnames[i]; i++) {
 		free(varnames[i]);
 	}
@@ -3618,20 +3582,18 @@ void ProxySQL_Admin::flush_admin_variables___runtime_to_database(SQLite3DB *db,
 #ifdef DEBUG
 void ProxySQL_Admin::flush_debug_levels_runtime_to_database(SQLite3DB *db, bool replace) {
 	int i;
-	char *a=NULL;
+	char buf[16];
+	char *fields[2];
+	SQLite3_batch_insert bi(db, (replace ? "REPLACE INTO debug_levels(module,verbosity) VALUES " : "INSERT OR IGNORE INTO debug_levels(module,verbosity) VALUES "), 2);
+	bi.begin();
 	db->execute("DELETE FROM debug_levels WHERE verbosity=0");
-  if (replace) {
-    a=(char *)"REPLACE INTO debug_levels(module,verbosity) VALUES(\"%s\",%d)";
-  } else {
-    a=(char *)"INSERT OR IGNORE INTO debug_levels(module,verbosity) VALUES(\"%s\",%d)";
-  }
-  int l=strlen(a)+100;
-  for (i=0;i<PROXY_DEBUG_UNKNOWN;i++) {
-    char *query=(char *)malloc(l);
-    sprintf(query, a, GloVars.global.gdbg_lvl[i].name, GloVars.global.gdbg_lvl[i].verbosity);
-    db->execute(query);
-    free(query);
-  }
+	for (i=0;i<PROXY_DEBUG_UNKNOWN;i++) {
+		sprintf(buf,"%d",GloVars.global.gdbg_lvl[i].verbosity);
+		fields[0]=(char *)GloVars.global.gdbg_lvl[i].name;
+		fields[1]=buf;
+		bi.add_row(fields);
+	}
+	bi.flush();
 }
 #endif /* DEBUG */
 
@@ -3706,9 +3668,10 @@ void ProxySQL_Admin::__delete_disktable() {
 }
 
 void ProxySQL_Admin::__insert_or_replace_disktable_select_maintable() {
+	// a single transaction, so the disk database is synced once
+	admindb->execute("BEGIN");
   admindb->execute("INSERT OR REPLACE INTO disk.mysql_servers SELECT * FROM main.mysql_servers");
   admindb->execute("INSERT OR REPLACE INTO disk.mysql_replication_hostgroups SELECT * FROM main.mysql_replication_hostgroups");
-  admindb->execute("INSERT OR REPLACE INTO disk.mysql_query_rules SELECT * FROM main.mysql_query_rules");
   admindb->execute("INSERT OR REPLACE INTO disk.mysql_users SELECT * FROM main.mysql_users");
 	admindb->execute("INSERT OR REPLACE INTO disk.mysql_query_rules SELECT * FROM main.mysql_query_rules");
 	admindb->execute("INSERT OR REPLACE INTO disk.global_variables SELECT * FROM main.global_variables");
@@ -3716,6 +3679,227 @@ void ProxySQL_Admin::__insert_or_replace_disktable_select_maintable() {
 #ifdef DEBUG
   admindb->execute("INSERT OR REPLACE INTO disk.debug_levels SELECT * FROM main.debug_levels");
 #endif /* DEBUG */
+	admindb->execute("COMMIT");
+}
+
+// tables saved in a runtime snapshot: runtime table to save, main table to load, and its schema
+static const char * snapshot_tables[][3] = {
+	{ "runtime_mysql_servers", "main.mysql_servers", ADMIN_SQLITE_TABLE_MYSQL_SERVERS },
+	{ "runtime_mysql_replication_hostgroups", "main.mysql_replication_hostgroups", ADMIN_SQLITE_TABLE_MYSQL_REPLICATION_HOSTGROUPS },
+	{ "runtime_mysql_users", "main.mysql_users", ADMIN_SQLITE_TABLE_MYSQL_USERS },
+	{ "runtime_mysql_query_rules", "main.mysql_query_rules", ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES },
+	{ "runtime_scheduler", "main.scheduler", ADMIN_SQLITE_TABLE_SCHEDULER },
+	{ "runtime_global_variables", "main.global_variables", ADMIN_SQLITE_TABLE_GLOBAL_VARIABLES },
+};
+#define SNAPSHOT_TABLES (sizeof(snapshot_tables)/sizeof(snapshot_tables[0]))
+
+// a snapshot is usable only if created with the same tables definitions
+static uint64_t snapshot_schema_hash() {
+	std::string s;
+	for (unsigned int i=0; i<SNAPSHOT_TABLES; i++) {
+		s.append(snapshot_tables[i][2]);
+	}
+	return SpookyHash::Hash64(s.data(), s.length(), 0);
+}
+
+static void snapshot_append_u32(std::string &b, uint32_t v) {
+	b.append((const char *)&v, sizeof(v));
+}
+
+static void snapshot_append_u64(std::string &b, uint64_t v) {
+	b.append((const char *)&v, sizeof(v));
+}
+
+/*
+ * The snapshot file is a proxysql_snapshot_header_t followed by a body with,
+ * for every table in snapshot_tables:
+ *  - uint32 table index, uint32 number of columns, uint64 number of rows
+ *  - every field as uint32 length (SNAPSHOT_NULL_FIELD for NULL), its bytes and a trailing 0
+ * Fields are null-terminated so that they are bound in place from the mmap()ed file,
+ * see SQLite3_batch_insert::add_row()
+ */
+bool ProxySQL_Admin::save_runtime_snapshot(char **err) {
+	unsigned long long t1=monotonic_time();
+	// refresh the runtime_ tables from the runtime
+	mysql_servers_wrlock();
+	save_mysql_servers_runtime_to_database(true);
+	mysql_servers_wrunlock();
+	save_mysql_users_runtime_to_database(true);
+	save_mysql_query_rules_from_runtime(true);
+	save_scheduler_runtime_to_database(true);
+	admindb->execute("DELETE FROM runtime_global_variables");
+	flush_admin_variables___runtime_to_database(admindb, false, false, false, true);
+	flush_mysql_variables___runtime_to_database(admindb, false, false, false, true);
+
+	std::string body;
+	unsigned long long rows=0;
+	for (unsigned int i=0; i<SNAPSHOT_TABLES; i++) {
+		char *error=NULL;
+		int cols=0;
+		int affected_rows=0;
+		SQLite3_result *resultset=NULL;
+		char *query=(char *)malloc(strlen(snapshot_tables[i][0])+32);
+		sprintf(query,"SELECT * FROM %s", snapshot_tables[i][0]);
+		admindb->execute_statement(query, &error , &cols , &affected_rows , &resultset);
+		free(query);
+		if (error) {
+			*err=error;
+			if (resultset) delete resultset;
+			return false;
+		}
+		snapshot_append_u32(body, i);
+		snapshot_append_u32(body, resultset->columns);
+		snapshot_append_u64(body, resultset->rows_count);
+		for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
+			SQLite3_row *r=*it;
+			for (int j=0; j<resultset->columns; j++) {
+				if (r->fields[j]) {
+					uint32_t l=strlen(r->fields[j]);
+					snapshot_append_u32(body, l);
+					body.append(r->fields[j], l+1);
+				} else {
+					snapshot_append_u32(body, SNAPSHOT_NULL_FIELD);
+				}
+			}
+		}
+		rows+=resultset->rows_count;
+		delete resultset;
+	}
+
+	proxysql_snapshot_header_t hdr;
+	memset(&hdr,0,sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.format_version=SNAPSHOT_FORMAT_VERSION;
+	hdr.tables=SNAPSHOT_TABLES;
+	strncpy(hdr.proxysql_version, PROXYSQL_VERSION, sizeof(hdr.proxysql_version)-1);
+	hdr.schema_hash=snapshot_schema_hash();
+	hdr.created_at=realtime_time();
+	hdr.body_length=body.length();
+	hdr.body_hash=SpookyHash::Hash64(body.data(), body.length(), 0);
+
+	// write a temporary file and rename it, so a snapshot is never partially written
+	char *tmpfile=(char *)malloc(strlen(GloVars.snapshot)+5);
+	sprintf(tmpfile,"%s.tmp",GloVars.snapshot);
+	int fd=open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	bool ret=false;
+	if (fd>=0) {
+		if (
+			write(fd, &hdr, sizeof(hdr))==(ssize_t)sizeof(hdr)
+			&& write(fd, body.data(), body.length())==(ssize_t)body.length()
+			&& fsync(fd)==0
+		) {
+			ret=true;
+		}
+		close(fd);
+		if (ret && rename(tmpfile, GloVars.snapshot)) {
+			ret=false;
+		}
+	}
+	if (ret==false) {
+		*err=(char *)malloc(strlen(tmpfile)+strlen(strerror(errno))+64);
+		sprintf(*err,"Unable to write snapshot %s: %s", tmpfile, strerror(errno));
+		unlink(tmpfile);
+	} else {
+		proxy_info("Saved runtime snapshot %s with %llu rows in %llums\n", GloVars.snapshot, rows, (monotonic_time()-t1)/1000);
+	}
+	free(tmpfile);
+	return ret;
+}
+
+// returns false if the snapshot doesn't exist or can't be used: the configuration is then loaded from SQLite
+bool ProxySQL_Admin::load_runtime_snapshot() {
+	unsigned long long t1=monotonic_time();
+	int fd=open(GloVars.snapshot, O_RDONLY);
+	if (fd<0) {
+		proxy_warning("Unable to open snapshot %s: %s . Loading configuration from database\n", GloVars.snapshot, strerror(errno));
+		return false;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) || (size_t)sb.st_size < sizeof(proxysql_snapshot_header_t)) {
+		proxy_warning("Invalid snapshot %s . Loading configuration from database\n", GloVars.snapshot);
+		close(fd);
+		return false;
+	}
+	size_t size=sb.st_size;
+	char *map=(char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map==MAP_FAILED) {
+		proxy_warning("Unable to mmap snapshot %s: %s . Loading configuration from database\n", GloVars.snapshot, strerror(errno));
+		return false;
+	}
+	proxysql_snapshot_header_t hdr;
+	memcpy(&hdr, map, sizeof(hdr));
+	const char *body=map+sizeof(hdr);
+	if (
+		memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic))
+		|| hdr.format_version!=SNAPSHOT_FORMAT_VERSION
+		|| hdr.tables!=SNAPSHOT_TABLES
+		|| strncmp(hdr.proxysql_version, PROXYSQL_VERSION, sizeof(hdr.proxysql_version))
+		|| hdr.schema_hash!=snapshot_schema_hash()
+		|| hdr.body_length!=size-sizeof(hdr)
+		|| hdr.body_hash!=SpookyHash::Hash64(body, hdr.body_length, 0)
+	) {
+		proxy_warning("Snapshot %s was created by a different version or is corrupted . Loading configuration from database\n", GloVars.snapshot);
+		munmap(map, size);
+		return false;
+	}
+
+	// all rows are loaded in a single transaction, rolled back if the snapshot is truncated
+	const char *p=body;
+	const char *end=body+hdr.body_length;
+	bool ok=true;
+	unsigned long long rows=0;
+	admindb->execute("PRAGMA foreign_keys = OFF");
+	admindb->execute("BEGIN");
+	for (unsigned int i=0; i<SNAPSHOT_TABLES && ok; i++) {
+		uint32_t idx;
+		uint32_t cols;
+		uint64_t nrows;
+		if (end-p < (ssize_t)(sizeof(idx)+sizeof(cols)+sizeof(nrows))) { ok=false; break; }
+		memcpy(&idx, p, sizeof(idx)); p+=sizeof(idx);
+		memcpy(&cols, p, sizeof(cols)); p+=sizeof(cols);
+		memcpy(&nrows, p, sizeof(nrows)); p+=sizeof(nrows);
+		if (idx!=i || cols==0) { ok=false; break; }
+		char *query=(char *)malloc(strlen(snapshot_tables[i][1])+32);
+		sprintf(query,"DELETE FROM %s", snapshot_tables[i][1]);
+		admindb->execute(query);
+		sprintf(query,"INSERT INTO %s VALUES ", snapshot_tables[i][1]);
+		SQLite3_batch_insert *bi=new SQLite3_batch_insert(admindb, query, cols);
+		free(query);
+		char **fields=(char **)malloc(sizeof(char *)*cols);
+		for (uint64_t r=0; r<nrows && ok; r++) {
+			for (uint32_t j=0; j<cols; j++) {
+				uint32_t l;
+				if (end-p < (ssize_t)sizeof(l)) { ok=false; break; }
+				memcpy(&l, p, sizeof(l)); p+=sizeof(l);
+				if (l==SNAPSHOT_NULL_FIELD) {
+					fields[j]=NULL;
+				} else {
+					if ((uint64_t)(end-p) < (uint64_t)l+1 || p[l]!=0) { ok=false; break; }
+					fields[j]=(char *)p;
+					p+=l+1;
+				}
+			}
+			if (ok) {
+				ok=bi->add_row(fields, false); // the file is unmapped after delete bi
+				rows++;
+			}
+		}
+		if (ok) {
+			ok=bi->flush();
+		}
+		delete bi;
+		free(fields);
+	}
+	admindb->execute(ok ? "COMMIT" : "ROLLBACK");
+	admindb->execute("PRAGMA foreign_keys = ON");
+	munmap(map, size);
+	if (ok==false) {
+		proxy_warning("Unable to load snapshot %s . Loading configuration from database\n", GloVars.snapshot);
+		return false;
+	}
+	proxy_info("Loaded runtime snapshot %s with %llu rows in %llums\n", GloVars.snapshot, rows, (monotonic_time()-t1)/1000);
+	return true;
 }
 
 
@@ -3971,47 +4155,48 @@ void ProxySQL_Admin::save_mysql_users_runtime_to_database(bool _runtime) {
 	account_details_t **ads=NULL;
 	int num_users;
 	int i;
-	char *qf=(char *)"REPLACE INTO mysql_users(username,password,active,use_ssl,default_hostgroup,default_schema,schema_locked,transaction_persistent,fast_forward,backend,frontend,max_connections) VALUES(\"%s\",\"%s\",1,%d,%d,\"%s\",%d,%d,%d,COALESCE((SELECT backend FROM mysql_users WHERE username=\"%s\" AND frontend=1),0),1,%d)";
-	char *qb=(char *)"REPLACE INTO mysql_users(username,password,active,use_ssl,default_hostgroup,default_schema,schema_locked,transaction_persistent,fast_forward,backend,frontend,max_connections) VALUES(\"%s\",\"%s\",1,%d,%d,\"%s\",%d,%d,%d,1,COALESCE((SELECT frontend FROM mysql_users WHERE username=\"%s\" AND backend=1),0),%d)";
-	char *qfr=(char *)"REPLACE INTO runtime_mysql_users(username,password,active,use_ssl,default_hostgroup,default_schema,schema_locked,transaction_persistent,fast_forward,backend,frontend,max_connections) VALUES(\"%s\",\"%s\",1,%d,%d,\"%s\",%d,%d,%d,COALESCE((SELECT backend FROM runtime_mysql_users WHERE username=\"%s\" AND frontend=1),0),1,%d)";
-	char *qbr=(char *)"REPLACE INTO runtime_mysql_users(username,password,active,use_ssl,default_hostgroup,default_schema,schema_locked,transaction_persistent,fast_forward,backend,frontend,max_connections) VALUES(\"%s\",\"%s\",1,%d,%d,\"%s\",%d,%d,%d,1,COALESCE((SELECT frontend FROM runtime_mysql_users WHERE username=\"%s\" AND backend=1),0),%d)";
+	// a user defined both as frontend and backend is dumped as two accounts:
+	// the second row reads the first one, so rows are written one at a time
+	char *qp=(char *)(_runtime ? "REPLACE INTO runtime_mysql_users(username,password,active,use_ssl,default_hostgroup,default_schema,schema_locked,transaction_persistent,fast_forward,backend,frontend,max_connections) VALUES " : "REPLACE INTO mysql_users(username,password,active,use_ssl,default_hostgroup,default_schema,schema_locked,transaction_persistent,fast_forward,backend,frontend,max_connections) VALUES ");
+	SQLite3_batch_insert bif(admindb, qp, 9, (_runtime ? "(?,?,1,?,?,?,?,?,?,COALESCE((SELECT backend FROM runtime_mysql_users WHERE username=?1 AND frontend=1),0),1,?)" : "(?,?,1,?,?,?,?,?,?,COALESCE((SELECT backend FROM mysql_users WHERE username=?1 AND frontend=1),0),1,?)"), 1);
+	SQLite3_batch_insert bib(admindb, qp, 9, (_runtime ? "(?,?,1,?,?,?,?,?,?,1,COALESCE((SELECT frontend FROM runtime_mysql_users WHERE username=?1 AND backend=1),0),?)" : "(?,?,1,?,?,?,?,?,?,1,COALESCE((SELECT frontend FROM mysql_users WHERE username=?1 AND backend=1),0),?)"), 1);
 	num_users=GloMyAuth->dump_all_users(&ads);
 	if (num_users==0) return;
+	bif.begin();
 	for (i=0; i<num_users; i++) {
-	//fprintf(stderr,"%s %d\n", ads[i]->username, ads[i]->default_hostgroup);
 		account_details_t *ad=ads[i];
 		if (ads[i]->default_hostgroup >= 0) {
-			char *q=NULL;
-			if (_runtime==false) {
-				if (ad->__frontend) {
-					q=qf;
-				} else {
-					q=qb;
-				}
-			} else { // _runtime==true
-				if (ad->__frontend) {
-					q=qfr;
-				} else {
-					q=qbr;
-				}
+			char buf[6][16];
+			char *fields[9];
+			fields[0]=ad->username;
+			fields[1]=ad->password;
+			sprintf(buf[0],"%d",ad->use_ssl); fields[2]=buf[0];
+			sprintf(buf[1],"%d",ad->default_hostgroup); fields[3]=buf[1];
+			fields[4]=ad->default_schema;
+			sprintf(buf[2],"%d",ad->schema_locked); fields[5]=buf[2];
+			sprintf(buf[3],"%d",ad->transaction_persistent); fields[6]=buf[3];
+			sprintf(buf[4],"%d",ad->fast_forward); fields[7]=buf[4];
+			sprintf(buf[5],"%d",ad->max_connections); fields[8]=buf[5];
+			proxy_debug(PROXY_DEBUG_ADMIN, 4, "%s user %s\n", qp, ad->username);
+			if (ad->__frontend) {
+				bif.add_row(fields);
+			} else {
+				bib.add_row(fields);
 			}
-			query=(char *)malloc(strlen(q)+strlen(ad->username)*2+strlen(ad->password)+strlen(ad->default_schema)+256);
-			sprintf(query, q, ad->username, ad->password, ad->use_ssl, ad->default_hostgroup, ad->default_schema, ad->schema_locked, ad->transaction_persistent, ad->fast_forward, ad->username, ad->max_connections);
-			//fprintf(stderr,"%s\n",query);
-			proxy_debug(PROXY_DEBUG_ADMIN, 4, "%s\n", query);
-			admindb->execute(query);
-			free(query);
 		}
 		free(ad->username);
 		free(ad->password);
 		free(ad->default_schema);
 		free(ad);
 	}
+	bif.flush();
 	free(ads);
 }
 
 void ProxySQL_Admin::save_scheduler_runtime_to_database(bool _runtime) {
 	char *query=NULL;
+	SQLite3_batch_insert bi(admindb, (_runtime ? "INSERT INTO runtime_scheduler VALUES " : "INSERT INTO scheduler VALUES "), 10);
+	bi.begin();
 	// dump mysql_servers
 	if (_runtime) {
 		query=(char *)"DELETE FROM main.runtime_scheduler";
@@ -4023,67 +4208,29 @@ void ProxySQL_Admin::save_scheduler_runtime_to_database(bool _runtime) {
 	proxy_debug(PROXY_DEBUG_ADMIN, 4, "%s\n", query);
 	admindb->execute(query);
 
-	// allocate args only once
-	char **args=(char **)malloc(5*sizeof(char *));
+	char buf[3][24];
+	char *fields[10];
 	// read lock the scheduler
 	spin_rdlock(&scheduler->rwlock);
-	char *q=NULL;
-	if (_runtime) {
-		q=(char *)"INSERT INTO runtime_scheduler VALUES(%lu,%d,%lu,\"%s\" ,%s,%s,%s,%s,%s,'%s')";
-	} else {
-		q=(char *)"INSERT INTO scheduler VALUES(%lu,%d,%lu,\"%s\" ,%s,%s,%s,%s,%s,'%s')";
-	}
 	for (std::vector<Scheduler_Row *>::iterator it = scheduler->Scheduler_Rows.begin() ; it != scheduler->Scheduler_Rows.end(); ++it) {
 		Scheduler_Row *sr=*it;
-		int i;
-		int l=strlen(q);
-
-		l+=strlen(sr->filename);
-
-		for (i=0; i<5; i++) {
-			if (sr->args[i]) {
-				args[i]=(char *)malloc(strlen(sr->args[i])+4);
-				sprintf(args[i],"\"%s\"",sr->args[i]);
-			} else {
-				args[i]=(char *)"NULL";
-			}
-			l+=strlen(args[i]);
-		}
-		char *o=escape_string_single_quotes(sr->comment,false); // issue #643
-		l+=strlen(o);
-		l+=35; //padding
-		int is_active=0;
-		if (sr->is_active==true) {
-			is_active=1;
-		}
-		char *query=(char *)malloc(l);
-
-		sprintf(query, q,
-			sr->id, is_active, sr->interval_ms,
-			sr->filename, args[0],
-			args[1], args[2],
-			args[3], args[4],
-			o
-		);
-		if (o!=sr->comment) {
-			free(o);
+		sprintf(buf[0],"%u",sr->id);
+		sprintf(buf[1],"%d",(sr->is_active==true ? 1 : 0));
+		sprintf(buf[2],"%u",sr->interval_ms);
+		fields[0]=buf[0];
+		fields[1]=buf[1];
+		fields[2]=buf[2];
+		fields[3]=sr->filename;
+		for (int i=0; i<5; i++) {
+			fields[4+i]=sr->args[i]; // NULL args are saved as NULL
 		}
-
-		for (i=0; i<5; i++) {
-			if (sr->args[i]) {
-				free(args[i]);	// free only if we allocated memory
-			}
-		}
-
-		admindb->execute(query);
-		free(query);
+		fields[9]=sr->comment;
+		bi.add_row(fields);
 	}
 
 	// unlock the scheduler
 	spin_rdunlock(&scheduler->rwlock);
-
-	// deallocate args
-	free(args);
+	bi.flush();
 }
 
 
@@ -4092,6 +4239,8 @@ void ProxySQL_Admin::save_mysql_servers_runtime_to_database(bool _runtime) {
 	// make sure that the caller has called mysql_servers_wrlock()
 	char *query=NULL;
 	SQLite3_result *resultset=NULL;
+	SQLite3_batch_insert bi(admindb, (_runtime ? "INSERT INTO runtime_mysql_servers VALUES " : "INSERT INTO mysql_servers VALUES "), 12);
+	bi.begin();
 	// dump mysql_servers
 	if (_runtime) {
 		query=(char *)"DELETE FROM main.runtime_mysql_servers";
@@ -4102,37 +4251,23 @@ void ProxySQL_Admin::save_mysql_servers_runtime_to_database(bool _runtime) {
 	admindb->execute(query);
 	resultset=MyHGM->dump_table_mysql_servers();
 	if (resultset) {
-		char *q=NULL;
-		if (_runtime) {
-			q=(char *)"INSERT INTO runtime_mysql_servers VALUES(%s,\"%s\",%s,\"%s\",%s,%s,%s,%s,%s,%s,'%s')";
-		} else {
-			q=(char *)"INSERT INTO mysql_servers VALUES(%s,\"%s\",%s,\"%s\",%s,%s,%s,%s,%s,%s,'%s')";
-		}
+		char *fields[12];
 		for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 			SQLite3_row *r=*it;
-			char *o=escape_string_single_quotes(r->fields[10],false);
-			char *query=(char *)malloc(strlen(q)+strlen(r->fields[0])+strlen(r->fields[1])+strlen(r->fields[2])+strlen(r->fields[3])+strlen(r->fields[4])+strlen(r->fields[5])+strlen(r->fields[6])+strlen(r->fields[7])+
-				strlen(r->fields[8])+ // use_ssl
-				strlen(r->fields[9])+ // max_latency_ms
-				strlen(o)+ // comment
-			16); // padding
+			// dump_table_mysql_servers() returns weight before status
+			memcpy(fields, r->fields, sizeof(char *)*12);
 			// if the backend is shunned, save_mysql_servers_runtime_to_database() should set to ONLINE if _runtime==false
-			sprintf(query, q, r->fields[0], r->fields[1], r->fields[2], ( _runtime ? r->fields[4] : ( strcmp(r->fields[4],"SHUNNED")==0 ? "ONLINE" : r->fields[4] ) ), r->fields[3], r->fields[5], r->fields[6], r->fields[7],
-				r->fields[8], // use_ssl
-				r->fields[9], // max_latency_ms
-				o); // comment
-			proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "%s\n", query);
-			admindb->execute(query);
-			free(query);
-			if (o!=r->fields[10]) {
-				free(o);
-			}
+			fields[3]=( _runtime ? r->fields[4] : ( strcmp(r->fields[4],"SHUNNED")==0 ? (char *)"ONLINE" : r->fields[4] ) );
+			fields[4]=r->fields[3];
+			proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "Saving server %s:%s in hostgroup %s\n", r->fields[1], r->fields[2], r->fields[0]);
+			bi.add_row(fields);
 		}
 	}
 	if(resultset) delete resultset;
 	resultset=NULL;
 
 	// dump mysql_replication_hostgroups
+	SQLite3_batch_insert bir(admindb, (_runtime ? "INSERT INTO runtime_mysql_replication_hostgroups VALUES " : "INSERT INTO mysql_replication_hostgroups VALUES "), 3);
 	if (_runtime) {
 		query=(char *)"DELETE FROM main.runtime_mysql_replication_hostgroups";
 	} else {
@@ -4144,39 +4279,13 @@ void ProxySQL_Admin::save_mysql_servers_runtime_to_database(bool _runtime) {
 	if (resultset) {
 		for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
 			SQLite3_row *r=*it;
-			int l=0;
-			if (r->fields[2]) l=strlen(r->fields[2]);
-			char *q=NULL;
-			if (_runtime) {
-				if (r->fields[2]) { // comment is not null, #643
-					q=(char *)"INSERT INTO runtime_mysql_replication_hostgroups VALUES(%s,%s,'%s')";
-				} else {
-					q=(char *)"INSERT INTO runtime_mysql_replication_hostgroups VALUES(%s,%s,NULL)";
-				}
-			} else {
-				if (r->fields[2]) { // comment is not null, #643
-					q=(char *)"INSERT INTO mysql_replication_hostgroups VALUES(%s,%s,'%s')";
-				} else {
-					q=(char *)"INSERT INTO mysql_replication_hostgroups VALUES(%s,%s,NULL)";
-				}
-			}
-			char *query=(char *)malloc(strlen(q)+strlen(r->fields[0])+strlen(r->fields[1])+16+l);
-			if (r->fields[2]) {
-				char *o=escape_string_single_quotes(r->fields[2],false);
-				sprintf(query, q, r->fields[0], r->fields[1], o);
-				if (o!=r->fields[2]) { // there was a copy
-					free(o);
-				}
-			} else {
-				sprintf(query, q, r->fields[0], r->fields[1]);
-			}
-			proxy_debug(PROXY_DEBUG_MYSQL_CONNPOOL, 4, "%s\n", query);
-			admindb->execute(query);
-			free(query);
+			bir.add_row(r->fields); // a NULL comment is saved as NULL, #643
 		}
 	}
 	if(resultset) delete resultset;
 	resultset=NULL;
+	bir.flush();
+	bi.flush();
 }
 
 
@@ -4202,7 +4311,7 @@ void ProxySQL_Admin::load_mysql_servers_to_runtime() {
 	int cols=0;
 	int affected_rows=0;
 	SQLite3_result *resultset=NULL;
-	char *query=(char *)"SELECT hostgroup_id,hostname,port,status,weight,compression,max_connections,max_replication_lag,use_ssl,max_latency_ms,comment FROM main.mysql_servers";
+	char *query=(char *)"SELECT hostgroup_id,hostname,port,status,weight,compression,max_connections,max_replication_lag,use_ssl,max_latency_ms,min_idle_connections,comment FROM main.mysql_servers";
 	proxy_debug(PROXY_DEBUG_ADMIN, 4, "%s\n", query);
 	admindb->execute_statement(query, &error , &cols , &affected_rows , &resultset);
 	//MyHGH->wrlock();
@@ -4233,7 +4342,8 @@ void ProxySQL_Admin::load_mysql_servers_to_runtime() {
 			MyHGM->server_add(atoi(r->fields[0]), r->fields[1], atoi(r->fields[2]), atoi(r->fields[4]), status, atoi(r->fields[5]), atoi(r->fields[6]), atoi(r->fields[7]),
 				atoi(r->fields[8]), // use_ssl
 				atoi(r->fields[9]),  // max_latency_ms
-				r->fields[10]  // comment
+				atoi(r->fields[10]),  // min_idle_connections
+				r->fields[11]  // comment
 			);
 			//MyHGH->server_add_hg(atoi(r->fields[0]), r->fields[1], atoi(r->fields[2]), atoi(r->fields[3]));
 		}
@@ -4276,7 +4386,7 @@ char * ProxySQL_Admin::load_mysql_query_rules_to_runtime() {
 	int affected_rows=0;
 	if (GloQPro==NULL) return (char *)"Global Query Processor not started: command impossible to run";
 	SQLite3_result *resultset=NULL;
-	char *query=(char *)"SELECT rule_id, username, schemaname, flagIN, client_addr, proxy_addr, proxy_port, digest, match_digest, match_pattern, negate_match_pattern, re_modifiers, flagOUT, replace_pattern, destination_hostgroup, cache_ttl, reconnect, timeout, retries, delay, mirror_flagOUT, mirror_hostgroup, error_msg, sticky_conn, multiplex, log, apply, comment FROM main.mysql_query_rules WHERE active=1";
+	char *query=(char *)"SELECT rule_id, username, schemaname, flagIN, client_addr, proxy_addr, proxy_port, digest, match_digest, match_pattern, negate_match_pattern, re_modifiers, flagOUT, replace_pattern, destination_hostgroup, cache_ttl, reconnect, timeout, retries, delay, mirror_flagOUT, mirror_hostgroup, error_msg, sticky_conn, multiplex, log, apply, comment, qos_max_qps, qos_burst, qos_max_concurrency, qos_max_wait_ms, priority, hedge_delay_ms FROM main.mysql_query_rules WHERE active=1";
 	admindb->execute_statement(query, &error , &cols , &affected_rows , &resultset);
 	if (error) {
 		proxy_error("Error on %s : %s\n", query, error);
@@ -4315,7 +4425,13 @@ char * ProxySQL_Admin::load_mysql_query_rules_to_runtime() {
 				(r->fields[24]==NULL ? -1 : atol(r->fields[24])),	// multiplex
 				(r->fields[25]==NULL ? -1 : atol(r->fields[25])),	// log
 				(atoi(r->fields[26])==1 ? true : false),
-				r->fields[27] // comment
+				r->fields[27], // comment
+				(r->fields[28]==NULL ? -1 : atol(r->fields[28])),	// qos_max_qps
+				(r->fields[29]==NULL ? -1 : atol(r->fields[29])),	// qos_burst
+				(r->fields[30]==NULL ? -1 : atol(r->fields[30])),	// qos_max_concurrency
+				(r->fields[31]==NULL ? -1 : atol(r->fields[31])),	// qos_max_wait_ms
+				(r->fields[32]==NULL ? -1 : atol(r->fields[32])),	// priority
+				(r->fields[33]==NULL ? -1 : atol(r->fields[33]))	// hedge_delay_ms
 			);
 			GloQPro->insert(nqpr, false);
 		}
@@ -4341,7 +4457,8 @@ int ProxySQL_Admin::Read_Global_Variables_from_configfile(const char *prefix) {
 	//fprintf(stderr, "Found %d %s_variables\n",count, prefix);
 	int i;
 	admindb->execute("PRAGMA foreign_keys = OFF");
-	char *q=(char *)"INSERT OR REPLACE INTO global_variables VALUES (\"%s-%s\", \"%s\")";
+	SQLite3_batch_insert bi(admindb, "INSERT OR REPLACE INTO global_variables VALUES ", 2);
+	bi.begin();
 	for (i=0; i< count; i++) {
 		const Setting &sett = group[i];
 		const char *n=sett.getName();
@@ -4358,11 +4475,13 @@ int ProxySQL_Admin::Read_Global_Variables_from_configfile(const char *prefix) {
 			}
 		}
 		//fprintf(stderr,"%s = %s\n", n, value_string.c_str());
-		char *query=(char *)malloc(strlen(q)+strlen(prefix)+strlen(n)+strlen(value_string.c_str()));
-		sprintf(query,q, prefix, n, value_string.c_str());
-		//fprintf(stderr, "%s\n", query);
-  	admindb->execute(query);
+		std::string name=std::string(prefix) + "-" + n;
+		char *fields[2];
+		fields[0]=(char *)name.c_str();
+		fields[1]=(char *)value_string.c_str();
+		bi.add_row(fields);
 	}
+	bi.flush();
 	admindb->execute("PRAGMA foreign_keys = ON");
 	free(groupname);
 	return i;
@@ -4377,7 +4496,8 @@ int ProxySQL_Admin::Read_MySQL_Users_from_configfile() {
 	int i;
 	int rows=0;
 	admindb->execute("PRAGMA foreign_keys = OFF");
-	char *q=(char *)"INSERT OR REPLACE INTO mysql_users (username, password, active, default_hostgroup, default_schema, schema_locked, transaction_persistent, fast_forward, max_connections) VALUES (\"%s\", \"%s\", %d, %d, \"%s\", %d, %d, %d, %d)";
+	SQLite3_batch_insert bi(admindb, "INSERT OR REPLACE INTO mysql_users (username, password, active, default_hostgroup, default_schema, schema_locked, transaction_persistent, fast_forward, max_connections) VALUES ", 9);
+	bi.begin();
 	for (i=0; i< count; i++) {
 		const Setting &user = mysql_users[i];
 		std::string username;
@@ -4399,13 +4519,18 @@ int ProxySQL_Admin::Read_MySQL_Users_from_configfile() {
 		user.lookupValue("transaction_persistent", transaction_persistent);
 		user.lookupValue("fast_forward", fast_forward);
 		user.lookupValue("max_connections", max_connections);
-		char *query=(char *)malloc(strlen(q)+strlen(username.c_str())+strlen(password.c_str())+128);
-		sprintf(query,q, username.c_str(), password.c_str(), active, default_hostgroup, default_schema.c_str(), schema_locked, transaction_persistent, fast_forward, max_connections);
-		//fprintf(stderr, "%s\n", query);
-  	admindb->execute(query);
-		free(query);
+		std::string values[9] = {
+			username, password, std::to_string(active), std::to_string(default_hostgroup), default_schema,
+			std::to_string(schema_locked), std::to_string(transaction_persistent), std::to_string(fast_forward), std::to_string(max_connections)
+		};
+		char *fields[9];
+		for (int j=0; j<9; j++) {
+			fields[j]=(char *)values[j].c_str();
+		}
+		bi.add_row(fields);
 		rows++;
 	}
+	bi.flush();
 	admindb->execute("PRAGMA foreign_keys = ON");
 	return rows;
 }
@@ -4419,7 +4544,8 @@ int ProxySQL_Admin::Read_Scheduler_from_configfile() {
 	int i;
 	int rows=0;
 	admindb->execute("PRAGMA foreign_keys = OFF");
-	char *q=(char *)"INSERT OR REPLACE INTO scheduler (id, active, interval_ms, filename, arg1, arg2, arg3, arg4, arg5, comment) VALUES (%d, %d, %d, '%s', %s, %s, %s, %s, %s, '%s')";
+	SQLite3_batch_insert bi(admindb, "INSERT OR REPLACE INTO scheduler (id, active, interval_ms, filename, arg1, arg2, arg3, arg4, arg5, comment) VALUES ", 10);
+	bi.begin();
 	for (i=0; i< count; i++) {
 		const Setting &sched = schedulers[i];
 		int id;
@@ -4456,57 +4582,24 @@ int ProxySQL_Admin::Read_Scheduler_from_configfile() {
 		if (sched.lookupValue("arg5", arg5)) arg5_exists=true;
 		sched.lookupValue("comment", comment);
 
-
-		int query_len=0;
-		query_len+=strlen(q) +
-			strlen(std::to_string(id).c_str()) +
-			strlen(std::to_string(active).c_str()) +
-			strlen(std::to_string(interval_ms).c_str()) +
-			strlen(filename.c_str()) +
-			( arg1_exists ? strlen(arg1.c_str()) : 0 ) + 4 +
-			( arg2_exists ? strlen(arg2.c_str()) : 0 ) + 4 +
-			( arg3_exists ? strlen(arg3.c_str()) : 0 ) + 4 +
-			( arg4_exists ? strlen(arg4.c_str()) : 0 ) + 4 +
-			( arg5_exists ? strlen(arg5.c_str()) : 0 ) + 4 +
-			strlen(comment.c_str()) +
-			40;
-		char *query=(char *)malloc(query_len);
-		if (arg1_exists)
-			arg1="\'" + arg1 + "\'";
-		else
-			arg1 = "NULL";
-		if (arg2_exists)
-			arg2="\'" + arg2 + "\'";
-		else
-			arg2 = "NULL";
-		if (arg3_exists)
-			arg3="\'" + arg3 + "\'";
-		else
-			arg3 = "NULL";
-		if (arg4_exists)
-			arg4="\'" + arg4 + "\'";
-		else
-			arg4 = "NULL";
-		if (arg5_exists)
-			arg5="\'" + arg5 + "\'";
-		else
-			arg5 = "NULL";
-
-		sprintf(query, q,
-			id, active,
-			interval_ms,
-			filename.c_str(),
-			arg1.c_str(),
-			arg2.c_str(),
-			arg3.c_str(),
-			arg4.c_str(),
-			arg5.c_str(),
-			comment.c_str()
-		);
-		admindb->execute(query);
-		free(query);
+		std::string s_id=std::to_string(id);
+		std::string s_active=std::to_string(active);
+		std::string s_interval_ms=std::to_string(interval_ms);
+		char *fields[10];
+		fields[0]=(char *)s_id.c_str();
+		fields[1]=(char *)s_active.c_str();
+		fields[2]=(char *)s_interval_ms.c_str();
+		fields[3]=(char *)filename.c_str();
+		fields[4]=(arg1_exists ? (char *)arg1.c_str() : NULL);
+		fields[5]=(arg2_exists ? (char *)arg2.c_str() : NULL);
+		fields[6]=(arg3_exists ? (char *)arg3.c_str() : NULL);
+		fields[7]=(arg4_exists ? (char *)arg4.c_str() : NULL);
+		fields[8]=(arg5_exists ? (char *)arg5.c_str() : NULL);
+		fields[9]=(char *)comment.c_str();
+		bi.add_row(fields);
 		rows++;
 	}
+	bi.flush();
 	admindb->execute("PRAGMA foreign_keys = ON");
 	return rows;
 }
@@ -4520,7 +4613,8 @@ int ProxySQL_Admin::Read_MySQL_Query_Rules_from_configfile() {
 	int i;
 	int rows=0;
 	admindb->execute("PRAGMA foreign_keys = OFF");
-	char *q=(char *)"INSERT OR REPLACE INTO mysql_query_rules (rule_id, active, username, schemaname, flagIN, client_addr, proxy_addr, proxy_port, digest, match_digest, match_pattern, negate_match_pattern, re_modifiers, flagOUT, replace_pattern, destination_hostgroup, cache_ttl, reconnect, timeout, retries, delay, mirror_flagOUT, mirror_hostgroup, error_msg, sticky_conn, multiplex, log, apply, comment) VALUES (%d, %d, %s, %s, %s, %s, %s, %s, %s, %s, %s, %d, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %s, %d, %d, %d, %s)";
+	SQLite3_batch_insert bi(admindb, "INSERT OR REPLACE INTO mysql_query_rules (rule_id, active, username, schemaname, flagIN, client_addr, proxy_addr, proxy_port, digest, match_digest, match_pattern, negate_match_pattern, re_modifiers, flagOUT, replace_pattern, destination_hostgroup, cache_ttl, reconnect, timeout, retries, delay, mirror_flagOUT, mirror_hostgroup, error_msg, sticky_conn, multiplex, log, apply, comment, qos_max_qps, qos_burst, qos_max_concurrency, qos_max_wait_ms, priority, hedge_delay_ms) VALUES ", 35);
+	bi.begin();
 	for (i=0; i< count; i++) {
 		const Setting &rule = mysql_query_rules[i];
 		int rule_id;
@@ -4581,6 +4675,18 @@ int ProxySQL_Admin::Read_MySQL_Query_Rules_from_configfile() {
 		bool comment_exists=false;
 		std::string comment;
 
+		// rate limits
+		int qos_max_qps=-1;
+		int qos_burst=-1;
+		int qos_max_concurrency=-1;
+		int qos_max_wait_ms=-1;
+
+		// priority class in the connection pool queue
+		int priority=-1;
+
+		// hedged reads
+		int hedge_delay_ms=-1;
+
 		// validate arguments
 		if (rule.lookupValue("rule_id", rule_id)==false) continue;
 		rule.lookupValue("active", active);
@@ -4607,7 +4713,7 @@ int ProxySQL_Admin::Read_MySQL_Query_Rules_from_configfile() {
 		rule.lookupValue("timeout", timeout);
 		rule.lookupValue("retries", retries);
 		rule.lookupValue("delay", delay);
-		if (rule.lookupValue("error_msg", username)) error_msg_exists=true;
+		if (rule.lookupValue("error_msg", error_msg)) error_msg_exists=true;
 
 		rule.lookupValue("sticky_conn", sticky_conn);
 		rule.lookupValue("multiplex", multiplex);
@@ -4616,126 +4722,44 @@ int ProxySQL_Admin::Read_MySQL_Query_Rules_from_configfile() {
 
 		rule.lookupValue("apply", apply);
 
-		if (rule.lookupValue("error_msg", username)) error_msg_exists=true;
-
-		//if (user.lookupValue("default_schema", default_schema)==false) default_schema="";
-		int query_len=0;
-		query_len+=strlen(q) +
-			strlen(std::to_string(rule_id).c_str()) +
-			strlen(std::to_string(active).c_str()) +
-			( username_exists ? strlen(username.c_str()) : 0 ) + 4 +
-			( schemaname_exists ? strlen(schemaname.c_str()) : 0 ) + 4 +
-			strlen(std::to_string(flagIN).c_str()) + 4 +
-
-			( client_addr_exists ? strlen(client_addr.c_str()) : 0 ) + 4 +
-			( proxy_addr_exists ? strlen(proxy_addr.c_str()) : 0 ) + 4 +
-			strlen(std::to_string(proxy_port).c_str()) + 4 +
-
-			( match_digest_exists ? strlen(match_digest.c_str()) : 0 ) + 4 +
-			( match_pattern_exists ? strlen(match_pattern.c_str()) : 0 ) + 4 +
-			strlen(std::to_string(negate_match_pattern).c_str()) + 4 +
-			( re_modifiers_exists ? strlen(re_modifiers.c_str()) : 0 ) + 4 +
-			strlen(std::to_string(flagOUT).c_str()) + 4 +
-			( replace_pattern_exists ? strlen(replace_pattern.c_str()) : 0 ) + 4 +
-			strlen(std::to_string(destination_hostgroup).c_str()) + 4 +
-			strlen(std::to_string(cache_ttl).c_str()) + 4 +
-			strlen(std::to_string(reconnect).c_str()) + 4 +
-			strlen(std::to_string(timeout).c_str()) + 4 +
-			strlen(std::to_string(mirror_flagOUT).c_str()) + 4 +
-			strlen(std::to_string(mirror_hostgroup).c_str()) + 4 +
-			strlen(std::to_string(retries).c_str()) + 4 +
-			strlen(std::to_string(delay).c_str()) + 4 +
-			( error_msg_exists ? strlen(error_msg.c_str()) : 0 ) + 4 +
-			strlen(std::to_string(sticky_conn).c_str()) + 4 +
-			strlen(std::to_string(multiplex).c_str()) + 4 +
-			strlen(std::to_string(log).c_str()) + 4 +
-			strlen(std::to_string(apply).c_str()) + 4 +
-			( comment_exists ? strlen(comment.c_str()) : 0 ) + 4 +
-			64;
-		char *query=(char *)malloc(query_len);
-		if (username_exists)
-			username="\"" + username + "\"";
-		else
-			username = "NULL";
-		if (schemaname_exists)
-			schemaname="\"" + schemaname + "\"";
-		else
-			schemaname = "NULL";
-
-		if (client_addr_exists)
-			client_addr="\"" + client_addr + "\"";
-		else
-			client_addr = "NULL";
-		if (proxy_addr_exists)
-			proxy_addr="\"" + proxy_addr + "\"";
-		else
-			proxy_addr = "NULL";
-		if (digest_exists)
-			digest="\"" + digest + "\"";
-		else
-			digest = "NULL";
-
-		if (match_digest_exists)
-			match_digest="\"" + match_digest + "\"";
-		else
-			match_digest = "NULL";
-		if (match_pattern_exists)
-			match_pattern="\"" + match_pattern + "\"";
-		else
-			match_pattern = "NULL";
-		if (replace_pattern_exists)
-			replace_pattern="\"" + replace_pattern + "\"";
-		else
-			replace_pattern = "NULL";
-		if (error_msg_exists)
-			error_msg="\"" + error_msg + "\"";
-		else
-			error_msg = "NULL";
-		if (re_modifiers_exists)
-			re_modifiers="\"" + re_modifiers + "\"";
-		else
-			re_modifiers = "NULL";
-		if (comment_exists)
-			comment="\"" + comment + "\"";
-		else
-			comment = "NULL";
-
-
-		sprintf(query, q,
-			rule_id, active,
-			username.c_str(),
-			schemaname.c_str(),
-			( flagIN >= 0 ? std::to_string(flagIN).c_str() : "NULL") ,
-			client_addr.c_str(),
-			proxy_addr.c_str(),
-			( proxy_port >= 0 ? std::to_string(proxy_port).c_str() : "NULL") ,
-			digest.c_str(),
-			match_digest.c_str(),
-			match_pattern.c_str(),
-			( negate_match_pattern == 0 ? 0 : 1) ,
-			re_modifiers.c_str(),
-			( flagOUT >= 0 ? std::to_string(flagOUT).c_str() : "NULL") ,
-			replace_pattern.c_str(),
-			( destination_hostgroup >= 0 ? std::to_string(destination_hostgroup).c_str() : "NULL") ,
-			( cache_ttl >= 0 ? std::to_string(cache_ttl).c_str() : "NULL") ,
-			( reconnect >= 0 ? std::to_string(reconnect).c_str() : "NULL") ,
-			( timeout >= 0 ? std::to_string(timeout).c_str() : "NULL") ,
-			( retries >= 0 ? std::to_string(retries).c_str() : "NULL") ,
-			( delay >= 0 ? std::to_string(delay).c_str() : "NULL") ,
-			( mirror_flagOUT >= 0 ? std::to_string(mirror_flagOUT).c_str() : "NULL") ,
-			( mirror_hostgroup >= 0 ? std::to_string(mirror_hostgroup).c_str() : "NULL") ,
-			error_msg.c_str(),
-			( sticky_conn >= 0 ? std::to_string(sticky_conn).c_str() : "NULL") ,
-			( multiplex >= 0 ? std::to_string(multiplex).c_str() : "NULL") ,
-			( log >= 0 ? std::to_string(log).c_str() : "NULL") ,
-			( apply == 0 ? 0 : 1) ,
-			comment.c_str()
-		);
-		//fprintf(stderr, "%s\n", query);
-		admindb->execute(query);
-		free(query);
+		if (rule.lookupValue("comment", comment)) comment_exists=true;
+
+		rule.lookupValue("qos_max_qps", qos_max_qps);
+		rule.lookupValue("qos_burst", qos_burst);
+		rule.lookupValue("qos_max_concurrency", qos_max_concurrency);
+		rule.lookupValue("qos_max_wait_ms", qos_max_wait_ms);
+		rule.lookupValue("priority", priority);
+		rule.lookupValue("hedge_delay_ms", hedge_delay_ms);
+
+		// integers are bound as text, negative values mean NULL
+		std::string values[35] = {
+			std::to_string(rule_id), std::to_string(active), username, schemaname, std::to_string(flagIN),
+			client_addr, proxy_addr, std::to_string(proxy_port), digest, match_digest,
+			match_pattern, std::to_string(negate_match_pattern == 0 ? 0 : 1), re_modifiers, std::to_string(flagOUT), replace_pattern,
+			std::to_string(destination_hostgroup), std::to_string(cache_ttl), std::to_string(reconnect), std::to_string(timeout), std::to_string(retries),
+			std::to_string(delay), std::to_string(mirror_flagOUT), std::to_string(mirror_hostgroup), error_msg, std::to_string(sticky_conn),
+			std::to_string(multiplex), std::to_string(log), std::to_string(apply == 0 ? 0 : 1), comment, std::to_string(qos_max_qps),
+			std::to_string(qos_burst), std::to_string(qos_max_concurrency), std::to_string(qos_max_wait_ms), std::to_string(priority),
+			std::to_string(hedge_delay_ms)
+		};
+		bool is_null[35] = {
+			false, false, !username_exists, !schemaname_exists, flagIN < 0,
+			!client_addr_exists, !proxy_addr_exists, proxy_port < 0, !digest_exists, !match_digest_exists,
+			!match_pattern_exists, false, !re_modifiers_exists, flagOUT < 0, !replace_pattern_exists,
+			destination_hostgroup < 0, cache_ttl < 0, reconnect < 0, timeout < 0, retries < 0,
+			delay < 0, mirror_flagOUT < 0, mirror_hostgroup < 0, !error_msg_exists, sticky_conn < 0,
+			multiplex < 0, log < 0, false, !comment_exists, qos_max_qps < 0,
+			qos_burst < 0, qos_max_concurrency < 0, qos_max_wait_ms < 0, priority < 0,
+			hedge_delay_ms < 0
+		};
+		char *fields[35];
+		for (int j=0; j<35; j++) {
+			fields[j]=(is_null[j] ? NULL : (char *)values[j].c_str());
+		}
+		bi.add_row(fields);
 		rows++;
 	}
+	bi.flush();
 	admindb->execute("PRAGMA foreign_keys = ON");
 	return rows;
 }
@@ -4749,7 +4773,8 @@ int ProxySQL_Admin::Read_MySQL_Servers_from_configfile() {
 		const Setting &mysql_servers = root["mysql_servers"];
 		int count = mysql_servers.getLength();
 		//fprintf(stderr, "Found %d servers\n",count);
-		char *q=(char *)"INSERT OR REPLACE INTO mysql_servers (hostname, port, hostgroup_id, compression, weight, status, max_connections, max_replication_lag, use_ssl, max_latency_ms, comment) VALUES (\"%s\", %d, %d, %d, %d, \"%s\", %d, %d, %d, %d, '%s')";
+		SQLite3_batch_insert bi(admindb, "INSERT OR REPLACE INTO mysql_servers (hostname, port, hostgroup_id, compression, weight, status, max_connections, max_replication_lag, use_ssl, max_latency_ms, min_idle_connections, comment) VALUES ", 12);
+		bi.begin();
 		for (i=0; i< count; i++) {
 			const Setting &server = mysql_servers[i];
 			std::string address;
@@ -4762,6 +4787,7 @@ int ProxySQL_Admin::Read_MySQL_Servers_from_configfile() {
 			int max_replication_lag=0; // default
 			int use_ssl=0;
 			int max_latency_ms=0;
+			int min_idle_connections=0;
 			std::string comment="";
 			if (server.lookupValue("address", address)==false) continue;
 			if (server.lookupValue("port", port)==false) continue;
@@ -4781,23 +4807,26 @@ int ProxySQL_Admin::Read_MySQL_Servers_from_configfile() {
 			server.lookupValue("max_replication_lag", max_replication_lag);
 			server.lookupValue("use_ssl", use_ssl);
 			server.lookupValue("max_latency_ms", max_latency_ms);
+			server.lookupValue("min_idle_connections", min_idle_connections);
 			server.lookupValue("comment", comment);
-			char *o1=strdup(comment.c_str());
-			char *o=escape_string_single_quotes(o1, false);
-			char *query=(char *)malloc(strlen(q)+strlen(status.c_str())+strlen(address.c_str())+strlen(o)+128);
-			sprintf(query,q, address.c_str(), port, hostgroup, compression, weight, status.c_str(), max_connections, max_replication_lag, use_ssl, max_latency_ms, o);
-			//fprintf(stderr, "%s\n", query);
-			admindb->execute(query);
-			if (o!=o1) free(o);
-			free(o1);
-			free(query);
+			std::string values[12] = {
+				address, std::to_string(port), std::to_string(hostgroup), std::to_string(compression), std::to_string(weight), status,
+				std::to_string(max_connections), std::to_string(max_replication_lag), std::to_string(use_ssl), std::to_string(max_latency_ms), std::to_string(min_idle_connections), comment
+			};
+			char *fields[12];
+			for (int j=0; j<12; j++) {
+				fields[j]=(char *)values[j].c_str();
+			}
+			bi.add_row(fields);
 			rows++;
 		}
+		bi.flush();
 	}
 	if (root.exists("mysql_replication_hostgroups")==true) {
 		const Setting &mysql_replication_hostgroups = root["mysql_replication_hostgroups"];
 		int count = mysql_replication_hostgroups.getLength();
-		char *q=(char *)"INSERT OR REPLACE INTO mysql_replication_hostgroups (writer_hostgroup, reader_hostgroup, comment) VALUES (%d, %d, '%s')";
+		SQLite3_batch_insert bi(admindb, "INSERT OR REPLACE INTO mysql_replication_hostgroups (writer_hostgroup, reader_hostgroup, comment) VALUES ", 3);
+		bi.begin();
 		for (i=0; i< count; i++) {
 			const Setting &line = mysql_replication_hostgroups[i];
 			int writer_hostgroup;
@@ -4806,17 +4835,16 @@ int ProxySQL_Admin::Read_MySQL_Servers_from_configfile() {
 			if (line.lookupValue("writer_hostgroup", writer_hostgroup)==false) continue;
 			if (line.lookupValue("reader_hostgroup", reader_hostgroup)==false) continue;
 			line.lookupValue("comment", comment);
-			char *o1=strdup(comment.c_str());
-			char *o=escape_string_single_quotes(o1, false);
-			char *query=(char *)malloc(strlen(q)+strlen(o)+32);
-			sprintf(query,q, writer_hostgroup, reader_hostgroup, o);
-			//fprintf(stderr, "%s\n", query);
-			admindb->execute(query);
-			if (o!=o1) free(o);
-			free(o1);
-			free(query);
+			std::string s_writer_hostgroup=std::to_string(writer_hostgroup);
+			std::string s_reader_hostgroup=std::to_string(reader_hostgroup);
+			char *fields[3];
+			fields[0]=(char *)s_writer_hostgroup.c_str();
+			fields[1]=(char *)s_reader_hostgroup.c_str();
+			fields[2]=(char *)comment.c_str();
+			bi.add_row(fields);
 			rows++;
 		}
+		bi.flush();
 	}
 	admindb->execute("PRAGMA foreign_keys = ON");
 	return rows;
@@ -4913,6 +4941,51 @@ void ProxySQL_Admin::disk_upgrade_mysql_query_rules() {
 		// copy fields from old table
 		configdb->execute("INSERT INTO mysql_query_rules (rule_id,active,username,schemaname,flagIN,client_addr,proxy_addr,proxy_port,digest,match_digest,match_pattern,negate_match_pattern,flagOUT,replace_pattern,destination_hostgroup,cache_ttl,reconnect,timeout,retries,delay,mirror_flagOUT,mirror_hostgroup,error_msg,log,apply,comment) SELECT rule_id,active,username,schemaname,flagIN,client_addr,proxy_addr,proxy_port,digest,match_digest,match_pattern,negate_match_pattern,flagOUT,replace_pattern,destination_hostgroup,cache_ttl,reconnect,timeout,retries,delay,mirror_flagOUT,mirror_hostgroup,error_msg,log,apply,comment FROM mysql_query_rules_v122");
 	}
+	// adding rate limits to mysql_query_rules table
+	rci=configdb->check_table_structure((char *)"mysql_query_rules",(char *)ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES_V1_3_1);
+	if (rci) {
+		// upgrade is required
+		proxy_warning("Detected version v1.3.1 of table mysql_query_rules\n");
+		proxy_warning("ONLINE UPGRADE of table mysql_query_rules in progress\n");
+		// drop any existing table with suffix _v131
+		configdb->execute("DROP TABLE IF EXISTS mysql_query_rules_v131");
+		// rename current table to add suffix _v131
+		configdb->execute("ALTER TABLE mysql_query_rules RENAME TO mysql_query_rules_v131");
+		// create new table
+		configdb->build_table((char *)"mysql_query_rules",(char *)ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES,false);
+		// copy fields from old table
+		configdb->execute("INSERT INTO mysql_query_rules (rule_id,active,username,schemaname,flagIN,client_addr,proxy_addr,proxy_port,digest,match_digest,match_pattern,negate_match_pattern,re_modifiers,flagOUT,replace_pattern,destination_hostgroup,cache_ttl,reconnect,timeout,retries,delay,mirror_flagOUT,mirror_hostgroup,error_msg,sticky_conn,multiplex,log,apply,comment) SELECT rule_id,active,username,schemaname,flagIN,client_addr,proxy_addr,proxy_port,digest,match_digest,match_pattern,negate_match_pattern,re_modifiers,flagOUT,replace_pattern,destination_hostgroup,cache_ttl,reconnect,timeout,retries,delay,mirror_flagOUT,mirror_hostgroup,error_msg,sticky_conn,multiplex,log,apply,comment FROM mysql_query_rules_v131");
+	}
+	// adding priority to mysql_query_rules table
+	rci=configdb->check_table_structure((char *)"mysql_query_rules",(char *)ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES_V1_4_0);
+	if (rci) {
+		// upgrade is required
+		proxy_warning("Detected version v1.4.0 of table mysql_query_rules\n");
+		proxy_warning("ONLINE UPGRADE of table mysql_query_rules in progress\n");
+		// drop any existing table with suffix _v140
+		configdb->execute("DROP TABLE IF EXISTS mysql_query_rules_v140");
+		// rename current table to add suffix _v140
+		configdb->execute("ALTER TABLE mysql_query_rules RENAME TO mysql_query_rules_v140");
+		// create new table
+		configdb->build_table((char *)"mysql_query_rules",(char *)ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES,false);
+		// copy fields from old table
+		configdb->execute("INSERT INTO mysql_query_rules (rule_id,active,username,schemaname,flagIN,client_addr,proxy_addr,proxy_port,digest,match_digest,match_pattern,negate_match_pattern,re_modifiers,flagOUT,replace_pattern,destination_hostgroup,cache_ttl,reconnect,timeout,retries,delay,mirror_flagOUT,mirror_hostgroup,error_msg,sticky_conn,multiplex,log,apply,comment,qos_max_qps,qos_burst,qos_max_concurrency,qos_max_wait_ms) SELECT rule_id,active,username,schemaname,flagIN,client_addr,proxy_addr,proxy_port,digest,match_digest,match_pattern,negate_match_pattern,re_modifiers,flagOUT,replace_pattern,destination_hostgroup,cache_ttl,reconnect,timeout,retries,delay,mirror_flagOUT,mirror_hostgroup,error_msg,sticky_conn,multiplex,log,apply,comment,qos_max_qps,qos_burst,qos_max_concurrency,qos_max_wait_ms FROM mysql_query_rules_v140");
+	}
+	// adding hedged reads to mysql_query_rules table
+	rci=configdb->check_table_structure((char *)"mysql_query_rules",(char *)ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES_V1_4_1);
+	if (rci) {
+		// upgrade is required
+		proxy_warning("Detected version v1.4.1 of table mysql_query_rules\n");
+		proxy_warning("ONLINE UPGRADE of table mysql_query_rules in progress\n");
+		// drop any existing table with suffix _v141
+		configdb->execute("DROP TABLE IF EXISTS mysql_query_rules_v141");
+		// rename current table to add suffix _v141
+		configdb->execute("ALTER TABLE mysql_query_rules RENAME TO mysql_query_rules_v141");
+		// create new table
+		configdb->build_table((char *)"mysql_query_rules",(char *)ADMIN_SQLITE_TABLE_MYSQL_QUERY_RULES,false);
+		// copy fields from old table
+		configdb->execute("INSERT INTO mysql_query_rules (rule_id,active,username,schemaname,flagIN,client_addr,proxy_addr,proxy_port,digest,match_digest,match_pattern,negate_match_pattern,re_modifiers,flagOUT,replace_pattern,destination_hostgroup,cache_ttl,reconnect,timeout,retries,delay,mirror_flagOUT,mirror_hostgroup,error_msg,sticky_conn,multiplex,log,apply,comment,qos_max_qps,qos_burst,qos_max_concurrency,qos_max_wait_ms,priority) SELECT rule_id,active,username,schemaname,flagIN,client_addr,proxy_addr,proxy_port,digest,match_digest,match_pattern,negate_match_pattern,re_modifiers,flagOUT,replace_pattern,destination_hostgroup,cache_ttl,reconnect,timeout,retries,delay,mirror_flagOUT,mirror_hostgroup,error_msg,sticky_conn,multiplex,log,apply,comment,qos_max_qps,qos_burst,qos_max_concurrency,qos_max_wait_ms,priority FROM mysql_query_rules_v141");
+	}
 	configdb->execute("PRAGMA foreign_keys = ON");
 }
 
@@ -5000,6 +5073,20 @@ void ProxySQL_Admin::disk_upgrade_mysql_servers() {
 		// copy fields from old table
 		configdb->execute("INSERT INTO mysql_servers (hostgroup_id,hostname,port,status,weight,compression,max_connections,max_replication_lag,use_ssl,max_latency_ms) SELECT hostgroup_id,hostname,port,status,weight,compression,max_connections,max_replication_lag,use_ssl,max_latency_ms FROM mysql_servers_v120");
 	}
+	rci=configdb->check_table_structure((char *)"mysql_servers",(char *)ADMIN_SQLITE_TABLE_MYSQL_SERVERS_V1_2_2);
+	if (rci) {
+		// upgrade is required
+		proxy_warning("Detected version v1.2.2 of table mysql_servers\n");
+		proxy_warning("ONLINE UPGRADE of table mysql_servers in progress\n");
+		// drop any existing table with suffix _v122
+		configdb->execute("DROP TABLE IF EXISTS mysql_servers_v122");
+		// rename current table to add suffix _v122
+		configdb->execute("ALTER TABLE mysql_servers RENAME TO mysql_servers_v122");
+		// create new table
+		configdb->build_table((char *)"mysql_servers",(char *)ADMIN_SQLITE_TABLE_MYSQL_SERVERS,false);
+		// copy fields from old table
+		configdb->execute("INSERT INTO mysql_servers (hostgroup_id,hostname,port,status,weight,compression,max_connections,max_replication_lag,use_ssl,max_latency_ms,comment) SELECT hostgroup_id,hostname,port,status,weight,compression,max_connections,max_replication_lag,use_ssl,max_latency_ms,comment FROM mysql_servers_v122");
+	}
 	rci=configdb->check_table_structure((char *)"mysql_replication_hostgroups",(char *)ADMIN_SQLITE_TABLE_MYSQL_REPLICATION_HOSTGROUPS_V1_0); // isseu #643
 	if (rci) {
 		// upgrade is required
@@ -0,0 +1,424 @@
+#include "proxysql.h"
+#include "cpp.h"
+#include "ProxySQL_Exporter.hpp"
+
+extern Query_Cache *GloQC;
+extern Query_Processor *GloQPro;
+extern MySQL_Threads_Handler *GloMTH;
+extern MySQL_STMT_Manager *GloMyStmt;
+extern MySQL_Authentication *GloMyAuth;
+
+#define EXPORTER_MAX_REQUEST 4096
+#define EXPORTER_IO_TIMEOUT_SEC 1
+
+#define OPENMETRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+#define PROMETHEUS_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+static void * exporter_thread(void *arg) {
+	ProxySQL_Exporter *exp=(ProxySQL_Exporter *)arg;
+	exp->run();
+	return NULL;
+}
+
+// writes the # HELP and # TYPE lines of a metric family.
+// In OpenMetrics a counter family is named without the _total suffix, while
+// its samples always have it. In the Prometheus text format both have it.
+static void metric_family(std::string &out, const char *name, const char *type, const char *help, bool openmetrics) {
+	bool counter=(strcmp(type,"counter")==0);
+	out.append("# HELP ").append(name);
+	if (counter && !openmetrics) out.append("_total");
+	out.append(" ").append(help).append("\n");
+	out.append("# TYPE ").append(name);
+	if (counter && !openmetrics) out.append("_total");
+	out.append(" ").append(type).append("\n");
+}
+
+static void metric_sample(std::string &out, const char *name, const char *suffix, const char *labels, unsigned long long v) {
+	char buf[32];
+	out.append(name);
+	if (suffix) out.append(suffix);
+	if (labels) out.append("{").append(labels).append("}");
+	sprintf(buf," %llu\n",v);
+	out.append(buf);
+}
+
+static void metric(std::string &out, const char *name, const char *type, const char *help, unsigned long long v, bool openmetrics) {
+	metric_family(out, name, type, help, openmetrics);
+	metric_sample(out, name, (strcmp(type,"counter")==0 ? "_total" : NULL), NULL, v);
+}
+
+// label values are escaped as required by both formats
+static void label_value(std::string &out, const char *v) {
+	for (const char *c=v; *c; c++) {
+		switch (*c) {
+			case '\\': out.append("\\\\"); break;
+			case '"': out.append("\\\""); break;
+			case '\n': out.append("\\n"); break;
+			default: out.push_back(*c); break;
+		}
+	}
+}
+
+ProxySQL_Exporter::ProxySQL_Exporter() {
+	thread_started=false;
+	pthread_mutex_init(&mutex, NULL);
+	ifaces=strdup("");
+	version=0;
+	shutdown=0;
+	nfds=0;
+	scrapes=0;
+	if (pipe(pipefd)==-1) {
+		perror("pipe");
+		assert(0);
+	}
+	fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL, 0) | O_NONBLOCK);
+}
+
+ProxySQL_Exporter::~ProxySQL_Exporter() {
+	stop();
+	close(pipefd[0]);
+	close(pipefd[1]);
+	free(ifaces);
+	pthread_mutex_destroy(&mutex);
+}
+
+void ProxySQL_Exporter::start() {
+	if (thread_started) return;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 256*1024);
+	if (pthread_create(&thr, &attr, exporter_thread, (void *)this) != 0) {
+		perror("Thread creation");
+		exit(EXIT_FAILURE);
+	}
+	thread_started=true;
+}
+
+void ProxySQL_Exporter::stop() {
+	if (thread_started==false) return;
+	__sync_fetch_and_add(&shutdown,1);
+	int c=0;
+	write(pipefd[1], &c, sizeof(int));
+	pthread_join(thr, NULL);
+	thread_started=false;
+}
+
+void ProxySQL_Exporter::update_ifaces(const char *list) {
+	pthread_mutex_lock(&mutex);
+	if (strcmp(ifaces,list)) {
+		free(ifaces);
+		ifaces=strdup(list);
+		version++;
+	}
+	pthread_mutex_unlock(&mutex);
+	int c=0;
+	write(pipefd[1], &c, sizeof(int));
+}
+
+void ProxySQL_Exporter::close_listeners() {
+	for (int i=1; i<nfds; i++) {
+		close(fds[i].fd);
+	}
+	nfds=1;
+}
+
+void ProxySQL_Exporter::open_listeners() {
+	pthread_mutex_lock(&mutex);
+	char *list=strdup(ifaces);
+	pthread_mutex_unlock(&mutex);
+	tokenizer_t tok = tokenizer( list, ";", TOKENIZER_NO_EMPTIES );
+	const char* token;
+	for ( token = tokenize( &tok ) ; token && nfds < MAX_EXPORTER_LISTENERS+1 ; token = tokenize( &tok ) ) {
+		char *sn=strdup(token);
+		char *add=NULL; char *port=NULL;
+		if (*sn == '[') { // IPv6 , [address]:port
+			char *p = strchr(sn, ']');
+			if (p == NULL || *(p+1) != ':') {
+				proxy_error("Invalid metrics interface: %s\n", token);
+				free(sn);
+				continue;
+			}
+			*p = '\0';
+			add=strdup(sn+1);
+			port=strdup(p+2);
+		} else {
+			c_split_2(sn, ":" , &add, &port);
+		}
+		int s = ( atoi(port) ? listen_on_port(add, atoi(port), 16, false) : -1 );
+		if (s>=0) {
+			fds[nfds].fd=s;
+			fds[nfds].events=POLLIN;
+			fds[nfds].revents=0;
+			nfds++;
+			proxy_info("Metrics exporter listening on %s\n", token);
+		} else {
+			proxy_error("Unable to listen on metrics interface %s\n", token);
+		}
+		free(add);
+		free(port);
+		free(sn);
+	}
+	free_tokenizer( &tok );
+	free(list);
+}
+
+void ProxySQL_Exporter::run() {
+	int cur_version=-1;
+	fds[0].fd=pipefd[0];
+	fds[0].events=POLLIN;
+	nfds=1;
+	while (__sync_fetch_and_add(&shutdown,0)==0 && __sync_fetch_and_add(&glovars.shutdown,0)==0) {
+		pthread_mutex_lock(&mutex);
+		int v=version;
+		pthread_mutex_unlock(&mutex);
+		if (v!=cur_version) {
+			cur_version=v;
+			close_listeners();
+			open_listeners();
+		}
+		for (int i=0; i<nfds; i++) {
+			fds[i].revents=0;
+		}
+		int rc=poll(fds,nfds,1000);
+		if (rc<=0) {
+			continue;
+		}
+		if (fds[0].revents & POLLIN) {
+			int c;
+			while (read(pipefd[0], &c, sizeof(int)) > 0) {}
+		}
+		for (int i=1; i<nfds; i++) {
+			if (fds[i].revents & POLLIN) {
+				int client=accept(fds[i].fd, NULL, NULL);
+				if (client>=0) {
+					serve_client(client);
+					close(client);
+				}
+			}
+		}
+	}
+	close_listeners();
+}
+
+void ProxySQL_Exporter::serve_client(int fd) {
+	struct timeval tv;
+	tv.tv_sec=EXPORTER_IO_TIMEOUT_SEC;
+	tv.tv_usec=0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	char req[EXPORTER_MAX_REQUEST+1];
+	int len=0;
+	// read the request headers, the body (if any) is ignored
+	while (len < EXPORTER_MAX_REQUEST) {
+		int r=recv(fd, req+len, EXPORTER_MAX_REQUEST-len, 0);
+		if (r<=0) return;
+		len+=r;
+		req[len]=0;
+		if (strstr(req,"\r\n\r\n") || strstr(req,"\n\n")) break;
+	}
+	req[len]=0;
+	const char *status=NULL;
+	const char *content_type=PROMETHEUS_CONTENT_TYPE;
+	std::string body;
+	if (strncmp(req,"GET ",4) && strncmp(req,"HEAD ",5)) {
+		status="405 Method Not Allowed";
+		body="Method Not Allowed\n";
+		content_type="text/plain";
+	} else {
+		char *path=strchr(req,' ')+1;
+		size_t pl=strcspn(path," ?\r\n");
+		if ((pl==8 && strncmp(path,"/metrics",8)==0) || (pl==1 && path[0]=='/')) {
+			bool openmetrics=(strcasestr(req,"application/openmetrics-text")!=NULL);
+			if (openmetrics) content_type=OPENMETRICS_CONTENT_TYPE;
+			status="200 OK";
+			__sync_fetch_and_add(&scrapes,1);
+			generate_metrics(body, openmetrics);
+		} else {
+			status="404 Not Found";
+			body="Not Found\n";
+			content_type="text/plain";
+		}
+	}
+	char hdr[256];
+	sprintf(hdr,"HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n", status, content_type, (unsigned long)body.length());
+	std::string resp(hdr);
+	if (strncmp(req,"HEAD ",5)) {
+		resp.append(body);
+	}
+	const char *p=resp.data();
+	size_t left=resp.length();
+	while (left) {
+		ssize_t w=send(fd, p, left, MSG_NOSIGNAL);
+		if (w<=0) return;
+		p+=w;
+		left-=w;
+	}
+}
+
+void ProxySQL_Exporter::generate_metrics(std::string &out, bool om) {
+	char buf[256];
+	out.reserve(64*1024);
+	metric(out, "proxysql_uptime_seconds", "gauge", "Seconds since ProxySQL started.", (monotonic_time()-GloVars.global.start_time)/1000000, om);
+	metric(out, "proxysql_exporter_scrapes", "counter", "Number of metrics requests served.", __sync_fetch_and_add(&scrapes,0), om);
+	if (MyHGM) {
+		metric(out, "proxysql_client_connections_aborted", "counter", "Client connections aborted.", __sync_fetch_and_add(&MyHGM->status.client_connections_aborted,0), om);
+		metric(out, "proxysql_client_connections_connected", "gauge", "Client connections currently connected.", __sync_fetch_and_add(&MyHGM->status.client_connections,0), om);
+		metric(out, "proxysql_client_connections_created", "counter", "Client connections created.", __sync_fetch_and_add(&MyHGM->status.client_connections_created,0), om);
+		if (GloMyAuth) {
+			metric(out, "proxysql_client_auth_offloaded", "counter", "Client passwords verified by the auth threads.", __sync_fetch_and_add(&GloMyAuth->auth_offloaded,0), om);
+		}
+		metric(out, "proxysql_server_connections_aborted", "counter", "Backend connections aborted.", __sync_fetch_and_add(&MyHGM->status.server_connections_aborted,0), om);
+		metric(out, "proxysql_server_connections_connected", "gauge", "Backend connections currently connected.", __sync_fetch_and_add(&MyHGM->status.server_connections_connected,0), om);
+		metric(out, "proxysql_server_connections_created", "counter", "Backend connections created.", __sync_fetch_and_add(&MyHGM->status.server_connections_created,0), om);
+		metric(out, "proxysql_com_autocommit", "counter", "SET AUTOCOMMIT sent to backends.", __sync_fetch_and_add(&MyHGM->status.autocommit_cnt,0), om);
+		metric(out, "proxysql_com_autocommit_filtered", "counter", "SET AUTOCOMMIT not sent to backends.", __sync_fetch_and_add(&MyHGM->status.autocommit_cnt_filtered,0), om);
+		metric(out, "proxysql_com_commit", "counter", "COMMIT sent to backends.", __sync_fetch_and_add(&MyHGM->status.commit_cnt,0), om);
+		metric(out, "proxysql_com_commit_filtered", "counter", "COMMIT not sent to backends.", __sync_fetch_and_add(&MyHGM->status.commit_cnt_filtered,0), om);
+		metric(out, "proxysql_com_rollback", "counter", "ROLLBACK sent to backends.", __sync_fetch_and_add(&MyHGM->status.rollback_cnt,0), om);
+		metric(out, "proxysql_com_rollback_filtered", "counter", "ROLLBACK not sent to backends.", __sync_fetch_and_add(&MyHGM->status.rollback_cnt_filtered,0), om);
+		metric(out, "proxysql_myconnpoll_get", "counter", "Requests of a connection from the connection pool.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_get,0), om);
+		metric(out, "proxysql_myconnpoll_get_ok", "counter", "Successful requests of a connection from the connection pool.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_get_ok,0), om);
+		metric(out, "proxysql_myconnpoll_push", "counter", "Connections returned to the connection pool.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_push,0), om);
+		metric(out, "proxysql_myconnpoll_destroy", "counter", "Connections destroyed by the connection pool.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_destroy,0), om);
+		metric(out, "proxysql_myconnpoll_wait", "counter", "Sessions queued waiting for a connection from the connection pool.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_wait,0), om);
+		metric(out, "proxysql_myconnpoll_waiting", "gauge", "Sessions currently queued waiting for a connection.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_waiting,0), om);
+		metric(out, "proxysql_myconnpoll_handoff", "counter", "Connections handed off directly to a queued session.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_handoff,0), om);
+		metric(out, "proxysql_myconnpoll_wait_us", "counter", "Time spent by sessions queued waiting for a connection.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_wait_us,0), om);
+		metric_family(out, "proxysql_myconnpoll_wait_priority", "counter", "Sessions queued waiting for a connection, by priority class.", om);
+		for (int i=0; i<MYCONN_WAITER_PRIORITIES; i++) {
+			char l[32];
+			sprintf(l,"priority=\"%d\"",i);
+			metric_sample(out, "proxysql_myconnpoll_wait_priority", "_total", l, __sync_fetch_and_add(&MyHGM->status.myconnpoll_wait_prio[i],0));
+		}
+		metric_family(out, "proxysql_myconnpoll_wait_us_priority", "counter", "Time spent by sessions queued waiting for a connection, by priority class.", om);
+		for (int i=0; i<MYCONN_WAITER_PRIORITIES; i++) {
+			char l[32];
+			sprintf(l,"priority=\"%d\"",i);
+			metric_sample(out, "proxysql_myconnpoll_wait_us_priority", "_total", l, __sync_fetch_and_add(&MyHGM->status.myconnpoll_wait_us_prio[i],0));
+		}
+		metric(out, "proxysql_myconnpoll_warm", "counter", "Connections opened in background because of min_idle_connections.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_warm,0), om);
+		metric(out, "proxysql_myconnpoll_warm_err", "counter", "Background connections that failed to connect.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_warm_err,0), om);
+		metric(out, "proxysql_myconnpoll_connect_throttled", "counter", "Connections not created because of connect_rate_limit_per_server.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_connect_throttled,0), om);
+		metric(out, "proxysql_myconnpoll_reset", "counter", "Connections reset and returned to the pool.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_reset,0), om);
+		metric(out, "proxysql_myconnpoll_reset_err", "counter", "Connections that failed to reset.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_reset_err,0), om);
+		metric(out, "proxysql_myconnpoll_reset_dropped", "counter", "Connections destroyed without reset because the reset threads were busy.", __sync_fetch_and_add(&MyHGM->status.myconnpoll_reset_dropped,0), om);
+		metric(out, "proxysql_myconnpoll_reset_pending", "gauge", "Connections waiting to be reset.", MyHGM->HGCU_pending(), om);
+		metric(out, "proxysql_kill_query_queued", "counter", "KILL QUERY requested by sessions.", __sync_fetch_and_add(&MyHGM->status.kill_queued,0), om);
+		metric(out, "proxysql_kill_query_coalesced", "counter", "KILL QUERY not executed because already pending for the same backend thread.", __sync_fetch_and_add(&MyHGM->status.kill_coalesced,0), om);
+		metric(out, "proxysql_kill_query_dropped", "counter", "KILL QUERY not executed because too many were pending.", __sync_fetch_and_add(&MyHGM->status.kill_dropped,0), om);
+		metric(out, "proxysql_kill_query_ok", "counter", "KILL QUERY executed successfully.", __sync_fetch_and_add(&MyHGM->status.kill_ok,0), om);
+		metric(out, "proxysql_kill_query_failed", "counter", "KILL QUERY failed or timed out.", __sync_fetch_and_add(&MyHGM->status.kill_err,0), om);
+		metric(out, "proxysql_kill_query_latency_us", "counter", "Total time from KILL QUERY request to completion.", __sync_fetch_and_add(&MyHGM->status.kill_latency_us,0), om);
+		metric(out, "proxysql_kill_query_pending", "gauge", "KILL QUERY queued or in progress.", MyHGM->KILL_pending(), om);
+		metric(out, "proxysql_circuit_breaker_open", "counter", "Circuit breakers of backend servers tripped to OPEN.", __sync_fetch_and_add(&MyHGM->status.breaker_open,0), om);
+		metric(out, "proxysql_circuit_breaker_fast_fail", "counter", "Queries failed immediately because the circuit breakers of all the servers of the hostgroup were OPEN.", __sync_fetch_and_add(&MyHGM->status.breaker_fast_fail,0), om);
+		metric(out, "proxysql_servers_table_version", "gauge", "Version of the runtime mysql_servers table.", MyHGM->get_servers_table_version(), om);
+	}
+	if (GloMTH) {
+		metric(out, "proxysql_active_transactions", "gauge", "Client sessions with an active transaction.", GloMTH->get_active_transations(), om);
+		metric(out, "proxysql_client_connections_non_idle", "gauge", "Client connections handled by worker threads.", GloMTH->get_non_idle_client_connections(), om);
+		metric(out, "proxysql_queries_backends_bytes_recv", "counter", "Bytes received from backends.", GloMTH->get_queries_backends_bytes_recv(), om);
+		metric(out, "proxysql_queries_backends_bytes_sent", "counter", "Bytes sent to backends.", GloMTH->get_queries_backends_bytes_sent(), om);
+		metric(out, "proxysql_query_processor_time_nsec", "counter", "Time spent in the Query Processor.", GloMTH->get_query_processor_time(), om);
+		metric(out, "proxysql_backend_query_time_nsec", "counter", "Time spent waiting for backends.", GloMTH->get_backend_query_time(), om);
+		metric(out, "proxysql_com_stmt_prepare", "counter", "Prepared statements prepared by clients.", GloMTH->get_total_stmt_prepare(), om);
+		metric(out, "proxysql_com_stmt_execute", "counter", "Prepared statements executed by clients.", GloMTH->get_total_stmt_execute(), om);
+		metric(out, "proxysql_com_stmt_close", "counter", "Prepared statements closed by clients.", GloMTH->get_total_stmt_close(), om);
+		metric(out, "proxysql_questions", "counter", "Client requests.", GloMTH->get_total_queries(), om);
+		metric(out, "proxysql_slow_queries", "counter", "Queries slower than mysql-long_query_time.", GloMTH->get_slow_queries(), om);
+		metric(out, "proxysql_connpool_get_conn_immediate", "counter", "Connections taken from the thread local pool.", GloMTH->get_ConnPool_get_conn_immediate(), om);
+		metric(out, "proxysql_connpool_get_conn_success", "counter", "Connections taken from the global pool.", GloMTH->get_ConnPool_get_conn_success(), om);
+		metric(out, "proxysql_connpool_get_conn_failure", "counter", "Failed requests of a connection from the pool.", GloMTH->get_ConnPool_get_conn_failure(), om);
+		metric(out, "proxysql_mysql_thread_workers", "gauge", "MySQL worker threads.", GloMTH->num_threads, om);
+	}
+	if (GloMyStmt) {
+		uint32_t stmt_active_unique=0;
+		uint32_t stmt_active_total=0;
+		GloMyStmt->active_prepared_statements(&stmt_active_unique,&stmt_active_total);
+		metric(out, "proxysql_stmt_active_total", "gauge", "Prepared statements in use by clients.", stmt_active_total, om);
+		metric(out, "proxysql_stmt_active_unique", "gauge", "Unique prepared statements in use by clients.", stmt_active_unique, om);
+	}
+	if (GloQC) {
+		SQLite3_result *resultset=GloQC->SQL3_getStats();
+		for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
+			SQLite3_row *r=*it;
+			std::string name("proxysql_");
+			for (char *c=r->fields[0]; *c; c++) {
+				name.push_back(tolower(*c));
+			}
+			bool gauge=(strstr(r->fields[0],"Memory") || strstr(r->fields[0],"Entries"));
+			metric(out, name.c_str(), (gauge ? "gauge" : "counter"), "Query Cache statistic.", strtoull(r->fields[1],NULL,10), om);
+		}
+		delete resultset;
+	}
+	if (MyHGM) {
+		// per server connection pool metrics
+		static const char *cp_names[] = {
+			"proxysql_connpool_conn_used", "proxysql_connpool_conn_free", "proxysql_connpool_conn_ok", "proxysql_connpool_conn_err",
+			"proxysql_connpool_queries", "proxysql_connpool_bytes_data_sent", "proxysql_connpool_bytes_data_recv", "proxysql_connpool_latency_us"
+		};
+		static const char *cp_types[] = { "gauge", "gauge", "counter", "counter", "counter", "counter", "counter", "gauge" };
+		static const char *cp_help[] = {
+			"Backend connections in use.", "Idle backend connections.", "Backend connections established.", "Backend connections failed.",
+			"Queries sent to the backend.", "Bytes sent to the backend.", "Bytes received from the backend.", "Ping latency of the backend."
+		};
+		SQLite3_result *resultset=MyHGM->SQL3_Connection_Pool(false);
+		std::vector<std::string> labels;
+		for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
+			SQLite3_row *r=*it;
+			std::string l("hostgroup=\"");
+			label_value(l,r->fields[0]);
+			l.append("\",srv_host=\"");
+			label_value(l,r->fields[1]);
+			l.append("\",srv_port=\"");
+			label_value(l,r->fields[2]);
+			l.append("\"");
+			labels.push_back(l);
+		}
+		metric_family(out, "proxysql_connpool_status", "gauge", "Backend status: 0 ONLINE, 1 SHUNNED, 2 OFFLINE_SOFT, 3 OFFLINE_HARD, 4 SHUNNED_REPLICATION_LAG.", om);
+		static const char *st_names[] = { "ONLINE", "SHUNNED", "OFFLINE_SOFT", "OFFLINE_HARD", "SHUNNED_REPLICATION_LAG" };
+		for (unsigned int i=0; i<resultset->rows.size(); i++) {
+			unsigned long long st=0;
+			for (unsigned int k=0; k<5; k++) {
+				if (strcmp(resultset->rows[i]->fields[3],st_names[k])==0) st=k;
+			}
+			metric_sample(out, "proxysql_connpool_status", NULL, labels[i].c_str(), st);
+		}
+		for (int c=0; c<8; c++) {
+			bool counter=(strcmp(cp_types[c],"counter")==0);
+			metric_family(out, cp_names[c], cp_types[c], cp_help[c], om);
+			for (unsigned int i=0; i<resultset->rows.size(); i++) {
+				metric_sample(out, cp_names[c], (counter ? "_total" : NULL), labels[i].c_str(), strtoull(resultset->rows[i]->fields[4+c],NULL,10));
+			}
+		}
+		delete resultset;
+	}
+	if (GloQPro) {
+		// commands counters are exposed as histograms , with buckets in seconds
+		static const char *bounds[] = { "0.0001", "0.0005", "0.001", "0.005", "0.01", "0.05", "0.1", "0.5", "1", "5", "10", "+Inf" };
+		const char *name="proxysql_mysql_command_duration_seconds";
+		SQLite3_result *resultset=GloQPro->get_stats_commands_counters();
+		metric_family(out, name, "histogram", "Execution time of the queries, per command.", om);
+		for (std::vector<SQLite3_row *>::iterator it = resultset->rows.begin() ; it != resultset->rows.end(); ++it) {
+			SQLite3_row *r=*it;
+			std::string l("command=\"");
+			label_value(l,r->fields[0]);
+			l.append("\"");
+			unsigned long long cumulative=0;
+			for (int b=0; b<12; b++) {
+				cumulative+=strtoull(r->fields[3+b],NULL,10);
+				std::string lb(l);
+				lb.append(",le=\"").append(bounds[b]).append("\"");
+				metric_sample(out, name, "_bucket", lb.c_str(), cumulative);
+			}
+			out.append(name).append("_sum{").append(l).append("}");
+			sprintf(buf," %.6f\n", strtoull(r->fields[1],NULL,10)/1000000.0);
+			out.append(buf);
+			metric_sample(out, name, "_count", l.c_str(), strtoull(r->fields[2],NULL,10));
+		}
+		delete resultset;
+	}
+	if (om) {
+		out.append("# EOF\n");
+	}
+}
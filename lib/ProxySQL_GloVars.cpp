@@ -53,6 +53,7 @@ ProxySQL_GlobalVariables::ProxySQL_GlobalVariables() {
 
 	__cmd_proxysql_initial=false;
 	__cmd_proxysql_reload=false;
+	__cmd_proxysql_snapshot=false;
 
 	global.gdbg=false;
 	global.nostart=false;
@@ -90,6 +91,7 @@ ProxySQL_GlobalVariables::ProxySQL_GlobalVariables() {
 	opt->add((const char *)"",0,1,0,(const char *)"Datadir",(const char *)"-D",(const char *)"--datadir");
 	opt->add((const char *)"",0,0,0,(const char *)"Rename/empty database file",(const char *)"--initial");
 	opt->add((const char *)"",0,0,0,(const char *)"Merge config file into database file",(const char *)"--reload");
+	opt->add((const char *)"",0,0,0,(const char *)"Load configuration from the runtime snapshot, if compatible",(const char *)"--snapshot");
 	opt->add((const char *)"",0,1,0,(const char *)"Administration Unix Socket",(const char *)"-S",(const char *)"--admin-socket");
 
 	confFile=new ProxySQL_ConfigFile();
@@ -158,6 +160,10 @@ void ProxySQL_GlobalVariables::process_opts_pre() {
 		__cmd_proxysql_reload=true;
 	}
 
+	if (opt->isSet("--snapshot")) {
+		__cmd_proxysql_snapshot=true;
+	}
+
 	
 	config_file=GloVars.__cmd_proxysql_config_file;
 
@@ -20,6 +20,8 @@
 #define QP_RE_MOD_CASELESS 1
 #define QP_RE_MOD_GLOBAL 2
 
+extern MySQL_Threads_Handler *GloMTH;
+
 class QP_rule_text_hitsonly {
 	public:
 	char **pta;
@@ -42,7 +44,7 @@ class QP_rule_text {
 	char **pta;
 	int num_fields;
 	QP_rule_text(QP_rule_t *QPr) {
-		num_fields=30;
+		num_fields=36;
 		pta=NULL;
 		pta=(char **)malloc(sizeof(char *)*num_fields);
 		itostr(pta[0], (long long)QPr->rule_id);
@@ -95,7 +97,13 @@ class QP_rule_text {
 		itostr(pta[26], (long long)QPr->log);
 		itostr(pta[27], (long long)QPr->apply);
 		pta[28]=strdup_null(QPr->comment); // issue #643
-		itostr(pta[29], (long long)QPr->hits);
+		itostr(pta[29], (long long)QPr->qos_max_qps);
+		itostr(pta[30], (long long)QPr->qos_burst);
+		itostr(pta[31], (long long)QPr->qos_max_concurrency);
+		itostr(pta[32], (long long)QPr->qos_max_wait_ms);
+		itostr(pta[33], (long long)QPr->priority);
+		itostr(pta[34], (long long)QPr->hedge_delay_ms);
+		itostr(pta[35], (long long)QPr->hits);
 	}
 	~QP_rule_text() {
 		for(int i=0; i<num_fields; i++) {
@@ -116,6 +124,68 @@ struct __SQP_query_parser_t {
 
 typedef struct __SQP_query_parser_t SQP_par_t;
 */
+static const char *query_phase_names[QUERY_PHASE__END] = {
+	"rules",
+	"pool_wait",
+	"connect",
+	"reset",
+	"backend",
+	"client_write"
+};
+
+#define QUERY_PHASE_BUCKETS 12
+
+// upper bounds of the phase histogram buckets, in microseconds, the same
+// used by stats_mysql_commands_counters . The last bucket has no bound
+static const unsigned long long query_phase_bounds[QUERY_PHASE_BUCKETS-1] = {
+	100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000
+};
+
+// per digest histograms of the time spent in each query_phase .
+// Allocated only for digests that were tracked with mysql-query_digests_phases
+class QP_query_digest_phases {
+	public:
+	unsigned int count_star;
+	unsigned long long sum_time[QUERY_PHASE__END];
+	unsigned long long max_time[QUERY_PHASE__END];
+	unsigned int cnt[QUERY_PHASE__END][QUERY_PHASE_BUCKETS];
+	QP_query_digest_phases() {
+		count_star=0;
+		memset(sum_time,0,sizeof(sum_time));
+		memset(max_time,0,sizeof(max_time));
+		memset(cnt,0,sizeof(cnt));
+	}
+	void add_times(unsigned long long *t) {
+		int i;
+		int j;
+		count_star++;
+		for (i=0; i<QUERY_PHASE__END; i++) {
+			sum_time[i]+=t[i];
+			if (t[i] > max_time[i]) {
+				max_time[i]=t[i];
+			}
+			for (j=0; j<QUERY_PHASE_BUCKETS-1; j++) {
+				if (t[i] <= query_phase_bounds[j]) break;
+			}
+			cnt[i][j]++;
+		}
+	}
+	void merge(QP_query_digest_phases *o) {
+		int i;
+		int j;
+		count_star+=o->count_star;
+		for (i=0; i<QUERY_PHASE__END; i++) {
+			sum_time[i]+=o->sum_time[i];
+			if (o->max_time[i] > max_time[i]) {
+				max_time[i]=o->max_time[i];
+			}
+			for (j=0; j<QUERY_PHASE_BUCKETS; j++) {
+				cnt[i][j]+=o->cnt[i][j];
+			}
+		}
+	}
+};
+
 class QP_query_digest_stats {
 	public:
 	uint64_t digest;
@@ -129,6 +199,7 @@ class QP_query_digest_stats {
 	unsigned long long min_time;
 	unsigned long long max_time;
 	int hid;
+	QP_query_digest_phases *phases;
 	QP_query_digest_stats(char *u, char *s, uint64_t d, char *dt, int h) {
 		digest=d;
 		digest_text=strdup(dt);
@@ -141,6 +212,32 @@ class QP_query_digest_stats {
 		min_time=0;
 		max_time=0;
 		hid=h;
+		phases=NULL;
+	}
+	// merges the stats of another entry with the same digest_total
+	void merge(QP_query_digest_stats *o) {
+		count_star+=o->count_star;
+		sum_time+=o->sum_time;
+		if (o->min_time && (o->min_time < min_time || min_time==0)) {
+			min_time=o->min_time;
+		}
+		if (o->max_time > max_time) {
+			max_time=o->max_time;
+		}
+		if (o->first_seen && (o->first_seen < first_seen || first_seen==0)) {
+			first_seen=o->first_seen;
+		}
+		if (o->last_seen > last_seen) {
+			last_seen=o->last_seen;
+		}
+		if (o->phases) {
+			if (phases) {
+				phases->merge(o->phases);
+			} else {
+				phases=o->phases;
+				o->phases=NULL;
+			}
+		}
 	}
 	void add_time(unsigned long long t, unsigned long long n) {
 		count_star++;
@@ -169,25 +266,46 @@ class QP_query_digest_stats {
 			free(schemaname);
 			schemaname=NULL;
 		}
+		if (phases) {
+			delete phases;
+			phases=NULL;
+		}
+	}
+	// checks the columns of stats_mysql_query_digest that don't need formatting
+	bool match(SQLite3_vtab_filter *filter) {
+		char buf[32];
+		if (filter->constrained(0)) {
+			sprintf(buf,"%d",hid);
+			if (filter->match(0,buf)==false) return false;
+		}
+		if (filter->match(1,schemaname)==false) return false;
+		if (filter->match(2,username)==false) return false;
+		if (filter->constrained(3)) {
+			sprintf(buf,"0x%016llX", (long long unsigned int)digest);
+			if (filter->match(3,buf)==false) return false;
+		}
+		return true;
 	}
 	char **get_row() {
 		char buf[128];
 		char **pta=(char **)malloc(sizeof(char *)*11);
+		sprintf(buf,"%d",hid);
+		pta[0]=strdup(buf);
 		assert(schemaname);
-		pta[0]=strdup(schemaname);
+		pta[1]=strdup(schemaname);
 		assert(username);
-		pta[1]=strdup(username);
+		pta[2]=strdup(username);
 
 		//uint32_t d32[2];
 		//memcpy(&d32,&digest,sizeof(digest));
 		//sprintf(buf,"0x%X%X", d32[0], d32[1]);
 		sprintf(buf,"0x%016llX", (long long unsigned int)digest);
-		pta[2]=strdup(buf);
+		pta[3]=strdup(buf);
 
 		assert(digest_text);
-		pta[3]=strdup(digest_text);
+		pta[4]=strdup(digest_text);
 		sprintf(buf,"%u",count_star);
-		pta[4]=strdup(buf);
+		pta[5]=strdup(buf);
 
 		time_t __now;
     //char __buffer[25];
@@ -202,21 +320,19 @@ class QP_query_digest_stats {
 //    __tm_info = localtime(&seen_time);
 //    strftime(buf, 25, "%Y-%m-%d %H:%M:%S", __tm_info);
 		sprintf(buf,"%ld", seen_time);
-		pta[5]=strdup(buf);
+		pta[6]=strdup(buf);
 
 		seen_time= __now - curtime/1000000 + last_seen/1000000;
 //    __tm_info = localtime(&seen_time);
 //    strftime(buf, 25, "%Y-%m-%d %H:%M:%S", __tm_info);
 		sprintf(buf,"%ld", seen_time);
-		pta[6]=strdup(buf);
+		pta[7]=strdup(buf);
 
 		sprintf(buf,"%llu",sum_time);
-		pta[7]=strdup(buf);
-		sprintf(buf,"%llu",min_time);
 		pta[8]=strdup(buf);
-		sprintf(buf,"%llu",max_time);
+		sprintf(buf,"%llu",min_time);
 		pta[9]=strdup(buf);
-		sprintf(buf,"%d",hid);
+		sprintf(buf,"%llu",max_time);
 		pta[10]=strdup(buf);
 		return pta;
 	}
@@ -246,13 +362,14 @@ typedef struct __RE2_objects_t re2_t;
 
 static bool rules_sort_comp_function (QP_rule_t * a, QP_rule_t * b) { return (a->rule_id < b->rule_id); }
 
-static re2_t * compile_query_rule(QP_rule_t *qr, int i) {
+// regex_engine is the value of mysql-query_processor_regex
+static re2_t * compile_query_rule(QP_rule_t *qr, int i, int regex_engine) {
 	re2_t *r=(re2_t *)malloc(sizeof(re2_t));
 	r->opt1=NULL;
 	r->re1=NULL;
 	r->opt2=NULL;
 	r->re2=NULL;
-	if (mysql_thread___query_processor_regex==2) {
+	if (regex_engine==2) {
 		r->opt2=new re2::RE2::Options(RE2::Quiet);
 		if ((qr->re_modifiers & QP_RE_MOD_CASELESS) == QP_RE_MOD_CASELESS) {
 			r->opt2->set_case_sensitive(false);
@@ -282,8 +399,16 @@ static void __delete_query_rule(QP_rule_t *qr) {
 		free(qr->username);
 	if (qr->schemaname)
 		free(qr->schemaname);
+	if (qr->client_addr)
+		free(qr->client_addr);
+	if (qr->proxy_addr)
+		free(qr->proxy_addr);
+	if (qr->match_digest)
+		free(qr->match_digest);
 	if (qr->match_pattern)
 		free(qr->match_pattern);
+	if (qr->comment)
+		free(qr->comment);
 	if (qr->replace_pattern)
 		free(qr->replace_pattern);
 	if (qr->error_msg)
@@ -309,7 +434,7 @@ static void __delete_query_rule(QP_rule_t *qr) {
 
 // delete all the query rules in a Query Processor Table
 // Note that this function is called by GloQPro with &rules (generic table)
-//     and is called by each mysql thread with _thr_SQP_rules (per thread table)
+//     and by QP_rules_set with its compiled copies
 static void __reset_rules(std::vector<QP_rule_t *> * qrs) {
 	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 5, "Resetting rules in Query Processor Table %p\n", qrs);
 	if (qrs==NULL) return;
@@ -321,11 +446,30 @@ static void __reset_rules(std::vector<QP_rule_t *> * qrs) {
 	qrs->clear();
 }
 
+QP_rules_set::QP_rules_set(unsigned int v) {
+	version=v;
+	refcnt=1; // the reference of Query_Processor::rules_set
+	orphan=false;
+}
+
+QP_rules_set::~QP_rules_set() {
+	__reset_rules(&rules);
+}
+
+void QP_rules_set::release() {
+	if (__sync_sub_and_fetch(&refcnt,1)==0) {
+		delete this;
+	}
+}
+
 // per thread variables
 __thread unsigned int _thr_SQP_version;
-__thread std::vector<QP_rule_t *> * _thr_SQP_rules;
+__thread QP_rules_set * _thr_SQP_rules_set; // shared, read only
+__thread unsigned int * _thr_SQP_hits; // hits of the rules in _thr_SQP_rules_set , not yet flushed to the parents
+__thread unsigned int * _thr_SQP_qos_tokens; // tokens taken from the global buckets, indexed by QP_rule_qos::idx
+__thread unsigned int _thr_SQP_qos_tokens_len;
 //__thread unsigned int _thr_commands_counters[MYSQL_COM_QUERY___NONE];
-__thread Command_Counter * _thr_commands_counters[MYSQL_COM_QUERY___NONE];
+__thread Command_Counters_Block * _thr_commands_counters;
 
 Query_Processor::Query_Processor() {
 #ifdef DEBUG
@@ -339,8 +483,13 @@ Query_Processor::Query_Processor() {
 	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Initializing Query Processor with version=0\n");
 	spinlock_rwlock_init(&rwlock);
 	spinlock_rwlock_init(&digest_rwlock);
+	pthread_mutex_init(&digest_snapshot_mutex, NULL);
+	digest_umap=new umap_query_digest();
 	version=0;
+	rules_set=new QP_rules_set(0);
+	qos_next_idx=0;
 	for (int i=0; i<MYSQL_COM_QUERY___NONE; i++) commands_counters[i]=new Command_Counter(i);
+	pthread_mutex_init(&thr_commands_counters_mutex, NULL);
 
 	commands_counters_desc[MYSQL_COM_QUERY_ALTER_TABLE]=(char *)"ALTER_TABLE";
 	commands_counters_desc[MYSQL_COM_QUERY_ALTER_VIEW]=(char *)"ALTER_VIEW";
@@ -398,23 +547,65 @@ Query_Processor::Query_Processor() {
 
 Query_Processor::~Query_Processor() {
 	for (int i=0; i<MYSQL_COM_QUERY___NONE; i++) delete commands_counters[i];
+	for (std::vector<Command_Counters_Block *>::iterator it=thr_commands_counters.begin(); it!=thr_commands_counters.end(); ++it) {
+		delete *it;
+	}
+	pthread_mutex_destroy(&thr_commands_counters_mutex);
+	rules_set->release();
 	__reset_rules(&rules);
+	for (std::unordered_map<int, QP_rule_qos *>::iterator it=qos_map.begin(); it!=qos_map.end(); ++it) {
+		delete it->second;
+	}
+	for (std::unordered_map<int, QP_rule_hedge *>::iterator it=hedge_map.begin(); it!=hedge_map.end(); ++it) {
+		delete it->second;
+	}
+	for (umap_query_digest::iterator it=digest_umap->begin(); it!=digest_umap->end(); ++it) {
+		delete (QP_query_digest_stats *)it->second;
+	}
+	delete digest_umap;
 };
 
 // This function is called by each thread when it starts. It create a Query Processor Table for each thread
 void Query_Processor::init_thread() {
 	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Initializing Per-Thread Query Processor Table with version=0\n");
-	_thr_SQP_version=0;
-	_thr_SQP_rules=new std::vector<QP_rule_t *>;
-	for (int i=0; i<MYSQL_COM_QUERY___NONE; i++) _thr_commands_counters[i] = new Command_Counter(i);
+	_thr_SQP_rules_set=get_rules_set();
+	_thr_SQP_version=_thr_SQP_rules_set->version;
+	_thr_SQP_hits=(unsigned int *)calloc(_thr_SQP_rules_set->rules.size()+1,sizeof(unsigned int));
+	_thr_commands_counters=new Command_Counters_Block();
+	pthread_mutex_lock(&thr_commands_counters_mutex);
+	thr_commands_counters.push_back(_thr_commands_counters);
+	pthread_mutex_unlock(&thr_commands_counters_mutex);
 };
 
 
 void Query_Processor::end_thread() {
 	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Destroying Per-Thread Query Processor Table with version=%d\n", _thr_SQP_version);
-	__reset_rules(_thr_SQP_rules);
-	delete _thr_SQP_rules;
-	for (int i=0; i<MYSQL_COM_QUERY___NONE; i++) delete _thr_commands_counters[i];
+	if (_thr_SQP_rules_set) {
+		_thr_SQP_rules_set->release();
+		_thr_SQP_rules_set=NULL;
+		free(_thr_SQP_hits);
+		_thr_SQP_hits=NULL;
+	}
+	if (_thr_SQP_qos_tokens) {
+		free(_thr_SQP_qos_tokens);
+		_thr_SQP_qos_tokens=NULL;
+		_thr_SQP_qos_tokens_len=0;
+	}
+	if (_thr_commands_counters==NULL) return;
+	// the counters of an exiting thread are merged into the global ones
+	pthread_mutex_lock(&thr_commands_counters_mutex);
+	for (std::vector<Command_Counters_Block *>::iterator it=thr_commands_counters.begin(); it!=thr_commands_counters.end(); ++it) {
+		if (*it==_thr_commands_counters) {
+			thr_commands_counters.erase(it);
+			break;
+		}
+	}
+	for (int i=0; i<MYSQL_COM_QUERY___NONE; i++) {
+		commands_counters[i]->add(_thr_commands_counters->counters[i]);
+	}
+	pthread_mutex_unlock(&thr_commands_counters_mutex);
+	delete _thr_commands_counters;
+	_thr_commands_counters=NULL;
 };
 
 void Query_Processor::print_version() {
@@ -431,7 +622,7 @@ void Query_Processor::wrunlock() {
 
 
 
-QP_rule_t * Query_Processor::new_query_rule(int rule_id, bool active, char *username, char *schemaname, int flagIN, char *client_addr, char *proxy_addr, int proxy_port, char *digest, char *match_digest, char *match_pattern, bool negate_match_pattern, char *re_modifiers, int flagOUT, char *replace_pattern, int destination_hostgroup, int cache_ttl, int reconnect, int timeout, int retries, int delay, int mirror_flagOUT, int mirror_hostgroup, char *error_msg, int sticky_conn, int multiplex, int log, bool apply, char *comment) {
+QP_rule_t * Query_Processor::new_query_rule(int rule_id, bool active, char *username, char *schemaname, int flagIN, char *client_addr, char *proxy_addr, int proxy_port, char *digest, char *match_digest, char *match_pattern, bool negate_match_pattern, char *re_modifiers, int flagOUT, char *replace_pattern, int destination_hostgroup, int cache_ttl, int reconnect, int timeout, int retries, int delay, int mirror_flagOUT, int mirror_hostgroup, char *error_msg, int sticky_conn, int multiplex, int log, bool apply, char *comment, int qos_max_qps, int qos_burst, int qos_max_concurrency, int qos_max_wait_ms, int priority, int hedge_delay_ms) {
 	QP_rule_t * newQR=(QP_rule_t *)malloc(sizeof(QP_rule_t));
 	newQR->rule_id=rule_id;
 	newQR->active=active;
@@ -470,6 +661,14 @@ QP_rule_t * Query_Processor::new_query_rule(int rule_id, bool active, char *user
 	newQR->multiplex=multiplex;
 	newQR->apply=apply;
 	newQR->comment=(comment ? strdup(comment) : NULL); // see issue #643
+	newQR->qos_max_qps=qos_max_qps;
+	newQR->qos_burst=qos_burst;
+	newQR->qos_max_concurrency=qos_max_concurrency;
+	newQR->qos_max_wait_ms=qos_max_wait_ms;
+	newQR->qos=NULL;
+	newQR->priority=priority;
+	newQR->hedge_delay_ms=hedge_delay_ms;
+	newQR->hedge=NULL;
 	newQR->regex_engine1=NULL;
 	newQR->regex_engine2=NULL;
 	newQR->hits=0;
@@ -498,6 +697,7 @@ void Query_Processor::delete_query_rule(QP_rule_t *qr) {
 
 void Query_Processor::reset_all(bool lock) {
 	if (lock) spin_wrlock(&rwlock);
+	rules_set->orphan=true; // the parents of its rules are going away
 	__reset_rules(&rules);
 	if (lock) spin_wrunlock(&rwlock);
 };
@@ -518,22 +718,134 @@ void Query_Processor::sort(bool lock) {
 	if (lock) spin_wrunlock(&rwlock);
 };
 
-// when commit is called, the version number is increased and the this will trigger the mysql threads to get a new Query Processor Table
-// The operation is asynchronous
+// when commit is called, the active rules are copied and their regex compiled
+// into a new QP_rules_set . It is then published and the version number is
+// increased: this will trigger the mysql threads to switch to the new set.
+// The operation is asynchronous, and threads never copy nor compile rules
 void Query_Processor::commit() {
+	int regex_engine=(GloMTH ? GloMTH->get_variable_int((char *)"query_processor_regex") : 1);
+	QP_rules_set *rs=new QP_rules_set(0);
+	spin_rdlock(&rwlock);
+	QP_rule_t *qr1;
+	QP_rule_t *qr2;
+	for (std::vector<QP_rule_t *>::iterator it=rules.begin(); it!=rules.end(); ++it) {
+		qr1=*it;
+		if (qr1->active) {
+			proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Copying Query Rule id: %d\n", qr1->rule_id);
+			char buf[20];
+			if (qr1->digest) { // not 0
+				sprintf(buf,"0x%016llX", (long long unsigned int)qr1->digest);
+			}
+			std::string re_mod;
+			re_mod="";
+			if ((qr1->re_modifiers & QP_RE_MOD_CASELESS) == QP_RE_MOD_CASELESS) re_mod = "CASELESS";
+			if ((qr1->re_modifiers & QP_RE_MOD_GLOBAL) == QP_RE_MOD_GLOBAL) {
+				if (re_mod.length()) {
+					re_mod = re_mod + ",";
+				}
+				re_mod = re_mod + "GLOBAL";
+			}
+			qr2=new_query_rule(qr1->rule_id, qr1->active, qr1->username, qr1->schemaname, qr1->flagIN,
+				qr1->client_addr, qr1->proxy_addr, qr1->proxy_port,
+				( qr1->digest ? buf : NULL ) ,
+				qr1->match_digest, qr1->match_pattern, qr1->negate_match_pattern, (char *)re_mod.c_str(),
+				qr1->flagOUT, qr1->replace_pattern, qr1->destination_hostgroup,
+				qr1->cache_ttl, qr1->reconnect, qr1->timeout, qr1->retries, qr1->delay, qr1->mirror_flagOUT, qr1->mirror_hostgroup,
+				qr1->error_msg, qr1->sticky_conn, qr1->multiplex, qr1->log, qr1->apply,
+				qr1->comment, qr1->qos_max_qps, qr1->qos_burst, qr1->qos_max_concurrency, qr1->qos_max_wait_ms, qr1->priority, qr1->hedge_delay_ms);
+			qr2->parent=qr1;	// pointer to parent to speed up parent update (hits)
+			if (qr2->match_digest) {
+				proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Compiling regex for rule_id: %d, match_digest: %s\n", qr2->rule_id, qr2->match_digest);
+				qr2->regex_engine1=(void *)compile_query_rule(qr2,1,regex_engine);
+			}
+			if (qr2->match_pattern) {
+				proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Compiling regex for rule_id: %d, match_pattern: %s\n", qr2->rule_id, qr2->match_pattern);
+				qr2->regex_engine2=(void *)compile_query_rule(qr2,2,regex_engine);
+			}
+			rs->rules.push_back(qr2);
+		}
+	}
+	spin_rdunlock(&rwlock);
 	spin_wrlock(&rwlock);
-	__sync_add_and_fetch(&version,1);
+	// the limits keep their state (tokens, running queries, counters) across commits
+	for (std::vector<QP_rule_t *>::iterator it=rs->rules.begin(); it!=rs->rules.end(); ++it) {
+		qr2=*it;
+		if (qr2->qos_max_qps <= 0 && qr2->qos_max_concurrency <= 0) {
+			continue;
+		}
+		QP_rule_qos *q=NULL;
+		std::unordered_map<int, QP_rule_qos *>::iterator it2=qos_map.find(qr2->rule_id);
+		if (it2==qos_map.end()) {
+			q=new QP_rule_qos(qr2->rule_id, qos_next_idx++);
+			qos_map[qr2->rule_id]=q;
+		} else {
+			q=it2->second;
+		}
+		q->max_qps=(qr2->qos_max_qps > 0 ? qr2->qos_max_qps : 0);
+		q->burst=(qr2->qos_burst > 0 ? qr2->qos_burst : q->max_qps);
+		q->max_concurrency=(qr2->qos_max_concurrency > 0 ? qr2->qos_max_concurrency : 0);
+		q->max_wait_ms=(qr2->qos_max_wait_ms > 0 ? qr2->qos_max_wait_ms : 0);
+		qr2->qos=q;
+	}
+	// so do the latency histograms of hedged reads
+	for (std::vector<QP_rule_t *>::iterator it=rs->rules.begin(); it!=rs->rules.end(); ++it) {
+		qr2=*it;
+		if (qr2->hedge_delay_ms <= 0) {
+			continue;
+		}
+		QP_rule_hedge *h=NULL;
+		std::unordered_map<int, QP_rule_hedge *>::iterator it2=hedge_map.find(qr2->rule_id);
+		if (it2==hedge_map.end()) {
+			h=new QP_rule_hedge(qr2->rule_id);
+			hedge_map[qr2->rule_id]=h;
+		} else {
+			h=it2->second;
+		}
+		h->min_delay_ms=qr2->hedge_delay_ms;
+		qr2->hedge=h;
+	}
+	QP_rules_set *old=rules_set;
+	rs->version=__sync_add_and_fetch(&version,1);
+	rules_set=rs;
 	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Increasing version number to %d - all threads will notice this and refresh their rules\n", version);
 	spin_wrunlock(&rwlock);
+	old->release();
 };
 
+// returns the current rules set, with a reference that the caller must release
+QP_rules_set * Query_Processor::get_rules_set() {
+	spin_rdlock(&rwlock);
+	QP_rules_set *rs=rules_set;
+	__sync_fetch_and_add(&rs->refcnt,1);
+	spin_rdunlock(&rwlock);
+	return rs;
+}
+
+
+// sums the counters of the exited threads and of all the running threads into out[]
+// Counters of running threads are read while their owner may be updating them:
+// a row can be slightly inconsistent (total_cnt vs buckets) but never corrupted
+void Query_Processor::aggregate_commands_counters(Command_Counter **out) {
+	pthread_mutex_lock(&thr_commands_counters_mutex);
+	for (int i=0; i<MYSQL_COM_QUERY___NONE; i++) {
+		out[i]=new Command_Counter(i);
+		out[i]->add(commands_counters[i]);
+	}
+	for (std::vector<Command_Counters_Block *>::iterator it=thr_commands_counters.begin(); it!=thr_commands_counters.end(); ++it) {
+		Command_Counters_Block *ccb=*it;
+		for (int i=0; i<MYSQL_COM_QUERY___NONE; i++) {
+			out[i]->add(ccb->counters[i]);
+		}
+	}
+	pthread_mutex_unlock(&thr_commands_counters_mutex);
+}
 
 SQLite3_result * Query_Processor::get_stats_commands_counters() {
 	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Dumping commands counters\n");
 	SQLite3_result *result=new SQLite3_result(15);
 	result->add_column_definition(SQLITE_TEXT,"Command");
-	result->add_column_definition(SQLITE_TEXT,"Total_Cnt");
 	result->add_column_definition(SQLITE_TEXT,"Total_Time_us");
+	result->add_column_definition(SQLITE_TEXT,"Total_Cnt");
 	result->add_column_definition(SQLITE_TEXT,"cnt_100us");
 	result->add_column_definition(SQLITE_TEXT,"cnt_500us");
 	result->add_column_definition(SQLITE_TEXT,"cnt_1ms");
@@ -546,10 +858,44 @@ SQLite3_result * Query_Processor::get_stats_commands_counters() {
 	result->add_column_definition(SQLITE_TEXT,"cnt_5s");
 	result->add_column_definition(SQLITE_TEXT,"cnt_10s");
 	result->add_column_definition(SQLITE_TEXT,"cnt_INFs");
+	Command_Counter *cc[MYSQL_COM_QUERY___NONE];
+	aggregate_commands_counters(cc);
 	for (int i=0;i<MYSQL_COM_QUERY___NONE;i++) {
-		char **pta=commands_counters[i]->get_row();
+		char **pta=cc[i]->get_row();
 		result->add_row(pta);
-		commands_counters[i]->free_row(pta);
+		cc[i]->free_row(pta);
+		delete cc[i];
+	}
+	return result;
+}
+
+// only non empty buckets are returned. le_us is NULL for the overflow bucket
+SQLite3_result * Query_Processor::get_stats_commands_histogram() {
+	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Dumping commands histogram\n");
+	SQLite3_result *result=new SQLite3_result(3);
+	result->add_column_definition(SQLITE_TEXT,"Command");
+	result->add_column_definition(SQLITE_TEXT,"le_us");
+	result->add_column_definition(SQLITE_TEXT,"cnt");
+	Command_Counter *cc[MYSQL_COM_QUERY___NONE];
+	aggregate_commands_counters(cc);
+	char buf1[32];
+	char buf2[32];
+	char *pta[3];
+	for (int i=0;i<MYSQL_COM_QUERY___NONE;i++) {
+		for (int j=0; j<COMMAND_COUNTER_BUCKETS; j++) {
+			if (cc[i]->buckets[j]==0) continue;
+			pta[0]=commands_counters_desc[i];
+			if (j<COMMAND_COUNTER_BUCKETS-1) {
+				sprintf(buf1,"%llu",Command_Counter::bucket_bound(j));
+				pta[1]=buf1;
+			} else {
+				pta[1]=NULL;
+			}
+			sprintf(buf2,"%llu",cc[i]->buckets[j]);
+			pta[2]=buf2;
+			result->add_row(pta);
+		}
+		delete cc[i];
 	}
 	return result;
 }
@@ -573,9 +919,380 @@ SQLite3_result * Query_Processor::get_stats_query_rules() {
 	return result;
 }
 
+QP_rule_qos::QP_rule_qos(int _rule_id, unsigned int _idx) {
+	rule_id=_rule_id;
+	idx=_idx;
+	max_qps=0;
+	burst=0;
+	max_concurrency=0;
+	max_wait_ms=0;
+	spinlock_rwlock_init(&rwlock);
+	tokens=0;
+	last_refill=0;
+	running=0;
+	num_waiters=0;
+	admitted=0;
+	queued=0;
+	rejected=0;
+	wait_us=0;
+}
+
+// refills the global bucket and takes up to n tokens from it
+unsigned int QP_rule_qos::take(unsigned int n, unsigned long long now) {
+	unsigned int ret=0;
+	spin_wrlock(&rwlock);
+	unsigned long long max_tokens=(unsigned long long)burst*1000000;
+	if (last_refill==0) {
+		tokens=max_tokens; // the bucket starts full
+	} else if (now > last_refill) {
+		tokens+=(now-last_refill)*max_qps;
+	}
+	last_refill=now;
+	if (tokens > max_tokens) {
+		tokens=max_tokens;
+	}
+	ret=tokens/1000000;
+	if (ret > n) {
+		ret=n;
+	}
+	tokens-=(unsigned long long)ret*1000000;
+	spin_wrunlock(&rwlock);
+	return ret;
+}
+
+// when the global bucket will have a whole token again
+unsigned long long QP_rule_qos::refill_at(unsigned long long now) {
+	unsigned long long ret=now;
+	spin_rdlock(&rwlock);
+	if (max_qps && tokens < 1000000) {
+		ret=last_refill+(1000000-tokens+max_qps-1)/max_qps;
+	}
+	spin_rdunlock(&rwlock);
+	return (ret > now ? ret : now+1);
+}
+
+// true if no query is waiting ahead of o
+bool QP_rule_qos::is_next(Query_Processor_Output *o) {
+	bool ret=true;
+	if (__atomic_load_n(&num_waiters,__ATOMIC_SEQ_CST)==0) {
+		return true;
+	}
+	spin_rdlock(&rwlock);
+	if (waiters.size() && waiters.front()!=o) {
+		ret=false;
+	}
+	spin_rdunlock(&rwlock);
+	return ret;
+}
+
+// Wakes up the thread of a session waiting for the limits of a rule. The
+// session belongs to another thread: only its wakeup flag is written, see
+// MySQL_Thread::process_all_sessions()
+static void qos_wake(MySQL_Session *sess) {
+	__atomic_store_n(&sess->wakeup,1,__ATOMIC_RELEASE);
+	if (sess->thread) {
+		unsigned char s=0;
+		if (write(sess->thread->pipefd[1],&s,1)==-1) {
+			// the pipe is full, the thread will wake up anyway
+		}
+	}
+}
+
+void QP_rule_qos::enqueue(Query_Processor_Output *o) {
+	spin_wrlock(&rwlock);
+	waiters.push_back(o);
+	__sync_fetch_and_add(&num_waiters,1); // a full barrier, see wake_next()
+	spin_wrunlock(&rwlock);
+}
+
+// removes o from the queue. If it was the first, the next one can try again
+void QP_rule_qos::dequeue(Query_Processor_Output *o) {
+	spin_wrlock(&rwlock);
+	for (std::deque<Query_Processor_Output *>::iterator it=waiters.begin(); it!=waiters.end(); ++it) {
+		if (*it==o) {
+			bool first=(it==waiters.begin());
+			waiters.erase(it);
+			__sync_fetch_and_sub(&num_waiters,1);
+			if (first && waiters.size()) {
+				qos_wake(waiters.front()->qos_sess);
+			}
+			break;
+		}
+	}
+	spin_wrunlock(&rwlock);
+}
+
+// Called after releasing a concurrency slot: the first query in queue, if
+// not self, can try again. The caller released the slot with a full barrier
+// and qos_admit() checks running after enqueue() : either the releasing
+// thread sees the waiter, or the waiter sees the free slot
+void QP_rule_qos::wake_next(Query_Processor_Output *self) {
+	if (__atomic_load_n(&num_waiters,__ATOMIC_SEQ_CST)==0) {
+		return;
+	}
+	spin_rdlock(&rwlock);
+	if (waiters.size() && waiters.front()!=self) {
+		qos_wake(waiters.front()->qos_sess);
+	}
+	spin_rdunlock(&rwlock);
+}
+
+// takes a token from the cache of the thread. When empty, the cache is
+// refilled from the global bucket with a batch of up to 10ms worth of tokens,
+// or with a single token while queries are queued: tokens cached by a thread
+// can't be used by the queries queued by the others
+bool Query_Processor::qos_take_token(QP_rule_qos *q, unsigned long long now) {
+	if (q->idx >= _thr_SQP_qos_tokens_len) {
+		unsigned int l=q->idx+16;
+		_thr_SQP_qos_tokens=(unsigned int *)realloc(_thr_SQP_qos_tokens,sizeof(unsigned int)*l);
+		memset(_thr_SQP_qos_tokens+_thr_SQP_qos_tokens_len,0,sizeof(unsigned int)*(l-_thr_SQP_qos_tokens_len));
+		_thr_SQP_qos_tokens_len=l;
+	}
+	if (_thr_SQP_qos_tokens[q->idx]) {
+		_thr_SQP_qos_tokens[q->idx]--;
+		return true;
+	}
+	unsigned int n=q->take((__atomic_load_n(&q->num_waiters,__ATOMIC_RELAXED) ? 1 : q->max_qps/100+1), now);
+	if (n==0) {
+		return false;
+	}
+	_thr_SQP_qos_tokens[q->idx]=n-1;
+	return true;
+}
+
+// Called by the session before getting a connection for a query that matched
+// rules with rate or concurrency limits. Either all the limits admit the
+// query, or none: a concurrency slot taken before a failing limit is released.
+// A query doesn't pass the queries already queued on a rule.
+// Returns 1 if admitted, 0 if the query has to wait, -1 if rejected.
+// When waiting, the query is queued on the rule of the exceeded limit, and
+// wait_until is set to when the session has to try again if not woken up
+// earlier: the next token of the bucket, or the end of the wait.
+// On rejection rule_id is set to the rule whose limit was exceeded
+int Query_Processor::qos_admit(Query_Processor_Output *qpo, MySQL_Session *sess, unsigned long long now, int *rule_id, unsigned long long *wait_until) {
+	unsigned int i;
+	unsigned int max_wait_ms=0;
+	bool first_try=(qpo->qos_since==0);
+	bool retried=false;
+	QP_rule_qos *q=NULL;
+	if (first_try) {
+		qpo->qos_since=now;
+	}
+__retry_qos_admit:
+	for (i=0; i<qpo->qos_len; i++) {
+		q=qpo->qos[i];
+		if (q->max_wait_ms > max_wait_ms) {
+			max_wait_ms=q->max_wait_ms;
+		}
+		if (q->is_next(qpo)==false) {
+			break;
+		}
+		if (q->max_concurrency) {
+			if ((unsigned int)__sync_add_and_fetch(&q->running,1) > q->max_concurrency) {
+				__sync_fetch_and_sub(&q->running,1);
+				break;
+			}
+			qpo->qos_slot[i]=true;
+		}
+		if (q->max_qps) {
+			if (qos_take_token(q, now)==false) {
+				break;
+			}
+		}
+	}
+	if (i==qpo->qos_len) {
+		if (qpo->qos_queued) {
+			qpo->qos_queued->dequeue(qpo);
+			qpo->qos_queued=NULL;
+		}
+		for (i=0; i<qpo->qos_len; i++) {
+			__sync_fetch_and_add(&qpo->qos[i]->admitted,1);
+			if (first_try==false) {
+				__sync_fetch_and_add(&qpo->qos[i]->wait_us,now-qpo->qos_since);
+			}
+		}
+		qpo->qos_admitted=true;
+		return 1;
+	}
+	// limit i was exceeded: release what was taken so far
+	q=qpo->qos[i];
+	for (unsigned int j=0; j<=i; j++) {
+		if (qpo->qos_slot[j]) {
+			__sync_fetch_and_sub(&qpo->qos[j]->running,1);
+			qpo->qos_slot[j]=false;
+			qpo->qos[j]->wake_next(qpo);
+		}
+		if (j<i && qpo->qos[j]->max_qps) {
+			_thr_SQP_qos_tokens[qpo->qos[j]->idx]++; // the token goes back to the thread cache
+		}
+	}
+	if (first_try && retried==false && max_wait_ms) {
+		__sync_fetch_and_add(&q->queued,1);
+	}
+	unsigned long long deadline=qpo->qos_since+(unsigned long long)max_wait_ms*1000;
+	if (now < deadline) {
+		if (qpo->qos_queued!=q) {
+			if (qpo->qos_queued) {
+				qpo->qos_queued->dequeue(qpo);
+			}
+			qpo->qos_sess=sess;
+			q->enqueue(qpo);
+			qpo->qos_queued=q;
+		}
+		*wait_until=deadline;
+		if (q->is_next(qpo)) {
+			if (q->max_concurrency && retried==false && (unsigned int)__atomic_load_n(&q->running,__ATOMIC_SEQ_CST) < q->max_concurrency) {
+				// a slot was released before the query was queued
+				retried=true;
+				goto __retry_qos_admit;
+			}
+			if (q->max_qps) {
+				unsigned long long t=q->refill_at(now);
+				if (t < *wait_until) {
+					*wait_until=t;
+				}
+			}
+		}
+		return 0;
+	}
+	if (qpo->qos_queued) {
+		qpo->qos_queued->dequeue(qpo);
+		qpo->qos_queued=NULL;
+	}
+	__sync_fetch_and_add(&q->rejected,1);
+	if (first_try==false) {
+		__sync_fetch_and_add(&q->wait_us,now-qpo->qos_since);
+	}
+	*rule_id=q->rule_id;
+	return -1;
+}
+
+SQLite3_result * Query_Processor::get_stats_query_rules_qos() {
+	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Dumping query rules limits statistics, using Global version %d\n", version);
+	SQLite3_result *result=new SQLite3_result(10);
+	result->add_column_definition(SQLITE_TEXT,"rule_id");
+	result->add_column_definition(SQLITE_TEXT,"max_qps");
+	result->add_column_definition(SQLITE_TEXT,"burst");
+	result->add_column_definition(SQLITE_TEXT,"max_concurrency");
+	result->add_column_definition(SQLITE_TEXT,"max_wait_ms");
+	result->add_column_definition(SQLITE_TEXT,"running");
+	result->add_column_definition(SQLITE_TEXT,"admitted");
+	result->add_column_definition(SQLITE_TEXT,"queued");
+	result->add_column_definition(SQLITE_TEXT,"rejected");
+	result->add_column_definition(SQLITE_TEXT,"wait_time_us");
+	spin_rdlock(&rwlock);
+	// only the limits of the rules currently loaded
+	for (std::vector<QP_rule_t *>::iterator it=rules_set->rules.begin(); it!=rules_set->rules.end(); ++it) {
+		QP_rule_qos *q=(*it)->qos;
+		if (q==NULL) {
+			continue;
+		}
+		char **pta=(char **)malloc(sizeof(char *)*10);
+		itostr(pta[0], (long long)q->rule_id);
+		itostr(pta[1], (long long)q->max_qps);
+		itostr(pta[2], (long long)q->burst);
+		itostr(pta[3], (long long)q->max_concurrency);
+		itostr(pta[4], (long long)q->max_wait_ms);
+		itostr(pta[5], (long long)q->running);
+		itostr(pta[6], (long long)q->admitted);
+		itostr(pta[7], (long long)q->queued);
+		itostr(pta[8], (long long)q->rejected);
+		itostr(pta[9], (long long)q->wait_us);
+		result->add_row(pta);
+		for (int i=0; i<10; i++) {
+			free(pta[i]);
+		}
+		free(pta);
+	}
+	spin_rdunlock(&rwlock);
+	return result;
+}
+
+QP_rule_hedge::QP_rule_hedge(int _rule_id) {
+	rule_id=_rule_id;
+	min_delay_ms=0;
+	memset(buckets,0,sizeof(buckets));
+	samples=0;
+	hedged=0;
+	won=0;
+}
+
+void QP_rule_hedge::add_sample(unsigned long long us) {
+	int b=63-__builtin_clzll(us|1);
+	if (b >= QP_HEDGE_BUCKETS) {
+		b=QP_HEDGE_BUCKETS-1;
+	}
+	__sync_fetch_and_add(&buckets[b],1);
+	if (__sync_add_and_fetch(&samples,1) % QP_HEDGE_DECAY_SAMPLES == 0) {
+		// recent latencies weigh more. Increments racing with this are lost, that is fine for an estimate
+		for (int i=0; i<QP_HEDGE_BUCKETS; i++) {
+			buckets[i]/=2;
+		}
+	}
+}
+
+// the delay after which a query is hedged: the given percentile of the first
+// packet latencies, rounded up to a power of 2, but never less than min_delay_ms
+unsigned long long QP_rule_hedge::delay_us(int percentile) {
+	unsigned long long min_us=(unsigned long long)min_delay_ms*1000;
+	if (percentile <= 0) {
+		return min_us;
+	}
+	unsigned long long total=0;
+	unsigned int b[QP_HEDGE_BUCKETS];
+	for (int i=0; i<QP_HEDGE_BUCKETS; i++) {
+		b[i]=buckets[i];
+		total+=b[i];
+	}
+	if (total < QP_HEDGE_MIN_SAMPLES) {
+		return min_us;
+	}
+	unsigned long long threshold=total*percentile/100;
+	unsigned long long sum=0;
+	int i;
+	for (i=0; i<QP_HEDGE_BUCKETS-1; i++) {
+		sum+=b[i];
+		if (sum >= threshold) {
+			break;
+		}
+	}
+	unsigned long long ret=(1ULL << (i+1));
+	return (ret > min_us ? ret : min_us);
+}
+
+SQLite3_result * Query_Processor::get_stats_query_rules_hedge() {
+	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Dumping query rules hedged reads statistics, using Global version %d\n", version);
+	SQLite3_result *result=new SQLite3_result(5);
+	result->add_column_definition(SQLITE_TEXT,"rule_id");
+	result->add_column_definition(SQLITE_TEXT,"hedge_delay_ms");
+	result->add_column_definition(SQLITE_TEXT,"current_delay_us");
+	result->add_column_definition(SQLITE_TEXT,"hedged");
+	result->add_column_definition(SQLITE_TEXT,"won");
+	spin_rdlock(&rwlock);
+	for (std::vector<QP_rule_t *>::iterator it=rules_set->rules.begin(); it!=rules_set->rules.end(); ++it) {
+		QP_rule_hedge *h=(*it)->hedge;
+		if (h==NULL) {
+			continue;
+		}
+		char **pta=(char **)malloc(sizeof(char *)*5);
+		itostr(pta[0], (long long)h->rule_id);
+		itostr(pta[1], (long long)h->min_delay_ms);
+		itostr(pta[2], (long long)h->delay_us(GloMTH->variables.hedge_delay_percentile));
+		itostr(pta[3], (long long)h->hedged);
+		itostr(pta[4], (long long)h->won);
+		result->add_row(pta);
+		for (int i=0; i<5; i++) {
+			free(pta[i]);
+		}
+		free(pta);
+	}
+	spin_rdunlock(&rwlock);
+	return result;
+}
+
 SQLite3_result * Query_Processor::get_current_query_rules() {
 	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Dumping current query rules, using Global version %d\n", version);
-	SQLite3_result *result=new SQLite3_result(30);
+	SQLite3_result *result=new SQLite3_result(36);
 	spin_rdlock(&rwlock);
 	QP_rule_t *qr1;
 	result->add_column_definition(SQLITE_TEXT,"rule_id");
@@ -607,6 +1324,12 @@ SQLite3_result * Query_Processor::get_current_query_rules() {
 	result->add_column_definition(SQLITE_TEXT,"log");
 	result->add_column_definition(SQLITE_TEXT,"apply");
 	result->add_column_definition(SQLITE_TEXT,"comment"); // issue #643
+	result->add_column_definition(SQLITE_TEXT,"qos_max_qps");
+	result->add_column_definition(SQLITE_TEXT,"qos_burst");
+	result->add_column_definition(SQLITE_TEXT,"qos_max_concurrency");
+	result->add_column_definition(SQLITE_TEXT,"qos_max_wait_ms");
+	result->add_column_definition(SQLITE_TEXT,"priority");
+	result->add_column_definition(SQLITE_TEXT,"hedge_delay_ms");
 	result->add_column_definition(SQLITE_TEXT,"hits");
 	for (std::vector<QP_rule_t *>::iterator it=rules.begin(); it!=rules.end(); ++it) {
 		qr1=*it;
@@ -619,10 +1342,47 @@ SQLite3_result * Query_Processor::get_current_query_rules() {
 	return result;
 }
 
-SQLite3_result * Query_Processor::get_query_digests() {
-	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Dumping current query digest\n");
+// Detaches the current digest map from the data path. The swap is O(1), so
+// update_query_digest() is only blocked for the time of a pointer exchange,
+// and the caller can format the detached map without holding digest_rwlock
+umap_query_digest * Query_Processor::digest_umap_detach() {
+	umap_query_digest *snapshot=new umap_query_digest();
+	spin_wrlock(&digest_rwlock);
+	umap_query_digest *cur=digest_umap;
+	digest_umap=snapshot;
+	spin_wrunlock(&digest_rwlock);
+	return cur;
+}
+
+// Puts a detached map back. Entries created by the data path while the map
+// was detached are merged into it, and the larger of the two maps is kept
+// to minimize the work done while holding digest_rwlock
+void Query_Processor::digest_umap_reattach(umap_query_digest *snapshot) {
+	spin_wrlock(&digest_rwlock);
+	umap_query_digest *dst=snapshot;
+	umap_query_digest *src=digest_umap;
+	if (src->size() > dst->size()) {
+		dst=digest_umap;
+		src=snapshot;
+	}
+	for (umap_query_digest::iterator it=src->begin(); it!=src->end(); ++it) {
+		umap_query_digest::iterator f=dst->find(it->first);
+		if (f != dst->end()) {
+			QP_query_digest_stats *qds=(QP_query_digest_stats *)f->second;
+			QP_query_digest_stats *o=(QP_query_digest_stats *)it->second;
+			qds->merge(o);
+			delete o;
+		} else {
+			dst->insert(*it);
+		}
+	}
+	digest_umap=dst;
+	spin_wrunlock(&digest_rwlock);
+	delete src;
+}
+
+static SQLite3_result * new_query_digests_resultset() {
 	SQLite3_result *result=new SQLite3_result(11);
-	spin_rdlock(&digest_rwlock);
 	result->add_column_definition(SQLITE_TEXT,"hid");
 	result->add_column_definition(SQLITE_TEXT,"schemaname");
 	result->add_column_definition(SQLITE_TEXT,"usernname");
@@ -634,42 +1394,113 @@ SQLite3_result * Query_Processor::get_query_digests() {
 	result->add_column_definition(SQLITE_TEXT,"sum_time");
 	result->add_column_definition(SQLITE_TEXT,"min_time");
 	result->add_column_definition(SQLITE_TEXT,"max_time");
+	return result;
+}
+
+SQLite3_result * Query_Processor::get_query_digests(SQLite3_vtab_filter *filter) {
+	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Dumping current query digest\n");
+	SQLite3_result *result=new_query_digests_resultset();
+	// only one reader at a time can detach the map
+	pthread_mutex_lock(&digest_snapshot_mutex);
+	umap_query_digest *snapshot=digest_umap_detach();
 	//for (btree::btree_map<uint64_t, void *>::iterator it=digest_bt_map.begin(); it!=digest_bt_map.end(); ++it) {
-	for (std::unordered_map<uint64_t, void *>::iterator it=digest_umap.begin(); it!=digest_umap.end(); ++it) {
+	for (std::unordered_map<uint64_t, void *>::iterator it=snapshot->begin(); it!=snapshot->end(); ++it) {
 		QP_query_digest_stats *qds=(QP_query_digest_stats *)it->second;
+		if (filter && qds->match(filter)==false) {
+			continue;
+		}
 		char **pta=qds->get_row();
 		result->add_row(pta);
 		qds->free_row(pta);
 	}
-	spin_rdunlock(&digest_rwlock);
+	digest_umap_reattach(snapshot);
+	pthread_mutex_unlock(&digest_snapshot_mutex);
 	return result;
 }
 
 SQLite3_result * Query_Processor::get_query_digests_reset() {
-	SQLite3_result *result=new SQLite3_result(11);
-	spin_wrlock(&digest_rwlock);
-	result->add_column_definition(SQLITE_TEXT,"hid");
-	result->add_column_definition(SQLITE_TEXT,"schemaname");
-	result->add_column_definition(SQLITE_TEXT,"usernname");
-	result->add_column_definition(SQLITE_TEXT,"digest");
-	result->add_column_definition(SQLITE_TEXT,"digest_text");
-	result->add_column_definition(SQLITE_TEXT,"count_star");
-	result->add_column_definition(SQLITE_TEXT,"first_seen");
-	result->add_column_definition(SQLITE_TEXT,"last_seen");
-	result->add_column_definition(SQLITE_TEXT,"sum_time");
-	result->add_column_definition(SQLITE_TEXT,"min_time");
-	result->add_column_definition(SQLITE_TEXT,"max_time");
+	SQLite3_result *result=new_query_digests_resultset();
+	pthread_mutex_lock(&digest_snapshot_mutex);
+	umap_query_digest *snapshot=digest_umap_detach();
+	pthread_mutex_unlock(&digest_snapshot_mutex);
 	//for (btree::btree_map<uint64_t, void *>::iterator it=digest_bt_map.begin(); it!=digest_bt_map.end(); ++it) {
-	for (std::unordered_map<uint64_t, void *>::iterator it=digest_umap.begin(); it!=digest_umap.end(); ++it) {
+	for (std::unordered_map<uint64_t, void *>::iterator it=snapshot->begin(); it!=snapshot->end(); ++it) {
 		QP_query_digest_stats *qds=(QP_query_digest_stats *)it->second;
 		char **pta=qds->get_row();
 		result->add_row(pta);
 		qds->free_row(pta);
 		delete qds;
 	}
-	//digest_bt_map.erase(digest_bt_map.begin(),digest_bt_map.end());
-	digest_umap.erase(digest_umap.begin(),digest_umap.end());
-	spin_wrunlock(&digest_rwlock);
+	delete snapshot;
+	return result;
+}
+
+SQLite3_result * Query_Processor::get_query_digests_phases(SQLite3_vtab_filter *filter) {
+	char buf[128];
+	int i;
+	int j;
+	SQLite3_result *result=new SQLite3_result(8+QUERY_PHASE_BUCKETS);
+	result->add_column_definition(SQLITE_TEXT,"hostgroup");
+	result->add_column_definition(SQLITE_TEXT,"schemaname");
+	result->add_column_definition(SQLITE_TEXT,"username");
+	result->add_column_definition(SQLITE_TEXT,"digest");
+	result->add_column_definition(SQLITE_TEXT,"phase");
+	result->add_column_definition(SQLITE_TEXT,"count_star");
+	result->add_column_definition(SQLITE_TEXT,"sum_time");
+	result->add_column_definition(SQLITE_TEXT,"max_time");
+	for (j=0; j<QUERY_PHASE_BUCKETS-1; j++) {
+		if (query_phase_bounds[j] < 1000) {
+			sprintf(buf,"cnt_%lluus",query_phase_bounds[j]);
+		} else if (query_phase_bounds[j] < 1000000) {
+			sprintf(buf,"cnt_%llums",query_phase_bounds[j]/1000);
+		} else {
+			sprintf(buf,"cnt_%llus",query_phase_bounds[j]/1000000);
+		}
+		result->add_column_definition(SQLITE_TEXT,buf);
+	}
+	result->add_column_definition(SQLITE_TEXT,"cnt_INFs");
+	char **pta=(char **)malloc(sizeof(char *)*(8+QUERY_PHASE_BUCKETS));
+	pthread_mutex_lock(&digest_snapshot_mutex);
+	umap_query_digest *snapshot=digest_umap_detach();
+	for (std::unordered_map<uint64_t, void *>::iterator it=snapshot->begin(); it!=snapshot->end(); ++it) {
+		QP_query_digest_stats *qds=(QP_query_digest_stats *)it->second;
+		QP_query_digest_phases *qdp=qds->phases;
+		if (qdp==NULL) {
+			continue;
+		}
+		if (filter && qds->match(filter)==false) {
+			continue;
+		}
+		for (i=0; i<QUERY_PHASE__END; i++) {
+			if (filter && filter->match(4,query_phase_names[i])==false) {
+				continue;
+			}
+			sprintf(buf,"%d",qds->hid);
+			pta[0]=strdup(buf);
+			pta[1]=strdup(qds->schemaname);
+			pta[2]=strdup(qds->username);
+			sprintf(buf,"0x%016llX", (long long unsigned int)qds->digest);
+			pta[3]=strdup(buf);
+			pta[4]=strdup(query_phase_names[i]);
+			sprintf(buf,"%u",qdp->count_star);
+			pta[5]=strdup(buf);
+			sprintf(buf,"%llu",qdp->sum_time[i]);
+			pta[6]=strdup(buf);
+			sprintf(buf,"%llu",qdp->max_time[i]);
+			pta[7]=strdup(buf);
+			for (j=0; j<QUERY_PHASE_BUCKETS; j++) {
+				sprintf(buf,"%u",qdp->cnt[i][j]);
+				pta[8+j]=strdup(buf);
+			}
+			result->add_row(pta);
+			for (j=0; j<8+QUERY_PHASE_BUCKETS; j++) {
+				free(pta[j]);
+			}
+		}
+	}
+	digest_umap_reattach(snapshot);
+	pthread_mutex_unlock(&digest_snapshot_mutex);
+	free(pta);
 	return result;
 }
 
@@ -680,6 +1511,7 @@ Query_Processor_Output * Query_Processor::process_mysql_query(MySQL_Session *ses
 	//Query_Processor_Output *ret=NULL;
 	//ret=new Query_Processor_Output();
 	Query_Processor_Output *ret=sess->qpo;
+	ret->qos_release();
 	ret->init();
 	SQP_par_t *qp=NULL;
 	if (qi) {
@@ -690,57 +1522,18 @@ Query_Processor_Output * Query_Processor::process_mysql_query(MySQL_Session *ses
 	memcpy(query,(char *)ptr+sizeof(mysql_hdr)+1,len);
 	query[len]=0;
 	if (__sync_add_and_fetch(&version,0) > _thr_SQP_version) {
-		// update local rules;
+		// switch to the new rules set: hits not yet flushed are lost, as their parents are gone
 		proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Detected a changed in version. Global:%d , local:%d . Refreshing...\n", version, _thr_SQP_version);
-		spin_rdlock(&rwlock);
-		_thr_SQP_version=__sync_add_and_fetch(&version,0);
-		__reset_rules(_thr_SQP_rules);
-		QP_rule_t *qr1;
-		QP_rule_t *qr2;
-		for (std::vector<QP_rule_t *>::iterator it=rules.begin(); it!=rules.end(); ++it) {
-			qr1=*it;
-			if (qr1->active) {
-				proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Copying Query Rule id: %d\n", qr1->rule_id);
-				char buf[20];
-				if (qr1->digest) { // not 0
-					//uint32_t d32[2];
-					//memcpy(&d32,&qr1->digest,sizeof(qr1->digest));
-					//sprintf(buf,"0x%X%X", d32[0], d32[1]);
-					sprintf(buf,"0x%016llX", (long long unsigned int)qr1->digest);
-				}
-				std::string re_mod;
-				re_mod="";
-				if ((qr1->re_modifiers & QP_RE_MOD_CASELESS) == QP_RE_MOD_CASELESS) re_mod = "CASELESS";
-				if ((qr1->re_modifiers & QP_RE_MOD_GLOBAL) == QP_RE_MOD_GLOBAL) {
-					if (re_mod.length()) {
-						re_mod = re_mod + ",";
-					}
-					re_mod = re_mod + "GLOBAL";
-				}
-				qr2=new_query_rule(qr1->rule_id, qr1->active, qr1->username, qr1->schemaname, qr1->flagIN,
-					qr1->client_addr, qr1->proxy_addr, qr1->proxy_port,
-					( qr1->digest ? buf : NULL ) ,
-					qr1->match_digest, qr1->match_pattern, qr1->negate_match_pattern, (char *)re_mod.c_str(),
-					qr1->flagOUT, qr1->replace_pattern, qr1->destination_hostgroup,
-					qr1->cache_ttl, qr1->reconnect, qr1->timeout, qr1->retries, qr1->delay, qr1->mirror_flagOUT, qr1->mirror_hostgroup,
-					qr1->error_msg, qr1->sticky_conn, qr1->multiplex, qr1->log, qr1->apply,
-					qr1->comment);
-				qr2->parent=qr1;	// pointer to parent to speed up parent update (hits)
-				if (qr2->match_digest) {
-					proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Compiling regex for rule_id: %d, match_digest: \n", qr2->rule_id, qr2->match_digest);
-					qr2->regex_engine1=(void *)compile_query_rule(qr2,1);
-				}
-				if (qr2->match_pattern) {
-					proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 4, "Compiling regex for rule_id: %d, match_pattern: \n", qr2->rule_id, qr2->match_pattern);
-					qr2->regex_engine2=(void *)compile_query_rule(qr2,2);
-				}
-				_thr_SQP_rules->push_back(qr2);
-			}
-		}
-		spin_rdunlock(&rwlock); // unlock should be after the copy
+		_thr_SQP_rules_set->release();
+		free(_thr_SQP_hits);
+		_thr_SQP_rules_set=get_rules_set();
+		_thr_SQP_version=_thr_SQP_rules_set->version;
+		_thr_SQP_hits=(unsigned int *)calloc(_thr_SQP_rules_set->rules.size()+1,sizeof(unsigned int));
 	}
 	QP_rule_t *qr;
 	re2_t *re2p;
+	unsigned int i;
+	unsigned int n_rules=_thr_SQP_rules_set->rules.size();
 	int flagIN=0;
 	int reiterate=mysql_thread___query_processor_iterations;
 	if (sess->mirror==true) {
@@ -758,8 +1551,8 @@ Query_Processor_Output * Query_Processor::process_mysql_query(MySQL_Session *ses
 		}
 	}
 __internal_loop:
-	for (std::vector<QP_rule_t *>::iterator it=_thr_SQP_rules->begin(); it!=_thr_SQP_rules->end(); ++it) {
-		qr=*it;
+	for (i=0; i<n_rules; i++) {
+		qr=_thr_SQP_rules_set->rules[i];
 		if (qr->flagIN != flagIN) {
 			proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 6, "query rule %d has no matching flagIN\n", qr->rule_id);
 			continue;
@@ -859,7 +1652,13 @@ __internal_loop:
 		}
 
 		// if we arrived here, we have a match
-		qr->hits++; // this is done without atomic function because it updates only the local variables
+		_thr_SQP_hits[i]++; // rules are shared, hits are counted per thread
+		if (qr->qos && ret->qos_len < QP_QOS_MAX_LIMITS) {
+			proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 5, "query rule %d has set rate limits\n", qr->rule_id);
+			ret->qos[ret->qos_len]=qr->qos;
+			ret->qos_slot[ret->qos_len]=false;
+			ret->qos_len++;
+		}
 		bool set_flagOUT=false;
 		if (qr->flagOUT >= 0) {
 			proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 5, "query rule %d has changed flagOUT\n", qr->rule_id);
@@ -922,6 +1721,16 @@ __internal_loop:
       proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 5, "query rule %d has set log: %d. Query will%s logged\n", qr->rule_id, qr->log, (qr->log == 0 ? " NOT" : "" ));
       ret->log=qr->log;
     }
+    if (qr->priority >= 0) {
+			// Note: negative priority means this rule doesn't change
+      proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 5, "query rule %d has set priority: %d\n", qr->rule_id, qr->priority);
+      ret->priority=qr->priority;
+    }
+    if (qr->hedge_delay_ms >= 0) {
+			// Note: negative hedge_delay_ms means this rule doesn't change , 0 disables hedging
+      proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 5, "query rule %d has set hedge_delay_ms: %d\n", qr->rule_id, qr->hedge_delay_ms);
+      ret->hedge=qr->hedge;
+    }
     if (qr->destination_hostgroup >= 0) {
 			// Note: negative hostgroup means this rule doesn't change 
       proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 5, "query rule %d has set destination hostgroup: %d\n", qr->rule_id, qr->destination_hostgroup);
@@ -986,35 +1795,28 @@ void Query_Processor::update_query_processor_stats() {
 	// Note:
 	// this function is called by each thread to update global query statistics
 	//
-	// As an extra safety, it checks that the version didn't change
-	// Yet, if version changed doesn't perfomr any rules update
+	// As an extra safety, it checks that the thread still uses the current
+	// rules set, and that its parent rules weren't deleted by reset_all()
+	// Yet, if they changed doesn't perfomr any rules update
 	//
 	// It acquires a read lock to ensure that the rules table doesn't change
 	// Yet, because it has to update vales, it uses atomic operations
 	proxy_debug(PROXY_DEBUG_MYSQL_QUERY_PROCESSOR, 5, "Updating query rules statistics\n");
 	spin_rdlock(&rwlock);
-	if (__sync_add_and_fetch(&version,0) == _thr_SQP_version) {
+	if (_thr_SQP_rules_set==rules_set && rules_set->orphan==false) {
 		QP_rule_t *qr;
-		for (std::vector<QP_rule_t *>::iterator it=_thr_SQP_rules->begin(); it!=_thr_SQP_rules->end(); ++it) {
-			qr=*it;
-			if (qr->active && qr->hits) {
-				__sync_fetch_and_add(&qr->parent->hits,qr->hits);
-				qr->hits=0;
+		unsigned int i;
+		for (i=0; i<_thr_SQP_rules_set->rules.size(); i++) {
+			if (_thr_SQP_hits[i]) {
+				qr=_thr_SQP_rules_set->rules[i];
+				__sync_fetch_and_add(&qr->parent->hits,_thr_SQP_hits[i]);
+				_thr_SQP_hits[i]=0;
 			}
 		}
 	}
 	spin_rdunlock(&rwlock);
-	for (int i=0; i<MYSQL_COM_QUERY___NONE; i++) {
-		for (int j=0; j<13; j++) {
-			if (_thr_commands_counters[i]->counters[j]) {
-				__sync_fetch_and_add(&commands_counters[i]->counters[j],_thr_commands_counters[i]->counters[j]);
-				_thr_commands_counters[i]->counters[j]=0;
-			}
-		}
-		if (_thr_commands_counters[i]->total_time)
-			__sync_fetch_and_add(&commands_counters[i]->total_time,_thr_commands_counters[i]->total_time);
-		_thr_commands_counters[i]->total_time=0;
-	}
+	// commands counters are not flushed here: they are aggregated from the
+	// per-thread blocks only when read, see aggregate_commands_counters()
 };
 
 
@@ -1051,7 +1853,7 @@ enum MYSQL_COM_QUERY_command Query_Processor::query_parser_command_type(SQP_par_
 
 unsigned long long Query_Processor::query_parser_update_counters(MySQL_Session *sess, enum MYSQL_COM_QUERY_command c, SQP_par_t *qp, unsigned long long t) {
 	if (c>=MYSQL_COM_QUERY___NONE) return 0;
-	unsigned long long ret=_thr_commands_counters[c]->add_time(t);
+	unsigned long long ret=_thr_commands_counters->counters[c]->add_time(t);
 
 
 	if (sess->CurrentQuery.stmt_info==NULL && qp->digest_text) {
@@ -1071,7 +1873,8 @@ unsigned long long Query_Processor::query_parser_update_counters(MySQL_Session *
 		myhash.Update(ui->schemaname,strlen(ui->schemaname));
 		myhash.Update(&sess->current_hostgroup,sizeof(sess->default_hostgroup));
 		myhash.Final(&qp->digest_total,&hash2);
-		update_query_digest(qp, sess->current_hostgroup, ui, t, sess->thread->curtime, NULL);
+		update_query_digest(qp, sess->current_hostgroup, ui, t, sess->thread->curtime, NULL, sess->CurrentQuery.pending_phases_digest, sess->CurrentQuery.pending_phase_time);
+		sess->CurrentQuery.pending_phases_digest=0;
 	}
 	if (sess->CurrentQuery.stmt_info && sess->CurrentQuery.stmt_info->digest_text) {
 		uint64_t hash2;
@@ -1091,19 +1894,29 @@ unsigned long long Query_Processor::query_parser_update_counters(MySQL_Session *
 		myhash.Update(&sess->current_hostgroup,sizeof(sess->default_hostgroup));
 		myhash.Final(&qp->digest_total,&hash2);
 		//delete myhash;
-		update_query_digest(qp, sess->current_hostgroup, ui, t, sess->thread->curtime, stmt_info);
+		update_query_digest(qp, sess->current_hostgroup, ui, t, sess->thread->curtime, stmt_info, sess->CurrentQuery.pending_phases_digest, sess->CurrentQuery.pending_phase_time);
+		sess->CurrentQuery.pending_phases_digest=0;
 	}
 	return ret;
 }
 
-void Query_Processor::update_query_digest(SQP_par_t *qp, int hid, MySQL_Connection_userinfo *ui, unsigned long long t, unsigned long long n, MySQL_STMT_Global_info *_stmt_info) {
+static inline void query_digest_add_phases(QP_query_digest_stats *qds, unsigned long long *t) {
+	if (qds->phases==NULL) {
+		qds->phases=new QP_query_digest_phases();
+	}
+	qds->phases->add_times(t);
+}
+
+// If phases_digest is not 0, the phase times of the previous query of the
+// session are added to that digest in the same critical section
+void Query_Processor::update_query_digest(SQP_par_t *qp, int hid, MySQL_Connection_userinfo *ui, unsigned long long t, unsigned long long n, MySQL_STMT_Global_info *_stmt_info, uint64_t phases_digest, unsigned long long *phases) {
 	spin_wrlock(&digest_rwlock);
 
 	QP_query_digest_stats *qds;	
 
 	std::unordered_map<uint64_t, void *>::iterator it;
-	it=digest_umap.find(qp->digest_total);
-	if (it != digest_umap.end()) {
+	it=digest_umap->find(qp->digest_total);
+	if (it != digest_umap->end()) {
 		// found
 		qds=(QP_query_digest_stats *)it->second;
 		qds->add_time(t,n);
@@ -1114,12 +1927,35 @@ void Query_Processor::update_query_digest(SQP_par_t *qp, int hid, MySQL_Connecti
 			qds=new QP_query_digest_stats(ui->username, ui->schemaname, _stmt_info->digest, _stmt_info->digest_text, hid);
 		}
 		qds->add_time(t,n);
-		digest_umap.insert(std::make_pair(qp->digest_total,(void *)qds));
+		digest_umap->insert(std::make_pair(qp->digest_total,(void *)qds));
+	}
+	if (phases_digest) {
+		if (phases_digest!=qp->digest_total) {
+			it=digest_umap->find(phases_digest);
+			qds=(it != digest_umap->end() ? (QP_query_digest_stats *)it->second : NULL);
+		}
+		if (qds) {
+			query_digest_add_phases(qds,phases);
+		}
 	}
 
 	spin_wrunlock(&digest_rwlock);
 }
 
+// Adds the phase times of a query to the digest it was accounted to by
+// update_query_digest() , when the next query of the session can't carry them
+// (see Query_Info::phases_flush() ). If the digest isn't found (the map was
+// reset or is detached by a reader) the sample is dropped
+void Query_Processor::update_query_digest_phases(uint64_t digest_total, unsigned long long *t) {
+	spin_wrlock(&digest_rwlock);
+	std::unordered_map<uint64_t, void *>::iterator it;
+	it=digest_umap->find(digest_total);
+	if (it != digest_umap->end()) {
+		query_digest_add_phases((QP_query_digest_stats *)it->second,t);
+	}
+	spin_wrunlock(&digest_rwlock);
+}
+
 char * Query_Processor::get_digest_text(SQP_par_t *qp) {
 	if (qp==NULL) return NULL;
 	//SQP_par_t *qp=(SQP_par_t *)p;
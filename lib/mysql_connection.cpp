@@ -22,6 +22,166 @@ void MySQL_Connection::operator delete(void *ptr) {
 
 //extern __thread char *mysql_thread___default_schema;
 
+// Patterns of the digest text that change the multiplexing status flags of a
+// connection, see ProcessQueryAndSetStatusFlags() .
+// They are compiled once in a case insensitive Aho-Corasick automaton, so the
+// digest text is scanned only once whatever the number of patterns.
+// To detect a new pattern, add it here and handle its bit in
+// ProcessQueryAndSetStatusFlags()
+enum status_keyword_anchor {
+	STATUS_KW_PREFIX, // the digest text starts with the pattern
+	STATUS_KW_EXACT, // the digest text is the pattern
+	STATUS_KW_ANYWHERE
+};
+
+enum status_keyword_id {
+	STATUS_KW_AT,
+	STATUS_KW_SELECT_TX_ISOLATION,
+	STATUS_KW_SELECT_VERSION,
+	STATUS_KW_SAFE_UPDATES,
+	STATUS_KW_PREPARE,
+	STATUS_KW_CREATE_TEMPORARY_TABLE,
+	STATUS_KW_LOCK_TABLE,
+	STATUS_KW_FLUSH_TABLES_WITH_READ_LOCK,
+	STATUS_KW_UNLOCK_TABLES,
+	STATUS_KW_GET_LOCK,
+	STATUS_KW__END // max 32
+};
+
+#define STATUS_KW(id) (1U << (id))
+
+static const struct {
+	const char *pattern;
+	enum status_keyword_anchor anchor;
+} status_keywords[STATUS_KW__END] = {
+	{ "@", STATUS_KW_ANYWHERE },
+	{ "SELECT @@tx_isolation", STATUS_KW_PREFIX },
+	{ "SELECT @@version", STATUS_KW_PREFIX },
+	{ "SET SQL_SAFE_UPDATES=?,SQL_SELECT_LIMIT=?,MAX_JOIN_SIZE=?", STATUS_KW_EXACT }, // issue #555
+	{ "PREPARE ", STATUS_KW_PREFIX },
+	{ "CREATE TEMPORARY TABLE ", STATUS_KW_PREFIX },
+	{ "LOCK TABLE", STATUS_KW_PREFIX },
+	{ "FLUSH TABLES WITH READ LOCK", STATUS_KW_PREFIX }, // issue 613
+	{ "UNLOCK TABLES", STATUS_KW_PREFIX },
+	{ "GET_LOCK(", STATUS_KW_ANYWHERE }
+};
+
+class Status_Keywords_Automaton {
+	private:
+	unsigned char cls[256]; // character classes, 0 for characters not in any pattern
+	unsigned int ncls;
+	std::vector<uint16_t> delta; // transitions, ncls per state
+	std::vector<unsigned int> depth;
+	std::vector<uint32_t> own; // patterns ending in this state
+	std::vector<uint32_t> out; // patterns ending in this state or in its failure states
+	uint32_t prefix_mask;
+	uint32_t exact_mask;
+	uint32_t anywhere_mask;
+	unsigned int max_anchored_len;
+	public:
+	Status_Keywords_Automaton() {
+		unsigned int i;
+		unsigned int j;
+		memset(cls,0,sizeof(cls));
+		ncls=1;
+		prefix_mask=0;
+		exact_mask=0;
+		anywhere_mask=0;
+		max_anchored_len=0;
+		for (i=0; i<STATUS_KW__END; i++) {
+			for (const char *c=status_keywords[i].pattern; *c; c++) {
+				unsigned char u=toupper((unsigned char)*c);
+				if (cls[u]==0) {
+					cls[u]=ncls;
+					cls[tolower(u)]=ncls;
+					ncls++;
+				}
+			}
+		}
+		// trie
+		new_state(0);
+		for (i=0; i<STATUS_KW__END; i++) {
+			unsigned int st=0;
+			const char *p=status_keywords[i].pattern;
+			for (j=0; p[j]; j++) {
+				unsigned int c=cls[(unsigned char)p[j]];
+				if (delta[st*ncls+c]==0) {
+					unsigned int ns=new_state(j+1); // resizes delta
+					delta[st*ncls+c]=ns;
+				}
+				st=delta[st*ncls+c];
+			}
+			own[st]|=STATUS_KW(i);
+			switch (status_keywords[i].anchor) {
+				case STATUS_KW_PREFIX:
+					prefix_mask|=STATUS_KW(i);
+					break;
+				case STATUS_KW_EXACT:
+					exact_mask|=STATUS_KW(i);
+					break;
+				default:
+					anywhere_mask|=STATUS_KW(i);
+					break;
+			}
+			if (status_keywords[i].anchor!=STATUS_KW_ANYWHERE && j > max_anchored_len) {
+				max_anchored_len=j;
+			}
+		}
+		// failure links, breadth first: missing transitions are replaced by
+		// the ones of the failure state, so the automaton becomes a DFA
+		std::vector<unsigned int> fail(depth.size(),0);
+		std::vector<unsigned int> bfs;
+		for (j=0; j<ncls; j++) {
+			if (delta[j]) bfs.push_back(delta[j]);
+		}
+		for (i=0; i<bfs.size(); i++) {
+			unsigned int st=bfs[i];
+			out[st]=own[st]|out[fail[st]];
+			for (j=0; j<ncls; j++) {
+				unsigned int nx=delta[st*ncls+j];
+				if (nx && depth[nx]==depth[st]+1) {
+					fail[nx]=delta[fail[st]*ncls+j];
+					bfs.push_back(nx);
+				} else {
+					delta[st*ncls+j]=delta[fail[st]*ncls+j];
+				}
+			}
+		}
+	}
+	unsigned int new_state(unsigned int d) {
+		unsigned int st=depth.size();
+		depth.push_back(d);
+		own.push_back(0);
+		out.push_back(0);
+		delta.resize(delta.size()+ncls,0);
+		return st;
+	}
+	// returns the STATUS_KW() bits of the patterns matched by text .
+	// If anywhere is false, STATUS_KW_ANYWHERE patterns are not needed and
+	// only the beginning of text is scanned
+	uint32_t scan(const char *text, bool anywhere) {
+		uint32_t m=0;
+		unsigned int st=0;
+		unsigned int i;
+		for (i=0; text[i]; i++) {
+			if (anywhere==false && i>=max_anchored_len) {
+				return m;
+			}
+			st=delta[st*ncls+cls[(unsigned char)text[i]]];
+			m|=(out[st] & anywhere_mask);
+			if (depth[st]==i+1) { // st is the whole text so far
+				m|=(own[st] & prefix_mask);
+			}
+		}
+		if (depth[st]==i) {
+			m|=(own[st] & exact_mask);
+		}
+		return m;
+	}
+};
+
+static Status_Keywords_Automaton status_keywords_automaton;
+
 static int
 mysql_status(short event, short cont) {
 	int status= 0;
@@ -1090,6 +1250,7 @@ int MySQL_Connection::async_connect(short event) {
 		case ASYNC_CONNECT_SUCCESSFUL:
 			async_state_machine=ASYNC_IDLE;
 			myds->wait_until=0;
+			creation_time=myds->sess->thread->curtime;
 			return 0;
 			break;
 		case ASYNC_CONNECT_FAILED:
@@ -1437,48 +1598,41 @@ bool MySQL_Connection::MultiplexDisabled() {
 
 void MySQL_Connection::ProcessQueryAndSetStatusFlags(char *query_digest_text) {
 	if (query_digest_text==NULL) return;
+	// a single pass on the digest text, see Status_Keywords_Automaton
+	uint32_t kw=status_keywords_automaton.scan(query_digest_text, (get_status_user_variable()==false || get_status_get_lock()==false));
 	if (get_status_user_variable()==false) { // we search for variables only if not already set
-		if (index(query_digest_text,'@')) {
-			if (
-				strncasecmp(query_digest_text,"SELECT @@tx_isolation", strlen("SELECT @@tx_isolation"))
-				&&
-				strncasecmp(query_digest_text,"SELECT @@version", strlen("SELECT @@version"))
-			) {
+		if (kw & STATUS_KW(STATUS_KW_AT)) {
+			if ((kw & (STATUS_KW(STATUS_KW_SELECT_TX_ISOLATION)|STATUS_KW(STATUS_KW_SELECT_VERSION)))==0) {
 				set_status_user_variable(true);
 			}
 		}
 		// For issue #555 , multiplexing is disabled if --safe-updates is used
-		if (strcasecmp(query_digest_text,"SET SQL_SAFE_UPDATES=?,SQL_SELECT_LIMIT=?,MAX_JOIN_SIZE=?")==0) {
+		if (kw & STATUS_KW(STATUS_KW_SAFE_UPDATES)) {
 				set_status_user_variable(true);
 		}
 	}
 	if (get_status_prepared_statement()==false) { // we search if prepared was already executed
-		if (!strncasecmp(query_digest_text,"PREPARE ", strlen("PREPARE "))) {
+		if (kw & STATUS_KW(STATUS_KW_PREPARE)) {
 			set_status_prepared_statement(true);
 		}
 	}
 	if (get_status_temporary_table()==false) { // we search for temporary if not already set
-		if (!strncasecmp(query_digest_text,"CREATE TEMPORARY TABLE ", strlen("CREATE TEMPORARY TABLE "))) {
+		if (kw & STATUS_KW(STATUS_KW_CREATE_TEMPORARY_TABLE)) {
 			set_status_temporary_table(true);
 		}
 	}
 	if (get_status_lock_tables()==false) { // we search for lock tables only if not already set
-		if (!strncasecmp(query_digest_text,"LOCK TABLE", strlen("LOCK TABLE"))) {
-			set_status_lock_tables(true);
-		}
-	}
-	if (get_status_lock_tables()==false) { // we search for lock tables only if not already set
-		if (!strncasecmp(query_digest_text,"FLUSH TABLES WITH READ LOCK", strlen("FLUSH TABLES WITH READ LOCK"))) { // issue 613
+		if (kw & (STATUS_KW(STATUS_KW_LOCK_TABLE)|STATUS_KW(STATUS_KW_FLUSH_TABLES_WITH_READ_LOCK))) {
 			set_status_lock_tables(true);
 		}
 	}
 	if (get_status_lock_tables()==true) {
-		if (!strncasecmp(query_digest_text,"UNLOCK TABLES", strlen("UNLOCK TABLES"))) {
+		if (kw & STATUS_KW(STATUS_KW_UNLOCK_TABLES)) {
 			set_status_lock_tables(false);
 		}
 	}
 	if (get_status_get_lock()==false) { // we search for get_lock if not already set
-		if (strcasestr(query_digest_text,"GET_LOCK(")) {
+		if (kw & STATUS_KW(STATUS_KW_GET_LOCK)) {
 			set_status_get_lock(true);
 		}
 	}
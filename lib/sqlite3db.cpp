@@ -9,9 +9,15 @@ SQLite3DB::SQLite3DB() {
 	url=NULL;
 	assert_on_error=0;
 	spinlock_rwlock_init(&rwlock);
+	pthread_mutex_init(&stmt_cache_mutex, NULL);
 }
 
 SQLite3DB::~SQLite3DB() {
+	for (std::vector<sqlite3_stmt *>::iterator it=stmt_cache.begin(); it!=stmt_cache.end(); ++it) {
+		sqlite3_finalize(*it);
+	}
+	stmt_cache.clear();
+	pthread_mutex_destroy(&stmt_cache_mutex);
 	if (db) {
 		// close db
 		int rc;
@@ -223,3 +229,500 @@ char *SQLite3_result::checksum() {
 	sprintf(buf,"0x%X%X", d32[0], d32[1]);
 	return strdup(buf);
 }
+
+static bool vtab_is_number(const char *s, double *d) {
+	if (s==NULL || *s==0) return false;
+	char *end=NULL;
+	*d=strtod(s,&end);
+	return (*end==0);
+}
+
+// A row is discarded only if SQLite would certainly reject it: both the
+// field and the constraint must be numbers, as vtab_column() returns them.
+// Anything else is left to SQLite
+bool SQLite3_vtab_filter::match(int col, const char *field) {
+	if (col >= columns) return true;
+	double a, b;
+	if (field==NULL || vtab_is_number(field,&a)==false) return true;
+	if (min_values[col] && vtab_is_number(min_values[col],&b) && a < b) {
+		return false;
+	}
+	if (values[col] && vtab_is_number(values[col],&b) && a != b) {
+		return false;
+	}
+	return true;
+}
+
+bool SQLite3_vtab_filter::match(SQLite3_row *row) {
+	for (int i=0; i<columns && i<row->cnt; i++) {
+		if (match(i,row->fields[i])==false) return false;
+	}
+	return true;
+}
+
+SQLite3_vtab_table::SQLite3_vtab_table(const char *name, const char *def, SQLite3_vtab_rows_cb cb, void *arg, pthread_mutex_t *m) {
+	table_name=strdup(name);
+	table_def=strdup(def);
+	rows_cb=cb;
+	rows_arg=arg;
+	rows_mutex=m;
+	columns=0;
+	numeric=NULL;
+	// split the column list on top level commas, and apply the SQLite rules
+	// for type affinity to each column type. Table constraints are skipped
+	const char *s=strchr(def,'(');
+	assert(s);
+	s++;
+	std::vector<std::string> defs;
+	std::string cur;
+	int depth=0;
+	for (; *s; s++) {
+		if (*s=='(') depth++;
+		if (*s==')') {
+			if (depth==0) break;
+			depth--;
+		}
+		if (*s==',' && depth==0) {
+			defs.push_back(cur);
+			cur.clear();
+		} else {
+			cur+=toupper(*s);
+		}
+	}
+	defs.push_back(cur);
+	numeric=(bool *)malloc(sizeof(bool)*defs.size());
+	for (std::vector<std::string>::iterator it=defs.begin(); it!=defs.end(); ++it) {
+		std::string c=*it;
+		size_t p=c.find_first_not_of(" \t\n");
+		if (p==std::string::npos) continue;
+		c=c.substr(p);
+		if (c.compare(0,7,"PRIMARY")==0 || c.compare(0,6,"UNIQUE")==0 || c.compare(0,5,"CHECK")==0 || c.compare(0,7,"FOREIGN")==0 || c.compare(0,10,"CONSTRAINT")==0) {
+			continue;
+		}
+		p=c.find_first_of(" \t\n");
+		std::string t=(p==std::string::npos ? "" : c.substr(p));
+		numeric[columns]=(
+			t.find("INT")!=std::string::npos || t.find("REAL")!=std::string::npos ||
+			t.find("FLOA")!=std::string::npos || t.find("DOUB")!=std::string::npos ||
+			t.find("NUMERIC")!=std::string::npos || t.find("DECIMAL")!=std::string::npos
+		);
+		columns++;
+	}
+}
+
+SQLite3_vtab_table::~SQLite3_vtab_table() {
+	free(table_name);
+	free(table_def);
+	free(numeric);
+}
+
+typedef struct _SQLite3_vtab_t {
+	sqlite3_vtab base;
+	SQLite3_vtab_table *vt;
+} SQLite3_vtab_t;
+
+typedef struct _SQLite3_vtab_cursor_t {
+	sqlite3_vtab_cursor base;
+	SQLite3_result *resultset;
+	SQLite3_vtab_filter *filter;
+	unsigned int idx;
+} SQLite3_vtab_cursor_t;
+
+static int vtab_connect(sqlite3 *db, void *pAux, int argc, const char * const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+	SQLite3_vtab_table *vt=(SQLite3_vtab_table *)pAux;
+	int rc=sqlite3_declare_vtab(db, vt->table_def);
+	if (rc!=SQLITE_OK) {
+		*pzErr=sqlite3_mprintf("%s", sqlite3_errmsg(db));
+		return rc;
+	}
+	SQLite3_vtab_t *v=(SQLite3_vtab_t *)sqlite3_malloc(sizeof(SQLite3_vtab_t));
+	if (v==NULL) return SQLITE_NOMEM;
+	memset(v,0,sizeof(SQLite3_vtab_t));
+	v->vt=vt;
+	*ppVtab=&v->base;
+	return SQLITE_OK;
+}
+
+// xCreate must differ from xConnect, otherwise SQLite would also expose the
+// module as an eponymous table in the main schema of every connection
+static int vtab_create(sqlite3 *db, void *pAux, int argc, const char * const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+	return vtab_connect(db, pAux, argc, argv, ppVtab, pzErr);
+}
+
+static int vtab_disconnect(sqlite3_vtab *pVtab) {
+	sqlite3_free(pVtab);
+	return SQLITE_OK;
+}
+
+static int vtab_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo) {
+	SQLite3_vtab_t *v=(SQLite3_vtab_t *)pVtab;
+	// equality and lower bound constraints on numeric columns are passed to
+	// xFilter; idxStr lists them in argv order as "<op><column>," where op is
+	// '=' or '>'. SQLite still evaluates every constraint, so > is handled as >=
+	int argv_idx=0;
+	int eq=0;
+	char *idx_str=sqlite3_mprintf("");
+	for (int i=0; i<pInfo->nConstraint; i++) {
+		int col=pInfo->aConstraint[i].iColumn;
+		if (pInfo->aConstraint[i].usable==0 || col < 0 || col >= v->vt->columns || v->vt->numeric[col]==false) continue;
+		char op=0;
+		switch (pInfo->aConstraint[i].op) {
+			case SQLITE_INDEX_CONSTRAINT_EQ:
+				op='=';
+				eq++;
+				break;
+			case SQLITE_INDEX_CONSTRAINT_GT:
+			case SQLITE_INDEX_CONSTRAINT_GE:
+				op='>';
+				break;
+			default:
+				break;
+		}
+		if (op==0) continue;
+		pInfo->aConstraintUsage[i].argvIndex=++argv_idx;
+		pInfo->aConstraintUsage[i].omit=0;
+		char *t=sqlite3_mprintf("%s%c%d,", idx_str, op, col);
+		sqlite3_free(idx_str);
+		idx_str=t;
+	}
+	pInfo->idxNum=argv_idx;
+	pInfo->idxStr=idx_str;
+	pInfo->needToFreeIdxStr=1;
+	pInfo->estimatedCost=1000.0/(eq+1) - argv_idx;
+	return SQLITE_OK;
+}
+
+static int vtab_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+	SQLite3_vtab_cursor_t *c=(SQLite3_vtab_cursor_t *)sqlite3_malloc(sizeof(SQLite3_vtab_cursor_t));
+	if (c==NULL) return SQLITE_NOMEM;
+	memset(c,0,sizeof(SQLite3_vtab_cursor_t));
+	*ppCursor=&c->base;
+	return SQLITE_OK;
+}
+
+static void vtab_cursor_reset(SQLite3_vtab_cursor_t *c) {
+	if (c->resultset) {
+		delete c->resultset;
+		c->resultset=NULL;
+	}
+	if (c->filter) {
+		delete c->filter;
+		c->filter=NULL;
+	}
+	c->idx=0;
+}
+
+static int vtab_close(sqlite3_vtab_cursor *cur) {
+	SQLite3_vtab_cursor_t *c=(SQLite3_vtab_cursor_t *)cur;
+	vtab_cursor_reset(c);
+	sqlite3_free(c);
+	return SQLITE_OK;
+}
+
+static void vtab_skip_filtered(SQLite3_vtab_cursor_t *c) {
+	while (c->idx < c->resultset->rows.size() && c->filter->match(c->resultset->rows[c->idx])==false) {
+		c->idx++;
+	}
+}
+
+static int vtab_filter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+	SQLite3_vtab_cursor_t *c=(SQLite3_vtab_cursor_t *)cur;
+	SQLite3_vtab_table *vt=((SQLite3_vtab_t *)cur->pVtab)->vt;
+	vtab_cursor_reset(c);
+	c->filter=new SQLite3_vtab_filter(vt->columns);
+	const char *p=idxStr;
+	for (int a=0; a < argc && p && *p; a++) {
+		char op=*p++;
+		int col=atoi(p);
+		p=strchr(p,',');
+		if (p) p++;
+		const char *v=(const char *)sqlite3_value_text(argv[a]);
+		if (v==NULL) continue;
+		char **dst=(op=='=' ? c->filter->values : c->filter->min_values);
+		if (dst[col]==NULL) {
+			dst[col]=strdup(v);
+		}
+	}
+	if (vt->rows_mutex) {
+		pthread_mutex_lock(vt->rows_mutex);
+	}
+	c->resultset=vt->rows_cb(vt->rows_arg, c->filter);
+	if (vt->rows_mutex) {
+		pthread_mutex_unlock(vt->rows_mutex);
+	}
+	if (c->resultset==NULL) {
+		c->resultset=new SQLite3_result(vt->columns);
+	}
+	vtab_skip_filtered(c);
+	return SQLITE_OK;
+}
+
+static int vtab_next(sqlite3_vtab_cursor *cur) {
+	SQLite3_vtab_cursor_t *c=(SQLite3_vtab_cursor_t *)cur;
+	c->idx++;
+	vtab_skip_filtered(c);
+	return SQLITE_OK;
+}
+
+static int vtab_eof(sqlite3_vtab_cursor *cur) {
+	SQLite3_vtab_cursor_t *c=(SQLite3_vtab_cursor_t *)cur;
+	return (c->idx >= c->resultset->rows.size());
+}
+
+static int vtab_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int i) {
+	SQLite3_vtab_cursor_t *c=(SQLite3_vtab_cursor_t *)cur;
+	SQLite3_vtab_table *vt=((SQLite3_vtab_t *)cur->pVtab)->vt;
+	SQLite3_row *r=c->resultset->rows[c->idx];
+	// NULL fields are returned as empty strings, as the INSERTs used to do
+	const char *f=( (i < r->cnt && r->fields[i]) ? r->fields[i] : "");
+	if (vt->numeric[i]) {
+		char *end=NULL;
+		long long l=strtoll(f,&end,10);
+		if (*f && *end==0) {
+			sqlite3_result_int64(ctx,l);
+			return SQLITE_OK;
+		}
+		double d;
+		if (vtab_is_number(f,&d)) {
+			sqlite3_result_double(ctx,d);
+			return SQLITE_OK;
+		}
+	}
+	sqlite3_result_text(ctx,f,-1,SQLITE_TRANSIENT);
+	return SQLITE_OK;
+}
+
+static int vtab_rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+	SQLite3_vtab_cursor_t *c=(SQLite3_vtab_cursor_t *)cur;
+	*pRowid=c->idx;
+	return SQLITE_OK;
+}
+
+static sqlite3_module vtab_module = {
+	0,                // iVersion
+	vtab_create,      // xCreate
+	vtab_connect,     // xConnect
+	vtab_best_index,  // xBestIndex
+	vtab_disconnect,  // xDisconnect
+	vtab_disconnect,  // xDestroy
+	vtab_open,        // xOpen
+	vtab_close,       // xClose
+	vtab_filter,      // xFilter
+	vtab_next,        // xNext
+	vtab_eof,         // xEof
+	vtab_column,      // xColumn
+	vtab_rowid,       // xRowid
+	NULL,             // xUpdate : read only
+	NULL,             // xBegin
+	NULL,             // xSync
+	NULL,             // xCommit
+	NULL,             // xRollback
+	NULL,             // xFindFunction
+	NULL,             // xRename
+	NULL,             // xSavepoint
+	NULL,             // xRelease
+	NULL              // xRollbackTo
+};
+
+// The module is named after the table, and must be registered on every
+// connection that reads the table (including connections that ATTACH it).
+// vt is not owned by the connection and must outlive it
+bool SQLite3DB::create_vtab_module(SQLite3_vtab_table *vt) {
+	assert(db);
+	int rc=sqlite3_create_module_v2(db, vt->table_name, &vtab_module, vt, NULL);
+	if (rc!=SQLITE_OK) {
+		proxy_error("SQLITE error: unable to create module %s : %s\n", vt->table_name, sqlite3_errmsg(db));
+		return false;
+	}
+	return true;
+}
+
+// Returns a prepared statement for str, reusing an idle one if available.
+// The caller owns it until release_cached() is called.
+sqlite3_stmt *SQLite3DB::prepare_cached(const char *str) {
+	assert(db);
+	sqlite3_stmt *statement=NULL;
+	pthread_mutex_lock(&stmt_cache_mutex);
+	for (std::vector<sqlite3_stmt *>::iterator it=stmt_cache.begin(); it!=stmt_cache.end(); ++it) {
+		if (strcmp(sqlite3_sql(*it),str)==0) {
+			statement=*it;
+			stmt_cache.erase(it);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stmt_cache_mutex);
+	if (statement) {
+		return statement;
+	}
+	if (sqlite3_prepare_v2(db, str, -1, &statement, 0) != SQLITE_OK) {
+		proxy_error("SQLITE error: %s --- %s\n", sqlite3_errmsg(db), str);
+		if (assert_on_error) {
+			assert(0);
+		}
+		sqlite3_finalize(statement);
+		return NULL;
+	}
+	return statement;
+}
+
+void SQLite3DB::release_cached(sqlite3_stmt *statement) {
+	if (statement==NULL) return;
+	sqlite3_reset(statement);
+	sqlite3_clear_bindings(statement);
+	pthread_mutex_lock(&stmt_cache_mutex);
+	stmt_cache.push_back(statement);
+	pthread_mutex_unlock(&stmt_cache_mutex);
+}
+
+SQLite3_batch_insert::SQLite3_batch_insert(SQLite3DB *_db, const char *_prefix, int _params, const char *_row, int _rows_per_stmt) {
+	db=_db;
+	prefix=strdup(_prefix);
+	params=_params;
+	if (_row) {
+		row=strdup(_row);
+	} else {
+		row=(char *)malloc(params*2+2);
+		char *p=row;
+		*p++='(';
+		for (int i=0; i<params; i++) {
+			if (i) *p++=',';
+			*p++='?';
+		}
+		*p++=')';
+		*p=0;
+	}
+	// never exceed the maximum number of host parameters of a statement
+	int max_vars=sqlite3_limit(db->get_db(), SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+	rows_per_stmt=_rows_per_stmt;
+	if (rows_per_stmt*params > max_vars) {
+		rows_per_stmt=max_vars/params;
+	}
+	if (rows_per_stmt < 1) rows_per_stmt=1;
+	pending=0;
+	rows_written=0;
+	in_transaction=false;
+	values=(char **)malloc(sizeof(char *)*rows_per_stmt*params);
+	memset(values,0,sizeof(char *)*rows_per_stmt*params);
+	copied=(bool *)malloc(sizeof(bool)*rows_per_stmt*params);
+	memset(copied,0,sizeof(bool)*rows_per_stmt*params);
+	char *q=build_query(1);
+	stmt1=db->prepare_cached(q);
+	free(q);
+	stmtN=NULL;
+	if (rows_per_stmt > 1) {
+		q=build_query(rows_per_stmt);
+		stmtN=db->prepare_cached(q);
+		free(q);
+	}
+}
+
+SQLite3_batch_insert::~SQLite3_batch_insert() {
+	flush();
+	db->release_cached(stmt1);
+	db->release_cached(stmtN);
+	free(values);
+	free(copied);
+	free(prefix);
+	free(row);
+}
+
+char *SQLite3_batch_insert::build_query(int rows) {
+	int lp=strlen(prefix);
+	int lr=strlen(row);
+	char *q=(char *)malloc(lp+(lr+1)*rows+1);
+	char *p=q;
+	memcpy(p,prefix,lp);
+	p+=lp;
+	for (int i=0; i<rows; i++) {
+		if (i) *p++=',';
+		memcpy(p,row,lr);
+		p+=lr;
+	}
+	*p=0;
+	return q;
+}
+
+bool SQLite3_batch_insert::bind_and_step(sqlite3_stmt *stmt, char **vals, int rows) {
+	if (stmt==NULL) return false;
+	int rc;
+	int n=rows*params;
+	for (int i=0; i<n; i++) {
+		if (vals[i]) {
+			rc=sqlite3_bind_text(stmt, i+1, vals[i], -1, SQLITE_STATIC);
+		} else {
+			rc=sqlite3_bind_null(stmt, i+1);
+		}
+		assert(rc==SQLITE_OK);
+	}
+	do {
+		rc=sqlite3_step(stmt);
+		if (rc==SQLITE_LOCKED) { // the execution of the prepared statement failed because locked
+			usleep(USLEEP_SQLITE_LOCKED);
+			sqlite3_reset(stmt);
+		}
+	} while (rc==SQLITE_LOCKED);
+	if (rc!=SQLITE_DONE) {
+		proxy_error("SQLITE error: %s --- %s\n", sqlite3_errmsg(db->get_db()), sqlite3_sql(stmt));
+	} else {
+		rows_written+=rows;
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return (rc==SQLITE_DONE);
+}
+
+void SQLite3_batch_insert::begin() {
+	if (in_transaction==false && sqlite3_get_autocommit(db->get_db())) {
+		in_transaction=db->execute("BEGIN");
+	}
+}
+
+void SQLite3_batch_insert::release_values(int n) {
+	for (int i=0; i<n; i++) {
+		if (copied[i]) {
+			free(values[i]);
+			copied[i]=false;
+		}
+		values[i]=NULL;
+	}
+}
+
+// With copy==false the fields are bound as they are (SQLITE_STATIC) : the
+// caller keeps them valid until the row is written, at the latest by flush()
+bool SQLite3_batch_insert::add_row(char **fields, bool copy) {
+	bool ret=true;
+	char **v=values+pending*params;
+	bool *c=copied+pending*params;
+	for (int i=0; i<params; i++) {
+		if (fields[i] && copy) {
+			v[i]=strdup(fields[i]);
+			c[i]=true;
+		} else {
+			v[i]=fields[i];
+			c[i]=false;
+		}
+	}
+	pending++;
+	if (pending==rows_per_stmt) {
+		ret=bind_and_step((rows_per_stmt > 1 ? stmtN : stmt1), values, pending);
+		release_values(pending*params);
+		pending=0;
+	}
+	return ret;
+}
+
+bool SQLite3_batch_insert::flush() {
+	bool ret=true;
+	for (int r=0; r<pending; r++) {
+		if (bind_and_step(stmt1, values+r*params, 1)==false) {
+			ret=false;
+		}
+	}
+	release_values(pending*params);
+	pending=0;
+	if (in_transaction) {
+		db->execute("COMMIT");
+		in_transaction=false;
+	}
+	return ret;
+}
@@ -41,7 +41,8 @@ static const char * proxysql_pid_file() {
 */
 struct cpu_timer
 {
-	cpu_timer() {
+	cpu_timer(const char *_phase=NULL) {
+		phase=_phase;
 		begin = monotonic_time();
 	}
 	~cpu_timer()
@@ -50,9 +51,13 @@ struct cpu_timer
 #ifdef DEBUG
 		std::cerr << double( end - begin ) / 1000000 << " secs.\n" ;
 #endif /* DEBUG */
+		if (phase) { // startup report
+			proxy_info("Startup phase \"%s\" completed in %llums\n", phase, (end-begin)/1000);
+		}
 		begin=end-begin; // here only to make compiler happy
 	};
 	unsigned long long begin;
+	const char *phase;
 };
 
 /*
@@ -61,12 +66,25 @@ void ProxySQL_Main_init_SSL_module() {
 	SSL_METHOD *ssl_method;
 	OpenSSL_add_all_algorithms();
 	SSL_load_error_strings();
-	ssl_method = (SSL_METHOD *)TLSv1_server_method();
+	ssl_method = (SSL_METHOD *)SSLv23_server_method(); // TLSv1.2 is needed for ECDHE with GCM
 	GloVars.global.ssl_ctx = SSL_CTX_new(ssl_method);
 	if (GloVars.global.ssl_ctx==NULL)	{
 		ERR_print_errors_fp(stderr);
 		abort();
 	}
+	SSL_CTX_set_options(GloVars.global.ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_SINGLE_ECDH_USE);
+	// short lived clients resume their sessions (session cache and tickets)
+	// instead of paying a full handshake at every connection
+	SSL_CTX_set_session_id_context(GloVars.global.ssl_ctx, (const unsigned char *)"proxysql", 8);
+	SSL_CTX_set_session_cache_mode(GloVars.global.ssl_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(GloVars.global.ssl_ctx, 16384);
+	SSL_CTX_set_timeout(GloVars.global.ssl_ctx, 300);
+	// ECDHE with the curves offered by the client, preferring the fastest
+	if (SSL_CTX_set1_curves_list(GloVars.global.ssl_ctx, "X25519:P-256:P-384")!=1) {
+		proxy_error("Unable to set TLS curves, using the OpenSSL defaults\n");
+		ERR_print_errors_fp(stderr);
+	}
+	SSL_CTX_set_ecdh_auto(GloVars.global.ssl_ctx, 1);
 
 	if ( SSL_CTX_use_certificate_file(GloVars.global.ssl_ctx, "newreq.pem", SSL_FILETYPE_PEM) <= 0 )	{
 		ERR_print_errors_fp(stderr);
@@ -193,6 +211,7 @@ void * mysql_worker_thread_func_idles(void *arg) {
 }
 
 void * mysql_shared_query_cache_funct(void *arg) {
+	GloMTH->set_auxiliary_thread_affinity();
 	GloQC->purgeHash_thread(NULL);
 	return NULL;
 }
@@ -239,6 +258,9 @@ void ProxySQL_Main_process_global_variables(int argc, const char **argv) {
 	GloVars.admindb=(char *)malloc(strlen(GloVars.datadir)+strlen((char *)"proxysql.db")+2);
 	sprintf(GloVars.admindb,"%s/%s",GloVars.datadir, (char *)"proxysql.db");
 
+	GloVars.snapshot=(char *)malloc(strlen(GloVars.datadir)+strlen((char *)"proxysql.snapshot")+2);
+	sprintf(GloVars.snapshot,"%s/%s",GloVars.datadir, (char *)"proxysql.snapshot");
+
 	GloVars.errorlog=(char *)malloc(strlen(GloVars.datadir)+strlen((char *)"proxysql.log")+2);
 	sprintf(GloVars.errorlog,"%s/%s",GloVars.datadir, (char *)"proxysql.log");
 
@@ -293,6 +315,8 @@ void ProxySQL_Main_init_Query_module() {
 void ProxySQL_Main_init_MySQL_Threads_Handler_module() {
 	unsigned int i;
 	GloMTH->init();
+	MyHGM->init();
+	GloMyAuth->init();
 	load_ = GloMTH->num_threads * 2 + 1;
 	for (i=0; i<GloMTH->num_threads; i++) {
 		GloMTH->create_thread(i,mysql_worker_thread_func, false);
@@ -449,15 +473,21 @@ void ProxySQL_Main_init() {
 
 
 void ProxySQL_Main_init_phase2___not_started() {
-	ProxySQL_Main_init_main_modules();
-	ProxySQL_Main_init_Admin_module();
-	GloMTH->print_version();
+	{
+		cpu_timer t("Admin module and config");
+		ProxySQL_Main_init_main_modules();
+		ProxySQL_Main_init_Admin_module();
+		GloMTH->print_version();
 
-	if (GloVars.configfile_open) {
-		GloVars.confFile->CloseFile();
+		if (GloVars.configfile_open) {
+			GloVars.confFile->CloseFile();
+		}
 	}
 
-	ProxySQL_Main_init_Auth_module();
+	{
+		cpu_timer t("mysql_users");
+		ProxySQL_Main_init_Auth_module();
+	}
 
 	if (GloVars.global.nostart) {
 		pthread_mutex_lock(&GloVars.global.start_mutex);
@@ -475,23 +505,20 @@ void ProxySQL_Main_init_phase3___start_all() {
 #endif
 	}
 	// load all mysql servers to GloHGH
+	// mysql servers and scheduler don't depend on query rules: they are loaded
+	// while the Query Processor is initialized in another thread
 	{
-		cpu_timer t;
+		cpu_timer t("mysql_servers, scheduler and mysql_query_rules");
+		std::thread query_module_thr(ProxySQL_Main_init_Query_module);
 		GloAdmin->init_mysql_servers();
 		GloAdmin->load_scheduler_to_runtime();
+		query_module_thr.join();
 #ifdef DEBUG
-		std::cerr << "Main phase3 : GloAdmin initialized in ";
+		std::cerr << "Main phase3 : GloAdmin and Query Processor initialized in ";
 #endif
 	}
 	{
-		cpu_timer t;
-		ProxySQL_Main_init_Query_module();
-#ifdef DEBUG
-		std::cerr << "Main phase3 : Query Processor initialized in ";
-#endif
-	}
-	{
-		cpu_timer t;
+		cpu_timer t("MySQL Threads Handler");
 		ProxySQL_Main_init_MySQL_Threads_Handler_module();
 #ifdef DEBUG
 		std::cerr << "Main phase3 : MySQL Threads Handler initialized in ";
@@ -749,6 +776,7 @@ __start_label:
 		std::cerr << "Main init phase3 completed in ";
 #endif
 	}
+	proxy_info("ProxySQL started in %llums\n", (monotonic_time()-GloVars.global.start_time)/1000);
 
 	while (glovars.shutdown==0) {
 		usleep(500000);   // FIXME: TERRIBLE UGLY
@@ -9,9 +9,12 @@ using namespace std;
 #define CPY1(x) *((uint8_t *)x)
 
 enum log_event_type {
-	PROXYSQL_QUERY
+	PROXYSQL_QUERY,
+	PROXYSQL_QUERY_PHASES
 };
 
+const char *phase_names[] = { "rules", "pool_wait", "connect", "reset", "backend", "client_write" };
+
 typedef union _4bytes_t {
 	unsigned char data[4];
 	uint32_t i;
@@ -95,6 +98,7 @@ class MySQL_Event {
 		f->read((char *)&et,1);
 		switch (et) {
 			case PROXYSQL_QUERY:
+			case PROXYSQL_QUERY_PHASES:
 				read_query(f);
 				break;
 			default:
@@ -144,6 +148,19 @@ class MySQL_Event {
 		cout << " endtime=\"" << buffer << "." << buffer2 << "\"";
 		cout << " duration=" << (end_time-start_time) << "us";
 		cout << " digest=\"" << digest_hex << "\"" << endl << query_ptr << endl;
+		if (et==PROXYSQL_QUERY_PHASES) {
+			uint64_t num_phases=0;
+			uint64_t phase_time=0;
+			read_encoded_length(&num_phases,f);
+			cout << "phases:";
+			for (uint64_t i=0; i<num_phases; i++) {
+				read_encoded_length(&phase_time,f);
+				if (i < sizeof(phase_names)/sizeof(char *)) {
+					cout << " " << phase_names[i] << "=" << phase_time << "us";
+				}
+			}
+			cout << endl;
+		}
 	}
 	~MySQL_Event() {
 		free(username);
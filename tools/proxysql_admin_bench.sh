@@ -0,0 +1,81 @@
+#!/bin/bash
+## Measures how long the Admin module takes to move large configurations
+## between memory and runtime.
+## WARNING: it replaces mysql_users, mysql_servers and mysql_query_rules in memory
+## and runtime. Run it only against a test instance.
+
+# CHANGE THOSE
+PROXYSQL_USERNAME="admin"
+PROXYSQL_PASSWORD="admin"
+PROXYSQL_HOSTNAME="127.0.0.1"
+PROXYSQL_PORT="6032"
+#
+
+NUM_USERS=${1:-10000}
+NUM_SERVERS=${2:-5000}
+NUM_RULES=${3:-2000}
+BATCH=500
+
+MYSQL="mysql -u$PROXYSQL_USERNAME -p$PROXYSQL_PASSWORD -h$PROXYSQL_HOSTNAME -P$PROXYSQL_PORT -N -s"
+
+function usage()
+{
+  cat << EOF
+
+Usage: $0 [users] [servers] [query rules]
+
+Defaults to 10000 users, 5000 servers and 2000 query rules.
+Servers are created on 127.0.0.1 on unused ports, spread across 50 hostgroups.
+
+Edit PROXYSQL_* at the top of the script to point it to the Admin interface.
+
+EOF
+}
+
+if [ "$1" = "-h" ] || [ "$1" = "--help" ]; then
+  usage
+  exit 0
+fi
+
+# generate multi-row INSERTs of $BATCH rows
+# $1 = INSERT prefix , $2 = number of rows , $3 = awk expression printing a row for i
+function gen_inserts()
+{
+  awk -v prefix="$1" -v n="$2" -v b="$BATCH" "BEGIN {
+    for (i=1; i<=n; i++) {
+      if ((i-1)%b==0) printf \"%s\", prefix; else printf \",\";
+      $3
+      if (i%b==0 || i==n) printf \";\n\";
+    }
+  }"
+}
+
+# $1 = label , $2 = admin command
+function timed()
+{
+  local start end
+  start=$(date +%s%N)
+  echo "$2" | $MYSQL >/dev/null 2>&1 || { echo "ERROR running: $2"; exit 1; }
+  end=$(date +%s%N)
+  printf "%-45s %8d ms\n" "$1" $(( (end-start)/1000000 ))
+}
+
+echo "Populating $NUM_USERS users, $NUM_SERVERS servers, $NUM_RULES query rules"
+{
+  echo "DELETE FROM mysql_users;"
+  echo "DELETE FROM mysql_servers;"
+  echo "DELETE FROM mysql_query_rules;"
+  gen_inserts "INSERT INTO mysql_users (username,password,default_hostgroup) VALUES " $NUM_USERS 'printf "(\"user%05d\",\"pass%05d\",%d)", i, i, i%50;'
+  gen_inserts "INSERT INTO mysql_servers (hostgroup_id,hostname,port,comment) VALUES " $NUM_SERVERS 'printf "(%d,\"127.0.0.1\",%d,\"bench server %d\")", i%50, 10000+i, i;'
+  gen_inserts "INSERT INTO mysql_query_rules (rule_id,active,match_digest,destination_hostgroup,apply,comment) VALUES " $NUM_RULES 'printf "(%d,1,\"^SELECT .* FROM t%05d\",%d,1,\"bench rule %d\")", i, i, i%50, i;'
+} | $MYSQL 2>/dev/null || { echo "ERROR populating tables"; exit 1; }
+
+timed "LOAD MYSQL USERS TO RUNTIME" "LOAD MYSQL USERS TO RUNTIME"
+timed "SAVE MYSQL USERS TO MEMORY" "SAVE MYSQL USERS TO MEMORY"
+timed "LOAD MYSQL SERVERS TO RUNTIME" "LOAD MYSQL SERVERS TO RUNTIME"
+timed "SAVE MYSQL SERVERS TO MEMORY" "SAVE MYSQL SERVERS TO MEMORY"
+timed "LOAD MYSQL QUERY RULES TO RUNTIME" "LOAD MYSQL QUERY RULES TO RUNTIME"
+timed "SAVE MYSQL QUERY RULES TO MEMORY" "SAVE MYSQL QUERY RULES TO MEMORY"
+timed "LOAD MYSQL VARIABLES TO RUNTIME" "LOAD MYSQL VARIABLES TO RUNTIME"
+timed "SAVE MYSQL VARIABLES TO MEMORY" "SAVE MYSQL VARIABLES TO MEMORY"
+timed "SELECT runtime_* tables" "SELECT COUNT(*) FROM runtime_mysql_users UNION ALL SELECT COUNT(*) FROM runtime_mysql_servers UNION ALL SELECT COUNT(*) FROM runtime_mysql_query_rules"